@@ -0,0 +1,102 @@
+#include <linux/kernel.h>
+#include <linux/kprobes.h>
+#include <linux/socket.h>
+#include <linux/tcp.h>
+#include <linux/slab.h>
+#include <linux/proc_fs.h>
+#include <linux/module.h>
+#include <linux/ktime.h>
+#include <linux/time.h>
+#include <linux/jiffies.h>
+#include <linux/version.h>
+
+#include <net/tcp.h>
+
+#include "tcp_probe_plus.h"
+
+/*
+ * Burst capture: while a capture runs, every packet of the matching flows
+ * is written to its own ring, whatever full and probetime are. The ring is
+ * allocated at load (capture_bufsize) and drained from
+ * /proc/net/tcpprobe_capture at the reader's pace once the burst is over.
+ * The sampled stream of /proc/net/tcpprobe_data is not affected.
+ */
+struct tcp_probe_list tcp_capture;
+unsigned long capture_until __read_mostly;
+
+/*
+ * Start a capture of secs seconds, or stop the running one when secs is 0.
+ * The records not read yet stay in the capture ring.
+ */
+int tcpprobe_capture_arm(int secs)
+{
+	unsigned long until = 0;
+
+	if (secs > 0) {
+		if (!tcp_capture.log.chunks)
+			return -EINVAL; /* capture_bufsize is 0 */
+		until = jiffies + secs * HZ;
+		/* 0 means no capture */
+		if (!until)
+			until = 1;
+		PRINT_DEBUG("Capturing every packet for %d s.\n", secs);
+	}
+	capture_until = until;
+	return 0;
+}
+
+/* Seconds left in the running capture, 0 if none */
+int tcpprobe_capture_remaining(void)
+{
+	unsigned long until = ACCESS_ONCE(capture_until);
+
+	if (!until || !time_before(jiffies, until))
+		return 0;
+	return DIV_ROUND_UP(until - jiffies, HZ);
+}
+
+/*
+ * Drain the capture ring. Never blocks: end of file once the capture ring
+ * is empty, so that "cat /proc/net/tcpprobe_capture > file" terminates.
+ */
+static ssize_t tcpprobe_capture_read(struct file *file, char __user *buf,
+						size_t len, loff_t *ppos)
+{
+	size_t cnt = 0;
+
+	if (!buf)
+		return -EINVAL;
+
+	while (cnt < len) {
+		char tbuf[512];
+		int width;
+
+		spin_lock_bh(&tcp_capture.lock);
+		if (tcp_capture.head == tcp_capture.tail) {
+			spin_unlock_bh(&tcp_capture.lock);
+			break;
+		}
+		width = tcpprobe_sprint(tcp_ring_slot(&tcp_capture, tcp_capture.tail), 0,
+				tbuf, sizeof(tbuf));
+		/* if record greater than space available
+		return partial buffer (so far) */
+		if (cnt + width > len) {
+			spin_unlock_bh(&tcp_capture.lock);
+			break;
+		}
+		tcp_capture.tail++;
+		spin_unlock_bh(&tcp_capture.lock);
+
+		if (copy_to_user(buf + cnt, tbuf, width)) {
+			TCPPROBE_STAT_INC(copy_error);
+			return -EFAULT;
+		}
+		cnt += width;
+	}
+	return cnt;
+}
+
+const struct file_operations tcpprobe_capture_fops = {
+	.owner	 = THIS_MODULE,
+	.read    = tcpprobe_capture_read,
+};
@@ -0,0 +1,305 @@
+#include <linux/kernel.h>
+#include <linux/kprobes.h>
+#include <linux/socket.h>
+#include <linux/tcp.h>
+#include <linux/slab.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/ctype.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/rcupdate.h>
+
+#include <net/tcp.h>
+
+#include "tcp_probe_plus.h"
+
+/*
+ * Configuration. The settings live in the globals of sysctl.c, which the
+ * sysctls, TCPPROBE_CMD_SET_CONFIG and /proc/net/tcpprobe_ctl change;
+ * every change then publishes an immutable copy of all of them through
+ * tcpprobe_cfg. Every hook reads that single pointer once per call (under
+ * RCU) and hands it to its helpers, so it sees either the old or the new
+ * configuration, never a mix of both. The readers of the ring, which may
+ * run after the hooks are gone, take a copy with tcpprobe_config_get().
+ */
+struct tcpprobe_config __rcu *tcpprobe_cfg;
+/* serializes the writers of the settings */
+static DEFINE_MUTEX(tcpprobe_cfg_mutex);
+/* set at unload: the control file and netlink outlive the hooks */
+static int tcpprobe_cfg_closed;
+
+struct tcpprobe_param {
+	const char *name;
+	size_t offset; /* in struct tcpprobe_config */
+	int *value; /* global of sysctl.c, readnum is unsigned */
+	int min;
+	int max;
+};
+
+#define TCPPROBE_PARAM(_name, _field, _value, _min, _max) \
+	{ _name, offsetof(struct tcpprobe_config, _field), (int *) &_value, _min, _max }
+
+/* The settings that can be changed at runtime, with their valid range */
+static const struct tcpprobe_param tcpprobe_params[] = {
+	TCPPROBE_PARAM("port", port, port, 0, UINT16_MAX),
+	TCPPROBE_PARAM("full", full, full, 0, 1),
+	TCPPROBE_PARAM("probetime", probetime, probetime, 0, INT_MAX),
+	TCPPROBE_PARAM("maxflows", maxflows, maxflows, 0, INT_MAX),
+	TCPPROBE_PARAM("purge_time", purgetime, purgetime, 1, INT_MAX),
+	TCPPROBE_PARAM("readnum", readnum, readnum, 1, INT_MAX),
+	TCPPROBE_PARAM("debug", debug, debug, DEBUG_DISABLE, TRACE_ENABLE),
+	TCPPROBE_PARAM("export", export_mode, export_mode, 0, TCPPROBE_EXPORT_MAX),
+	TCPPROBE_PARAM("reset_on_open", reset_on_open, reset_on_open, 0, 1),
+	TCPPROBE_PARAM("mem_limit_mb", mem_limit_mb, mem_limit_mb, 0, INT_MAX),
+	TCPPROBE_PARAM("unload_wait_ms", unload_wait_ms, unload_wait_ms, 0, INT_MAX),
+	TCPPROBE_PARAM("flowid", flowid, flowid, 0, 1),
+	TCPPROBE_PARAM("flow_rate", flow_rate, flow_rate, 0, INT_MAX),
+	TCPPROBE_PARAM("flow_burst", flow_burst, flow_burst, 1, INT_MAX),
+	TCPPROBE_PARAM("fair_share", fair_share, fair_share, 0, 100),
+	TCPPROBE_PARAM("stall_ms", stall_ms, stall_ms, 0, INT_MAX),
+	TCPPROBE_PARAM("ecn_interval_ms", ecn_interval_ms, ecn_interval_ms, 0, INT_MAX),
+	TCPPROBE_PARAM("hostq_interval_ms", hostq_interval_ms, hostq_interval_ms, 0, INT_MAX),
+	TCPPROBE_PARAM("listen_interval_ms", listen_interval_ms, listen_interval_ms, 0, INT_MAX),
+};
+
+static inline int *tcpprobe_param_field(struct tcpprobe_config *c,
+		const struct tcpprobe_param *param)
+{
+	return (int *) ((char *) c + param->offset);
+}
+
+static void tcpprobe_config_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct tcpprobe_config, rcu));
+}
+
+/*
+ * Publish c, which the hooks see from now on. c is freed instead once the
+ * module is unloading.
+ * Assumes that tcpprobe_cfg_mutex has been taken.
+ */
+static void tcpprobe_config_replace(struct tcpprobe_config *c)
+{
+	struct tcpprobe_config *old;
+
+	if (tcpprobe_cfg_closed) {
+		kfree(c);
+		return;
+	}
+	old = rcu_dereference_protected(tcpprobe_cfg,
+			lockdep_is_held(&tcpprobe_cfg_mutex));
+	rcu_assign_pointer(tcpprobe_cfg, c);
+	if (old)
+		call_rcu(&old->rcu, tcpprobe_config_free_rcu);
+}
+
+/*
+ * Serialize the writers of the settings: the sysctls hold the mutex from
+ * the write of their global to tcpprobe_config_publish().
+ */
+void tcpprobe_config_lock(void)
+{
+	mutex_lock(&tcpprobe_cfg_mutex);
+}
+
+void tcpprobe_config_unlock(void)
+{
+	mutex_unlock(&tcpprobe_cfg_mutex);
+}
+
+/* Current settings */
+void tcpprobe_config_get(struct tcpprobe_config *c)
+{
+	int i;
+
+	memset(c, 0, sizeof(*c));
+	mutex_lock(&tcpprobe_cfg_mutex);
+	for (i = 0; i < ARRAY_SIZE(tcpprobe_params); i++)
+		*tcpprobe_param_field(c, &tcpprobe_params[i]) = *tcpprobe_params[i].value;
+	mutex_unlock(&tcpprobe_cfg_mutex);
+}
+
+/*
+ * Apply the settings of c given in mask (TCPPROBE_CFG_BIT()) at once, the
+ * others keep their value. The current settings are read, merged and
+ * published under tcpprobe_cfg_mutex, so concurrent writers do not lose
+ * each other's changes. Nothing is changed unless every setting is valid.
+ * Returns 0 or -EINVAL, -ENOMEM.
+ */
+int tcpprobe_config_set(const struct tcpprobe_config *c, u32 mask)
+{
+	const struct tcpprobe_param *param;
+	struct tcpprobe_config *copy;
+	int i, *v;
+
+	BUILD_BUG_ON(offsetof(struct tcpprobe_config, rcu) / sizeof(int) > 32);
+
+	copy = kzalloc(sizeof(*copy), GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	mutex_lock(&tcpprobe_cfg_mutex);
+	for (i = 0; i < ARRAY_SIZE(tcpprobe_params); i++) {
+		param = &tcpprobe_params[i];
+		v = tcpprobe_param_field(copy, param);
+		if (mask & TCPPROBE_CFG_BIT(param->offset))
+			*v = *tcpprobe_param_field((struct tcpprobe_config *) c, param);
+		else
+			*v = *param->value;
+		if (*v < param->min || *v > param->max) {
+			mutex_unlock(&tcpprobe_cfg_mutex);
+			kfree(copy);
+			return -EINVAL;
+		}
+	}
+	/* the sysctls show the new settings */
+	for (i = 0; i < ARRAY_SIZE(tcpprobe_params); i++)
+		*tcpprobe_params[i].value = *tcpprobe_param_field(copy, &tcpprobe_params[i]);
+	tcpprobe_config_replace(copy);
+	mutex_unlock(&tcpprobe_cfg_mutex);
+	return 0;
+}
+
+/*
+ * Publish the settings as they are in the globals, after a sysctl
+ * changed one of them. The sysctls keep their own bounds.
+ * Assumes that tcpprobe_cfg_mutex has been taken.
+ */
+int tcpprobe_config_publish(void)
+{
+	struct tcpprobe_config *c;
+	int i;
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(tcpprobe_params); i++)
+		*tcpprobe_param_field(c, &tcpprobe_params[i]) = *tcpprobe_params[i].value;
+	tcpprobe_config_replace(c);
+	return 0;
+}
+
+/* Publish the configuration given at load time */
+int tcpprobe_config_init(void)
+{
+	int ret;
+
+	mutex_lock(&tcpprobe_cfg_mutex);
+	ret = tcpprobe_config_publish();
+	mutex_unlock(&tcpprobe_cfg_mutex);
+	return ret;
+}
+
+/* At unload, once the hooks are gone */
+void tcpprobe_config_exit(void)
+{
+	struct tcpprobe_config *c;
+
+	mutex_lock(&tcpprobe_cfg_mutex);
+	c = rcu_dereference_protected(tcpprobe_cfg,
+			lockdep_is_held(&tcpprobe_cfg_mutex));
+	RCU_INIT_POINTER(tcpprobe_cfg, NULL);
+	tcpprobe_cfg_closed = 1;
+	mutex_unlock(&tcpprobe_cfg_mutex);
+	if (c)
+		call_rcu(&c->rcu, tcpprobe_config_free_rcu);
+}
+
+/*
+ * /proc/net/tcpprobe_ctl: reading gives every setting, one "name value"
+ * per line. Writing "name=value" pairs separated by spaces or newlines
+ * applies them together, in a single write(): the settings not given
+ * keep their value, and nothing changes if one of them is invalid.
+ */
+static int tcpprobe_ctl_show(struct seq_file *seq, void *v)
+{
+	struct tcpprobe_config c;
+	int i;
+
+	tcpprobe_config_get(&c);
+	for (i = 0; i < ARRAY_SIZE(tcpprobe_params); i++)
+		seq_printf(seq, "%s %d\n", tcpprobe_params[i].name,
+			*tcpprobe_param_field(&c, &tcpprobe_params[i]));
+	return 0;
+}
+
+static int tcpprobe_ctl_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tcpprobe_ctl_show, NULL);
+}
+
+static const struct tcpprobe_param *tcpprobe_param_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tcpprobe_params); i++)
+		if (!strcmp(tcpprobe_params[i].name, name))
+			return &tcpprobe_params[i];
+	return NULL;
+}
+
+static ssize_t tcpprobe_ctl_write(struct file *file, const char __user *buf,
+		size_t len, loff_t *ppos)
+{
+	const struct tcpprobe_param *param;
+	struct tcpprobe_config c;
+	char *kbuf, *cur, *tok, *val;
+	u32 mask = 0;
+	int ret, v;
+
+	if (len >= PAGE_SIZE)
+		return -E2BIG;
+	kbuf = kmalloc(len + 1, GFP_KERNEL);
+	if (!kbuf)
+		return -ENOMEM;
+	if (copy_from_user(kbuf, buf, len)) {
+		kfree(kbuf);
+		return -EFAULT;
+	}
+	kbuf[len] = '\0';
+
+	memset(&c, 0, sizeof(c));
+	ret = 0;
+	cur = kbuf;
+	while ((tok = strsep(&cur, " \t\n")) != NULL) {
+		if (*tok == '\0')
+			continue;
+		val = strchr(tok, '=');
+		if (!val) {
+			ret = -EINVAL;
+			break;
+		}
+		*val++ = '\0';
+		param = tcpprobe_param_find(tok);
+		if (!param || kstrtoint(val, 0, &v)) {
+			ret = -EINVAL;
+			break;
+		}
+		*tcpprobe_param_field(&c, param) = v;
+		mask |= TCPPROBE_CFG_BIT(param->offset);
+	}
+	if (!ret)
+		ret = tcpprobe_config_set(&c, mask);
+	kfree(kbuf);
+	if (ret)
+		return ret;
+	PRINT_DEBUG("Configuration changed through %s.\n", PROC_TCPPROBE_CTL);
+	/* Start draining what accumulated in the ring */
+	tcpprobe_config_get(&c);
+	tcpprobe_nl_kick(&c);
+	wake_up(&tcp_probe.wait);
+	return len;
+}
+
+const struct file_operations tcpprobe_ctl_fops = {
+	.owner   = THIS_MODULE,
+	.open    = tcpprobe_ctl_open,
+	.read    = seq_read,
+	.write   = tcpprobe_ctl_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
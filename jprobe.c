@@ -41,17 +41,22 @@
 #include <linux/swap.h>
 #include <linux/random.h>
 #include <linux/vmalloc.h>
+#include <linux/delay.h>
+#include <linux/rcupdate.h>
+#include <asm/unaligned.h>
 
 
 #include <net/tcp.h>
+#include <net/inet_ecn.h>
 
 #include "tcp_probe_plus.h"
 
 struct tcp_probe_list tcp_probe;
 
-static DEFINE_SPINLOCK(tcp_hash_lock); /* hash table lock */
+DEFINE_SPINLOCK(tcp_hash_lock); /* hash table lock */
 LIST_HEAD(tcp_flow_list); /* all flows */
 struct timer_list purge_timer;
+struct timer_list stall_timer;
 atomic_t flow_count = ATOMIC_INIT(0);
 DEFINE_PER_CPU(struct tcpprobe_stat, tcpprobe_stat);
 
@@ -76,10 +81,307 @@ struct timespec ns_to_timespec(const s64 nsec)
 }
 #endif
 
+/* Copy the user agent of the flow, if any, into the record */
+static inline void
+copy_user_agent(struct tcp_log *p, const struct tcp_hash_flow *tcp_flow)
+{
+	const char *agent = ACCESS_ONCE(tcp_flow->user_agent);
+
+	if (agent) {
+		strlcpy(p->user_agent, agent, MAX_AGENT_LEN);
+	} else {
+		p->user_agent[0] = '\0';
+	}
+}
+
+/*
+ * Take a snapshot of the socket state. Sequence numbers are relative to
+ * the first one seen for the flow, absolute when there is no flow.
+ */
+static void
+fill_flow_sample(int type, const struct tcp_hash_flow *tcp_flow, struct sock *sk,
+		struct tcp_flow_sample *s)
+{
+	const struct tcp_sock *tp = tcp_sk(sk);
+	u64 first_seq_num = tcp_flow ? tcp_flow->first_seq_num : 0;
+
+	/* update the cumulative bytes */
+	s->write_seq = tp->write_seq - first_seq_num;
+	if (type != LOG_SETUP) {
+		s->snd_nxt = tp->snd_nxt - first_seq_num;
+		s->snd_una = tp->snd_una - first_seq_num;
+	} else {
+		s->snd_nxt = 0;
+		s->snd_una = 0;
+	}
+	s->snd_cwnd = tp->snd_cwnd;
+	s->snd_wnd = tp->snd_wnd;
+	s->rcv_wnd = tp->rcv_wnd;
+	s->ssthresh = tcp_current_ssthresh(sk);
+	
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,10,0)
+	s->srtt = jiffies_to_usecs(tp->srtt);
+	s->rttvar = jiffies_to_usecs(tp->rttvar);
+	s->mdev = jiffies_to_usecs(tp->mdev);
+#else
+	/* element was renamed */ 
+	s->srtt = tp->srtt_us;
+	s->rttvar = tp->rttvar_us;
+	s->mdev = tp->mdev_us;
+#endif
+	
+	s->retrans_out = tp->retrans_out;
+	s->lost_out = tp->lost_out;
+	s->packets_out = tp->packets_out;
+	s->sacked_out = tp->sacked_out;
+	s->retrans = tp->total_retrans;
+	/* s->rto = s->srtt + (4 * s->rttvar); */
+
+	s->rto = inet_csk(sk)->icsk_rto;
+	s->ca_state = inet_csk(sk)->icsk_ca_state;
+	
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,10,0)
+	s->frto_counter = tp->frto_counter;
+#else
+	s->frto_counter = tp->frto;	
+#endif
+	
+	/* same method as tcp_diag to retrieve the queue sizes */
+	if (sk->sk_state == TCP_LISTEN) {
+		s->rqueue = sk->sk_ack_backlog;
+		s->wqueue = sk->sk_max_ack_backlog;
+	} else {
+		s->rqueue = max_t(int, tp->rcv_nxt - tp->copied_seq, 0);
+		s->wqueue = tp->write_seq - tp->snd_una;
+	}
+}
+
+/*
+ * Take a snapshot of the socket state into the flow. The snapshot is the
+ * last known state of the flow reported by the purge records.
+ * Assumes that the spin_lock on the tcp_probe has been taken, which
+ * serializes the writers of the snapshot.
+ */
+static void
+update_flow_sample(int type, struct tcp_hash_flow *tcp_flow, struct sock *sk)
+{
+	write_seqcount_begin(&tcp_flow->seq);
+	fill_flow_sample(type, tcp_flow, sk, &tcp_flow->last);
+	write_seqcount_end(&tcp_flow->seq);
+}
+
+/* Copy the socket state of a flow snapshot into the record */
+static inline void
+copy_flow_sample(struct tcp_log *p, const struct tcp_flow_sample *s)
+{
+	p->ca_state = s->ca_state;
+	p->frto_counter = s->frto_counter;
+	p->snd_nxt = s->snd_nxt;
+	p->snd_una = s->snd_una;
+	p->snd_wnd = s->snd_wnd;
+	p->snd_cwnd = s->snd_cwnd;
+	p->rcv_wnd = s->rcv_wnd;
+	p->ssthresh = s->ssthresh;
+	p->srtt = s->srtt;
+	p->mdev = s->mdev;
+	p->rttvar = s->rttvar;
+	p->rto = s->rto;
+	p->packets_out = s->packets_out;
+	p->lost_out = s->lost_out;
+	p->sacked_out = s->sacked_out;
+	p->retrans_out = s->retrans_out;
+	p->retrans = s->retrans;
+	p->write_seq = s->write_seq;
+	p->rqueue = s->rqueue;
+	p->wqueue = s->wqueue;
+}
+
+/*
+ * Write the definition of the flow (LOG_FLOWDEF) before its first record:
+ * the tuple and socket_idf of the flow are given once for its flow_id.
+ * Returns -ENOSPC if the ring has no room for the definition and the
+ * record that follows it; the definition is then attempted again with
+ * the next record of the flow.
+ * Assumes that the spin_lock on the tcp_probe has been taken.
+ */
+static int
+write_flow_def(struct tcp_hash_flow *tcp_flow, ktime_t tstamp)
+{
+	struct tcp_log *p;
+
+	if (tcp_flow->defined)
+		return 0;
+	if (tcp_probe_avail() <= 2)
+		return -ENOSPC;
+
+	p = tcp_probe_slot(tcp_probe.head);
+	memset(p, 0, offsetof(struct tcp_log, user_agent));
+	p->type = LOG_FLOWDEF;
+	p->tstamp = tstamp;
+	p->saddr = tcp_flow->tuple.saddr;
+	p->sport = tcp_flow->tuple.sport;
+	p->daddr = tcp_flow->tuple.daddr;
+	p->dport = tcp_flow->tuple.dport;
+	p->flow_id = tcp_flow->flow_id;
+	p->socket_idf = tcp_flow->first_seq_num;
+	p->seq_num = tcp_flow->first_seq_num;
+	p->ack_num = tcp_flow->first_ack_num;
+	p->user_agent[0] = '\0';
+	tcp_probe.head++;
+	tcp_flow->defined = 1;
+	return 0;
+}
+
+/*
+ * Write the retransmissions of the flow since its previous record
+ * (LOG_RETRANS), if any, just before its next record. They are kept for
+ * the record after when the ring has no room for both.
+ * Assumes that the spin_lock on the tcp_probe has been taken.
+ */
+static void
+write_flow_retrans(struct tcp_hash_flow *tcp_flow, ktime_t tstamp)
+{
+	struct tcp_log *p;
+
+	if (!tcp_retx_pending(&tcp_flow->retx) || tcp_probe_avail() <= 2)
+		return;
+
+	p = tcp_probe_slot(tcp_probe.head);
+	memset(p, 0, offsetof(struct tcp_log, user_agent));
+	p->type = LOG_RETRANS;
+	p->tstamp = tstamp;
+	p->saddr = tcp_flow->tuple.saddr;
+	p->sport = tcp_flow->tuple.sport;
+	p->daddr = tcp_flow->tuple.daddr;
+	p->dport = tcp_flow->tuple.dport;
+	p->flow_id = tcp_flow->flow_id;
+	p->socket_idf = tcp_flow->first_seq_num;
+	p->retx = tcp_flow->retx;
+	tcp_probe.head++;
+	memset(&tcp_flow->retx, 0, sizeof(tcp_flow->retx));
+}
+
+/* Fraction num / den in per mille */
+static inline u32 tcp_permille(u32 num, u32 den)
+{
+	return den ? div_u64((u64) num * 1000, den) : 0;
+}
+
+/*
+ * Write the ECN marks counted for the flow (LOG_ECN) just before its next
+ * record, at most every ecn_interval_ms unless flushed by the last record
+ * of the flow.
+ * Assumes that the spin_lock on the tcp_probe has been taken.
+ */
+static void
+write_flow_ecn(const struct tcpprobe_config *cfg, struct tcp_hash_flow *tcp_flow,
+		ktime_t tstamp, int flush)
+{
+	struct tcp_ecn_count *c = &tcp_flow->ecn;
+	struct tcp_log *p;
+
+	if (!atomic_read(&c->acks) && !atomic_read(&c->data_pkts))
+		return;
+	if (!flush && ktime_to_ns(tstamp) - tcp_flow->ecn_last <
+			(s64) cfg->ecn_interval_ms * NSEC_PER_MSEC)
+		return;
+	if (tcp_probe_avail() <= 2)
+		return;
+
+	p = tcp_probe_slot(tcp_probe.head);
+	memset(p, 0, offsetof(struct tcp_log, user_agent));
+	p->type = LOG_ECN;
+	p->tstamp = tstamp;
+	p->saddr = tcp_flow->tuple.saddr;
+	p->sport = tcp_flow->tuple.sport;
+	p->daddr = tcp_flow->tuple.daddr;
+	p->dport = tcp_flow->tuple.dport;
+	p->flow_id = tcp_flow->flow_id;
+	p->socket_idf = tcp_flow->first_seq_num;
+	/* the hooks keep counting while the counters are taken */
+	p->ecn.acks = atomic_xchg(&c->acks, 0);
+	p->ecn.ece_acks = atomic_xchg(&c->ece_acks, 0);
+	p->ecn.acked_bytes = atomic_xchg(&c->acked_bytes, 0);
+	p->ecn.ece_bytes = atomic_xchg(&c->ece_bytes, 0);
+	p->ecn.ece_permille = tcp_permille(p->ecn.ece_bytes, p->ecn.acked_bytes);
+	p->ecn.cwr = atomic_xchg(&c->cwr, 0);
+	p->ecn.data_pkts = atomic_xchg(&c->data_pkts, 0);
+	p->ecn.data_bytes = atomic_xchg(&c->data_bytes, 0);
+	p->ecn.ce_pkts = atomic_xchg(&c->ce_pkts, 0);
+	p->ecn.ce_bytes = atomic_xchg(&c->ce_bytes, 0);
+	p->ecn.ce_permille = tcp_permille(p->ecn.ce_bytes, p->ecn.data_bytes);
+	tcp_probe.head++;
+	tcp_flow->ecn_last = ktime_to_ns(tstamp);
+}
+
+/*
+ * Write the owner of the flow (LOG_OWNER) before its first record once
+ * it is known, and again before its done or purge record (flush).
+ * Assumes that the spin_lock on the tcp_probe has been taken.
+ */
+static void
+write_flow_owner(struct tcp_hash_flow *tcp_flow, ktime_t tstamp, int flush)
+{
+	struct tcp_log *p;
+
+	if (ACCESS_ONCE(tcp_flow->owned) != TCP_OWNER_SET ||
+		(tcp_flow->owner_written && !flush) || tcp_probe_avail() <= 2)
+		return;
+	/* pairs with smp_wmb() in tcp_flow_set_owner() */
+	smp_rmb();
+
+	p = tcp_probe_slot(tcp_probe.head);
+	memset(p, 0, offsetof(struct tcp_log, user_agent));
+	p->type = LOG_OWNER;
+	p->tstamp = tstamp;
+	p->saddr = tcp_flow->tuple.saddr;
+	p->sport = tcp_flow->tuple.sport;
+	p->daddr = tcp_flow->tuple.daddr;
+	p->dport = tcp_flow->tuple.dport;
+	p->flow_id = tcp_flow->flow_id;
+	p->socket_idf = tcp_flow->first_seq_num;
+	p->owner = tcp_flow->owner;
+	tcp_probe.head++;
+	tcp_flow->owner_written = 1;
+}
+
+/*
+ * Write the time spent by the flow in each TCP state (LOG_STATES) just
+ * before its done or purge record, the last state counting until then.
+ * Assumes that the spin_lock on the tcp_probe has been taken.
+ */
+static void
+write_flow_states(struct tcp_hash_flow *tcp_flow, ktime_t tstamp)
+{
+	struct tcp_states_stat *st = &tcp_flow->states;
+	struct tcp_log *p;
+
+	if (!st->transitions || tcp_probe_avail() <= 2)
+		return;
+
+	p = tcp_probe_slot(tcp_probe.head);
+	memset(p, 0, offsetof(struct tcp_log, user_agent));
+	p->type = LOG_STATES;
+	p->tstamp = tstamp;
+	p->saddr = tcp_flow->tuple.saddr;
+	p->sport = tcp_flow->tuple.sport;
+	p->daddr = tcp_flow->tuple.daddr;
+	p->dport = tcp_flow->tuple.dport;
+	p->flow_id = tcp_flow->flow_id;
+	p->socket_idf = tcp_flow->first_seq_num;
+	p->states = *st;
+	p->states.ms[st->state] += div_s64(ktime_to_ns(tstamp) - tcp_flow->state_since,
+			NSEC_PER_MSEC);
+	tcp_probe.head++;
+}
+
+/*
+ * Write a purge record carrying the last known state of the flow.
+ * Assumes that the spin_lock on the tcp_probe has been taken.
+ */
 static int
-write_flow_purge(struct tcp_hash_flow *tcp_flow)
+write_flow_purge(const struct tcpprobe_config *cfg, struct tcp_hash_flow *tcp_flow)
 {
-	int i=0;
 	ktime_t tstamp;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,21)
@@ -89,47 +391,35 @@ write_flow_purge(struct tcp_hash_flow *tcp_flow)
 #else
 	tstamp = ktime_get();
 #endif
+	/* last record of the flow */
+	tcp_flow->dead = 1;
 	/* If log fills, just silently drop */
-	if (tcp_probe_avail() > 1) {
-		struct tcp_log *p = tcp_probe.log + tcp_probe.head;
+	if (tcp_probe_avail() > 1 && write_flow_def(tcp_flow, tstamp) == 0) {
+		struct tcp_log *p;
+
+		write_flow_owner(tcp_flow, tstamp, 1);
+		write_flow_retrans(tcp_flow, tstamp);
+		write_flow_ecn(cfg, tcp_flow, tstamp, 1);
+		write_flow_states(tcp_flow, tstamp);
+		p = tcp_probe_slot(tcp_probe.head);
 		p->type = LOG_PURGE;
-		p->ca_state = 0;
-		p->frto_counter = 0;
+		p->flow_id = tcp_flow->flow_id;
 		p->tcp_flags = 0;
 		p->tstamp = tstamp;
 		p->saddr = tcp_flow->tuple.saddr;
 		p->sport = tcp_flow->tuple.sport;
 		p->daddr = tcp_flow->tuple.daddr;
 		p->dport = tcp_flow->tuple.dport;
-		p->rto_num = 0;
+		p->rto_num = atomic_read(&tcp_flow->rto_num);
 		p->length = 0;
 		p->seq_num = tcp_flow->first_seq_num;
 		p->ack_num = tcp_flow->first_ack_num;
-		p->snd_nxt = 0;
-		p->snd_una = 0;
-		p->snd_wnd = 0;
-		p->snd_cwnd = 0;
-		p->rcv_wnd = 0;
-		p->ssthresh = 0;
-		p->srtt = 0;
-		p->mdev = 0;
-		p->rttvar = 0;
-		p->retrans = 0;
-		p->retrans_out = 0;
-		p->lost_out = 0;
-		p->packets_out = 0;
-		p->sacked_out = 0;
-		p->rto = 0;
-		p->write_seq = 0;
-		p->rqueue = 0;
-		p->wqueue = 0;
+		copy_flow_sample(p, &tcp_flow->last);
 		p->socket_idf = tcp_flow->first_seq_num;
 		p->seq_rtt = 0;
-		while (tcp_flow->user_agent[i]) {
-			p->user_agent[i] = tcp_flow->user_agent[i];
-			i++;
-		}
-		tcp_probe.head = (tcp_probe.head + 1) & (bufsize - 1);
+		copy_user_agent(p, tcp_flow);
+		tcp_probe.head++;
+		tcpprobe_commit(cfg);
 	} else {
 		TCPPROBE_STAT_INC(ack_drop_ring_full);
 	}
@@ -139,6 +429,7 @@ write_flow_purge(struct tcp_hash_flow *tcp_flow)
 
 void purge_timer_run(unsigned long dummy)
 {
+	const struct tcpprobe_config *cfg;
 	struct tcp_hash_flow *flow;
 	struct tcp_hash_flow *temp;
 	ktime_t tstamp;
@@ -152,72 +443,550 @@ void purge_timer_run(unsigned long dummy)
 #endif
 
 	PRINT_DEBUG("Running purge timer.\n");
+	/* one configuration for the whole run, see config.c */
+	rcu_read_lock();
+	cfg = rcu_dereference(tcpprobe_cfg);
 	spin_lock(&tcp_hash_lock);
 	list_for_each_entry_safe(flow, temp, &tcp_flow_list, list) {
 	
-		struct timespec tv = ktime_to_timespec(ktime_sub(tstamp, flow->tstamp));
+		struct timespec tv = ktime_to_timespec(ktime_sub(tstamp, tcp_flow_tstamp(flow)));
 		
-		if (tv.tv_sec >= purgetime) {
+		if (tv.tv_sec >= cfg->purgetime) {
 			PRINT_DEBUG(
 				"Purging flow src: %pI4 dst: %pI4"
 				" src_port: %u dst_port: %u\n",
 				&flow->tuple.saddr, &flow->tuple.daddr,
 				ntohs(flow->tuple.sport), ntohs(flow->tuple.dport));
 			spin_lock(&tcp_probe.lock);
-			write_flow_purge(flow);
+			write_flow_purge(cfg, flow);
 			spin_unlock(&tcp_probe.lock);
-			// Remove from Hashtable
-			hlist_del(&flow->hlist);
-			// Remove from Global List
-			list_del(&flow->list);
-			// Free memory
-			tcp_hash_flow_free(flow);
+			tcp_flow_unlink(flow);
 		}
 	}
 	spin_unlock(&tcp_hash_lock);
-	mod_timer(&purge_timer, jiffies + (HZ * purgetime));			
+	mod_timer(&purge_timer, jiffies + (HZ * cfg->purgetime));
+	rcu_read_unlock();
+}
+
+/*
+ * Write a stall record for the flow.
+ * Assumes that the spin_lock on the tcp_probe has been taken.
+ */
+static int
+write_flow_stall(const struct tcpprobe_config *cfg, struct tcp_hash_flow *tcp_flow,
+		int cause, ktime_t tstamp, const struct tcp_flow_sample *s)
+{
+	if (tcp_flow->dead)
+		return 0;
+	/* If log fills, just silently drop */
+	if (tcp_probe_avail() > 1 && write_flow_def(tcp_flow, tstamp) == 0) {
+		struct tcp_log *p = tcp_probe_slot(tcp_probe.head);
+
+		memset(p, 0, offsetof(struct tcp_log, user_agent));
+		p->type = LOG_STALL;
+		p->tstamp = tstamp;
+		p->saddr = tcp_flow->tuple.saddr;
+		p->sport = tcp_flow->tuple.sport;
+		p->daddr = tcp_flow->tuple.daddr;
+		p->dport = tcp_flow->tuple.dport;
+		p->flow_id = tcp_flow->flow_id;
+		p->socket_idf = tcp_flow->first_seq_num;
+		p->stall.cause = cause;
+		p->stall.stalled_ms = div_s64(ktime_to_ns(tstamp) - tcp_flow->stall_since,
+				NSEC_PER_MSEC);
+		p->stall.snd_una = s->snd_una;
+		p->stall.snd_wnd = s->snd_wnd;
+		p->stall.wqueue = s->wqueue;
+		p->stall.rqueue = s->rqueue;
+		p->stall.packets_out = s->packets_out;
+		p->stall.rto_num = atomic_read(&tcp_flow->rto_num) - tcp_flow->stall_rto;
+		tcp_probe.head++;
+		tcpprobe_commit(cfg);
+		return 1;
+	}
+	TCPPROBE_STAT_INC(ack_drop_ring_full);
+	return 0;
+}
+
+/*
+ * Why would the flow be stalled, judging from the state of its last
+ * record? 0 if it is not waiting for anything.
+ */
+static int
+tcp_stall_cause(const struct tcp_hash_flow *flow, const struct tcp_flow_sample *s)
+{
+	if (s->wqueue > 0) {
+		if (s->packets_out > 0) {
+			/* the window is full and nothing timed out */
+			if (s->ca_state != TCP_CA_Loss &&
+			    atomic_read(&flow->rto_num) == flow->stall_rto &&
+			    (u32) s->snd_nxt - s->snd_una >= s->snd_wnd)
+				return TCPPROBE_STALL_RWND;
+			return TCPPROBE_STALL_NETWORK;
+		}
+		if (s->snd_wnd == 0)
+			return TCPPROBE_STALL_ZERO_WINDOW;
+		return TCPPROBE_STALL_RWND;
+	}
+	if (s->rqueue > 0)
+		return TCPPROBE_STALL_APP;
+	return 0;
+}
+
+/*
+ * Report the flow once if it has made no progress for stall_ms: snd_una
+ * has not moved while data is queued, or the receive queue has not been
+ * read. Returns 1 if a stall record was written.
+ * Assumes that tcp_hash_lock has been taken, which serializes the runs of
+ * the detector.
+ */
+static int
+tcp_flow_check_stall(const struct tcpprobe_config *cfg, struct tcp_hash_flow *flow,
+		ktime_t tstamp)
+{
+	s64 now = ktime_to_ns(tstamp);
+	struct tcp_flow_sample s;
+	int cause, written;
+
+	tcp_flow_read_sample(flow, &s);
+	cause = tcp_stall_cause(flow, &s);
+	if (!flow->stall_since || !cause || s.snd_una != flow->stall_una ||
+	    s.rqueue < flow->stall_rqueue) {
+		/* progress, or nothing to wait for */
+		flow->stall_since = now;
+		flow->stall_una = s.snd_una;
+		flow->stall_rqueue = s.rqueue;
+		flow->stall_rto = atomic_read(&flow->rto_num);
+		flow->stalled = 0;
+		return 0;
+	}
+	/* the receive queue keeps growing */
+	flow->stall_rqueue = s.rqueue;
+	if (flow->stalled || now - flow->stall_since < (s64) cfg->stall_ms * NSEC_PER_MSEC)
+		return 0;
+
+	PRINT_DEBUG("Stalled flow src: %pI4 dst: %pI4"
+		" src_port: %u dst_port: %u cause: %d\n",
+		&flow->tuple.saddr, &flow->tuple.daddr,
+		ntohs(flow->tuple.sport), ntohs(flow->tuple.dport), cause);
+	flow->stalled = 1;
+	spin_lock(&tcp_probe.lock);
+	written = write_flow_stall(cfg, flow, cause, tstamp, &s);
+	spin_unlock(&tcp_probe.lock);
+	return written;
+}
+
+/* Run the stall detector every stall_ms / 2, check every second when it is off */
+unsigned long stall_timer_interval(const struct tcpprobe_config *cfg)
+{
+	int ms = cfg->stall_ms;
+
+	if (ms <= 0)
+		return HZ;
+	return msecs_to_jiffies(max(ms / 2, TCP_STALL_SCAN_MIN_MS));
+}
+
+/*
+ * Stall detector: look for the tracked flows without progress. It only
+ * looks at the state of the last record of each flow, so stall_ms should
+ * be well above probetime.
+ */
+void stall_timer_run(unsigned long dummy)
+{
+	const struct tcpprobe_config *cfg;
+	struct tcp_hash_flow *flow;
+	ktime_t tstamp = ktime_get();
+	int written = 0;
+
+	/* one configuration for the whole run, see config.c */
+	rcu_read_lock();
+	cfg = rcu_dereference(tcpprobe_cfg);
+	if (cfg->stall_ms > 0) {
+		spin_lock(&tcp_hash_lock);
+		list_for_each_entry(flow, &tcp_flow_list, list) {
+			written += tcp_flow_check_stall(cfg, flow, tstamp);
+		}
+		spin_unlock(&tcp_hash_lock);
+		if (written)
+			wake_up(&tcp_probe.wait);
+	}
+	mod_timer(&stall_timer, jiffies + stall_timer_interval(cfg));
+	rcu_read_unlock();
+}
+
+/* Is anybody going to drain the ring? */
+static int tcpprobe_has_consumer(const struct tcpprobe_config *cfg)
+{
+	if (cfg->export_mode == TCPPROBE_EXPORT_NETLINK)
+		return tcpprobe_nl_listening();
+	return atomic_read(&tcp_probe.readers) > 0;
 }
 
+/*
+ * Wait until the ring has room for one more record and its flow
+ * definition, or until the
+ * deadline. Readers are woken up and the exporter kicked while waiting.
+ * Returns 0 if there is room.
+ */
+static int wait_ring_room(const struct tcpprobe_config *cfg, unsigned long deadline)
+{
+	int avail;
+
+	for (;;) {
+		spin_lock_bh(&tcp_probe.lock);
+		avail = tcp_probe_avail();
+		spin_unlock_bh(&tcp_probe.lock);
+		if (avail > 2)
+			return 0;
+		if (time_after(jiffies, deadline) || !tcpprobe_has_consumer(cfg))
+			return -ETIMEDOUT;
+		wake_up(&tcp_probe.wait);
+		tcpprobe_nl_kick(cfg);
+		msleep(TCP_UNLOAD_POLL_MS);
+	}
+}
+
+/*
+ * Write a purge record for every flow and release them. Called at unload
+ * once the probes, the purge timer and the shrinker are gone, so nothing
+ * else removes flows: when the ring is full the records are drained
+ * through the reader for up to unload_wait_ms before being dropped.
+ * Readers blocked in tcpprobe_read() are released once the ring is empty.
+ */
 void purge_all_flows(void)
 {
 	// Method to make sure to release all memory before calling kmem_cache_destroy
+	struct tcpprobe_config cfg;
+	unsigned long deadline;
 	struct tcp_hash_flow *flow;
-	struct tcp_hash_flow *temp;
+	unsigned int written = 0, dropped = 0;
+	u64 used;
 	
+	/* a copy, the purge sleeps while the reader drains the ring */
+	tcpprobe_config_get(&cfg);
+	deadline = jiffies + msecs_to_jiffies(cfg.unload_wait_ms);
 	PRINT_DEBUG("Purging all flows.\n");
-	spin_lock(&tcp_hash_lock);
-	list_for_each_entry_safe(flow, temp, &tcp_flow_list, list) {
+	for (;;) {
+		flow = NULL;
+		spin_lock_bh(&tcp_hash_lock);
+		if (!list_empty(&tcp_flow_list)) {
+			flow = list_first_entry(&tcp_flow_list, struct tcp_hash_flow, list);
+		}
+		spin_unlock_bh(&tcp_hash_lock);
+		if (!flow)
+			break;
+
+		if (wait_ring_room(&cfg, deadline) == 0)
+			written++;
+		else
+			dropped++;
+		spin_lock_bh(&tcp_probe.lock);
+		write_flow_purge(&cfg, flow); /* accounts ack_drop_ring_full */
+		spin_unlock_bh(&tcp_probe.lock);
+
+		spin_lock_bh(&tcp_hash_lock);
+		tcp_flow_unlink(flow);
+		spin_unlock_bh(&tcp_hash_lock);
+	}
+
+	/* Give the reader a chance to collect the last records */
+	for (;;) {
+		spin_lock_bh(&tcp_probe.lock);
+		used = tcp_probe_used();
+		spin_unlock_bh(&tcp_probe.lock);
+		if (!used || time_after(jiffies, deadline) || !tcpprobe_has_consumer(&cfg))
+			break;
+		wake_up(&tcp_probe.wait);
+		tcpprobe_nl_kick(&cfg);
+		msleep(TCP_UNLOAD_POLL_MS);
+	}
+
+	spin_lock_bh(&tcp_probe.lock);
+	tcp_probe.closing = 1;
+	spin_unlock_bh(&tcp_probe.lock);
+	wake_up(&tcp_probe.wait);
+
+	if (dropped || used)
+		pr_info("Unload: %u purge records written, %u dropped, %llu not read.\n",
+			written, dropped, (unsigned long long)used);
+	else
+		PRINT_DEBUG("Unload: %u purge records written.\n", written);
+}
+
+/*
+ * Purge up to nr flows, coldest first, that have been idle for at least
+ * min_idle_ms. The coldest flow is the one idle the longest among the
+ * TCP_FLOW_EVICT_SCAN oldest flows, so that a purge never walks the
+ * whole flow list.
+ * Assumes that tcp_hash_lock has been taken. Returns the number of purged flows.
+ */
+int purge_cold_flows(const struct tcpprobe_config *cfg, int nr, s64 min_idle_ms)
+{
+	ktime_t tstamp = ktime_get();
+	int purged = 0;
+
+	while (purged < nr) {
+		struct tcp_hash_flow *flow;
+		struct tcp_hash_flow *coldest = NULL;
+		s64 idle, coldest_idle = -1;
+		int scanned = 0;
+
+		list_for_each_entry_reverse(flow, &tcp_flow_list, list) {
+			idle = ktime_to_ms(ktime_sub(tstamp, tcp_flow_tstamp(flow)));
+			if (idle > coldest_idle) {
+				coldest = flow;
+				coldest_idle = idle;
+			}
+			if (++scanned >= TCP_FLOW_EVICT_SCAN) {
+				break;
+			}
+		}
+		if (!coldest || coldest_idle < min_idle_ms) {
+			break;
+		}
+		PRINT_DEBUG(
+			"Evicting flow src: %pI4 dst: %pI4"
+			" src_port: %u dst_port: %u idle: %lld ms\n",
+			&coldest->tuple.saddr, &coldest->tuple.daddr,
+			ntohs(coldest->tuple.sport), ntohs(coldest->tuple.dport),
+			coldest_idle);
 		spin_lock(&tcp_probe.lock);
-		write_flow_purge(flow);
+		write_flow_purge(cfg, coldest);
 		spin_unlock(&tcp_probe.lock);
-		// Remove from Hashtable
-		hlist_del(&flow->hlist);
-		// Remove from Global List
-		list_del(&flow->list);
-		// Free memory
-		tcp_hash_flow_free(flow);
+		tcp_flow_unlink(coldest);
+		TCPPROBE_STAT_INC(conn_evicted);
+		purged++;
 	}
-	spin_unlock(&tcp_hash_lock);
+	return purged;
+}
+
+/*
+ * Flow cache shrinker: give memory back under pressure by purging the
+ * flows that have been idle for at least TCP_FLOW_SHRINK_IDLE_MS.
+ */
+#ifndef SHRINK_STOP
+#define SHRINK_STOP (~0UL)
+#endif
+
+static unsigned long
+tcp_flow_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+	return atomic_read(&flow_count);
+}
+
+static unsigned long
+tcp_flow_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+	int purged;
+
+	rcu_read_lock();
+	spin_lock_bh(&tcp_hash_lock);
+	purged = purge_cold_flows(rcu_dereference(tcpprobe_cfg), sc->nr_to_scan,
+			TCP_FLOW_SHRINK_IDLE_MS);
+	spin_unlock_bh(&tcp_hash_lock);
+	rcu_read_unlock();
+	if (purged > 0) {
+		wake_up(&tcp_probe.wait);
+	}
+	return purged ? purged : SHRINK_STOP;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,12,0)
+/* Before 3.12, a single callback counts (nr_to_scan is 0) and scans */
+static int tcp_flow_shrink(struct shrinker *shrink, struct shrink_control *sc)
+{
+	if (sc->nr_to_scan && tcp_flow_shrink_scan(shrink, sc) == SHRINK_STOP) {
+		return -1;
+	}
+	return tcp_flow_shrink_count(shrink, sc);
+}
+#endif
+
+struct shrinker tcp_flow_shrinker = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,12,0)
+	.shrink = tcp_flow_shrink,
+#else
+	.count_objects = tcp_flow_shrink_count,
+	.scan_objects = tcp_flow_shrink_scan,
+#endif
+	.seeks = DEFAULT_SEEKS,
+};
+
+/*
+ * Check the flow limits before creating a new flow. When the memory budget
+ * is exhausted, the coldest flow is evicted to make room.
+ * Assumes that tcp_hash_lock has been taken. Returns 1 if the flow can be created.
+ */
+static int tcp_flow_admit(const struct tcpprobe_config *cfg)
+{
+	if (cfg->maxflows > 0 && atomic_read(&flow_count) >= cfg->maxflows) {
+		/* This is DOC attack prevention */
+		TCPPROBE_STAT_INC(conn_maxflow_limit);
+		PRINT_DEBUG("Flow count = %u execeed max flow = %u\n", 
+		atomic_read(&flow_count), cfg->maxflows);
+		return 0;
+	}
+	if (tcpprobe_mem_exceeded(cfg, tcp_flow_size()) && purge_cold_flows(cfg, 1, 0) == 0) {
+		TCPPROBE_STAT_INC(conn_memory_limit);
+		return 0;
+	}
+	return 1;
 }
 
 
+/*
+ * Write a record of a burst capture into the capture ring. The state of
+ * the flow is left untouched, so that the sampled stream is the same with
+ * or without a capture. A capture never creates flows: the packets of the
+ * flows that are not tracked have flow id 0 and absolute sequence numbers.
+ */
+static void
+write_flow_capture(int type, const struct tcp_hash_flow *tcp_flow, struct tcp_tuple *tuple,
+		ktime_t tstamp, struct sock *sk, u8 tcp_flags, u16 length,
+		u32 seq_num, u32 ack_num)
+{
+	struct tcp_flow_sample s;
+
+	fill_flow_sample(type, tcp_flow, sk, &s);
+	spin_lock(&tcp_capture.lock);
+	if (tcp_ring_avail(&tcp_capture) > 0) {
+		struct tcp_log *p = tcp_ring_slot(&tcp_capture, tcp_capture.head);
+
+		p->type = type;
+		p->flow_id = tcp_flow ? tcp_flow->flow_id : 0;
+		p->tstamp = tstamp;
+		p->saddr = tuple->saddr;
+		p->sport = tuple->sport;
+		p->daddr = tuple->daddr;
+		p->dport = tuple->dport;
+		p->tcp_flags = tcp_flags;
+		p->length = length;
+		copy_flow_sample(p, &s);
+		p->socket_idf = tcp_flow ? tcp_flow->first_seq_num : 0;
+		p->rto_num = tcp_flow ? atomic_read(&tcp_flow->rto_num) : 0;
+		p->seq_rtt = 0;
+		p->user_agent[0] = '\0';
+		p->seq_num = seq_num;
+		p->ack_num = ack_num;
+		tcp_capture.head++;
+	} else {
+		TCPPROBE_STAT_INC(capture_drop);
+	}
+	spin_unlock(&tcp_capture.lock);
+}
+
+/*
+ * Claim the sample of the current probetime interval of the flow. The
+ * RX and TX hooks of a flow race for it without lock: the one that moves
+ * the timestamp forward writes the record. Returns 1 if a record is due.
+ */
+static int
+tcp_flow_sample_due(const struct tcpprobe_config *cfg, struct tcp_hash_flow *tcp_flow,
+		ktime_t tstamp)
+{
+	s64 now = ktime_to_ns(tstamp);
+	s64 last;
+
+	do {
+		last = atomic64_read(&tcp_flow->tstamp);
+		/* a probetime of 0 samples every packet, without moving back in time */
+		if (now - last < (s64) cfg->probetime * NSEC_PER_MSEC)
+			return cfg->probetime <= 0;
+	} while (atomic64_cmpxchg(&tcp_flow->tstamp, last, now) != last);
+	return 1;
+}
+
+/*
+ * Per-flow token bucket of flow_rate records per second, flow_burst records
+ * deep. The bucket is kept as the earliest time of the next record (GCRA),
+ * so that the RX and TX hooks of a flow update it without lock.
+ * Returns 1 if the flow may write a record.
+ */
+static int
+tcp_flow_rate_ok(const struct tcpprobe_config *cfg, struct tcp_hash_flow *tcp_flow,
+		ktime_t tstamp)
+{
+	s64 now = ktime_to_ns(tstamp);
+	s64 interval, tolerance, tat, next;
+	int rate = cfg->flow_rate;
+
+	if (rate <= 0)
+		return 1;
+	interval = NSEC_PER_SEC / rate;
+	tolerance = (s64) (max(cfg->flow_burst, 1) - 1) * interval;
+	do {
+		tat = atomic64_read(&tcp_flow->rate_tat);
+		if (tat - now > tolerance) {
+			TCPPROBE_STAT_INC(ack_drop_rate);
+			return 0;
+		}
+		next = max(tat, now) + interval;
+	} while (atomic64_cmpxchg(&tcp_flow->rate_tat, tat, next) != tat);
+	return 1;
+}
+
+/*
+ * Fair share of the ring: once the ring is more than fair_share percent
+ * full, a flow may only write ring size / active flows records per epoch,
+ * an epoch ending each time the reader has consumed a whole ring. A few
+ * loud flows then cannot take the room left to the others while the
+ * reader lags behind.
+ * Assumes that the spin_lock on the tcp_probe has been taken.
+ * Returns 1 if the flow may write a record.
+ */
+static int
+tcp_flow_fair_ok(const struct tcpprobe_config *cfg, struct tcp_hash_flow *tcp_flow)
+{
+	u64 epoch = tcp_probe.tail >> ilog2(tcp_probe.size);
+	unsigned int share;
+
+	if (tcp_flow->fair_epoch != epoch) {
+		tcp_flow->fair_epoch = epoch;
+		tcp_flow->fair_records = 0;
+	}
+	if (cfg->fair_share > 0 &&
+	    (u64) tcp_probe_used() * 100 >= (u64) tcp_probe.size * cfg->fair_share) {
+		share = tcp_probe.size / max(atomic_read(&flow_count), 1);
+		if (tcp_flow->fair_records >= max(share, 1U)) {
+			TCPPROBE_STAT_INC(ack_drop_fair);
+			return 0;
+		}
+	}
+	tcp_flow->fair_records++;
+	return 1;
+}
+
   /*
    * Utility function to write the flow record
    * Assumes that the spin_lock on the tcp_probe has been taken
    * before calling it
    */
 static int
-write_flow(int type, struct tcp_hash_flow *tcp_flow, struct tcp_tuple *tuple, ktime_t tstamp,
+write_flow(const struct tcpprobe_config *cfg, int type, struct tcp_hash_flow *tcp_flow,
+		struct tcp_tuple *tuple, ktime_t tstamp,
 		struct sock *sk, struct sk_buff *skb, u8 tcp_flags, u16 length,
 		u32 seq_num, u32 ack_num, long reserved)
 {
 	const struct tcp_sock *tp = tcp_sk(sk);
-	int i=0;
+
+	/* Found by a hook just before it was done or purged */
+	if (tcp_flow->dead)
+		return 0;
+	if (type == LOG_DONE)
+		tcp_flow->dead = 1;
+	update_flow_sample(type, tcp_flow, sk);
 	/* If log fills, just silently drop */
-	if (tcp_probe_avail() > 1) {
-		struct tcp_log *p = tcp_probe.log + tcp_probe.head;
-		
+	if (tcp_probe_avail() > 1 && write_flow_def(tcp_flow, tstamp) == 0) {
+		struct tcp_log *p;
+
+		write_flow_owner(tcp_flow, tstamp, type == LOG_DONE);
+		write_flow_retrans(tcp_flow, tstamp);
+		write_flow_ecn(cfg, tcp_flow, tstamp, type == LOG_DONE);
+		if (type == LOG_DONE)
+			write_flow_states(tcp_flow, tstamp);
+		p = tcp_probe_slot(tcp_probe.head);
 		p->type = type;
+		p->flow_id = tcp_flow->flow_id;
 		p->tstamp = tstamp; 
 		p->saddr = tuple->saddr;
 		p->sport = tuple->sport;
@@ -225,68 +994,18 @@ write_flow(int type, struct tcp_hash_flow *tcp_flow, struct tcp_tuple *tuple, kt
 		p->dport = tuple->dport;
 		p->tcp_flags = tcp_flags;
 		p->length = length;
-		/* update the cumulative bytes */
-		p->write_seq = tp->write_seq - tcp_flow->first_seq_num;
-		if (type != LOG_SETUP) {
-			p->snd_nxt = tp->snd_nxt - tcp_flow->first_seq_num;
-			p->snd_una = tp->snd_una - tcp_flow->first_seq_num;
-		} else {
-			p->snd_nxt = 0;
-			p->snd_una = 0;
-		}
-		p->snd_cwnd = tp->snd_cwnd;
-		p->snd_wnd = tp->snd_wnd;
-		p->rcv_wnd = tp->rcv_wnd;
-		p->ssthresh = tcp_current_ssthresh(sk);
-	
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,10,0)
-		p->srtt = jiffies_to_usecs(tp->srtt);
-		p->rttvar = jiffies_to_usecs(tp->rttvar);
-		p->mdev = jiffies_to_usecs(tp->mdev);
-#else
-		/* element was renamed */ 
-		p->srtt = tp->srtt_us;
-		p->rttvar = tp->rttvar_us;
-		p->mdev = tp->mdev_us;
-#endif
-	
-		p->retrans_out = tp->retrans_out;
-		p->lost_out = tp->lost_out;
-		p->packets_out = tp->packets_out;
-		p->sacked_out = tp->sacked_out;
-		p->retrans = tp->total_retrans;
-		/* p->rto = p->srtt + (4 * p->rttvar); */
-
-		p->rto = inet_csk(sk)->icsk_rto;
-		p->ca_state = inet_csk(sk)->icsk_ca_state;
-	
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,10,0)
-		p->frto_counter = tp->frto_counter;
-#else
-		p->frto_counter = tp->frto;	
-#endif
-	
-		/* same method as tcp_diag to retrieve the queue sizes */
-		if (sk->sk_state == TCP_LISTEN) {
-			p->rqueue = sk->sk_ack_backlog;
-			p->wqueue = sk->sk_max_ack_backlog;
-		} else {
-			p->rqueue = max_t(int, tp->rcv_nxt - tp->copied_seq, 0);
-			p->wqueue = tp->write_seq - tp->snd_una;
-		}
+		copy_flow_sample(p, &tcp_flow->last);
 		p->socket_idf = tcp_flow->first_seq_num;
-		p->rto_num = tcp_flow->rto_num;
+		p->rto_num = atomic_read(&tcp_flow->rto_num);
 		if (type == LOG_DONE) {
-			while (tcp_flow->user_agent[i]) {
-				p->user_agent[i] = tcp_flow->user_agent[i];
-				i++;
-			}
+			copy_user_agent(p, tcp_flow);
 		} else {
 			p->user_agent[0] = '\0';
 		}
 		p->seq_num = seq_num;
 		p->ack_num = ack_num;
-		tcp_probe.head = (tcp_probe.head + 1) & (bufsize - 1);
+		tcp_probe.head++;
+		tcpprobe_commit(cfg);
 	} else {
 		TCPPROBE_STAT_INC(ack_drop_ring_full);
 	}
@@ -310,7 +1029,7 @@ void jtcp_done(struct sock *sk)
 	struct tcp_hash_flow *tcp_flow;
 	unsigned int hash;
 	ktime_t tstamp;
-
+	const struct tcpprobe_config *cfg;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,21)
 	struct timespec ts;
@@ -332,8 +1051,11 @@ void jtcp_done(struct sock *sk)
 	tuple.dport = inet->dport;
 #endif
 
-	if (port == 0 || ntohs(tuple.dport) == port ||
-		ntohs(tuple.sport) == port) {
+	/* one configuration for the whole call, see config.c */
+	rcu_read_lock();
+	cfg = rcu_dereference(tcpprobe_cfg);
+	if (cfg->port == 0 || ntohs(tuple.dport) == cfg->port ||
+		ntohs(tuple.sport) == cfg->port) {
 
 		PRINT_DEBUG(
 			"Reset flow src: %pI4 dst: %pI4"
@@ -343,8 +1065,8 @@ void jtcp_done(struct sock *sk)
 		);
 	
 		hash = hash_tcp_flow(&tuple);
-		/* Making sure that we are the only one touching this flow */
-		spin_lock(&tcp_hash_lock);
+		/* Making sure that we are the only one removing this flow */
+		spin_lock_bh(&tcp_hash_lock);
 		
 		tcp_flow = tcp_flow_find(&tuple, hash);
 		if (!tcp_flow) {
@@ -354,7 +1076,7 @@ void jtcp_done(struct sock *sk)
 				&tuple.saddr, &tuple.daddr,
 				ntohs(tuple.sport), ntohs(tuple.dport)
 			);
-			spin_unlock(&tcp_hash_lock);
+			spin_unlock_bh(&tcp_hash_lock);
 			goto skip;
 		} else {
 			tcp_flow->last_seq_num = tp->snd_nxt;
@@ -363,23 +1085,19 @@ void jtcp_done(struct sock *sk)
 		// Get the other lock and write
 		spin_lock(&tcp_probe.lock);
 		TCPPROBE_STAT_INC(reset_flows);
-		write_flow(LOG_DONE, tcp_flow, &tuple, tstamp, sk, NULL, 0, 0,
+		write_flow(cfg, LOG_DONE, tcp_flow, &tuple, tstamp, sk, NULL, 0, 0,
 				tcp_flow->first_seq_num, tcp_flow->first_ack_num, 0);
 		spin_unlock(&tcp_probe.lock);
 		
 		/* Release the flow tuple*/
-		// Remove from Hashtable
-		hlist_del(&tcp_flow->hlist);
-		// Remove from Global List
-		list_del(&tcp_flow->list);
-		// Free memory
-		tcp_hash_flow_free(tcp_flow);
+		tcp_flow_unlink(tcp_flow);
 		
-		spin_unlock(&tcp_hash_lock);
+		spin_unlock_bh(&tcp_hash_lock);
 		wake_up(&tcp_probe.wait);
 	}
 	
 skip:
+	rcu_read_unlock();
 	jprobe_return();
 	return;
 }
@@ -435,6 +1153,20 @@ get_user_agent(struct sk_buff *skb, char *buff, unsigned buflen) {
 	return 0;
 }
 
+/* Capture the User-Agent of the flow from an HTTP request, if any */
+static void
+tcp_flow_capture_agent(const struct tcpprobe_config *cfg, struct tcp_hash_flow *tcp_flow,
+		struct sk_buff *skb)
+{
+	char agent[MAX_AGENT_LEN];
+
+	agent[0] = '\0';
+	get_user_agent(skb, agent, MAX_AGENT_LEN-1);
+	if (agent[0] != '\0') {
+		tcp_flow_set_agent(cfg, tcp_flow, agent);
+	}
+}
+
 static inline u32
 get_tsecr(const struct tcp_sock *tp, const struct tcphdr *th)
 {
@@ -449,6 +1181,284 @@ get_tsecr(const struct tcp_sock *tp, const struct tcphdr *th)
 	return 0;
 }
 
+/*
+ * Does the ACK carry a DSACK, i.e. report a segment received twice? The
+ * first SACK block is then below the cumulative ACK or inside the second
+ * block (RFC 2883).
+ */
+static int
+tcp_skb_has_dsack(const struct tcphdr *th)
+{
+	const unsigned char *ptr = (const unsigned char *)(th + 1);
+	int length = (th->doff * 4) - sizeof(struct tcphdr);
+
+	while (length > 0) {
+		int opcode = *ptr++;
+		int opsize;
+
+		if (opcode == TCPOPT_EOL)
+			return 0;
+		if (opcode == TCPOPT_NOP) {
+			length--;
+			continue;
+		}
+		if (length < 2)
+			return 0;
+		opsize = *ptr++;
+		if (opsize < 2 || opsize > length)
+			return 0;
+		if (opcode == TCPOPT_SACK &&
+		    opsize >= TCPOLEN_SACK_BASE + TCPOLEN_SACK_PERBLOCK) {
+			u32 start = get_unaligned_be32(ptr);
+			u32 end = get_unaligned_be32(ptr + 4);
+
+			if (before(start, ntohl(th->ack_seq)))
+				return 1;
+			if (opsize >= TCPOLEN_SACK_BASE + 2 * TCPOLEN_SACK_PERBLOCK)
+				return !before(start, get_unaligned_be32(ptr + 8)) &&
+					!after(end, get_unaligned_be32(ptr + 12));
+			return 0;
+		}
+		ptr += opsize - 2;
+		length -= opsize;
+	}
+	return 0;
+}
+
+enum {
+	TCP_RETX_FAST,
+	TCP_RETX_RTO,
+	TCP_RETX_TLP,
+};
+
+/*
+ * Account a retransmission of [seq, end_seq) (relative) in the
+ * retransmissions of the flow since its previous record.
+ */
+static void
+tcp_flow_count_retx(struct tcp_hash_flow *tcp_flow, int kind, u32 seq, u32 end_seq)
+{
+	struct tcp_retx_stat *r = &tcp_flow->retx;
+
+	spin_lock_bh(&tcp_probe.lock);
+	if (!r->fast && !r->rto && !r->tlp) {
+		r->seq_lo = seq;
+		r->seq_hi = end_seq;
+	} else {
+		if (before(seq, r->seq_lo))
+			r->seq_lo = seq;
+		if (after(end_seq, r->seq_hi))
+			r->seq_hi = end_seq;
+	}
+	r->bytes += end_seq - seq;
+	switch (kind) {
+	case TCP_RETX_RTO:
+		r->rto++;
+		break;
+	case TCP_RETX_TLP:
+		r->tlp++;
+		break;
+	default:
+		r->fast++;
+	}
+	spin_unlock_bh(&tcp_probe.lock);
+}
+
+/*
+ * The socket of the flow moves from TCP state old to state: account the
+ * time spent in old. Transitions are rare, the ring lock is taken as for
+ * the other per-flow state written by the records.
+ */
+static void
+tcp_flow_state_change(struct tcp_hash_flow *tcp_flow, int old, int state, ktime_t tstamp)
+{
+	struct tcp_states_stat *st = &tcp_flow->states;
+	s64 now = ktime_to_ns(tstamp);
+
+	spin_lock_bh(&tcp_probe.lock);
+	if (!tcp_flow->dead) {
+		if (old > 0 && old < TCPPROBE_TCP_STATES)
+			st->ms[old] += div_s64(now - tcp_flow->state_since, NSEC_PER_MSEC);
+		st->state = state;
+		st->transitions++;
+		tcp_flow->state_since = now;
+	}
+	spin_unlock_bh(&tcp_probe.lock);
+}
+
+/*
+ * Count the ECN marks of a received segment: ECE and the bytes it newly
+ * acknowledges (the DCTCP estimator of the sender), CWR, and the CE
+ * mark of the IP header for data.
+ */
+static void
+tcp_flow_count_ecn(struct tcp_hash_flow *tcp_flow, const struct tcp_sock *tp,
+		struct sk_buff *skb, const struct tcphdr *th, u16 length)
+{
+	struct tcp_ecn_count *c = &tcp_flow->ecn;
+	u32 ack_seq = ntohl(th->ack_seq);
+
+	if (th->ack) {
+		u32 acked = after(ack_seq, tp->snd_una) ? ack_seq - tp->snd_una : 0;
+
+		atomic_inc(&c->acks);
+		atomic_add(acked, &c->acked_bytes);
+		if (th->ece) {
+			atomic_inc(&c->ece_acks);
+			atomic_add(acked, &c->ece_bytes);
+		}
+	}
+	if (th->cwr)
+		atomic_inc(&c->cwr);
+	if (length) {
+		atomic_inc(&c->data_pkts);
+		atomic_add(length, &c->data_bytes);
+		if (INET_ECN_is_ce(ip_hdr(skb)->tos)) {
+			atomic_inc(&c->ce_pkts);
+			atomic_add(length, &c->ce_bytes);
+		}
+	}
+}
+
+/* Host side reasons for not sending, TCP_HOSTQ_* */
+#define TCP_HOSTQ_TSQ		1	/* too much data in the qdisc/device (TSQ) */
+#define TCP_HOSTQ_PACING	2	/* the pacing timer is armed */
+
+static int
+tcp_hostq_state(struct sock *sk)
+{
+	int state = 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	if (test_bit(TSQ_THROTTLED, &sk->sk_tsq_flags))
+		state |= TCP_HOSTQ_TSQ;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3,6,0)
+	if (test_bit(TSQ_THROTTLED, &tcp_sk(sk)->tsq_flags))
+		state |= TCP_HOSTQ_TSQ;
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+	/* pacing by the fq qdisc before 4.13 is not visible here */
+	if (hrtimer_active(&tcp_sk(sk)->pacing_timer))
+		state |= TCP_HOSTQ_PACING;
+#endif
+	return state;
+}
+
+/* Time the socket has been limited by its send buffer, in ms */
+static u32
+tcp_sndbuf_limited_ms(struct sock *sk)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+	const struct tcp_sock *tp = tcp_sk(sk);
+	u32 limited = tp->chrono_stat[TCP_CHRONO_SNDBUF_LIMITED - 1];
+
+	if (tp->chrono_type == TCP_CHRONO_SNDBUF_LIMITED)
+		limited += tcp_jiffies32 - tp->chrono_start;
+	return jiffies_to_msecs(limited);
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Write the host side queueing of the flow (LOG_HOSTQ) and start a new
+ * interval.
+ * Assumes that the spin_lock on the tcp_probe has been taken.
+ */
+static void
+write_flow_hostq(const struct tcpprobe_config *cfg, struct tcp_hash_flow *tcp_flow,
+		struct sock *sk, ktime_t tstamp)
+{
+	struct tcp_hostq_count *h = &tcp_flow->hostq;
+	u32 sndbuf_ms = tcp_sndbuf_limited_ms(sk);
+
+	if (tcp_flow->dead)
+		return;
+	/* If log fills, just silently drop */
+	if (tcp_probe_avail() > 1 && write_flow_def(tcp_flow, tstamp) == 0) {
+		struct tcp_log *p = tcp_probe_slot(tcp_probe.head);
+
+		memset(p, 0, offsetof(struct tcp_log, user_agent));
+		p->type = LOG_HOSTQ;
+		p->tstamp = tstamp;
+		p->saddr = tcp_flow->tuple.saddr;
+		p->sport = tcp_flow->tuple.sport;
+		p->daddr = tcp_flow->tuple.daddr;
+		p->dport = tcp_flow->tuple.dport;
+		p->flow_id = tcp_flow->flow_id;
+		p->socket_idf = tcp_flow->first_seq_num;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,12,0)
+		p->hostq.pacing_rate = sk->sk_pacing_rate;
+#else
+		p->hostq.pacing_rate = ~0ULL;
+#endif
+		p->hostq.wmem_queued = sk->sk_wmem_queued;
+		p->hostq.wmem_queued_max = h->wmem_queued_max;
+		p->hostq.wmem_alloc = sk_wmem_alloc_get(sk);
+		p->hostq.wmem_alloc_max = h->wmem_alloc_max;
+		p->hostq.tsq_ms = div_u64(h->tsq_ns, NSEC_PER_MSEC);
+		p->hostq.pacing_ms = div_u64(h->pacing_ns, NSEC_PER_MSEC);
+		p->hostq.sndbuf_ms = sndbuf_ms - h->sndbuf_prev;
+		p->hostq.events = h->events;
+		tcp_probe.head++;
+		tcpprobe_commit(cfg);
+	} else {
+		TCPPROBE_STAT_INC(ack_drop_ring_full);
+	}
+	h->last_ns = ktime_to_ns(tstamp);
+	h->wmem_queued_max = 0;
+	h->wmem_alloc_max = 0;
+	h->tsq_ns = 0;
+	h->pacing_ns = 0;
+	h->sndbuf_prev = sndbuf_ms;
+	h->events = 0;
+}
+
+/*
+ * Account the host side queueing of the flow at a packet: the time spent
+ * throttled by TSQ or waiting for the pacing timer is the time between two
+ * packets of the flow while it was in that state. Writes the interval
+ * every hostq_interval_ms.
+ */
+static void
+tcp_flow_hostq(const struct tcpprobe_config *cfg, struct tcp_hash_flow *tcp_flow,
+		struct sock *sk, ktime_t tstamp)
+{
+	struct tcp_hostq_count *h = &tcp_flow->hostq;
+	s64 now = ktime_to_ns(tstamp);
+
+	if (!h->prev_ns) {
+		/* first packet of the flow seen */
+		h->last_ns = now;
+		h->sndbuf_prev = tcp_sndbuf_limited_ms(sk);
+	} else {
+		if (h->prev_state & TCP_HOSTQ_TSQ)
+			h->tsq_ns += now - h->prev_ns;
+		if (h->prev_state & TCP_HOSTQ_PACING)
+			h->pacing_ns += now - h->prev_ns;
+	}
+	h->prev_ns = now;
+	h->prev_state = tcp_hostq_state(sk);
+	h->wmem_queued_max = max_t(u32, h->wmem_queued_max, sk->sk_wmem_queued);
+	h->wmem_alloc_max = max_t(u32, h->wmem_alloc_max, sk_wmem_alloc_get(sk));
+	h->events++;
+
+	if (now - h->last_ns >= (s64) cfg->hostq_interval_ms * NSEC_PER_MSEC) {
+		spin_lock(&tcp_probe.lock);
+		write_flow_hostq(cfg, tcp_flow, sk, tstamp);
+		spin_unlock(&tcp_probe.lock);
+	}
+}
+
+/* Account a retransmission reported unneeded by a DSACK */
+static void
+tcp_flow_count_spurious(struct tcp_hash_flow *tcp_flow)
+{
+	spin_lock_bh(&tcp_probe.lock);
+	tcp_flow->retx.spurious++;
+	spin_unlock_bh(&tcp_probe.lock);
+}
+
 /*
 * Hook inserted to be called before each receive packet.
 * Note: arguments must match tcp_rcv_established()!
@@ -466,6 +1476,8 @@ int jtcp_rcv_established(struct sock *sk, struct sk_buff *skb,
 	unsigned int hash;
 	struct tcp_skb_cb *tcb = TCP_SKB_CB(skb);
 	u8 tcp_flags;
+	const struct tcpprobe_config *cfg;
+	int matched, sampled, capturing, dsack, ecn, hostq;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,21)
 	struct timespec ts;
@@ -487,64 +1499,88 @@ int jtcp_rcv_established(struct sock *sk, struct sk_buff *skb,
 	tuple.sport = inet->sport;
 	tuple.dport = inet->dport;
 #endif
-	if ((port == 0 || ntohs(tuple.dport) == port ||
-		ntohs(tuple.sport) == port) &&
-		(full || tp->snd_cwnd != tcp_probe.lastcwnd)) {
+	/* one configuration for the whole packet, see config.c */
+	rcu_read_lock();
+	cfg = rcu_dereference(tcpprobe_cfg);
+	/* a burst capture takes every packet, the sampled stream is unchanged */
+	sampled = cfg->full || tp->snd_cwnd != tcp_probe.lastcwnd;
+	capturing = tcpprobe_capturing();
+	matched = cfg->port == 0 || ntohs(tuple.dport) == cfg->port ||
+		ntohs(tuple.sport) == cfg->port;
+	/* only worth parsing the options of a matching socket that has retransmitted */
+	dsack = matched && tp->total_retrans && th->doff > 5 && tcp_skb_has_dsack(th);
+	/* ECN and host queueing accounting look at every packet */
+	ecn = cfg->ecn_interval_ms > 0;
+	hostq = cfg->hostq_interval_ms > 0;
+	if (matched && (sampled || capturing || dsack || ecn || hostq)) {
 		/* Only update if port matches */
 		hash = hash_tcp_flow(&tuple);
-		spin_lock(&tcp_hash_lock);
-		//if (spin_trylock(&tcp_hash_lock) == 0) {
-		//	/* Purge is ongoing.. skip this ACK  */
-		//	TCPPROBE_STAT_INC(ack_drop_purge);
-		//	goto skip;
-		//}
+		/* lockless lookup, tcp_hash_lock is only taken to create the flow */
 		tcp_flow = tcp_flow_find(&tuple, hash);
 		if (!tcp_flow) {
-			if (maxflows > 0 && atomic_read(&flow_count) >= maxflows) {
-				/* This is DOC attack prevention */
-				TCPPROBE_STAT_INC(conn_maxflow_limit);
-				PRINT_DEBUG("Flow count = %u execeed max flow = %u\n", 
-				atomic_read(&flow_count), maxflows);
-			} else {
-				/* create an entry in hashtable */
-				PRINT_DEBUG(
-					"Init new flow src: %pI4 dst: %pI4"
-					" src_port: %u dst_port: %u\n",
-					&tuple.saddr, &tuple.daddr,
-					ntohs(tuple.sport), ntohs(tuple.dport)
-				);
-				tcp_flow = init_tcp_hash_flow(&tuple, tstamp, hash);
-				tcp_flow->first_seq_num = tcb->ack_seq; 
-				tcp_flow->first_ack_num = tcb->seq;
-				tcp_flow->tstamp = tstamp;
-				tcp_flow->rto_num = 0;
-				tcp_flow->user_agent[0] = '\0';
-				should_write_flow = 1;
-			}
-		} else {
-		/* if the difference between timestamps is >= probetime then write the flow to ring */
-			struct timespec tv = ktime_to_timespec(ktime_sub(tstamp, tcp_flow->tstamp));	
-			u_int64_t milliseconds = (tv.tv_sec * MSEC_PER_SEC) + (tv.tv_nsec/NSEC_PER_MSEC);
-			if (milliseconds >= probetime) { 
-				tcp_flow->tstamp = tstamp;
-				should_write_flow = 1;
+			if (sampled) {
+				spin_lock_bh(&tcp_hash_lock);
+				/* the other direction of the flow may have just created it */
+				tcp_flow = tcp_flow_find(&tuple, hash);
+				if (tcp_flow) {
+					should_write_flow = tcp_flow_sample_due(cfg, tcp_flow, tstamp) &&
+							tcp_flow_rate_ok(cfg, tcp_flow, tstamp);
+				} else if (tcp_flow_admit(cfg)) {
+					/* create an entry in hashtable */
+					PRINT_DEBUG(
+						"Init new flow src: %pI4 dst: %pI4"
+						" src_port: %u dst_port: %u\n",
+						&tuple.saddr, &tuple.daddr,
+						ntohs(tuple.sport), ntohs(tuple.dport)
+					);
+					tcp_flow = init_tcp_hash_flow(&tuple, tstamp, hash,
+							tcb->ack_seq, tcb->seq);
+					if (tcp_flow) {
+						should_write_flow = 1;
+					}
+				}
+				spin_unlock_bh(&tcp_hash_lock);
 			}
+		} else if (sampled) {
+		/* if the difference between timestamps is >= probetime and the flow is within
+		   flow_rate then write the flow to ring */
+			should_write_flow = tcp_flow_sample_due(cfg, tcp_flow, tstamp) &&
+					tcp_flow_rate_ok(cfg, tcp_flow, tstamp);
+		}
+		if (dsack && tcp_flow) {
+			tcp_flow_count_spurious(tcp_flow);
+		}
+		if (ecn && tcp_flow) {
+			tcp_flow_count_ecn(tcp_flow, tp, skb, th, length);
+		}
+		if (hostq && tcp_flow) {
+			tcp_flow_hostq(cfg, tcp_flow, sk, tstamp);
+		}
+		if (tcp_flow) {
+			tcp_flow_set_owner(tcp_flow);
+		}
+		if (capturing) {
+			u32 seq_base = tcp_flow ? tcp_flow->first_ack_num : 0;
+			u32 ack_base = tcp_flow ? tcp_flow->first_seq_num : 0;
+			write_flow_capture(LOG_RECV, tcp_flow, &tuple, tstamp, sk, TCP_FLAGS(th), length,
+						tcb->seq - seq_base, tcb->ack_seq - ack_base);
 		}
 		if (should_write_flow) {
-			if (tcp_flow->user_agent[0] == '\0') {
-				get_user_agent(skb, tcp_flow->user_agent, MAX_AGENT_LEN-1);
+			if (!tcp_flow->user_agent) {
+				tcp_flow_capture_agent(cfg, tcp_flow, skb);
 			}
 			tcp_flow->last_seq_num = tp->snd_nxt;
 			tcp_flags = TCP_FLAGS(th);
 			spin_lock(&tcp_probe.lock);
-			write_flow(LOG_RECV, tcp_flow, &tuple, tstamp, sk, skb, tcp_flags, length,
-						tcb->seq - tcp_flow->first_ack_num,
-						tcb->ack_seq - tcp_flow->first_seq_num, 0);
+			if (tcp_flow_fair_ok(cfg, tcp_flow))
+				write_flow(cfg, LOG_RECV, tcp_flow, &tuple, tstamp, sk, skb, tcp_flags, length,
+							tcb->seq - tcp_flow->first_ack_num,
+							tcb->ack_seq - tcp_flow->first_seq_num, 0);
 			spin_unlock(&tcp_probe.lock);
 			wake_up(&tcp_probe.wait);
 		}
-		spin_unlock(&tcp_hash_lock);
 	}
+	rcu_read_unlock();
 	jprobe_return();
 	return 0;
 }
@@ -564,6 +1600,8 @@ void jtcp_transmit_skb(struct sock *sk, struct sk_buff *skb, int clone_it,
 	struct tcp_hash_flow *tcp_flow;
 	unsigned int hash;
 	struct tcp_skb_cb *tcb = TCP_SKB_CB(skb);
+	const struct tcpprobe_config *cfg;
+	int sampled, capturing, hostq;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,21)
 	struct timespec ts;
@@ -585,68 +1623,80 @@ void jtcp_transmit_skb(struct sock *sk, struct sk_buff *skb, int clone_it,
 	tuple.sport = inet->sport;
 	tuple.dport = inet->dport;
 #endif
+	/* one configuration for the whole packet, see config.c */
+	rcu_read_lock();
+	cfg = rcu_dereference(tcpprobe_cfg);
+	/* a burst capture takes every packet, the sampled stream is unchanged */
+	sampled = cfg->full || tp->snd_cwnd != tcp_probe.lastcwnd;
+	capturing = tcpprobe_capturing();
+	/* host queueing accounting looks at every packet */
+	hostq = cfg->hostq_interval_ms > 0;
 
 	/* Only update if port or skb mark matches */
-	if ((port == 0 ||
-	     ntohs(inet->inet_dport) == port ||
-	     ntohs(inet->inet_sport) == port) &&
-	    (full || tp->snd_cwnd != tcp_probe.lastcwnd)) {
+	if ((cfg->port == 0 ||
+	     ntohs(inet->inet_dport) == cfg->port ||
+	     ntohs(inet->inet_sport) == cfg->port) &&
+	    (sampled || capturing || hostq)) {
 
 		hash = hash_tcp_flow(&tuple);
-		spin_lock(&tcp_hash_lock);
+		/* lockless lookup, tcp_hash_lock is only taken to create the flow */
 		tcp_flow = tcp_flow_find(&tuple, hash);
 		if (!tcp_flow) {
-			if (sk->sk_state == TCP_ESTABLISHED) {
-				/* The number of monitor flows reaches its maximum */
-				if (maxflows > 0 && atomic_read(&flow_count) >= maxflows) {
-					/* This is DOC attack prevention */
-					TCPPROBE_STAT_INC(conn_maxflow_limit);
-					PRINT_DEBUG("Flow count = %u execeed max flow = %u\n", 
-					atomic_read(&flow_count), maxflows);
-					spin_unlock(&tcp_hash_lock);
-					goto skip;
-				} else {
+			/*May be this is a syn packet. Donot create a hash item in case of DoS attach*/
+			if (sampled && sk->sk_state == TCP_ESTABLISHED) {
+				spin_lock_bh(&tcp_hash_lock);
+				/* the other direction of the flow may have just created it */
+				tcp_flow = tcp_flow_find(&tuple, hash);
+				if (tcp_flow) {
+					should_write_flow = tcp_flow_sample_due(cfg, tcp_flow, tstamp) &&
+							tcp_flow_rate_ok(cfg, tcp_flow, tstamp);
+				} else if (tcp_flow_admit(cfg)) {
 					/* create an entry in hashtable */
 					PRINT_DEBUG(
 						"Init new flow src: %pI4 dst: %pI4"
 						" src_port: %u dst_port: %u\n",
 						&tuple.saddr, &tuple.daddr,
 						ntohs(tuple.sport), ntohs(tuple.dport));
-					tcp_flow = init_tcp_hash_flow(&tuple, tstamp, hash);
-					tcp_flow->first_seq_num = tcb->seq;
-					tcp_flow->first_ack_num = tp->rcv_nxt;
-					tcp_flow->tstamp = tstamp;
-					tcp_flow->rto_num = 0;
-					tcp_flow->user_agent[0] = '\0';
-					should_write_flow = 1;
+					tcp_flow = init_tcp_hash_flow(&tuple, tstamp, hash,
+							tcb->seq, tp->rcv_nxt);
+					if (tcp_flow) {
+						should_write_flow = 1;
+					}
 				}
-			} else {
-			/*May be this is a syn packet. Donot create a hash item in case of DoS attach*/
-				spin_unlock(&tcp_hash_lock);
-				goto skip;
-			}
-		} else {
-		/* if the difference between timestamps is >= probetime then write the flow to ring */
-			struct timespec tv = ktime_to_timespec(ktime_sub(tstamp, tcp_flow->tstamp));	
-			u_int64_t milliseconds = (tv.tv_sec * MSEC_PER_SEC) + (tv.tv_nsec/NSEC_PER_MSEC);
-			if (milliseconds >= probetime) { 
-				tcp_flow->tstamp = tstamp;
-				should_write_flow = 1;
+				/* The number of monitor flows reaches its maximum: tcp_flow is NULL */
+				spin_unlock_bh(&tcp_hash_lock);
 			}
+		} else if (sampled) {
+		/* if the difference between timestamps is >= probetime and the flow is within
+		   flow_rate then write the flow to ring */
+			should_write_flow = tcp_flow_sample_due(cfg, tcp_flow, tstamp) &&
+					tcp_flow_rate_ok(cfg, tcp_flow, tstamp);
+		}
+		if (hostq && tcp_flow) {
+			tcp_flow_hostq(cfg, tcp_flow, sk, tstamp);
+		}
+		if (tcp_flow) {
+			tcp_flow_set_owner(tcp_flow);
+		}
+		if (capturing) {
+			u32 seq_base = tcp_flow ? tcp_flow->first_seq_num : 0;
+			u32 ack_base = tcp_flow ? tcp_flow->first_ack_num : 0;
+			write_flow_capture(LOG_SEND, tcp_flow, &tuple, tstamp, sk, tcb->tcp_flags, length,
+						tcb->seq - seq_base, tp->rcv_nxt - ack_base);
 		}
 		if (should_write_flow) {
 			tcp_flow->last_seq_num = tp->snd_nxt;
 			spin_lock(&tcp_probe.lock);
-			write_flow(LOG_SEND, tcp_flow, &tuple, tstamp, sk, skb, tcb->tcp_flags, length,
-						tcb->seq - tcp_flow->first_seq_num,
-						tp->rcv_nxt - tcp_flow->first_ack_num, 0);
+			if (tcp_flow_fair_ok(cfg, tcp_flow))
+				write_flow(cfg, LOG_SEND, tcp_flow, &tuple, tstamp, sk, skb, tcb->tcp_flags, length,
+							tcb->seq - tcp_flow->first_seq_num,
+							tp->rcv_nxt - tcp_flow->first_ack_num, 0);
 			spin_unlock(&tcp_probe.lock);
 			wake_up(&tcp_probe.wait);
 		}
-		spin_unlock(&tcp_hash_lock);
 	}
+	rcu_read_unlock();
 
-skip:
 	jprobe_return();
 	return ;
 }
@@ -661,7 +1711,7 @@ void jtcp_retransmit_timer(struct sock *sk)
 	struct tcp_hash_flow *tcp_flow;
 	unsigned int hash;
 	ktime_t tstamp;
-
+	const struct tcpprobe_config *cfg;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,21)
 	struct timespec ts;
@@ -683,8 +1733,11 @@ void jtcp_retransmit_timer(struct sock *sk)
 	tuple.dport = inet->dport;
 #endif
 
-	if (port == 0 || ntohs(tuple.dport) == port ||
-		ntohs(tuple.sport) == port) {
+	/* one configuration for the whole call, see config.c */
+	rcu_read_lock();
+	cfg = rcu_dereference(tcpprobe_cfg);
+	if (cfg->port == 0 || ntohs(tuple.dport) == cfg->port ||
+		ntohs(tuple.sport) == cfg->port) {
 		PRINT_DEBUG(
 			"RTO Timeout src: %pI4 dst: %pI4"
 			" src_port: %u dst_port: %u\n",
@@ -693,9 +1746,6 @@ void jtcp_retransmit_timer(struct sock *sk)
 		);
 	
 		hash = hash_tcp_flow(&tuple);
-		/* Making sure that we are the only one touching this flow */
-		spin_lock(&tcp_hash_lock);
-		
 		tcp_flow = tcp_flow_find(&tuple, hash);
 		if (!tcp_flow) {
 			/*We just saw the FIN for this one so we can probably forget it */
@@ -704,21 +1754,131 @@ void jtcp_retransmit_timer(struct sock *sk)
 				&tuple.saddr, &tuple.daddr,
 				ntohs(tuple.sport), ntohs(tuple.dport)
 			);
-			spin_unlock(&tcp_hash_lock);
 			goto skip;
 		} else {
-			tcp_flow->rto_num ++;
+			atomic_inc(&tcp_flow->rto_num);
 		}
 		
-		// Get the other lock and write
+		// Get the ring lock and write
 		spin_lock(&tcp_probe.lock);
-		write_flow(LOG_TIMEOUT, tcp_flow, &tuple, tstamp, sk, NULL, 0, 0, 0, 0, 0);
+		write_flow(cfg, LOG_TIMEOUT, tcp_flow, &tuple, tstamp, sk, NULL, 0, 0, 0, 0, 0);
 		spin_unlock(&tcp_probe.lock);
-		
-		spin_unlock(&tcp_hash_lock);
 		wake_up(&tcp_probe.wait);
 	}
 	
+skip:
+	rcu_read_unlock();
+	jprobe_return();
+	return;
+}
+
+/*
+* Hook inserted to be called before each retransmission, whatever its cause:
+* recovery (fast retransmit), retransmit timeout or tail loss probe.
+* Note: arguments must match __tcp_retransmit_skb()!
+*/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,9,0)
+void jtcp_retransmit_skb(struct sock *sk, struct sk_buff *skb, int segs)
+#else
+void jtcp_retransmit_skb(struct sock *sk, struct sk_buff *skb)
+#endif
+{
+	const struct inet_connection_sock *icsk = inet_csk(sk);
+	const struct inet_sock *inet = inet_sk(sk);
+	const struct tcp_skb_cb *tcb = TCP_SKB_CB(skb);
+	struct tcp_tuple tuple;
+	struct tcp_hash_flow *tcp_flow;
+	unsigned int hash;
+	int kind;
+	const struct tcpprobe_config *cfg;
+
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,32)
+	tuple.saddr = inet->inet_saddr;
+	tuple.daddr = inet->inet_daddr;
+	tuple.sport = inet->inet_sport;
+	tuple.dport = inet->inet_dport;
+#else
+	tuple.saddr = inet->saddr;
+	tuple.daddr = inet->daddr;
+	tuple.sport = inet->sport;
+	tuple.dport = inet->dport;
+#endif
+
+	/* one configuration for the whole call, see config.c */
+	rcu_read_lock();
+	cfg = rcu_dereference(tcpprobe_cfg);
+	if (cfg->port == 0 || ntohs(tuple.dport) == cfg->port ||
+		ntohs(tuple.sport) == cfg->port) {
+		/* the timeout moved the socket to Loss before retransmitting */
+		if (icsk->icsk_ca_state == TCP_CA_Loss) {
+			kind = TCP_RETX_RTO;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
+		} else if (icsk->icsk_pending == ICSK_TIME_LOSS_PROBE) {
+			kind = TCP_RETX_TLP;
+#endif
+		} else {
+			kind = TCP_RETX_FAST;
+		}
+
+		hash = hash_tcp_flow(&tuple);
+		/* only the tracked flows, a retransmission does not create one */
+		tcp_flow = tcp_flow_find(&tuple, hash);
+		if (tcp_flow) {
+			tcp_flow_count_retx(tcp_flow, kind,
+					tcb->seq - tcp_flow->first_seq_num,
+					tcb->end_seq - tcp_flow->first_seq_num);
+		}
+	}
+	rcu_read_unlock();
+
+	jprobe_return();
+	return;
+}
+
+/*
+* Hook inserted to be called before each change of TCP state of a socket,
+* so that half-closed connections (CLOSE_WAIT, FIN_WAIT2, LAST_ACK) show
+* how long they linger.
+* Note: arguments must match tcp_set_state()!
+*/
+void jtcp_set_state(struct sock *sk, int state)
+{
+	const struct inet_sock *inet = inet_sk(sk);
+	struct tcp_tuple tuple;
+	struct tcp_hash_flow *tcp_flow;
+	unsigned int hash;
+	int old = sk->sk_state;
+	const struct tcpprobe_config *cfg;
+
+	if (sk->sk_family != AF_INET || state == old || state <= 0 ||
+		state >= TCPPROBE_TCP_STATES)
+		goto skip;
+
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,32)
+	tuple.saddr = inet->inet_saddr;
+	tuple.daddr = inet->inet_daddr;
+	tuple.sport = inet->inet_sport;
+	tuple.dport = inet->inet_dport;
+#else
+	tuple.saddr = inet->saddr;
+	tuple.daddr = inet->daddr;
+	tuple.sport = inet->sport;
+	tuple.dport = inet->dport;
+#endif
+
+	/* one configuration for the whole call, see config.c */
+	rcu_read_lock();
+	cfg = rcu_dereference(tcpprobe_cfg);
+	if (cfg->port == 0 || ntohs(tuple.dport) == cfg->port ||
+		ntohs(tuple.sport) == cfg->port) {
+		hash = hash_tcp_flow(&tuple);
+		/* only the tracked flows, a change of state does not create one */
+		tcp_flow = tcp_flow_find(&tuple, hash);
+		if (tcp_flow)
+			tcp_flow_state_change(tcp_flow, old, state, ktime_get());
+	}
+	rcu_read_unlock();
+
 skip:
 	jprobe_return();
 	return;
@@ -743,6 +1903,7 @@ void jtcp_v4_syn_recv_sock(struct sock *sk, struct sk_buff *skb,
 	struct tcp_skb_cb *tcb = TCP_SKB_CB(skb);
 	const struct iphdr *iph = ip_hdr(skb);
 	u8 tcp_flags;
+	const struct tcpprobe_config *cfg;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,21)
 	struct timespec ts;
@@ -758,29 +1919,26 @@ void jtcp_v4_syn_recv_sock(struct sock *sk, struct sk_buff *skb,
 	tuple.sport = th->dest;
 	tuple.dport = th->source;
 
-	if (port == 0 ||
-		ntohs(inet->inet_dport) == port ||
-		ntohs(inet->inet_sport) == port) {
+	/* one configuration for the whole call, see config.c */
+	rcu_read_lock();
+	cfg = rcu_dereference(tcpprobe_cfg);
+	if (cfg->port == 0 ||
+		ntohs(inet->inet_dport) == cfg->port ||
+		ntohs(inet->inet_sport) == cfg->port) {
 		/* Only update if port matches */
+		tcp_listen_syn_recv(cfg, sk, tstamp);
 		hash = hash_tcp_flow(&tuple);
-		spin_lock(&tcp_hash_lock);
+		spin_lock_bh(&tcp_hash_lock);
 		tcp_flow = tcp_flow_find(&tuple, hash);
 		if(tcp_flow) {
-			/* Release the flow tuple*/
-			// Remove from Hashtable
-			hlist_del(&tcp_flow->hlist);
-			// Remove from Global List
-			list_del(&tcp_flow->list);
-			// Free memory
-			tcp_hash_flow_free(tcp_flow);
-		}
-		if (maxflows > 0 &&
-			atomic_read(&flow_count) >= maxflows) {
-			/* This is DOC attack prevention */
-			TCPPROBE_STAT_INC(conn_maxflow_limit);
-			PRINT_DEBUG("Flow count = %u execeed max flow = %u\n",
-					atomic_read(&flow_count), maxflows);
-		} else {
+			/* Release the flow tuple, no more records for it */
+			spin_lock(&tcp_probe.lock);
+			tcp_flow->dead = 1;
+			spin_unlock(&tcp_probe.lock);
+			tcp_flow_unlink(tcp_flow);
+			tcp_flow = NULL;
+		}
+		if (tcp_flow_admit(cfg)) {
 			/* create an entry in hashtable */
 			PRINT_DEBUG(
 				"Init new flow src: %pI4 dst: %pI4"
@@ -788,29 +1946,30 @@ void jtcp_v4_syn_recv_sock(struct sock *sk, struct sk_buff *skb,
 				&tuple.saddr, &tuple.daddr,
 				ntohs(tuple.sport), ntohs(tuple.dport)
 			);
-			tcp_flow = init_tcp_hash_flow(&tuple, tstamp, hash);
-			tcp_flow->first_seq_num = tcb->ack_seq;
-			tcp_flow->first_ack_num = tcb->seq;
-			tcp_flow->last_seq_num = tp->snd_nxt;
-			tcp_flow->tstamp = tstamp;
-			tcp_flow->rto_num = 0;
-			tcp_flow->user_agent[0] = '\0';
-			should_write_flow = 1;
+			tcp_flow = init_tcp_hash_flow(&tuple, tstamp, hash,
+					tcb->ack_seq, tcb->seq);
 		}
-		if (tcp_flow->user_agent[0] == '\0') {
-			get_user_agent(skb, tcp_flow->user_agent, MAX_AGENT_LEN-1);
+		if (!tcp_flow) {
+			spin_unlock_bh(&tcp_hash_lock);
+			goto skip;
 		}
+		should_write_flow = 1;
+		tcp_flow_capture_agent(cfg, tcp_flow, skb);
 		tcp_flow->last_seq_num = tp->snd_nxt;
+		/* the time to accept() is measured from here */
+		tcp_flow->setup_ns = ktime_to_ns(tstamp);
 		tcp_flags = TCP_FLAGS(th);
 		spin_lock(&tcp_probe.lock);
-		write_flow(LOG_SETUP, tcp_flow, &tuple, tstamp, sk, skb, tcp_flags, length,
+		write_flow(cfg, LOG_SETUP, tcp_flow, &tuple, tstamp, sk, skb, tcp_flags, length,
 						tcb->seq - tcp_flow->first_ack_num,
 						tcb->ack_seq - tcp_flow->first_seq_num, 0);
 		spin_unlock(&tcp_probe.lock);
 		wake_up(&tcp_probe.wait);
 		
-		spin_unlock(&tcp_hash_lock);
+		spin_unlock_bh(&tcp_hash_lock);
 	}
+skip:
+	rcu_read_unlock();
 	jprobe_return();
 	return ;
 }
@@ -833,6 +1992,8 @@ void jtcp_v4_do_rcv(struct sock *sk, struct sk_buff *skb)
 	unsigned int hash;
 	struct tcp_skb_cb *tcb = TCP_SKB_CB(skb);
 	u8 tcp_flags;
+	const struct tcpprobe_config *cfg;
+	int matched, sampled, capturing, dsack, ecn, hostq;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,21)
 	struct timespec ts;
@@ -854,64 +2015,89 @@ void jtcp_v4_do_rcv(struct sock *sk, struct sk_buff *skb)
 	tuple.sport = inet->sport;
 	tuple.dport = inet->dport;
 #endif
-	if ((port == 0 || ntohs(tuple.dport) == port || ntohs(tuple.sport) == port) &&
-		(sk->sk_state == TCP_ESTABLISHED || sk->sk_state == TCP_FIN_WAIT1) &&
-		(full || tp->snd_cwnd != tcp_probe.lastcwnd)) {
+	/* one configuration for the whole packet, see config.c */
+	rcu_read_lock();
+	cfg = rcu_dereference(tcpprobe_cfg);
+	/* a burst capture takes every packet, the sampled stream is unchanged */
+	sampled = cfg->full || tp->snd_cwnd != tcp_probe.lastcwnd;
+	capturing = tcpprobe_capturing();
+	matched = (cfg->port == 0 || ntohs(tuple.dport) == cfg->port ||
+		ntohs(tuple.sport) == cfg->port) &&
+		(sk->sk_state == TCP_ESTABLISHED || sk->sk_state == TCP_FIN_WAIT1);
+	/* only worth parsing the options of a matching socket that has retransmitted */
+	dsack = matched && tp->total_retrans && th->doff > 5 && tcp_skb_has_dsack(th);
+	/* ECN and host queueing accounting look at every packet */
+	ecn = cfg->ecn_interval_ms > 0;
+	hostq = cfg->hostq_interval_ms > 0;
+	if (matched && (sampled || capturing || dsack || ecn || hostq)) {
 		/* Only update if port matches */
 		hash = hash_tcp_flow(&tuple);
-		spin_lock(&tcp_hash_lock);
-		//if (spin_trylock(&tcp_hash_lock) == 0) {
-		//	/* Purge is ongoing.. skip this ACK  */
-		//	TCPPROBE_STAT_INC(ack_drop_purge);
-		//	goto skip;
-		//}
+		/* lockless lookup, tcp_hash_lock is only taken to create the flow */
 		tcp_flow = tcp_flow_find(&tuple, hash);
 		if (!tcp_flow) {
-			if (maxflows > 0 && atomic_read(&flow_count) >= maxflows) {
-				/* This is DOC attack prevention */
-				TCPPROBE_STAT_INC(conn_maxflow_limit);
-				PRINT_DEBUG("Flow count = %u execeed max flow = %u\n", 
-				atomic_read(&flow_count), maxflows);
-			} else if (sk->sk_state == TCP_ESTABLISHED) {
-				/* create an entry in hashtable */
-				PRINT_DEBUG(
-					"Init new flow src: %pI4 dst: %pI4"
-					" src_port: %u dst_port: %u\n",
-					&tuple.saddr, &tuple.daddr,
-					ntohs(tuple.sport), ntohs(tuple.dport)
-				);
-				tcp_flow = init_tcp_hash_flow(&tuple, tstamp, hash);
-				tcp_flow->first_seq_num = tcb->ack_seq; 
-				tcp_flow->first_ack_num = tcb->seq;
-				tcp_flow->tstamp = tstamp;
-				tcp_flow->rto_num = 0;
-				tcp_flow->user_agent[0] = '\0';
-				should_write_flow = 1;
-			}
-		} else {
-		/* if the difference between timestamps is >= probetime then write the flow to ring */
-			struct timespec tv = ktime_to_timespec(ktime_sub(tstamp, tcp_flow->tstamp));	
-			u_int64_t milliseconds = (tv.tv_sec * MSEC_PER_SEC) + (tv.tv_nsec/NSEC_PER_MSEC);
-			if (milliseconds >= probetime) { 
-				tcp_flow->tstamp = tstamp;
-				should_write_flow = 1;
+			if (sampled && sk->sk_state == TCP_ESTABLISHED) {
+				spin_lock_bh(&tcp_hash_lock);
+				/* the other direction of the flow may have just created it */
+				tcp_flow = tcp_flow_find(&tuple, hash);
+				if (tcp_flow) {
+					should_write_flow = tcp_flow_sample_due(cfg, tcp_flow, tstamp) &&
+							tcp_flow_rate_ok(cfg, tcp_flow, tstamp);
+				} else if (tcp_flow_admit(cfg)) {
+					/* create an entry in hashtable */
+					PRINT_DEBUG(
+						"Init new flow src: %pI4 dst: %pI4"
+						" src_port: %u dst_port: %u\n",
+						&tuple.saddr, &tuple.daddr,
+						ntohs(tuple.sport), ntohs(tuple.dport)
+					);
+					tcp_flow = init_tcp_hash_flow(&tuple, tstamp, hash,
+							tcb->ack_seq, tcb->seq);
+					if (tcp_flow) {
+						should_write_flow = 1;
+					}
+				}
+				spin_unlock_bh(&tcp_hash_lock);
 			}
+		} else if (sampled) {
+		/* if the difference between timestamps is >= probetime and the flow is within
+		   flow_rate then write the flow to ring */
+			should_write_flow = tcp_flow_sample_due(cfg, tcp_flow, tstamp) &&
+					tcp_flow_rate_ok(cfg, tcp_flow, tstamp);
+		}
+		if (dsack && tcp_flow) {
+			tcp_flow_count_spurious(tcp_flow);
+		}
+		if (ecn && tcp_flow) {
+			tcp_flow_count_ecn(tcp_flow, tp, skb, th, length);
+		}
+		if (hostq && tcp_flow) {
+			tcp_flow_hostq(cfg, tcp_flow, sk, tstamp);
+		}
+		if (tcp_flow) {
+			tcp_flow_set_owner(tcp_flow);
+		}
+		if (capturing) {
+			u32 seq_base = tcp_flow ? tcp_flow->first_ack_num : 0;
+			u32 ack_base = tcp_flow ? tcp_flow->first_seq_num : 0;
+			write_flow_capture(LOG_RECV, tcp_flow, &tuple, tstamp, sk, TCP_FLAGS(th), length,
+						tcb->seq - seq_base, tcb->ack_seq - ack_base);
 		}
 		if (should_write_flow) {
-			if (tcp_flow->user_agent[0] == '\0') {
-				get_user_agent(skb, tcp_flow->user_agent, MAX_AGENT_LEN-1);
+			if (!tcp_flow->user_agent) {
+				tcp_flow_capture_agent(cfg, tcp_flow, skb);
 			}
 			tcp_flow->last_seq_num = tp->snd_nxt;
 			tcp_flags = TCP_FLAGS(th);
 			spin_lock(&tcp_probe.lock);
-			write_flow(LOG_RECV, tcp_flow, &tuple, tstamp, sk, skb, tcp_flags, length,
-						tcb->seq - tcp_flow->first_ack_num,
-						tcb->ack_seq - tcp_flow->first_seq_num, 0);
+			if (tcp_flow_fair_ok(cfg, tcp_flow))
+				write_flow(cfg, LOG_RECV, tcp_flow, &tuple, tstamp, sk, skb, tcp_flags, length,
+							tcb->seq - tcp_flow->first_ack_num,
+							tcb->ack_seq - tcp_flow->first_seq_num, 0);
 			spin_unlock(&tcp_probe.lock);
 			wake_up(&tcp_probe.wait);
 		}
-		spin_unlock(&tcp_hash_lock);
 	}
+	rcu_read_unlock();
 	jprobe_return();
 	return ;
 }
@@ -0,0 +1,157 @@
+/*
+ * libtcpprobe: per-flow rollups of the records, per second and per minute.
+ *
+ *	tcpprobe::aggregator agg([](const tcpprobe::rollup &r) { ... });
+ *
+ *	while (rd.next(b))
+ *		agg.add(b.begin(), b.size());
+ *	agg.flush();
+ *
+ * The state of the flows is kept in an open addressing hash table keyed
+ * by the tuple and the socket identifier of the flow, sized up front:
+ * adding a record does not allocate, unless the table has to grow. The
+ * intervals follow the timestamps of the records (time of the module),
+ * not the wall clock, so replaying records gives the same rollups.
+ *
+ * At the end of each second, every flow that had samples in that second
+ * gets a rollup, and at the end of each minute a rollup of the minute.
+ * A flow is removed after its DONE or PURGE record, with the rollups of
+ * the intervals it had not completed (rollup::final set).
+ */
+#ifndef TCPPROBE_AGGREGATE_HPP
+#define TCPPROBE_AGGREGATE_HPP
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "tcpprobe/record.hpp"
+
+namespace tcpprobe {
+
+struct flow_key {
+	uint32_t saddr;
+	uint32_t daddr;
+	uint16_t sport;
+	uint16_t dport;
+	uint64_t socket_idf;
+
+	bool operator==(const flow_key &o) const
+	{
+		return saddr == o.saddr && daddr == o.daddr && sport == o.sport &&
+			dport == o.dport && socket_idf == o.socket_idf;
+	}
+};
+
+flow_key key_of(const record &r);
+/* Hash of the flow, never 0 */
+uint32_t flow_hash(const flow_key &k);
+
+/*
+ * Histogram of the congestion window over an interval: 4 buckets per power
+ * of 2, so a percentile is exact to 25%. The counts are 16 bits to keep
+ * the flows small; they are all halved when one would overflow, which
+ * keeps the shape of the distribution.
+ */
+struct cwnd_hist {
+	static constexpr unsigned BUCKETS = 80; /* windows up to 2^20 packets */
+
+	uint16_t count[BUCKETS];
+
+	void clear();
+	void add(uint32_t cwnd);
+	void merge(const cwnd_hist &o);
+	/* Lowest window of the bucket holding the p-th percentile (0 to 100) */
+	uint32_t percentile(unsigned p) const;
+};
+
+struct rollup {
+	flow_key key;
+	uint64_t start_ns;    /* start of the interval, time of the module */
+	uint32_t period_s;    /* 1 or 60 */
+	bool final;           /* last rollup of the flow, interval not complete */
+	uint32_t samples;
+	uint64_t acked_bytes; /* progress of snd_una */
+	uint64_t goodput_bps; /* acked_bytes over the period, bits per second */
+	uint32_t srtt_max;
+	uint32_t retrans;     /* segments retransmitted in the interval */
+	uint32_t cwnd_p50;
+	uint32_t cwnd_p90;
+	uint32_t cwnd_p99;
+	uint32_t cwnd_max;
+};
+
+struct aggregator_stats {
+	uint64_t records = 0;
+	uint64_t flows = 0;      /* in the table */
+	uint64_t expired = 0;    /* removed after DONE or PURGE */
+	uint64_t rollups = 0;
+	uint64_t grows = 0;
+};
+
+class aggregator {
+public:
+	using emit_fn = std::function<void(const rollup &)>;
+
+	/* flows is the number of flows expected, the table grows past it */
+	explicit aggregator(emit_fn emit, size_t flows = 1 << 14);
+
+	void add(const record &r);
+	void add(const record *recs, size_t n)
+	{
+		for (size_t i = 0; i < n; i++)
+			add(recs[i]);
+	}
+	/*
+	 * Close the seconds before the one of tstamp_ns, as a record of that
+	 * time would, for an aggregator fed only a share of the flows
+	 */
+	void advance(uint64_t tstamp_ns);
+	/* Emit the intervals in progress of every flow, as final */
+	void flush();
+
+	const aggregator_stats &stats() const { return stats_; }
+
+private:
+	struct window {
+		uint32_t samples;
+		uint32_t srtt_max;
+		uint64_t acked_bytes;
+		uint32_t retrans;
+		uint32_t cwnd_max;
+		cwnd_hist cwnd;
+
+		void clear();
+		void merge(const window &o);
+	};
+
+	struct flow {
+		flow_key key;
+		uint32_t hash;      /* 0: empty slot */
+		bool primed;        /* snd_una and retrans below are set */
+		uint32_t snd_una;
+		uint32_t retrans;
+		window sec;
+		window min;
+	};
+
+	flow *lookup(const flow_key &k, uint32_t h);
+	flow *insert(const flow_key &k, uint32_t h);
+	void erase(flow *f);
+	void grow();
+	void tick(uint64_t sec);
+	void finish(flow &f);
+	void emit(const flow &f, const window &w, uint64_t start_s, uint32_t period_s,
+			bool final);
+
+	emit_fn emit_;
+	std::vector<flow> table_;
+	size_t mask_;
+	uint64_t sec_;       /* second in progress, of the records */
+	bool started_;
+	aggregator_stats stats_;
+};
+
+} /* namespace tcpprobe */
+
+#endif /* TCPPROBE_AGGREGATE_HPP */
@@ -0,0 +1,161 @@
+/*
+ * libtcpprobe: capture files of records, written by tcpprobe_capture and
+ * scanned by tcpprobe_query.
+ *
+ * A capture file is a file header followed by blocks of up to block_rows
+ * records. A block stores its records by column: each field of struct
+ * record is an array of its own, aligned to 64 bytes, so a scan reads
+ * only the columns it needs and compares them in tight loops. The header
+ * of each block has the minimum and maximum of every scalar column (zone
+ * map), which lets a scan skip the blocks that cannot match.
+ *
+ * Blocks are written whole and are self-delimiting: the file of a writer
+ * that was killed is readable up to its last complete block.
+ */
+#ifndef TCPPROBE_CAPTURE_HPP
+#define TCPPROBE_CAPTURE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tcpprobe/record.hpp"
+
+namespace tcpprobe {
+
+constexpr uint64_t CAPTURE_MAGIC = 0x3130706163707474ULL; /* "ttpcap01" */
+constexpr uint32_t CAPTURE_VERSION = 1;
+constexpr uint32_t CAPTURE_BLOCK_MAGIC = 0x6b6c6274;     /* "tblk" */
+constexpr size_t CAPTURE_ALIGN = 64;
+
+/* Columns of a block, in the order they are stored */
+enum column : uint32_t {
+	COL_TYPE, COL_CA_STATE, COL_FRTO_COUNTER, COL_TCP_FLAGS, COL_RTO_NUM,
+	COL_LENGTH, COL_FLOW_ID, COL_SADDR, COL_DADDR, COL_SPORT, COL_DPORT,
+	COL_TSTAMP_NS, COL_SOCKET_IDF, COL_SEQ_NUM, COL_ACK_NUM, COL_SND_NXT,
+	COL_SND_UNA, COL_SND_WND, COL_SND_CWND, COL_RCV_WND, COL_SSTHRESH,
+	COL_SRTT, COL_MDEV, COL_RTTVAR, COL_RTO, COL_PACKETS_OUT, COL_LOST_OUT,
+	COL_SACKED_OUT, COL_RETRANS_OUT, COL_RETRANS, COL_WRITE_SEQ, COL_RQUEUE,
+	COL_WQUEUE,
+	COL_SCALARS,            /* the columns above have a zone map */
+	COL_PAYLOAD = COL_SCALARS, /* user agent or payload of the event, not a scalar */
+	COL_COUNT,
+};
+
+struct column_info {
+	const char *name;
+	uint32_t offset;  /* in struct record */
+	uint32_t width;   /* 1, 2, 4 or 8 bytes, AGENT_LEN for the payload */
+};
+
+extern const column_info columns[COL_COUNT];
+/* Column of that name, COL_COUNT if there is none */
+column column_by_name(const std::string &name);
+
+struct capture_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t record_size;   /* sizeof(record) */
+	uint32_t block_rows;    /* most rows in a block */
+	uint32_t columns;       /* COL_COUNT */
+	int64_t created_ns;     /* CLOCK_REALTIME */
+	uint8_t pad[32];
+};
+
+struct zone {
+	uint64_t min;
+	uint64_t max;
+};
+
+struct block_header {
+	uint32_t magic;
+	uint32_t rows;
+	uint64_t size;          /* of the block, header included */
+	/*
+	 * CLOCK_REALTIME of the tstamp_ns 0 of the module, as estimated when
+	 * the block was written: tstamps are since the module was loaded
+	 */
+	int64_t wall_base_ns;
+	uint64_t pad[3];
+	zone zones[COL_SCALARS];
+};
+
+static_assert(sizeof(capture_header) % CAPTURE_ALIGN == 0, "blocks start aligned");
+static_assert(sizeof(block_header) % CAPTURE_ALIGN == 0, "columns start aligned");
+
+/* Size of a column of rows values, padded to CAPTURE_ALIGN */
+inline size_t column_size(column c, uint32_t rows)
+{
+	size_t len = (size_t) columns[c].width * rows;
+
+	return (len + CAPTURE_ALIGN - 1) & ~(CAPTURE_ALIGN - 1);
+}
+
+/* Appends records to a capture file, a block at a time */
+class capture_writer {
+public:
+	/* Creates path, throws std::system_error */
+	explicit capture_writer(const std::string &path, uint32_t block_rows = 4096);
+	~capture_writer();
+	capture_writer(const capture_writer &) = delete;
+	capture_writer &operator=(const capture_writer &) = delete;
+
+	void add(const record *recs, size_t n);
+	/* Write the rows pending as a short block */
+	void flush();
+	void close();
+
+	uint64_t bytes() const { return bytes_; }
+
+private:
+	void write_block();
+
+	int fd_;
+	std::string path_;
+	uint32_t block_rows_;
+	std::vector<record> rows_;
+	int64_t wall_base_ns_;  /* lowest estimate of the rows pending */
+	std::vector<unsigned char> buf_;
+	uint64_t bytes_;
+};
+
+/* A block of a mapped capture file */
+struct block_view {
+	const block_header *hdr;
+	const unsigned char *col[COL_COUNT];
+
+	template <typename T>
+	const T *values(column c) const { return (const T *) col[c]; }
+	/* Value of a scalar column, widened */
+	uint64_t value(column c, uint32_t row) const;
+	/* Gather the columns of a row back into a record */
+	void row(uint32_t i, record &r) const;
+};
+
+/* A capture file mapped read-only */
+class capture_file {
+public:
+	/* Maps path, throws std::system_error */
+	explicit capture_file(const std::string &path);
+	~capture_file();
+	capture_file(const capture_file &) = delete;
+	capture_file &operator=(const capture_file &) = delete;
+
+	const std::string &path() const { return path_; }
+	const capture_header &header() const { return *(const capture_header *) map_; }
+	/*
+	 * Block at offset, which is sizeof(capture_header) for the first one.
+	 * Returns false past the last complete block, otherwise sets offset to
+	 * the next block.
+	 */
+	bool block(uint64_t &offset, block_view &b) const;
+
+private:
+	std::string path_;
+	const unsigned char *map_;
+	size_t len_;
+};
+
+} /* namespace tcpprobe */
+
+#endif /* TCPPROBE_CAPTURE_HPP */
@@ -0,0 +1,88 @@
+/*
+ * libtcpprobe: per-flow rollups on several threads.
+ *
+ *	tcpprobe::collector col(4, encode, write);
+ *
+ *	while (rd.next(b))
+ *		col.add(b.begin(), b.size());
+ *	col.finish();
+ *
+ * The thread calling add() is the reader stage: it shards the records by
+ * flow hash into one lock-free queue per worker. Each worker owns the
+ * flows of its shard in its own tcpprobe::aggregator, and encodes its
+ * rollups into chunks of text with encode. A writer thread collects the
+ * chunks of all the workers and hands them to write.
+ *
+ * All the records of a flow go through the same worker in the order they
+ * were added, so the rollups of a flow are written in order. Rollups of
+ * different flows are not ordered between workers. When a queue is full
+ * the reader waits for its worker: nothing is dropped.
+ */
+#ifndef TCPPROBE_COLLECTOR_HPP
+#define TCPPROBE_COLLECTOR_HPP
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tcpprobe/aggregate.hpp"
+#include "tcpprobe/spsc.hpp"
+
+namespace tcpprobe {
+
+struct collector_stats {
+	uint64_t records = 0;
+	uint64_t rollups = 0;
+	uint64_t chunks = 0;
+	uint64_t reader_waits = 0;  /* a worker queue was full */
+	std::vector<uint64_t> worker_records;
+};
+
+class collector {
+public:
+	/* Append the encoding of r to out, on the thread of a worker */
+	using encode_fn = std::function<void(std::string &out, const rollup &r)>;
+	/* Output a chunk of encoded rollups, on the writer thread */
+	using write_fn = std::function<void(const std::string &chunk)>;
+
+	/* flows is the number of flows expected, shared between the workers */
+	collector(unsigned workers, encode_fn encode, write_fn write,
+			size_t flows = 1 << 14, size_t queue = 1 << 13);
+	/* Calls finish() */
+	~collector();
+	collector(const collector &) = delete;
+	collector &operator=(const collector &) = delete;
+
+	/* Reader stage */
+	void add(const record *recs, size_t n);
+	/* Flush the flows, write everything and stop the threads */
+	void finish();
+
+	collector_stats stats() const;
+
+private:
+	struct worker;
+
+	void run_worker(worker &w, size_t flows);
+	void run_writer();
+	void send(worker &w, record *recs, size_t n);
+	void flush_staged();
+
+	encode_fn encode_;
+	write_fn write_;
+	std::vector<std::unique_ptr<worker>> workers_;
+	std::thread writer_;
+	std::atomic<unsigned> running_;  /* workers not finished yet */
+	uint64_t sec_;                   /* latest second seen by the reader */
+	bool started_;
+	bool finished_;
+	uint64_t records_;
+	uint64_t reader_waits_;
+};
+
+} /* namespace tcpprobe */
+
+#endif /* TCPPROBE_COLLECTOR_HPP */
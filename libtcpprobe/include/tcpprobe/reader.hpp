@@ -0,0 +1,155 @@
+/*
+ * libtcpprobe: reader of the records of tcp_probe_plus.
+ *
+ *	tcpprobe::reader r;
+ *	tcpprobe::batch b;
+ *
+ *	r.open();
+ *	while (r.next(b)) {
+ *		if (b.lost())
+ *			...;
+ *		for (const tcpprobe::record &rec : b)
+ *			...;
+ *	}
+ *
+ * The reader follows the "export" sysctl: it subscribes to the netlink
+ * multicast group when the module exports to netlink and reads
+ * /proc/net/tcpprobe_data otherwise. The records of a batch are decoded
+ * in place into storage owned by the batch, which is reused from one
+ * batch to the next: iterating does not copy and reading does not
+ * allocate once the batch has grown to its size.
+ *
+ * Errors are reported with std::system_error.
+ */
+#ifndef TCPPROBE_READER_HPP
+#define TCPPROBE_READER_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tcpprobe/record.hpp"
+
+namespace tcpprobe {
+
+enum class transport {
+	any,     /* whatever the "export" sysctl selects */
+	procfs,  /* text of /proc/net/tcpprobe_data */
+	netlink, /* binary batches of the TCPPROBE_GENL_MCGRP group */
+};
+
+const char *transport_name(transport t);
+
+struct options {
+	transport mode = transport::any;
+	std::string proc_path = "/proc/net/tcpprobe_data";
+	std::string sysctl_dir = "/proc/sys/net/tcpprobe_plus";
+	/* Reopen the transport when the module goes away or is reloaded */
+	bool reconnect = true;
+	int reconnect_ms = 1000;
+	/* procfs: first record to read, -1 for the oldest one still in the ring */
+	int64_t start_seq = -1;
+	/* netlink: receive buffer of the socket, 0 keeps the default */
+	int rcvbuf = 8 << 20;
+};
+
+/*
+ * Records read at once, with their position in the stream of the module.
+ * Sequence numbers are the ring positions of the module: seq() is the
+ * first record of the batch and next_seq() the one after the last. With
+ * procfs the flow definitions skipped by the module (flowid not set) are
+ * counted in the range.
+ */
+class batch {
+public:
+	const record *begin() const { return records_.data(); }
+	const record *end() const { return records_.data() + size_; }
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	const record &operator[](size_t i) const { return records_[i]; }
+
+	uint64_t seq() const { return seq_; }
+	uint64_t next_seq() const { return next_seq_; }
+	/* Records missed between the previous batch and this one */
+	uint64_t lost() const { return lost_; }
+	/* The module was reloaded before this batch, sequence numbers restarted */
+	bool restarted() const { return restarted_; }
+	/* netlink: counters of the module, TCPPROBE_A_DROP_RING and _NETLINK */
+	uint64_t drop_ring() const { return drop_ring_; }
+	uint64_t drop_netlink() const { return drop_netlink_; }
+
+private:
+	friend class reader;
+	friend class procfs_source;
+	friend class netlink_source;
+
+	record &append();
+	void clear();
+
+	std::vector<record> records_;
+	size_t size_ = 0;
+	uint64_t seq_ = 0;
+	uint64_t next_seq_ = 0;
+	uint64_t lost_ = 0;
+	bool restarted_ = false;
+	uint64_t drop_ring_ = 0;
+	uint64_t drop_netlink_ = 0;
+};
+
+struct reader_stats {
+	uint64_t records = 0;
+	uint64_t batches = 0;
+	uint64_t lost = 0;       /* sum of batch::lost() */
+	uint64_t reconnects = 0;
+	uint64_t overruns = 0;   /* netlink: ENOBUFS on the socket */
+	uint64_t bad_lines = 0;  /* procfs: lines that could not be parsed */
+};
+
+class source;
+class flow_table;
+
+class reader {
+public:
+	explicit reader(const options &opt = options());
+	~reader();
+	reader(const reader &) = delete;
+	reader &operator=(const reader &) = delete;
+
+	/* Open the transport, throws std::system_error */
+	void open();
+	void close();
+
+	/*
+	 * Wait for the next batch. Returns false when timeout_ms (-1 waits
+	 * forever) expired, or when the module went away and reconnect is not
+	 * set. procfs reads block until readnum records are available and do
+	 * not honor timeout_ms.
+	 */
+	bool next(batch &b, int timeout_ms = -1);
+
+	/* Transport in use, any until open() */
+	transport active() const { return active_; }
+	/* Sequence number of the next record expected */
+	uint64_t position() const { return next_seq_; }
+	const reader_stats &stats() const { return stats_; }
+
+private:
+	transport negotiate() const;
+	bool reopen();
+
+	options opt_;
+	transport active_ = transport::any;
+	std::unique_ptr<source> src_;
+	std::unique_ptr<flow_table> flows_; /* tuples of the flows, flowid set */
+	uint64_t next_seq_ = 0;
+	bool positioned_ = false;
+	reader_stats stats_;
+};
+
+/* Value of a sysctl of the module, -1 if it cannot be read */
+long read_sysctl(const std::string &sysctl_dir, const char *name);
+
+} /* namespace tcpprobe */
+
+#endif /* TCPPROBE_READER_HPP */
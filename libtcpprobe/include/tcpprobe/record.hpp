@@ -0,0 +1,174 @@
+/*
+ * libtcpprobe: records of tcp_probe_plus, as seen by userspace.
+ *
+ * struct record has the same content whatever the transport the records
+ * came from (/proc/net/tcpprobe_data or netlink). Addresses and ports are
+ * in host byte order and every record carries the tuple of its flow, also
+ * when the flowid sysctl is set. The layout is fixed (no pointers, fixed
+ * width integers), so records can be stored or shared as they are.
+ */
+#ifndef TCPPROBE_RECORD_HPP
+#define TCPPROBE_RECORD_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "tcp_probe_plus_uapi.h"
+
+namespace tcpprobe {
+
+/* Record types, LOG_* of the module */
+enum record_type : uint8_t {
+	RECV = 0,
+	SEND = 1,
+	TIMEOUT = 2,
+	SETUP = 3,
+	DONE = 4,
+	PURGE = 5,
+	FLOWDEF = 6,  /* flow definition, only with the flowid sysctl set */
+	RETRANS = 7,
+	STALL = 8,
+	ECN = 9,
+	HOSTQ = 10,
+	LISTEN = 11,
+	STATES = 12,
+	OWNER = 13,
+};
+
+/* Longest user agent, MAX_AGENT_LEN of the module */
+constexpr size_t AGENT_LEN = 128;
+
+/* Payloads of the event records, struct tcp_*_stat of the module */
+struct retx_stat {
+	uint32_t fast;
+	uint32_t rto;
+	uint32_t tlp;
+	uint32_t spurious;
+	uint32_t bytes;
+	uint32_t seq_lo;
+	uint32_t seq_hi;
+};
+
+struct stall_stat {
+	uint32_t cause; /* TCPPROBE_STALL_* */
+	uint32_t stalled_ms;
+	uint32_t snd_una;
+	uint32_t snd_wnd;
+	uint32_t wqueue;
+	uint32_t rqueue;
+	uint32_t packets_out;
+	uint32_t rto_num;
+};
+
+struct ecn_stat {
+	uint32_t acks;
+	uint32_t ece_acks;
+	uint32_t acked_bytes;
+	uint32_t ece_bytes;
+	uint32_t ece_permille;
+	uint32_t cwr;
+	uint32_t data_pkts;
+	uint32_t data_bytes;
+	uint32_t ce_pkts;
+	uint32_t ce_bytes;
+	uint32_t ce_permille;
+};
+
+struct hostq_stat {
+	uint64_t pacing_rate;
+	uint32_t wmem_queued;
+	uint32_t wmem_queued_max;
+	uint32_t wmem_alloc;
+	uint32_t wmem_alloc_max;
+	uint32_t tsq_ms;
+	uint32_t pacing_ms;
+	uint32_t sndbuf_ms;
+	uint32_t events;
+};
+
+struct listen_stat {
+	uint32_t port;
+	uint32_t conns;
+	uint32_t overflows;
+	uint32_t accepts;
+	uint32_t backlog_max;
+	uint32_t backlog_avg;
+	uint32_t max_backlog;
+	uint32_t accept_avg_us;
+	uint32_t accept_max_us;
+};
+
+struct states_stat {
+	uint32_t state;
+	uint32_t transitions;
+	uint32_t ms[TCPPROBE_TCP_STATES]; /* indexed by TCP state */
+};
+
+struct owner_stat {
+	uint32_t pid;
+	uint32_t tgid;
+	uint32_t uid;
+	char comm[TCPPROBE_COMM_LEN];
+};
+
+struct record {
+	uint8_t type; /* record_type */
+	uint8_t ca_state;
+	uint8_t frto_counter;
+	uint8_t tcp_flags;
+	uint16_t rto_num;
+	uint16_t length;
+	uint32_t flow_id;
+	uint32_t saddr; /* host byte order */
+	uint32_t daddr;
+	uint16_t sport;
+	uint16_t dport;
+	uint64_t tstamp_ns; /* since the module was loaded */
+	uint64_t socket_idf;
+	uint32_t seq_num;
+	uint32_t ack_num;
+	uint64_t snd_nxt;
+	uint32_t snd_una;
+	uint32_t snd_wnd;
+	uint32_t snd_cwnd;
+	uint32_t rcv_wnd;
+	uint32_t ssthresh;
+	uint32_t srtt;
+	uint32_t mdev;
+	uint32_t rttvar;
+	uint32_t rto;
+	uint32_t packets_out;
+	uint32_t lost_out;
+	uint32_t sacked_out;
+	uint32_t retrans_out;
+	uint32_t retrans;
+	uint32_t write_seq;
+	uint32_t rqueue;
+	uint32_t wqueue;
+	uint32_t pad;
+	/* event records carry their payload instead of a user agent */
+	union {
+		char user_agent[AGENT_LEN]; /* NUL terminated, empty if unknown */
+		retx_stat retx;       /* RETRANS */
+		stall_stat stall;     /* STALL */
+		ecn_stat ecn;         /* ECN */
+		hostq_stat hostq;     /* HOSTQ */
+		listen_stat listen;   /* LISTEN */
+		states_stat states;   /* STATES */
+		owner_stat owner;     /* OWNER */
+	};
+
+	/* Records with the socket state rather than an event payload */
+	bool is_sample() const { return type <= FLOWDEF; }
+	/* Last record of a flow */
+	bool is_end() const { return type == DONE || type == PURGE; }
+};
+
+static_assert(std::is_trivially_copyable<record>::value,
+		"records are copied and stored as bytes");
+static_assert(sizeof(record) == 256, "the layout of record is part of the ABI");
+
+} /* namespace tcpprobe */
+
+#endif /* TCPPROBE_RECORD_HPP */
@@ -0,0 +1,90 @@
+/*
+ * libtcpprobe: parallel scans of capture files, used by tcpprobe_query.
+ *
+ *	tcpprobe::query q;
+ *	q.where.push_back({ tcpprobe::COL_SRTT, tcpprobe::cmp::gt, 200000 << 3 });
+ *	q.group.push_back({ tcpprobe::COL_DADDR, 0xffffff00 });
+ *	q.select.push_back({ tcpprobe::agg_fn::count, tcpprobe::COL_TYPE });
+ *	tcpprobe::scan_result res = tcpprobe::scan(files, q, 8);
+ *
+ * selects the records with a srtt above 200ms (srtt is us << 3) by remote /24.
+ *
+ * The files are mapped, and a block whose zone map excludes a predicate
+ * is skipped without touching its columns. The predicates of the other
+ * blocks are evaluated a column at a time over the whole block into a
+ * selection vector, in loops the compiler vectorizes; only the rows left
+ * selected are grouped.
+ *
+ * The threads start with a share of the files, split them into blocks on
+ * their own queue, and steal blocks from the others when theirs is empty:
+ * one large file is scanned by all the threads.
+ */
+#ifndef TCPPROBE_SCAN_HPP
+#define TCPPROBE_SCAN_HPP
+
+#include <array>
+#include <climits>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tcpprobe/capture.hpp"
+
+namespace tcpprobe {
+
+enum class cmp { lt, le, gt, ge, eq, ne };
+
+struct predicate {
+	column col;  /* a scalar column */
+	cmp op;
+	uint64_t value;
+};
+
+enum class agg_fn { count, sum, min, max, avg };
+
+struct aggregate {
+	agg_fn fn;
+	column col;  /* ignored by count */
+};
+
+struct group_key {
+	column col;
+	uint64_t mask;  /* applied to the value, 0xffffff00 groups addresses by /24 */
+};
+
+constexpr size_t MAX_GROUP = 4;
+
+struct query {
+	std::vector<predicate> where;   /* all of them */
+	std::vector<group_key> group;   /* up to MAX_GROUP, none for one total */
+	std::vector<aggregate> select;
+	/* CLOCK_REALTIME bounds of the records, see block_header::wall_base_ns */
+	int64_t since_ns = INT64_MIN;
+	int64_t until_ns = INT64_MAX;
+};
+
+struct group_row {
+	std::array<uint64_t, MAX_GROUP> key;
+	std::vector<double> values;  /* one per aggregate of the query */
+};
+
+struct scan_stats {
+	uint64_t files = 0;
+	uint64_t blocks = 0;
+	uint64_t blocks_skipped = 0;  /* by their zone map */
+	uint64_t rows_scanned = 0;
+	uint64_t rows_matched = 0;
+	uint64_t steals = 0;
+};
+
+struct scan_result {
+	std::vector<group_row> rows;  /* in no particular order */
+	scan_stats stats;
+};
+
+/* Scan paths on threads threads, throws std::system_error or std::invalid_argument */
+scan_result scan(const std::vector<std::string> &paths, const query &q, unsigned threads);
+
+} /* namespace tcpprobe */
+
+#endif /* TCPPROBE_SCAN_HPP */
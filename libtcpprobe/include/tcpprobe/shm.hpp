@@ -0,0 +1,139 @@
+/*
+ * libtcpprobe: shared memory ring of records, written by tcpprobe_fanout.
+ *
+ * The kernel ring has a single consumer. tcpprobe_fanout is that consumer
+ * and republishes every record into a ring in POSIX shared memory
+ * (/dev/shm/tcpprobe by default), which any number of local subscribers
+ * map read-only. Each subscriber has its own cursor: a slow subscriber
+ * only loses the records the ring overwrote before it read them, and
+ * never slows down the daemon or the other subscribers.
+ *
+ * Each slot carries the ring sequence number of its record, written last
+ * by the daemon (per slot seqlock): a subscriber detects that a slot was
+ * overwritten while it copied it and moves forward instead of returning
+ * a torn record.
+ */
+#ifndef TCPPROBE_SHM_HPP
+#define TCPPROBE_SHM_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "tcpprobe/record.hpp"
+
+namespace tcpprobe {
+
+constexpr const char *SHM_DEFAULT_NAME = "/tcpprobe";
+constexpr uint64_t SHM_MAGIC = 0x3162727070637474ULL; /* "ttcpprb1" */
+constexpr uint32_t SHM_VERSION = 1;
+
+enum {
+	SHM_RUNNING = 1,
+	SHM_CLOSED = 2, /* the daemon stopped, subscribers must reopen */
+};
+
+struct shm_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t record_size;  /* sizeof(record) */
+	uint64_t capacity;     /* slots, a power of 2 */
+	uint64_t epoch;        /* changes each time the daemon creates the ring */
+	uint32_t writer_pid;
+	std::atomic<uint32_t> state;  /* SHM_* */
+	/* written by the daemon, read by the subscribers */
+	alignas(64) std::atomic<uint64_t> head;  /* ring sequence number of the next record */
+	std::atomic<uint32_t> wake;   /* futex, bumped after each batch */
+	std::atomic<uint64_t> module_seq;      /* sequence number of the module, next record */
+	std::atomic<uint64_t> lost_upstream;   /* records the daemon missed from the module */
+	std::atomic<uint64_t> restarts;        /* reloads of the module seen */
+	std::atomic<uint64_t> heartbeat_ns;    /* CLOCK_MONOTONIC of the last batch or idle tick */
+};
+
+struct shm_slot {
+	std::atomic<uint64_t> seq;  /* ring sequence number of rec, ~0 while written */
+	uint64_t pad;
+	record rec;
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+		"the ring is shared between processes");
+
+/* Writer side, used by tcpprobe_fanout */
+class shm_publisher {
+public:
+	/* Creates the ring, replacing a stale one of the same name */
+	shm_publisher(const std::string &name, uint64_t capacity);
+	~shm_publisher();
+	shm_publisher(const shm_publisher &) = delete;
+	shm_publisher &operator=(const shm_publisher &) = delete;
+
+	/* Append n records and wake the subscribers */
+	void publish(const record *recs, size_t n);
+	/* Upstream state after a batch of the reader */
+	void set_upstream(uint64_t module_seq, uint64_t lost, bool restarted);
+	/* Tell the subscribers the daemon is alive while nothing is published */
+	void heartbeat();
+	/* Mark the ring closed, the subscribers reopen the next one */
+	void close();
+
+	const shm_header &header() const { return *hdr_; }
+
+private:
+	std::string name_;
+	shm_header *hdr_;
+	shm_slot *slots_;
+	size_t map_len_;
+	uint64_t mask_;
+};
+
+struct subscriber_stats {
+	uint64_t records = 0;
+	uint64_t lost = 0;      /* overwritten before they were read */
+	uint64_t reopens = 0;
+};
+
+/* Reader side: any number of processes, mapping the ring read-only */
+class shm_subscriber {
+public:
+	/* Where a new subscriber starts */
+	enum class start { newest, oldest };
+
+	explicit shm_subscriber(const std::string &name = SHM_DEFAULT_NAME,
+			start from = start::newest);
+	~shm_subscriber();
+	shm_subscriber(const shm_subscriber &) = delete;
+	shm_subscriber &operator=(const shm_subscriber &) = delete;
+
+	/*
+	 * Copy up to max records into out, waiting up to timeout_ms (-1
+	 * forever) for the first one. Returns the number of records copied,
+	 * 0 on timeout. Reopens the ring when the daemon was restarted.
+	 */
+	size_t read(record *out, size_t max, int timeout_ms = -1);
+
+	/* Records published but not read yet */
+	uint64_t lag() const;
+	uint64_t cursor() const { return cursor_; }
+	const subscriber_stats &stats() const { return stats_; }
+	/* Valid until the next read() */
+	const shm_header &header() const { return *hdr_; }
+
+private:
+	void open(start from);
+	void unmap();
+	bool replaced() const;
+
+	std::string name_;
+	const shm_header *hdr_;
+	const shm_slot *slots_;
+	size_t map_len_;
+	uint64_t mask_;
+	unsigned long ino_; /* of the ring mapped */
+	uint64_t cursor_;
+	subscriber_stats stats_;
+};
+
+} /* namespace tcpprobe */
+
+#endif /* TCPPROBE_SHM_HPP */
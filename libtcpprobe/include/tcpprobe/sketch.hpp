@@ -0,0 +1,140 @@
+/*
+ * libtcpprobe: mergeable quantile sketches of srtt, cwnd, goodput and RTO
+ * counts, per flow, local port and peer.
+ *
+ *	tcpprobe::sketch_builder sb;
+ *
+ *	while (rd.next(b))
+ *		sb.add(b.begin(), b.size());
+ *	sb.finish();
+ *	sb.table().save("host.tps");
+ *
+ * A quantile_sketch is a log-linear histogram (as HDR histograms): the
+ * values below 64 have a bucket each, and every power of 2 above is cut in
+ * 32 buckets, so a quantile is within 1.6% of the exact value whatever
+ * the range of the values. Only the buckets in use are stored. Merging
+ * two sketches adds their buckets: the merge of the sketches of several
+ * hosts is exactly the sketch of all their records, which is what makes
+ * fleet-wide percentiles cheap.
+ */
+#ifndef TCPPROBE_SKETCH_HPP
+#define TCPPROBE_SKETCH_HPP
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "tcpprobe/aggregate.hpp"
+#include "tcpprobe/record.hpp"
+
+namespace tcpprobe {
+
+class quantile_sketch {
+public:
+	static constexpr unsigned SUB_BITS = 5; /* 32 buckets per power of 2 */
+
+	void add(uint64_t v, uint64_t n = 1);
+	void merge(const quantile_sketch &o);
+
+	uint64_t count() const { return count_; }
+	uint64_t min() const { return count_ ? min_ : 0; }
+	uint64_t max() const { return max_; }
+	uint64_t sum() const { return sum_; }
+	/* Value of quantile q (0 to 1), 0 if the sketch is empty */
+	uint64_t quantile(double q) const;
+
+	/* Append the sketch to out */
+	void serialize(std::string &out) const;
+	/* Read a sketch at p, moving p past it; false if the data is corrupt */
+	bool deserialize(const unsigned char *&p, const unsigned char *end);
+
+private:
+	/* bucket index and count, sorted by index */
+	std::vector<std::pair<uint32_t, uint64_t>> buckets_;
+	uint64_t count_ = 0;
+	uint64_t min_ = UINT64_MAX;
+	uint64_t max_ = 0;
+	uint64_t sum_ = 0;
+};
+
+enum metric {
+	M_SRTT,     /* per sample, us (record::srtt >> 3) */
+	M_CWND,     /* per sample, packets */
+	M_GOODPUT,  /* per second of a flow with samples, bits per second */
+	M_RTO,      /* per flow, RTOs of the flow when it ended */
+	METRICS,
+};
+
+extern const char *const metric_names[METRICS];
+
+/* What the sketches are kept per */
+enum dimension : uint8_t {
+	DIM_FLOW = 1,  /* tuple and socket identifier */
+	DIM_PORT = 2,  /* local port, sport */
+	DIM_PEER = 4,  /* remote address, daddr */
+	DIM_ALL = DIM_FLOW | DIM_PORT | DIM_PEER,
+};
+
+struct sketch_key {
+	dimension dim;
+	flow_key flow;  /* only the fields of dim are set */
+
+	bool operator==(const sketch_key &o) const { return dim == o.dim && flow == o.flow; }
+};
+
+struct sketch_key_hash {
+	size_t operator()(const sketch_key &k) const { return flow_hash(k.flow) ^ k.dim; }
+};
+
+struct metric_sketches {
+	quantile_sketch m[METRICS];
+};
+
+/* Sketches by key, saved to and merged from files */
+class sketch_table {
+public:
+	typedef std::unordered_map<sketch_key, metric_sketches, sketch_key_hash> map;
+
+	metric_sketches &operator[](const sketch_key &k) { return sketches_[k]; }
+	const map &sketches() const { return sketches_; }
+	void merge(const sketch_table &o);
+
+	/* Write the table to path, throws std::system_error */
+	void save(const std::string &path) const;
+	/* Merge the table saved at path, throws std::system_error */
+	void load(const std::string &path);
+
+private:
+	map sketches_;
+};
+
+/* Builds the sketches of a stream of records, in a single pass */
+class sketch_builder {
+public:
+	explicit sketch_builder(unsigned dims = DIM_ALL, size_t flows = 1 << 14);
+
+	void add(const record &r);
+	void add(const record *recs, size_t n)
+	{
+		for (size_t i = 0; i < n; i++)
+			add(recs[i]);
+	}
+	/* Account the seconds in progress of the flows */
+	void finish();
+
+	sketch_table &table() { return table_; }
+
+private:
+	template <typename F>
+	void each_key(const flow_key &k, F f);
+
+	unsigned dims_;
+	sketch_table table_;
+	aggregator goodput_; /* per second rollups of the flows */
+};
+
+} /* namespace tcpprobe */
+
+#endif /* TCPPROBE_SKETCH_HPP */
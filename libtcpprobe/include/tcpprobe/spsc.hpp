@@ -0,0 +1,93 @@
+/*
+ * libtcpprobe: bounded lock-free queue, one producer thread and one
+ * consumer thread.
+ *
+ * Each side caches the index of the other side and only reloads it when
+ * the queue looks full (producer) or empty (consumer), and both move
+ * elements in bulk: a batch costs one atomic store, not one per element.
+ */
+#ifndef TCPPROBE_SPSC_HPP
+#define TCPPROBE_SPSC_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace tcpprobe {
+
+template <typename T>
+class spsc_queue {
+public:
+	/* capacity is a power of 2 */
+	explicit spsc_queue(size_t capacity)
+		: slots_(capacity), mask_(capacity - 1), head_(0), tail_cache_(0),
+		  tail_(0), head_cache_(0)
+	{
+		if (capacity < 2 || (capacity & (capacity - 1)))
+			throw std::invalid_argument("queue capacity must be a power of 2");
+	}
+	spsc_queue(const spsc_queue &) = delete;
+	spsc_queue &operator=(const spsc_queue &) = delete;
+
+	/* Producer: move up to n elements in, returns how many fit */
+	size_t push(T *v, size_t n)
+	{
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		size_t room = slots_.size() - (tail - head_cache_);
+
+		if (room < n) {
+			head_cache_ = head_.load(std::memory_order_acquire);
+			room = slots_.size() - (tail - head_cache_);
+			if (n > room)
+				n = room;
+		}
+		for (size_t i = 0; i < n; i++)
+			slots_[(tail + i) & mask_] = std::move(v[i]);
+		tail_.store(tail + n, std::memory_order_release);
+		return n;
+	}
+
+	/* Consumer: move up to max elements out, returns how many */
+	size_t pop(T *out, size_t max)
+	{
+		size_t head = head_.load(std::memory_order_relaxed);
+		size_t n = tail_cache_ - head;
+
+		if (n < max) {
+			tail_cache_ = tail_.load(std::memory_order_acquire);
+			n = tail_cache_ - head;
+		}
+		if (n > max)
+			n = max;
+		for (size_t i = 0; i < n; i++)
+			out[i] = std::move(slots_[(head + i) & mask_]);
+		head_.store(head + n, std::memory_order_release);
+		return n;
+	}
+
+	/* Either side, an estimate while the other one runs */
+	size_t size() const
+	{
+		return tail_.load(std::memory_order_acquire) -
+			head_.load(std::memory_order_acquire);
+	}
+
+private:
+	std::vector<T> slots_;
+	size_t mask_;
+	/* written by the consumer; the padding keeps both sides on their cache lines */
+	char pad0_[64];
+	std::atomic<size_t> head_;
+	size_t tail_cache_;
+	char pad1_[64];
+	/* written by the producer */
+	std::atomic<size_t> tail_;
+	size_t head_cache_;
+	char pad2_[64];
+};
+
+} /* namespace tcpprobe */
+
+#endif /* TCPPROBE_SPSC_HPP */
@@ -0,0 +1,345 @@
+/*
+ * libtcpprobe: per-flow rollups of the records, see tcpprobe/aggregate.hpp.
+ */
+#include <cstring>
+
+#include "tcpprobe/aggregate.hpp"
+
+namespace tcpprobe {
+
+/* Load factor of the table above which it doubles, in tenths */
+static const size_t MAX_LOAD = 7;
+
+static unsigned bucket_of(uint32_t v)
+{
+	unsigned e;
+
+	if (v < 4)
+		return v;
+	if (v >= 1U << 21)
+		v = (1U << 21) - 1;
+	e = 31 - __builtin_clz(v);
+	return 4 * (e - 1) + ((v >> (e - 2)) & 3);
+}
+
+static uint32_t bucket_low(unsigned b)
+{
+	unsigned e = b / 4 + 1;
+
+	if (b < 4)
+		return b;
+	return (4 + b % 4) << (e - 2);
+}
+
+void cwnd_hist::clear()
+{
+	memset(count, 0, sizeof(count));
+}
+
+void cwnd_hist::add(uint32_t cwnd)
+{
+	unsigned b = bucket_of(cwnd);
+
+	if (count[b] == UINT16_MAX)
+		for (unsigned i = 0; i < BUCKETS; i++)
+			count[i] /= 2;
+	count[b]++;
+}
+
+void cwnd_hist::merge(const cwnd_hist &o)
+{
+	bool halve = false;
+
+	for (unsigned i = 0; i < BUCKETS; i++)
+		if ((uint32_t) count[i] + o.count[i] > UINT16_MAX)
+			halve = true;
+	for (unsigned i = 0; i < BUCKETS; i++)
+		count[i] = halve ? (count[i] + o.count[i]) / 2 : count[i] + o.count[i];
+}
+
+uint32_t cwnd_hist::percentile(unsigned p) const
+{
+	uint64_t total = 0, rank, seen = 0;
+
+	for (unsigned i = 0; i < BUCKETS; i++)
+		total += count[i];
+	if (!total)
+		return 0;
+	/* smallest bucket holding at least p% of the samples */
+	rank = (total * p + 99) / 100;
+	if (!rank)
+		rank = 1;
+	for (unsigned i = 0; i < BUCKETS; i++) {
+		seen += count[i];
+		if (seen >= rank)
+			return bucket_low(i);
+	}
+	return bucket_low(BUCKETS - 1);
+}
+
+void aggregator::window::clear()
+{
+	samples = 0;
+	srtt_max = 0;
+	acked_bytes = 0;
+	retrans = 0;
+	cwnd_max = 0;
+	cwnd.clear();
+}
+
+void aggregator::window::merge(const window &o)
+{
+	samples += o.samples;
+	if (o.srtt_max > srtt_max)
+		srtt_max = o.srtt_max;
+	acked_bytes += o.acked_bytes;
+	retrans += o.retrans;
+	if (o.cwnd_max > cwnd_max)
+		cwnd_max = o.cwnd_max;
+	cwnd.merge(o.cwnd);
+}
+
+flow_key key_of(const record &r)
+{
+	flow_key k;
+
+	k.saddr = r.saddr;
+	k.daddr = r.daddr;
+	k.sport = r.sport;
+	k.dport = r.dport;
+	k.socket_idf = r.socket_idf;
+	return k;
+}
+
+aggregator::aggregator(emit_fn emit, size_t flows)
+	: emit_(emit), sec_(0), started_(false)
+{
+	size_t size = 16;
+
+	while (size * MAX_LOAD < flows * 10)
+		size *= 2;
+	table_.resize(size);
+	mask_ = size - 1;
+	for (flow &f : table_)
+		f.hash = 0;
+}
+
+uint32_t flow_hash(const flow_key &k)
+{
+	uint64_t x;
+
+	x = ((uint64_t) k.saddr << 32 | k.daddr) ^
+		((uint64_t) k.sport << 48 | (uint64_t) k.dport << 32) ^
+		k.socket_idf * 0x9e3779b97f4a7c15ULL;
+	/* finalizer of murmur3 */
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return (uint32_t) x ? (uint32_t) x : 1;
+}
+
+aggregator::flow *aggregator::lookup(const flow_key &k, uint32_t h)
+{
+	for (size_t i = h & mask_;; i = (i + 1) & mask_) {
+		flow &f = table_[i];
+
+		if (!f.hash)
+			return nullptr;
+		if (f.hash == h && f.key == k)
+			return &f;
+	}
+}
+
+aggregator::flow *aggregator::insert(const flow_key &k, uint32_t h)
+{
+	size_t i;
+
+	if ((stats_.flows + 1) * 10 > table_.size() * MAX_LOAD)
+		grow();
+	for (i = h & mask_; table_[i].hash; i = (i + 1) & mask_)
+		;
+	flow &f = table_[i];
+	f.key = k;
+	f.hash = h;
+	f.primed = false;
+	f.sec.clear();
+	f.min.clear();
+	stats_.flows++;
+	return &f;
+}
+
+/* Backward shift deletion: linear probing keeps no tombstones */
+void aggregator::erase(flow *f)
+{
+	size_t i = f - table_.data(), j = i;
+
+	for (;;) {
+		size_t home;
+
+		j = (j + 1) & mask_;
+		if (!table_[j].hash)
+			break;
+		home = table_[j].hash & mask_;
+		/* the entry at j can move to i if its home is not in (i, j] */
+		if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+			table_[i] = table_[j];
+			i = j;
+		}
+	}
+	table_[i].hash = 0;
+	stats_.flows--;
+}
+
+void aggregator::grow()
+{
+	std::vector<flow> old(table_.size() * 2);
+
+	old.swap(table_);
+	mask_ = table_.size() - 1;
+	for (flow &f : table_)
+		f.hash = 0;
+	for (const flow &f : old) {
+		size_t i;
+
+		if (!f.hash)
+			continue;
+		for (i = f.hash & mask_; table_[i].hash; i = (i + 1) & mask_)
+			;
+		table_[i] = f;
+	}
+	stats_.grows++;
+}
+
+void aggregator::emit(const flow &f, const window &w, uint64_t start_s,
+		uint32_t period_s, bool final)
+{
+	rollup r;
+
+	r.key = f.key;
+	r.start_ns = start_s * 1000000000ULL;
+	r.period_s = period_s;
+	r.final = final;
+	r.samples = w.samples;
+	r.acked_bytes = w.acked_bytes;
+	r.goodput_bps = w.acked_bytes * 8 / period_s;
+	r.srtt_max = w.srtt_max;
+	r.retrans = w.retrans;
+	r.cwnd_p50 = w.cwnd.percentile(50);
+	r.cwnd_p90 = w.cwnd.percentile(90);
+	r.cwnd_p99 = w.cwnd.percentile(99);
+	r.cwnd_max = w.cwnd_max;
+	stats_.rollups++;
+	emit_(r);
+}
+
+/* The second sec_ is over: emit it, and its minute if that is over too */
+void aggregator::tick(uint64_t sec)
+{
+	bool minute = sec / 60 != sec_ / 60;
+
+	for (flow &f : table_) {
+		if (!f.hash)
+			continue;
+		if (f.sec.samples) {
+			emit(f, f.sec, sec_, 1, false);
+			f.min.merge(f.sec);
+			f.sec.clear();
+		}
+		if (minute && f.min.samples) {
+			emit(f, f.min, sec_ / 60 * 60, 60, false);
+			f.min.clear();
+		}
+	}
+	sec_ = sec;
+}
+
+/* Emit the intervals the flow had not completed */
+void aggregator::finish(flow &f)
+{
+	if (f.sec.samples)
+		emit(f, f.sec, sec_, 1, true);
+	f.min.merge(f.sec);
+	if (f.min.samples)
+		emit(f, f.min, sec_ / 60 * 60, 60, true);
+	f.sec.clear();
+	f.min.clear();
+}
+
+void aggregator::advance(uint64_t tstamp_ns)
+{
+	uint64_t sec = tstamp_ns / 1000000000ULL;
+
+	if (!started_) {
+		sec_ = sec;
+		started_ = true;
+	} else if (sec + 60 < sec_) {
+		/* the module was reloaded, its clock and its flows started again */
+		flush();
+		for (flow &o : table_)
+			o.hash = 0;
+		stats_.flows = 0;
+		sec_ = sec;
+		started_ = true;
+	} else if (sec > sec_) {
+		tick(sec);
+	}
+}
+
+void aggregator::add(const record &r)
+{
+	flow_key k;
+	uint32_t h;
+	flow *f;
+
+	stats_.records++;
+	/* event records and flow definitions carry no sample of the socket */
+	if (!r.is_sample() || r.type == FLOWDEF)
+		return;
+
+	/* a record a little late is counted in the second in progress */
+	advance(r.tstamp_ns);
+
+	k = key_of(r);
+	h = flow_hash(k);
+	f = lookup(k, h);
+	if (!f)
+		f = insert(k, h);
+
+	window &w = f->sec;
+	if (f->primed) {
+		uint32_t acked = r.snd_una - f->snd_una;
+
+		/* snd_una going back is a restart of the relative numbers */
+		if (acked < 1U << 31)
+			w.acked_bytes += acked;
+		if (r.retrans > f->retrans)
+			w.retrans += r.retrans - f->retrans;
+	}
+	f->snd_una = r.snd_una;
+	f->retrans = r.retrans;
+	f->primed = true;
+	w.samples++;
+	if (r.srtt > w.srtt_max)
+		w.srtt_max = r.srtt;
+	if (r.snd_cwnd > w.cwnd_max)
+		w.cwnd_max = r.snd_cwnd;
+	w.cwnd.add(r.snd_cwnd);
+
+	if (r.is_end()) {
+		finish(*f);
+		erase(f);
+		stats_.expired++;
+	}
+}
+
+void aggregator::flush()
+{
+	for (flow &f : table_)
+		if (f.hash)
+			finish(f);
+	started_ = false;
+}
+
+} /* namespace tcpprobe */
@@ -0,0 +1,295 @@
+/*
+ * libtcpprobe: capture files of records, see tcpprobe/capture.hpp.
+ */
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tcpprobe/capture.hpp"
+
+namespace tcpprobe {
+
+#define COLUMN(name, field) { name, offsetof(record, field), sizeof(record::field) }
+
+const column_info columns[COL_COUNT] = {
+	COLUMN("type", type),
+	COLUMN("ca_state", ca_state),
+	COLUMN("frto_counter", frto_counter),
+	COLUMN("tcp_flags", tcp_flags),
+	COLUMN("rto_num", rto_num),
+	COLUMN("length", length),
+	COLUMN("flow_id", flow_id),
+	COLUMN("saddr", saddr),
+	COLUMN("daddr", daddr),
+	COLUMN("sport", sport),
+	COLUMN("dport", dport),
+	COLUMN("tstamp_ns", tstamp_ns),
+	COLUMN("socket_idf", socket_idf),
+	COLUMN("seq_num", seq_num),
+	COLUMN("ack_num", ack_num),
+	COLUMN("snd_nxt", snd_nxt),
+	COLUMN("snd_una", snd_una),
+	COLUMN("snd_wnd", snd_wnd),
+	COLUMN("snd_cwnd", snd_cwnd),
+	COLUMN("rcv_wnd", rcv_wnd),
+	COLUMN("ssthresh", ssthresh),
+	COLUMN("srtt", srtt),
+	COLUMN("mdev", mdev),
+	COLUMN("rttvar", rttvar),
+	COLUMN("rto", rto),
+	COLUMN("packets_out", packets_out),
+	COLUMN("lost_out", lost_out),
+	COLUMN("sacked_out", sacked_out),
+	COLUMN("retrans_out", retrans_out),
+	COLUMN("retrans", retrans),
+	COLUMN("write_seq", write_seq),
+	COLUMN("rqueue", rqueue),
+	COLUMN("wqueue", wqueue),
+	COLUMN("payload", user_agent),
+};
+
+#undef COLUMN
+
+static_assert(sizeof(record) - offsetof(record, user_agent) == AGENT_LEN,
+		"the payload column is the end of the record");
+
+column column_by_name(const std::string &name)
+{
+	for (uint32_t c = 0; c < COL_COUNT; c++)
+		if (name == columns[c].name)
+			return (column) c;
+	return COL_COUNT;
+}
+
+static uint64_t load(const unsigned char *p, uint32_t width)
+{
+	switch (width) {
+	case 1:
+		return *p;
+	case 2:
+		return *(const uint16_t *) p;
+	case 4:
+		return *(const uint32_t *) p;
+	default:
+		return *(const uint64_t *) p;
+	}
+}
+
+static int64_t realtime_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+capture_writer::capture_writer(const std::string &path, uint32_t block_rows)
+	: fd_(-1), path_(path), block_rows_(block_rows), wall_base_ns_(INT64_MAX),
+	  bytes_(0)
+{
+	capture_header h;
+
+	if (!block_rows_)
+		throw std::system_error(EINVAL, std::generic_category(), "empty blocks");
+	fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd_ < 0)
+		throw std::system_error(errno, std::generic_category(), "open " + path);
+	memset(&h, 0, sizeof(h));
+	h.magic = CAPTURE_MAGIC;
+	h.version = CAPTURE_VERSION;
+	h.record_size = sizeof(record);
+	h.block_rows = block_rows_;
+	h.columns = COL_COUNT;
+	h.created_ns = realtime_ns();
+	if (::write(fd_, &h, sizeof(h)) != (ssize_t) sizeof(h)) {
+		int err = errno;
+
+		::close(fd_);
+		throw std::system_error(err, std::generic_category(), "write " + path);
+	}
+	bytes_ = sizeof(h);
+	rows_.reserve(block_rows_);
+}
+
+capture_writer::~capture_writer()
+{
+	try {
+		close();
+	} catch (const std::system_error &) {
+	}
+}
+
+void capture_writer::add(const record *recs, size_t n)
+{
+	int64_t now = realtime_ns();
+
+	for (size_t i = 0; i < n; i++) {
+		/* delivery only adds delay: the lowest estimate is the closest */
+		int64_t base = now - (int64_t) recs[i].tstamp_ns;
+
+		if (base < wall_base_ns_)
+			wall_base_ns_ = base;
+		rows_.push_back(recs[i]);
+		if (rows_.size() == block_rows_)
+			write_block();
+	}
+}
+
+void capture_writer::write_block()
+{
+	uint32_t rows = rows_.size();
+	block_header *h;
+	size_t size = sizeof(block_header), pos;
+
+	for (uint32_t c = 0; c < COL_COUNT; c++)
+		size += column_size((column) c, rows);
+	buf_.assign(size, 0);
+	h = (block_header *) buf_.data();
+	h->magic = CAPTURE_BLOCK_MAGIC;
+	h->rows = rows;
+	h->size = size;
+	h->wall_base_ns = wall_base_ns_;
+
+	/* transpose the rows into columns, with the zone map of each */
+	pos = sizeof(block_header);
+	for (uint32_t c = 0; c < COL_COUNT; c++) {
+		const column_info &ci = columns[c];
+		unsigned char *dst = buf_.data() + pos;
+		uint64_t lo = UINT64_MAX, hi = 0;
+
+		for (uint32_t i = 0; i < rows; i++) {
+			const unsigned char *src = (const unsigned char *) &rows_[i] + ci.offset;
+
+			memcpy(dst + (size_t) i * ci.width, src, ci.width);
+			if (c < COL_SCALARS) {
+				uint64_t v = load(src, ci.width);
+
+				if (v < lo)
+					lo = v;
+				if (v > hi)
+					hi = v;
+			}
+		}
+		if (c < COL_SCALARS) {
+			h->zones[c].min = lo;
+			h->zones[c].max = hi;
+		}
+		pos += column_size((column) c, rows);
+	}
+
+	for (pos = 0; pos < size;) {
+		ssize_t n = ::write(fd_, buf_.data() + pos, size - pos);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::system_error(errno, std::generic_category(), "write " + path_);
+		}
+		pos += n;
+	}
+	bytes_ += size;
+	rows_.clear();
+	wall_base_ns_ = INT64_MAX;
+}
+
+void capture_writer::flush()
+{
+	if (!rows_.empty())
+		write_block();
+}
+
+void capture_writer::close()
+{
+	if (fd_ < 0)
+		return;
+	flush();
+	::close(fd_);
+	fd_ = -1;
+}
+
+uint64_t block_view::value(column c, uint32_t row) const
+{
+	return load(col[c] + (size_t) row * columns[c].width, columns[c].width);
+}
+
+void block_view::row(uint32_t i, record &r) const
+{
+	memset(&r, 0, sizeof(r));
+	for (uint32_t c = 0; c < COL_COUNT; c++)
+		memcpy((unsigned char *) &r + columns[c].offset,
+				col[c] + (size_t) i * columns[c].width, columns[c].width);
+}
+
+capture_file::capture_file(const std::string &path)
+	: path_(path), map_(nullptr), len_(0)
+{
+	const capture_header *h;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), "open " + path);
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(capture_header)) {
+		::close(fd);
+		throw std::system_error(EPROTO, std::generic_category(),
+				path + " is not a capture file");
+	}
+	map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+		throw std::system_error(errno, std::generic_category(), "mmap " + path);
+	map_ = (const unsigned char *) map;
+	len_ = st.st_size;
+	h = &header();
+	if (h->magic != CAPTURE_MAGIC || h->version != CAPTURE_VERSION ||
+		h->record_size != sizeof(record) || h->columns != COL_COUNT) {
+		munmap((void *) map_, len_);
+		throw std::system_error(EPROTO, std::generic_category(),
+				path + ": unknown capture version");
+	}
+	/* blocks are read once, in order */
+	madvise((void *) map_, len_, MADV_SEQUENTIAL);
+}
+
+capture_file::~capture_file()
+{
+	munmap((void *) map_, len_);
+}
+
+bool capture_file::block(uint64_t &offset, block_view &b) const
+{
+	const block_header *h;
+	size_t size = sizeof(block_header), pos;
+
+	if (offset + sizeof(block_header) > len_)
+		return false;
+	h = (const block_header *) (map_ + offset);
+	if (h->magic != CAPTURE_BLOCK_MAGIC || h->rows > header().block_rows ||
+		h->size > len_ - offset)
+		return false;
+	for (uint32_t c = 0; c < COL_COUNT; c++)
+		size += column_size((column) c, h->rows);
+	if (size != h->size)
+		return false;
+
+	b.hdr = h;
+	pos = offset + sizeof(block_header);
+	for (uint32_t c = 0; c < COL_COUNT; c++) {
+		b.col[c] = map_ + pos;
+		pos += column_size((column) c, h->rows);
+	}
+	offset += h->size;
+	return true;
+}
+
+} /* namespace tcpprobe */
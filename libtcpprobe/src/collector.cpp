@@ -0,0 +1,239 @@
+/*
+ * libtcpprobe: per-flow rollups on several threads, see tcpprobe/collector.hpp.
+ */
+#include <chrono>
+
+#include "tcpprobe/collector.hpp"
+
+namespace tcpprobe {
+
+/* Record type the reader sends to every worker when a second starts */
+static const uint8_t TICK = 0xff;
+/* Records moved to a worker at once */
+static const size_t STAGE = 256;
+/* Encoded rollups handed to the writer at once */
+static const size_t CHUNK = 64 << 10;
+
+struct collector::worker {
+	spsc_queue<record> in;
+	spsc_queue<std::string> out;
+	std::vector<record> staged;  /* reader side, not in the queue yet */
+	std::atomic<bool> done;      /* the reader will not add anything */
+	std::atomic<uint64_t> records;
+	std::atomic<uint64_t> rollups;
+	std::atomic<uint64_t> chunks;
+	std::thread thread;
+
+	explicit worker(size_t queue)
+		: in(queue), out(64), done(false), records(0), rollups(0), chunks(0)
+	{
+		staged.reserve(STAGE);
+	}
+};
+
+/* Empty polls: spin, then yield, then sleep */
+static void backoff(unsigned &idle)
+{
+	if (++idle < 64)
+		return;
+	if (idle < 1024)
+		std::this_thread::yield();
+	else
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+}
+
+collector::collector(unsigned workers, encode_fn encode, write_fn write,
+		size_t flows, size_t queue)
+	: encode_(encode), write_(write), running_(workers ? workers : 1), sec_(0),
+	  started_(false), finished_(false), records_(0), reader_waits_(0)
+{
+	if (!workers)
+		workers = 1;
+	for (unsigned i = 0; i < workers; i++)
+		workers_.emplace_back(new worker(queue));
+	for (unsigned i = 0; i < workers; i++) {
+		worker &w = *workers_[i];
+
+		w.thread = std::thread([this, &w, flows, workers] {
+			run_worker(w, flows / workers);
+		});
+	}
+	writer_ = std::thread([this] { run_writer(); });
+}
+
+collector::~collector()
+{
+	finish();
+}
+
+void collector::run_worker(worker &w, size_t flows)
+{
+	std::vector<record> buf(STAGE);
+	std::string chunk;
+	unsigned idle = 0;
+	aggregator agg([this, &w, &chunk](const rollup &r) {
+		encode_(chunk, r);
+		w.rollups.fetch_add(1, std::memory_order_relaxed);
+	}, flows);
+	auto ship = [&w, &chunk] {
+		std::string c;
+		unsigned wait = 0;
+
+		if (chunk.empty())
+			return;
+		c.swap(chunk);
+		while (!w.out.push(&c, 1))
+			backoff(wait);
+		w.chunks.fetch_add(1, std::memory_order_relaxed);
+	};
+
+	for (;;) {
+		size_t n = w.in.pop(buf.data(), buf.size());
+
+		if (!n) {
+			/* nothing more for now: the writer gets what is ready */
+			ship();
+			if (w.done.load(std::memory_order_acquire) && !w.in.size())
+				break;
+			backoff(idle);
+			continue;
+		}
+		idle = 0;
+		for (size_t i = 0; i < n; i++) {
+			if (buf[i].type == TICK)
+				agg.advance(buf[i].tstamp_ns);
+			else
+				agg.add(buf[i]);
+		}
+		w.records.fetch_add(n, std::memory_order_relaxed);
+		if (chunk.size() >= CHUNK)
+			ship();
+	}
+	agg.flush();
+	ship();
+	running_.fetch_sub(1, std::memory_order_release);
+}
+
+void collector::run_writer()
+{
+	std::string chunk;
+	unsigned idle = 0;
+
+	for (;;) {
+		/* read before draining: a worker finishing after still gets drained */
+		bool last = !running_.load(std::memory_order_acquire);
+		bool got = false;
+
+		for (auto &w : workers_)
+			while (w->out.pop(&chunk, 1)) {
+				write_(chunk);
+				got = true;
+			}
+		if (got) {
+			idle = 0;
+			continue;
+		}
+		if (last)
+			break;
+		backoff(idle);
+	}
+}
+
+void collector::send(worker &w, record *recs, size_t n)
+{
+	unsigned idle = 0;
+
+	while (n) {
+		size_t done = w.in.push(recs, n);
+
+		recs += done;
+		n -= done;
+		if (n) {
+			/* the worker is behind: wait, dropping would break the rollups */
+			if (!idle)
+				reader_waits_++;
+			backoff(idle);
+		}
+	}
+}
+
+void collector::flush_staged()
+{
+	for (auto &w : workers_) {
+		send(*w, w->staged.data(), w->staged.size());
+		w->staged.clear();
+	}
+}
+
+void collector::add(const record *recs, size_t n)
+{
+	uint64_t nworkers = workers_.size();
+
+	for (size_t i = 0; i < n; i++) {
+		const record &r = recs[i];
+		uint64_t sec = r.tstamp_ns / 1000000000ULL;
+		worker *w;
+
+		records_++;
+		/* what the aggregators would ignore is not queued */
+		if (!r.is_sample() || r.type == FLOWDEF)
+			continue;
+
+		/* a worker with few flows still closes its seconds in time */
+		if (!started_ || sec > sec_ || sec + 60 < sec_) {
+			record tick = record();
+
+			tick.type = TICK;
+			tick.tstamp_ns = r.tstamp_ns;
+			for (auto &o : workers_) {
+				o->staged.push_back(tick);
+				if (o->staged.size() == STAGE) {
+					send(*o, o->staged.data(), STAGE);
+					o->staged.clear();
+				}
+			}
+			sec_ = sec;
+			started_ = true;
+		}
+
+		/* the high bits of the hash: the tables of the workers use the low ones */
+		w = workers_[flow_hash(key_of(r)) * nworkers >> 32].get();
+		w->staged.push_back(r);
+		if (w->staged.size() == STAGE) {
+			send(*w, w->staged.data(), STAGE);
+			w->staged.clear();
+		}
+	}
+	flush_staged();
+}
+
+void collector::finish()
+{
+	if (finished_)
+		return;
+	finished_ = true;
+	flush_staged();
+	for (auto &w : workers_)
+		w->done.store(true, std::memory_order_release);
+	for (auto &w : workers_)
+		w->thread.join();
+	writer_.join();
+}
+
+collector_stats collector::stats() const
+{
+	collector_stats st;
+
+	st.records = records_;
+	st.reader_waits = reader_waits_;
+	for (auto &w : workers_) {
+		uint64_t n = w->records.load(std::memory_order_relaxed);
+
+		st.worker_records.push_back(n);
+		st.rollups += w->rollups.load(std::memory_order_relaxed);
+		st.chunks += w->chunks.load(std::memory_order_relaxed);
+	}
+	return st;
+}
+
+} /* namespace tcpprobe */
@@ -0,0 +1,373 @@
+/*
+ * libtcpprobe: records from the generic netlink multicast group.
+ *
+ * The module multicasts its records in batches (TCPPROBE_CMD_RECORDS)
+ * when the "export" sysctl is TCPPROBE_EXPORT_NETLINK. Each batch is one
+ * datagram on the socket and becomes one batch of the reader. The socket
+ * also joins the "notify" group of the controller, so that the unloading
+ * of the module (CTRL_CMD_DELFAMILY) is seen at once.
+ */
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <system_error>
+
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "source.hpp"
+
+namespace tcpprobe {
+
+/* A datagram holds one batch of NLMSG_GOODSIZE, at most a page or 8K */
+static const size_t NETLINK_BUF = 1 << 16;
+
+/* Call f(type, data, len) for each attribute of [data, data + len) */
+template <typename F>
+static void for_each_attr(const void *data, size_t len, F f)
+{
+	const char *p = (const char *) data;
+
+	while (len >= NLA_HDRLEN) {
+		const struct nlattr *nla = (const struct nlattr *) p;
+		size_t alen = NLA_ALIGN(nla->nla_len);
+
+		if (nla->nla_len < NLA_HDRLEN || nla->nla_len > len)
+			return;
+		f(nla->nla_type & NLA_TYPE_MASK, p + NLA_HDRLEN, nla->nla_len - NLA_HDRLEN);
+		if (alen >= len)
+			return;
+		p += alen;
+		len -= alen;
+	}
+}
+
+template <typename T>
+static inline T attr_get(const char *data, size_t len)
+{
+	T v = 0;
+
+	memcpy(&v, data, len < sizeof(v) ? len : sizeof(v));
+	return v;
+}
+
+static inline void attr_string(const char *data, size_t len, char *out, size_t size)
+{
+	size_t n = strnlen(data, len);
+
+	if (n >= size)
+		n = size - 1;
+	memcpy(out, data, n);
+	out[n] = '\0';
+}
+
+netlink_source::netlink_source(const options &opt, reader_stats &stats)
+	: fd_(-1), family_(0), seq_(0), buf_(NETLINK_BUF), stats_(stats)
+{
+	struct sockaddr_nl addr;
+	uint16_t ctrl;
+	uint32_t notify, records;
+
+	fd_ = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+	if (fd_ < 0)
+		throw std::system_error(errno, std::generic_category(), "netlink socket");
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	if (::bind(fd_, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		int err = errno;
+
+		::close(fd_);
+		throw std::system_error(err, std::generic_category(), "netlink bind");
+	}
+	if (opt.rcvbuf > 0 &&
+		::setsockopt(fd_, SOL_SOCKET, SO_RCVBUFFORCE, &opt.rcvbuf, sizeof(opt.rcvbuf)) < 0)
+		/* without CAP_NET_ADMIN, up to net.core.rmem_max */
+		::setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &opt.rcvbuf, sizeof(opt.rcvbuf));
+
+	try {
+		if (!resolve("nlctrl", "notify", ctrl, notify))
+			notify = 0;
+		if (!resolve(TCPPROBE_GENL_NAME, TCPPROBE_GENL_MCGRP, family_, records))
+			throw std::system_error(ENOENT, std::generic_category(),
+					"generic netlink family " TCPPROBE_GENL_NAME);
+		if (::setsockopt(fd_, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+				&records, sizeof(records)) < 0)
+			throw std::system_error(errno, std::generic_category(),
+					"join " TCPPROBE_GENL_MCGRP);
+		/* best effort, a reload is then only seen by the sequence numbers */
+		if (notify)
+			::setsockopt(fd_, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+					&notify, sizeof(notify));
+	} catch (...) {
+		::close(fd_);
+		throw;
+	}
+}
+
+netlink_source::~netlink_source()
+{
+	if (fd_ >= 0)
+		::close(fd_);
+}
+
+/*
+ * Ask the controller for the id of family name and of its multicast group.
+ * Returns false if the family is not registered.
+ */
+bool netlink_source::resolve(const char *name, const char *group, uint16_t &family,
+		uint32_t &group_id)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct genlmsghdr genl;
+		char attrs[NLA_HDRLEN + NLA_ALIGN(GENL_NAMSIZ)];
+	} req;
+	struct nlattr *nla = (struct nlattr *) req.attrs;
+	size_t name_len = strlen(name) + 1;
+	bool found = false;
+
+	memset(&req, 0, sizeof(req));
+	nla->nla_type = CTRL_ATTR_FAMILY_NAME;
+	nla->nla_len = NLA_HDRLEN + name_len;
+	memcpy(req.attrs + NLA_HDRLEN, name, name_len);
+	req.nlh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + NLA_ALIGN(nla->nla_len));
+	req.nlh.nlmsg_type = GENL_ID_CTRL;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST;
+	req.nlh.nlmsg_seq = ++seq_;
+	req.genl.cmd = CTRL_CMD_GETFAMILY;
+	req.genl.version = 1;
+	if (::send(fd_, &req, req.nlh.nlmsg_len, 0) < 0)
+		throw std::system_error(errno, std::generic_category(), "netlink send");
+
+	for (;;) {
+		ssize_t n = ::recv(fd_, buf_.data(), buf_.size(), 0);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::system_error(errno, std::generic_category(), "netlink recv");
+		}
+		for (struct nlmsghdr *nlh = (struct nlmsghdr *) buf_.data();
+				NLMSG_OK(nlh, (size_t) n); nlh = NLMSG_NEXT(nlh, n)) {
+			if (nlh->nlmsg_seq != seq_)
+				continue;
+			if (nlh->nlmsg_type == NLMSG_ERROR)
+				return false; /* ENOENT: not registered */
+			if (nlh->nlmsg_type != GENL_ID_CTRL)
+				continue;
+			group_id = 0;
+			for_each_attr(GENL_HDRLEN + (char *) NLMSG_DATA(nlh),
+					nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN),
+					[&](int type, const char *data, size_t len) {
+				if (type == CTRL_ATTR_FAMILY_ID) {
+					family = attr_get<uint16_t>(data, len);
+					found = true;
+				} else if (type == CTRL_ATTR_MCAST_GROUPS) {
+					for_each_attr(data, len, [&](int, const char *grp, size_t glen) {
+						uint32_t id = 0;
+						bool match = false;
+
+						for_each_attr(grp, glen, [&](int t, const char *d, size_t l) {
+							if (t == CTRL_ATTR_MCAST_GRP_ID)
+								id = attr_get<uint32_t>(d, l);
+							else if (t == CTRL_ATTR_MCAST_GRP_NAME)
+								match = strncmp(d, group, l) == 0;
+						});
+						if (match)
+							group_id = id;
+					});
+				}
+			});
+			return found && group_id != 0;
+		}
+	}
+}
+
+/* Decode the attributes of a TCPPROBE_CMD_RECORDS message into b */
+void netlink_source::parse_batch(const void *attrs, size_t len, batch &b)
+{
+	for_each_attr(attrs, len, [&](int type, const char *data, size_t alen) {
+		switch (type) {
+		case TCPPROBE_A_SEQ:
+			b.seq_ = attr_get<uint64_t>(data, alen);
+			break;
+		case TCPPROBE_A_DROP_RING:
+			b.drop_ring_ = attr_get<uint64_t>(data, alen);
+			break;
+		case TCPPROBE_A_DROP_NETLINK:
+			b.drop_netlink_ = attr_get<uint64_t>(data, alen);
+			break;
+		case TCPPROBE_A_RECORD: {
+			record &r = b.append();
+
+			memset(&r, 0, sizeof(r));
+			for_each_attr(data, alen, [&](int t, const char *d, size_t l) {
+				switch (t) {
+				case TCPPROBE_R_TYPE: r.type = attr_get<uint8_t>(d, l); break;
+				case TCPPROBE_R_TSTAMP: r.tstamp_ns = attr_get<uint64_t>(d, l); break;
+				case TCPPROBE_R_FLOW_ID: r.flow_id = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_SADDR: r.saddr = ntohl(attr_get<uint32_t>(d, l)); break;
+				case TCPPROBE_R_DADDR: r.daddr = ntohl(attr_get<uint32_t>(d, l)); break;
+				case TCPPROBE_R_SPORT: r.sport = ntohs(attr_get<uint16_t>(d, l)); break;
+				case TCPPROBE_R_DPORT: r.dport = ntohs(attr_get<uint16_t>(d, l)); break;
+				case TCPPROBE_R_SOCKET_IDF: r.socket_idf = attr_get<uint64_t>(d, l); break;
+				case TCPPROBE_R_LENGTH: r.length = attr_get<uint16_t>(d, l); break;
+				case TCPPROBE_R_TCP_FLAGS: r.tcp_flags = attr_get<uint8_t>(d, l); break;
+				case TCPPROBE_R_SEQ_NUM: r.seq_num = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_ACK_NUM: r.ack_num = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_CA_STATE: r.ca_state = attr_get<uint8_t>(d, l); break;
+				case TCPPROBE_R_SND_NXT: r.snd_nxt = attr_get<uint64_t>(d, l); break;
+				case TCPPROBE_R_WRITE_SEQ: r.write_seq = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_SSTHRESH: r.ssthresh = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_SND_CWND: r.snd_cwnd = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_RCV_WND: r.rcv_wnd = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_SRTT: r.srtt = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_MDEV: r.mdev = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_RTTVAR: r.rttvar = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_RTO: r.rto = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_LOST_OUT: r.lost_out = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_SACKED_OUT: r.sacked_out = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_RETRANS_OUT: r.retrans_out = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_RETRANS: r.retrans = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_FRTO_COUNTER: r.frto_counter = attr_get<uint8_t>(d, l); break;
+				case TCPPROBE_R_RTO_NUM: r.rto_num = attr_get<uint16_t>(d, l); break;
+				case TCPPROBE_R_USER_AGENT:
+					attr_string(d, l, r.user_agent, sizeof(r.user_agent));
+					break;
+				/* also given by the stall records, see below */
+				case TCPPROBE_R_SND_UNA: r.snd_una = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_SND_WND: r.snd_wnd = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_WQUEUE: r.wqueue = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_RQUEUE: r.rqueue = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_PACKETS_OUT: r.packets_out = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_RETX_FAST: r.retx.fast = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_RETX_RTO: r.retx.rto = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_RETX_TLP: r.retx.tlp = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_RETX_SPURIOUS: r.retx.spurious = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_RETX_BYTES: r.retx.bytes = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_RETX_SEQ_LO: r.retx.seq_lo = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_RETX_SEQ_HI: r.retx.seq_hi = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_STALL_CAUSE: r.stall.cause = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_STALL_MS: r.stall.stalled_ms = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_STALL_RTO: r.stall.rto_num = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_ECN_ACKS: r.ecn.acks = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_ECN_ECE_ACKS: r.ecn.ece_acks = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_ECN_ACKED_BYTES: r.ecn.acked_bytes = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_ECN_ECE_BYTES: r.ecn.ece_bytes = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_ECN_ECE_PERMILLE: r.ecn.ece_permille = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_ECN_CWR: r.ecn.cwr = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_ECN_DATA_PKTS: r.ecn.data_pkts = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_ECN_DATA_BYTES: r.ecn.data_bytes = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_ECN_CE_PKTS: r.ecn.ce_pkts = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_ECN_CE_BYTES: r.ecn.ce_bytes = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_ECN_CE_PERMILLE: r.ecn.ce_permille = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_HOSTQ_PACING_RATE: r.hostq.pacing_rate = attr_get<uint64_t>(d, l); break;
+				case TCPPROBE_R_HOSTQ_WMEM_QUEUED: r.hostq.wmem_queued = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_HOSTQ_WMEM_QUEUED_MAX: r.hostq.wmem_queued_max = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_HOSTQ_WMEM_ALLOC: r.hostq.wmem_alloc = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_HOSTQ_WMEM_ALLOC_MAX: r.hostq.wmem_alloc_max = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_HOSTQ_TSQ_MS: r.hostq.tsq_ms = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_HOSTQ_PACING_MS: r.hostq.pacing_ms = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_HOSTQ_SNDBUF_MS: r.hostq.sndbuf_ms = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_HOSTQ_EVENTS: r.hostq.events = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_LISTEN_CONNS: r.listen.conns = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_LISTEN_OVERFLOWS: r.listen.overflows = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_LISTEN_ACCEPTS: r.listen.accepts = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_LISTEN_BACKLOG_MAX: r.listen.backlog_max = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_LISTEN_BACKLOG_AVG: r.listen.backlog_avg = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_LISTEN_MAX_BACKLOG: r.listen.max_backlog = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_LISTEN_ACCEPT_AVG_US: r.listen.accept_avg_us = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_LISTEN_ACCEPT_MAX_US: r.listen.accept_max_us = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_STATE: r.states.state = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_STATE_TRANSITIONS: r.states.transitions = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_STATE_MS:
+					memcpy(r.states.ms, d, l < sizeof(r.states.ms) ? l : sizeof(r.states.ms));
+					break;
+				case TCPPROBE_R_OWNER_PID: r.owner.pid = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_OWNER_TGID: r.owner.tgid = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_OWNER_UID: r.owner.uid = attr_get<uint32_t>(d, l); break;
+				case TCPPROBE_R_OWNER_COMM:
+					attr_string(d, l, r.owner.comm, sizeof(r.owner.comm));
+					break;
+				}
+			});
+			if (r.type == LISTEN) {
+				r.listen.port = r.sport;
+			} else if (r.type == STALL) {
+				/* the payload of the text format */
+				r.stall.snd_una = r.snd_una;
+				r.stall.snd_wnd = r.snd_wnd;
+				r.stall.wqueue = r.wqueue;
+				r.stall.rqueue = r.rqueue;
+				r.stall.packets_out = r.packets_out;
+			}
+			break;
+		}
+		}
+	});
+	b.next_seq_ = b.seq_ + b.size_;
+}
+
+int netlink_source::read(batch &b, int timeout_ms)
+{
+	using clock = std::chrono::steady_clock;
+	clock::time_point deadline = clock::now() + std::chrono::milliseconds(timeout_ms);
+	struct pollfd pfd = { fd_, POLLIN, 0 };
+
+	for (;;) {
+		int wait = timeout_ms;
+		ssize_t n;
+
+		if (timeout_ms >= 0) {
+			wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+					deadline - clock::now()).count();
+			if (wait < 0)
+				wait = 0;
+		}
+		n = ::poll(&pfd, 1, wait);
+		if (n < 0 && errno != EINTR)
+			throw std::system_error(errno, std::generic_category(), "poll");
+		if (n <= 0)
+			return SOURCE_TIMEOUT;
+
+		n = ::recv(fd_, buf_.data(), buf_.size(), 0);
+		if (n < 0) {
+			if (errno == ENOBUFS) {
+				/* batches were dropped, the sequence numbers tell how many */
+				stats_.overruns++;
+				continue;
+			}
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			throw std::system_error(errno, std::generic_category(), "netlink recv");
+		}
+		for (struct nlmsghdr *nlh = (struct nlmsghdr *) buf_.data();
+				NLMSG_OK(nlh, (size_t) n); nlh = NLMSG_NEXT(nlh, n)) {
+			const struct genlmsghdr *genl = (const struct genlmsghdr *) NLMSG_DATA(nlh);
+			const char *attrs = GENL_HDRLEN + (const char *) genl;
+			size_t len = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+
+			if (nlh->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN))
+				continue;
+			if (nlh->nlmsg_type == GENL_ID_CTRL && genl->cmd == CTRL_CMD_DELFAMILY) {
+				bool ours = false;
+
+				for_each_attr(attrs, len, [&](int t, const char *d, size_t l) {
+					if (t == CTRL_ATTR_FAMILY_ID)
+						ours = attr_get<uint16_t>(d, l) == family_;
+				});
+				if (ours)
+					return SOURCE_GONE;
+			} else if (nlh->nlmsg_type == family_ && genl->cmd == TCPPROBE_CMD_RECORDS) {
+				parse_batch(attrs, len, b);
+				return SOURCE_BATCH;
+			}
+		}
+	}
+}
+
+} /* namespace tcpprobe */
@@ -0,0 +1,237 @@
+/*
+ * libtcpprobe: records from the text of /proc/net/tcpprobe_data.
+ *
+ * The format is the one of tcpprobe_sprint() in stat.c: hexadecimal fields
+ * separated by spaces, the tuple replaced by the flow id when the flowid
+ * sysctl is set. Every read() of the file returns whole records; the file
+ * position is the sequence number of the next record.
+ */
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "source.hpp"
+
+namespace tcpprobe {
+
+/* Large enough for readnum records of the longest line (512 bytes) */
+static const size_t PROCFS_BUF = 1 << 20;
+
+procfs_source::procfs_source(const options &opt, int64_t start_seq, reader_stats &stats)
+	: fd_(-1), pos_(0), compact_(false), buf_(PROCFS_BUF), carry_(0), stats_(stats)
+{
+	off_t pos;
+
+	fd_ = ::open(opt.proc_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd_ < 0)
+		throw std::system_error(errno, std::generic_category(), opt.proc_path);
+	pos = start_seq >= 0 ? ::lseek(fd_, start_seq, SEEK_SET) : ::lseek(fd_, 0, SEEK_CUR);
+	if (pos < 0) {
+		int err = errno;
+
+		::close(fd_);
+		throw std::system_error(err, std::generic_category(), "lseek " + opt.proc_path);
+	}
+	pos_ = pos;
+	compact_ = read_sysctl(opt.sysctl_dir, "flowid") == 1;
+}
+
+procfs_source::~procfs_source()
+{
+	if (fd_ >= 0)
+		::close(fd_);
+}
+
+/* Next hexadecimal field of [p, end), false if there is none */
+static inline bool next_hex(const char *&p, const char *end, uint64_t &v)
+{
+	while (p < end && *p == ' ')
+		p++;
+	if (p == end)
+		return false;
+	v = 0;
+	for (; p < end && *p != ' '; p++) {
+		unsigned c = (unsigned char) *p;
+
+		if (c - '0' < 10)
+			v = (v << 4) | (c - '0');
+		else if ((c | 0x20) - 'a' < 6)
+			v = (v << 4) | ((c | 0x20) - 'a' + 10);
+		else
+			return false;
+	}
+	return true;
+}
+
+/* The n next fields into the u32 of out */
+static inline bool next_hex32(const char *&p, const char *end, uint32_t *out, int n)
+{
+	uint64_t v;
+
+	for (int i = 0; i < n; i++) {
+		if (!next_hex(p, end, v))
+			return false;
+		out[i] = (uint32_t) v;
+	}
+	return true;
+}
+
+/* The rest of the line as a string of at most len - 1 characters */
+static inline void rest_of_line(const char *p, const char *end, char *out, size_t len)
+{
+	size_t n;
+
+	while (p < end && *p == ' ')
+		p++;
+	n = end - p < (ptrdiff_t) len - 1 ? end - p : len - 1;
+	memcpy(out, p, n);
+	out[n] = '\0';
+}
+
+bool procfs_source::parse_line(const char *p, const char *end, bool compact, record &r)
+{
+	uint64_t v[8];
+
+	memset(&r, 0, sizeof(r));
+	if (!next_hex(p, end, v[0]) || !next_hex(p, end, v[1]) || !next_hex(p, end, v[2]))
+		return false;
+	r.type = v[0];
+	r.tstamp_ns = v[1] * 1000000000ULL + v[2];
+
+	if (r.type == FLOWDEF) {
+		/* flow_id saddr sport daddr dport socket_idf first ack */
+		for (int i = 0; i < 7; i++)
+			if (!next_hex(p, end, v[i]))
+				return false;
+		r.flow_id = v[0];
+		r.saddr = v[1];
+		r.sport = v[2];
+		r.daddr = v[3];
+		r.dport = v[4];
+		r.socket_idf = v[5];
+		r.ack_num = v[6];
+		return true;
+	}
+	if (compact) {
+		if (!next_hex(p, end, v[0]))
+			return false;
+		r.flow_id = v[0];
+	} else {
+		for (int i = 0; i < 4; i++)
+			if (!next_hex(p, end, v[i]))
+				return false;
+		r.saddr = v[0];
+		r.sport = v[1];
+		r.daddr = v[2];
+		r.dport = v[3];
+	}
+
+	switch (r.type) {
+	case RETRANS:
+		return next_hex32(p, end, &r.retx.fast, 7);
+	case STALL:
+		return next_hex32(p, end, &r.stall.cause, 8);
+	case ECN:
+		return next_hex32(p, end, &r.ecn.acks, 11);
+	case HOSTQ:
+		return next_hex(p, end, r.hostq.pacing_rate) &&
+			next_hex32(p, end, &r.hostq.wmem_queued, 8);
+	case OWNER:
+		/* comm last, it may contain spaces */
+		if (!next_hex32(p, end, &r.owner.pid, 3))
+			return false;
+		rest_of_line(p, end, r.owner.comm, sizeof(r.owner.comm));
+		return true;
+	case STATES:
+		/* ms of TCP_ESTABLISHED to TCP_CLOSING */
+		return next_hex32(p, end, &r.states.state, 2) &&
+			next_hex32(p, end, &r.states.ms[1], TCPPROBE_TCP_STATES - 1);
+	case LISTEN:
+		if (!next_hex32(p, end, &r.listen.port, 9))
+			return false;
+		/* a listener has no flow, its port names it */
+		r.sport = r.listen.port;
+		return true;
+	}
+
+	/* length tcp_flags seq_num ack_num ca_state snd_nxt snd_una write_seq wqueue */
+	if (!next_hex(p, end, v[0]) || !next_hex(p, end, v[1]) ||
+		!next_hex32(p, end, &r.seq_num, 2) || !next_hex(p, end, v[2]) ||
+		!next_hex(p, end, r.snd_nxt) || !next_hex32(p, end, &r.snd_una, 1) ||
+		!next_hex32(p, end, &r.write_seq, 1) || !next_hex32(p, end, &r.wqueue, 1))
+		return false;
+	r.length = v[0];
+	r.tcp_flags = v[1];
+	r.ca_state = v[2];
+	/* snd_cwnd ssthresh snd_wnd srtt mdev rttvar rto */
+	if (!next_hex32(p, end, &r.snd_cwnd, 1) || !next_hex32(p, end, &r.ssthresh, 1) ||
+		!next_hex32(p, end, &r.snd_wnd, 1) || !next_hex32(p, end, &r.srtt, 4))
+		return false;
+	/* packets_out lost_out sacked_out retrans_out retrans frto_counter rto_num */
+	if (!next_hex32(p, end, &r.packets_out, 5) || !next_hex(p, end, v[0]) ||
+		!next_hex(p, end, v[1]))
+		return false;
+	r.frto_counter = v[0];
+	r.rto_num = v[1];
+	rest_of_line(p, end, r.user_agent, sizeof(r.user_agent));
+	return true;
+}
+
+int procfs_source::read(batch &b, int timeout_ms)
+{
+	char *buf = buf_.data();
+	ssize_t n;
+	off_t pos;
+	size_t len, start;
+
+	(void) timeout_ms;
+	n = ::read(fd_, buf + carry_, buf_.size() - carry_);
+	if (n < 0) {
+		if (errno == EINTR)
+			return SOURCE_TIMEOUT;
+		if (errno == ENODEV)
+			return SOURCE_GONE;
+		throw std::system_error(errno, std::generic_category(), "read");
+	}
+	/* end of file: the module is unloading and everything was read */
+	if (n == 0)
+		return SOURCE_GONE;
+
+	b.seq_ = pos_;
+	pos = ::lseek(fd_, 0, SEEK_CUR);
+	if (pos >= 0)
+		pos_ = pos;
+	b.next_seq_ = pos_;
+
+	len = carry_ + n;
+	start = 0;
+	for (size_t i = carry_; i < len; i++) {
+		if (buf[i] != '\n')
+			continue;
+		if (i > start) {
+			record &r = b.append();
+
+			if (!parse_line(buf + start, buf + i, compact_, r)) {
+				b.size_--;
+				stats_.bad_lines++;
+			} else if (r.type == FLOWDEF) {
+				/* flowid was set after the file was opened */
+				compact_ = true;
+			}
+		}
+		start = i + 1;
+	}
+	carry_ = len - start;
+	if (carry_ == buf_.size()) {
+		/* a line longer than the buffer, drop it */
+		stats_.bad_lines++;
+		carry_ = 0;
+	}
+	memmove(buf, buf + start, carry_);
+	return SOURCE_BATCH;
+}
+
+} /* namespace tcpprobe */
@@ -0,0 +1,222 @@
+/*
+ * libtcpprobe: transport negotiation, sequence accounting and reconnection.
+ */
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+
+#include "source.hpp"
+
+namespace tcpprobe {
+
+const char *transport_name(transport t)
+{
+	switch (t) {
+	case transport::procfs:
+		return "procfs";
+	case transport::netlink:
+		return "netlink";
+	default:
+		return "any";
+	}
+}
+
+long read_sysctl(const std::string &sysctl_dir, const char *name)
+{
+	std::string path = sysctl_dir + "/" + name;
+	FILE *f = fopen(path.c_str(), "r");
+	long v;
+
+	if (!f)
+		return -1;
+	if (fscanf(f, "%ld", &v) != 1)
+		v = -1;
+	fclose(f);
+	return v;
+}
+
+record &batch::append()
+{
+	if (size_ == records_.size())
+		records_.resize(records_.empty() ? 1024 : records_.size() * 2);
+	return records_[size_++];
+}
+
+void batch::clear()
+{
+	size_ = 0;
+	seq_ = next_seq_ = lost_ = 0;
+	restarted_ = false;
+	drop_ring_ = drop_netlink_ = 0;
+}
+
+/*
+ * Tuples of the flows, when the flowid sysctl is set and the records only
+ * name their flow by id. Filled by the flow definitions, emptied by the
+ * done and purge records.
+ */
+struct flow_tuple {
+	uint32_t saddr, daddr;
+	uint16_t sport, dport;
+	uint64_t socket_idf;
+};
+
+class flow_table {
+public:
+	flow_table() { flows_.reserve(1 << 16); }
+
+	void apply(record &r)
+	{
+		if (r.type == FLOWDEF) {
+			flows_[r.flow_id] = flow_tuple{ r.saddr, r.daddr, r.sport, r.dport,
+					r.socket_idf };
+			return;
+		}
+		if (r.flow_id == 0 || r.saddr || r.daddr || r.sport || r.dport)
+			return;
+		auto it = flows_.find(r.flow_id);
+		if (it == flows_.end())
+			return;
+		r.saddr = it->second.saddr;
+		r.daddr = it->second.daddr;
+		r.sport = it->second.sport;
+		r.dport = it->second.dport;
+		r.socket_idf = it->second.socket_idf;
+		if (r.is_end())
+			flows_.erase(it);
+	}
+
+	void clear() { flows_.clear(); }
+
+private:
+	std::unordered_map<uint32_t, flow_tuple> flows_;
+};
+
+reader::reader(const options &opt)
+	: opt_(opt), flows_(new flow_table())
+{
+	if (opt_.start_seq >= 0) {
+		next_seq_ = opt_.start_seq;
+		positioned_ = true;
+	}
+}
+
+reader::~reader()
+{
+	close();
+}
+
+transport reader::negotiate() const
+{
+	long mode;
+
+	if (opt_.mode != transport::any)
+		return opt_.mode;
+	mode = read_sysctl(opt_.sysctl_dir, "export");
+	if (mode < 0)
+		throw std::system_error(ENOENT, std::generic_category(),
+				"tcp_probe_plus is not loaded (" + opt_.sysctl_dir + ")");
+	if (mode == TCPPROBE_EXPORT_NETLINK)
+		return transport::netlink;
+	if (mode == TCPPROBE_EXPORT_TRACE)
+		/* the records are trace events, read them with perf or trace-cmd */
+		throw std::system_error(ENOTSUP, std::generic_category(),
+				"tcp_probe_plus exports to trace events");
+	return transport::procfs;
+}
+
+void reader::open()
+{
+	transport t = negotiate();
+
+	if (t == transport::netlink) {
+		src_.reset(new netlink_source(opt_, stats_));
+	} else {
+		/* resume where the previous source stopped */
+		procfs_source *p = new procfs_source(opt_, positioned_ ? next_seq_ : -1, stats_);
+
+		src_.reset(p);
+		if (positioned_ && p->position() < next_seq_) {
+			/* the ring restarted from 0, the module was reloaded */
+			src_.reset();
+			p = new procfs_source(opt_, 0, stats_);
+			src_.reset(p);
+		}
+	}
+	active_ = t;
+}
+
+void reader::close()
+{
+	src_.reset();
+	flows_->clear();
+}
+
+/* Try to reopen the transport after it went away, false if it is still gone */
+bool reader::reopen()
+{
+	try {
+		open();
+		stats_.reconnects++;
+		return true;
+	} catch (const std::system_error &e) {
+		if (e.code().value() == ENOTSUP)
+			throw;
+		return false;
+	}
+}
+
+bool reader::next(batch &b, int timeout_ms)
+{
+	using clock = std::chrono::steady_clock;
+	clock::time_point deadline = clock::now() + std::chrono::milliseconds(timeout_ms);
+
+	b.clear();
+	for (;;) {
+		int ret;
+
+		if (!src_) {
+			if (!opt_.reconnect)
+				return false;
+			if (!reopen()) {
+				if (timeout_ms >= 0 && clock::now() >= deadline)
+					return false;
+				std::this_thread::sleep_for(std::chrono::milliseconds(opt_.reconnect_ms));
+				continue;
+			}
+		}
+		ret = src_->read(b, timeout_ms);
+		if (ret == SOURCE_BATCH)
+			break;
+		if (ret == SOURCE_TIMEOUT)
+			return false;
+		/* the module went away, the next one starts from sequence number 0 */
+		src_.reset();
+		b.clear();
+		if (!opt_.reconnect)
+			return false;
+	}
+
+	if (positioned_ && b.seq_ < next_seq_) {
+		b.restarted_ = true;
+		flows_->clear();
+	} else if (positioned_) {
+		b.lost_ = b.seq_ - next_seq_;
+	}
+	next_seq_ = b.next_seq_;
+	positioned_ = true;
+
+	for (size_t i = 0; i < b.size_; i++)
+		flows_->apply(b.records_[i]);
+
+	stats_.records += b.size_;
+	stats_.batches++;
+	stats_.lost += b.lost_;
+	return true;
+}
+
+} /* namespace tcpprobe */
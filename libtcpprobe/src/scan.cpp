@@ -0,0 +1,408 @@
+/*
+ * libtcpprobe: parallel scans of capture files, see tcpprobe/scan.hpp.
+ */
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include "tcpprobe/scan.hpp"
+
+namespace tcpprobe {
+
+typedef std::array<uint64_t, MAX_GROUP> gkey;
+
+struct key_hash {
+	size_t operator()(const gkey &k) const
+	{
+		uint64_t h = 0;
+
+		for (uint64_t v : k)
+			h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+		return h ^ h >> 29;
+	}
+};
+
+/* What a thread accumulated: per group, its count then sum, min, max per aggregate */
+struct partial {
+	std::unordered_map<gkey, size_t, key_hash> groups;
+	std::vector<uint64_t> counts;
+	std::vector<uint64_t> sums;
+	std::vector<uint64_t> mins;
+	std::vector<uint64_t> maxs;
+	std::vector<uint8_t> sel;
+	std::vector<uint32_t> rows;
+	std::vector<predicate> preds;
+	scan_stats stats;
+};
+
+/* A file still to split into blocks, or a block */
+struct task {
+	const capture_file *file;
+	uint64_t offset;
+	bool whole_file;
+};
+
+struct task_queue {
+	std::mutex lock;
+	std::deque<task> tasks;
+};
+
+static bool zone_may_match(const zone &z, cmp op, uint64_t v)
+{
+	switch (op) {
+	case cmp::lt:
+		return z.min < v;
+	case cmp::le:
+		return z.min <= v;
+	case cmp::gt:
+		return z.max > v;
+	case cmp::ge:
+		return z.max >= v;
+	case cmp::eq:
+		return z.min <= v && v <= z.max;
+	default:
+		return !(z.min == v && z.max == v);
+	}
+}
+
+template <typename T, typename Op>
+static void eval_op(const T *__restrict c, size_t n, T v, uint8_t *__restrict sel, Op op)
+{
+	size_t i = 0;
+
+	/* chunks of a fixed size are vectorized at -O2 too */
+	for (; i + 64 <= n; i += 64, c += 64, sel += 64)
+		for (size_t j = 0; j < 64; j++)
+			sel[j] &= op(c[j], v);
+	for (; i < n; i++, c++, sel++)
+		*sel &= op(*c, v);
+}
+
+template <typename T>
+static void eval(const T *c, uint32_t n, cmp op, uint64_t v, uint8_t *sel)
+{
+	/* compare at the width of the column, more values per vector */
+	if (v > (T) ~(T) 0) {
+		if (op == cmp::gt || op == cmp::ge || op == cmp::eq)
+			memset(sel, 0, n);
+		return;
+	}
+	switch (op) {
+	case cmp::lt:
+		eval_op(c, n, (T) v, sel, std::less<T>());
+		break;
+	case cmp::le:
+		eval_op(c, n, (T) v, sel, std::less_equal<T>());
+		break;
+	case cmp::gt:
+		eval_op(c, n, (T) v, sel, std::greater<T>());
+		break;
+	case cmp::ge:
+		eval_op(c, n, (T) v, sel, std::greater_equal<T>());
+		break;
+	case cmp::eq:
+		eval_op(c, n, (T) v, sel, std::equal_to<T>());
+		break;
+	case cmp::ne:
+		eval_op(c, n, (T) v, sel, std::not_equal_to<T>());
+		break;
+	}
+}
+
+class scanner {
+public:
+	scanner(const query &q, unsigned threads) : q_(q), queues_(threads),
+		parts_(threads), pending_(0) {}
+
+	void run(const std::vector<std::unique_ptr<capture_file>> &files);
+	scan_result result();
+
+private:
+	/* Predicates of a block: those of the query and its time bounds */
+	bool block_preds(const block_header &h, std::vector<predicate> &preds) const;
+	void split(const capture_file &f, unsigned self);
+	void scan_block(const block_view &b, partial &p);
+	void work(unsigned self);
+	bool next(unsigned self, task &t);
+
+	const query &q_;
+	std::vector<task_queue> queues_;
+	std::vector<partial> parts_;
+	std::atomic<size_t> pending_;  /* tasks queued or running */
+};
+
+bool scanner::block_preds(const block_header &h, std::vector<predicate> &preds) const
+{
+	preds = q_.where;
+	if (q_.since_ns != INT64_MIN && q_.since_ns > h.wall_base_ns)
+		preds.push_back({ COL_TSTAMP_NS, cmp::ge,
+				(uint64_t) (q_.since_ns - h.wall_base_ns) });
+	if (q_.until_ns != INT64_MAX) {
+		if (q_.until_ns < h.wall_base_ns)
+			return false;
+		preds.push_back({ COL_TSTAMP_NS, cmp::le,
+				(uint64_t) (q_.until_ns - h.wall_base_ns) });
+	}
+	for (const predicate &p : preds)
+		if (!zone_may_match(h.zones[p.col], p.op, p.value))
+			return false;
+	return true;
+}
+
+void scanner::split(const capture_file &f, unsigned self)
+{
+	partial &p = parts_[self];
+	task_queue &tq = queues_[self];
+	uint64_t offset = sizeof(capture_header), at;
+	block_view b;
+
+	p.stats.files++;
+	for (at = offset; f.block(offset, b); at = offset) {
+		p.stats.blocks++;
+		if (!block_preds(*b.hdr, p.preds)) {
+			p.stats.blocks_skipped++;
+			continue;
+		}
+		pending_.fetch_add(1, std::memory_order_relaxed);
+		std::lock_guard<std::mutex> g(tq.lock);
+		tq.tasks.push_back({ &f, at, false });
+	}
+}
+
+void scanner::scan_block(const block_view &b, partial &p)
+{
+	uint32_t n = b.hdr->rows;
+	size_t nsel = q_.select.size();
+
+	block_preds(*b.hdr, p.preds);
+	p.sel.assign(n, 1);
+	for (const predicate &pr : p.preds) {
+		const unsigned char *c = b.col[pr.col];
+
+		switch (columns[pr.col].width) {
+		case 1:
+			eval((const uint8_t *) c, n, pr.op, pr.value, p.sel.data());
+			break;
+		case 2:
+			eval((const uint16_t *) c, n, pr.op, pr.value, p.sel.data());
+			break;
+		case 4:
+			eval((const uint32_t *) c, n, pr.op, pr.value, p.sel.data());
+			break;
+		default:
+			eval((const uint64_t *) c, n, pr.op, pr.value, p.sel.data());
+			break;
+		}
+	}
+	p.rows.clear();
+	for (uint32_t i = 0; i < n; i++)
+		if (p.sel[i])
+			p.rows.push_back(i);
+	p.stats.rows_scanned += n;
+	p.stats.rows_matched += p.rows.size();
+
+	for (uint32_t i : p.rows) {
+		gkey key = gkey();
+		size_t g, base;
+
+		for (size_t k = 0; k < q_.group.size(); k++)
+			key[k] = b.value(q_.group[k].col, i) & q_.group[k].mask;
+		auto it = p.groups.find(key);
+		if (it == p.groups.end()) {
+			g = p.counts.size();
+			p.groups.emplace(key, g);
+			p.counts.push_back(0);
+			p.sums.resize(p.sums.size() + nsel, 0);
+			p.mins.resize(p.mins.size() + nsel, UINT64_MAX);
+			p.maxs.resize(p.maxs.size() + nsel, 0);
+		} else {
+			g = it->second;
+		}
+		p.counts[g]++;
+		base = g * nsel;
+		for (size_t a = 0; a < nsel; a++) {
+			uint64_t v;
+
+			if (q_.select[a].fn == agg_fn::count)
+				continue;
+			v = b.value(q_.select[a].col, i);
+			p.sums[base + a] += v;
+			if (v < p.mins[base + a])
+				p.mins[base + a] = v;
+			if (v > p.maxs[base + a])
+				p.maxs[base + a] = v;
+		}
+	}
+}
+
+/* Own tasks newest first, then the oldest task of another thread */
+bool scanner::next(unsigned self, task &t)
+{
+	{
+		task_queue &tq = queues_[self];
+		std::lock_guard<std::mutex> g(tq.lock);
+
+		if (!tq.tasks.empty()) {
+			t = tq.tasks.back();
+			tq.tasks.pop_back();
+			return true;
+		}
+	}
+	for (size_t i = 1; i < queues_.size(); i++) {
+		task_queue &tq = queues_[(self + i) % queues_.size()];
+		std::lock_guard<std::mutex> g(tq.lock);
+
+		if (!tq.tasks.empty()) {
+			t = tq.tasks.front();
+			tq.tasks.pop_front();
+			parts_[self].stats.steals++;
+			return true;
+		}
+	}
+	return false;
+}
+
+void scanner::work(unsigned self)
+{
+	partial &p = parts_[self];
+	task t;
+
+	for (;;) {
+		if (!next(self, t)) {
+			if (!pending_.load(std::memory_order_acquire))
+				break;
+			/* the last tasks are running and may still split files */
+			std::this_thread::yield();
+			continue;
+		}
+		if (t.whole_file) {
+			split(*t.file, self);
+		} else {
+			uint64_t offset = t.offset;
+			block_view b;
+
+			if (t.file->block(offset, b))
+				scan_block(b, p);
+		}
+		pending_.fetch_sub(1, std::memory_order_acq_rel);
+	}
+}
+
+void scanner::run(const std::vector<std::unique_ptr<capture_file>> &files)
+{
+	std::vector<std::thread> threads;
+
+	/* the files are dealt out, their blocks are then stolen as needed */
+	for (size_t i = 0; i < files.size(); i++) {
+		queues_[i % queues_.size()].tasks.push_back({ files[i].get(), 0, true });
+		pending_++;
+	}
+	for (unsigned i = 1; i < queues_.size(); i++)
+		threads.emplace_back([this, i] { work(i); });
+	work(0);
+	for (std::thread &t : threads)
+		t.join();
+}
+
+scan_result scanner::result()
+{
+	std::unordered_map<gkey, size_t, key_hash> index;
+	size_t nsel = q_.select.size();
+	partial all;
+	scan_result res;
+
+	for (partial &p : parts_) {
+		res.stats.files += p.stats.files;
+		res.stats.blocks += p.stats.blocks;
+		res.stats.blocks_skipped += p.stats.blocks_skipped;
+		res.stats.rows_scanned += p.stats.rows_scanned;
+		res.stats.rows_matched += p.stats.rows_matched;
+		res.stats.steals += p.stats.steals;
+		for (const auto &kv : p.groups) {
+			size_t src = kv.second, g;
+			auto it = index.find(kv.first);
+
+			if (it == index.end()) {
+				g = all.counts.size();
+				index.emplace(kv.first, g);
+				all.counts.push_back(0);
+				all.sums.resize(all.sums.size() + nsel, 0);
+				all.mins.resize(all.mins.size() + nsel, UINT64_MAX);
+				all.maxs.resize(all.maxs.size() + nsel, 0);
+			} else {
+				g = it->second;
+			}
+			all.counts[g] += p.counts[src];
+			for (size_t a = 0; a < nsel; a++) {
+				size_t d = g * nsel + a, s = src * nsel + a;
+
+				all.sums[d] += p.sums[s];
+				if (p.mins[s] < all.mins[d])
+					all.mins[d] = p.mins[s];
+				if (p.maxs[s] > all.maxs[d])
+					all.maxs[d] = p.maxs[s];
+			}
+		}
+	}
+
+	for (const auto &kv : index) {
+		size_t g = kv.second;
+		group_row row;
+
+		row.key = kv.first;
+		for (size_t a = 0; a < nsel; a++) {
+			size_t i = g * nsel + a;
+
+			switch (q_.select[a].fn) {
+			case agg_fn::count:
+				row.values.push_back(all.counts[g]);
+				break;
+			case agg_fn::sum:
+				row.values.push_back(all.sums[i]);
+				break;
+			case agg_fn::min:
+				row.values.push_back(all.mins[i]);
+				break;
+			case agg_fn::max:
+				row.values.push_back(all.maxs[i]);
+				break;
+			case agg_fn::avg:
+				row.values.push_back((double) all.sums[i] / all.counts[g]);
+				break;
+			}
+		}
+		res.rows.push_back(std::move(row));
+	}
+	return res;
+}
+
+scan_result scan(const std::vector<std::string> &paths, const query &q, unsigned threads)
+{
+	std::vector<std::unique_ptr<capture_file>> files;
+
+	if (q.group.size() > MAX_GROUP)
+		throw std::invalid_argument("too many group keys");
+	for (const predicate &p : q.where)
+		if (p.col >= COL_SCALARS)
+			throw std::invalid_argument("predicate on a column that is not a scalar");
+	for (const group_key &g : q.group)
+		if (g.col >= COL_SCALARS)
+			throw std::invalid_argument("group key is not a scalar");
+	for (const aggregate &a : q.select)
+		if (a.fn != agg_fn::count && a.col >= COL_SCALARS)
+			throw std::invalid_argument("aggregate of a column that is not a scalar");
+
+	for (const std::string &path : paths)
+		files.emplace_back(new capture_file(path));
+	scanner s(q, threads ? threads : 1);
+	s.run(files);
+	return s.result();
+}
+
+} /* namespace tcpprobe */
@@ -0,0 +1,307 @@
+/*
+ * libtcpprobe: shared memory ring of records, see tcpprobe/shm.hpp.
+ */
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <random>
+#include <system_error>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "tcpprobe/shm.hpp"
+
+namespace tcpprobe {
+
+static const uint64_t SLOT_BUSY = ~0ULL;
+
+static uint64_t monotonic_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t shm_len(uint64_t capacity)
+{
+	return sizeof(shm_header) + capacity * sizeof(shm_slot);
+}
+
+static inline const shm_slot *slots_of(const shm_header *hdr)
+{
+	return (const shm_slot *) (hdr + 1);
+}
+
+shm_publisher::shm_publisher(const std::string &name, uint64_t capacity)
+	: name_(name), hdr_(nullptr), slots_(nullptr), map_len_(0), mask_(0)
+{
+	void *map;
+	int fd;
+
+	if (capacity < 2 || (capacity & (capacity - 1)))
+		throw std::system_error(EINVAL, std::generic_category(),
+				"ring capacity must be a power of 2");
+	/* the subscribers of the previous ring keep their mapping until they reopen */
+	shm_unlink(name_.c_str());
+	fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), "shm_open " + name_);
+	map_len_ = shm_len(capacity);
+	if (ftruncate(fd, map_len_) < 0) {
+		int err = errno;
+
+		::close(fd);
+		shm_unlink(name_.c_str());
+		throw std::system_error(err, std::generic_category(), "ftruncate " + name_);
+	}
+	map = mmap(nullptr, map_len_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) {
+		int err = errno;
+
+		shm_unlink(name_.c_str());
+		throw std::system_error(err, std::generic_category(), "mmap " + name_);
+	}
+
+	/* ftruncate gave zeroed memory: every slot seq is 0, set them invalid */
+	hdr_ = new (map) shm_header();
+	slots_ = (shm_slot *) (hdr_ + 1);
+	mask_ = capacity - 1;
+	for (uint64_t i = 0; i < capacity; i++)
+		slots_[i].seq.store(SLOT_BUSY, std::memory_order_relaxed);
+	hdr_->magic = SHM_MAGIC;
+	hdr_->version = SHM_VERSION;
+	hdr_->record_size = sizeof(record);
+	hdr_->capacity = capacity;
+	hdr_->epoch = std::random_device()() ^ monotonic_ns();
+	hdr_->writer_pid = getpid();
+	hdr_->heartbeat_ns.store(monotonic_ns(), std::memory_order_relaxed);
+	hdr_->state.store(SHM_RUNNING, std::memory_order_release);
+}
+
+shm_publisher::~shm_publisher()
+{
+	close();
+	munmap(hdr_, map_len_);
+	shm_unlink(name_.c_str());
+}
+
+void shm_publisher::publish(const record *recs, size_t n)
+{
+	uint64_t head = hdr_->head.load(std::memory_order_relaxed);
+
+	for (size_t i = 0; i < n; i++, head++) {
+		shm_slot &slot = slots_[head & mask_];
+
+		/* seqlock: a subscriber copying the previous record of the slot sees BUSY */
+		slot.seq.store(SLOT_BUSY, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(&slot.rec, &recs[i], sizeof(record));
+		slot.seq.store(head, std::memory_order_release);
+	}
+	hdr_->head.store(head, std::memory_order_release);
+	hdr_->heartbeat_ns.store(monotonic_ns(), std::memory_order_relaxed);
+	hdr_->wake.fetch_add(1, std::memory_order_release);
+	syscall(SYS_futex, &hdr_->wake, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+void shm_publisher::set_upstream(uint64_t module_seq, uint64_t lost, bool restarted)
+{
+	hdr_->module_seq.store(module_seq, std::memory_order_relaxed);
+	if (lost)
+		hdr_->lost_upstream.fetch_add(lost, std::memory_order_relaxed);
+	if (restarted)
+		hdr_->restarts.fetch_add(1, std::memory_order_relaxed);
+}
+
+void shm_publisher::heartbeat()
+{
+	hdr_->heartbeat_ns.store(monotonic_ns(), std::memory_order_relaxed);
+}
+
+void shm_publisher::close()
+{
+	if (hdr_->state.exchange(SHM_CLOSED) == SHM_CLOSED)
+		return;
+	hdr_->wake.fetch_add(1, std::memory_order_release);
+	syscall(SYS_futex, &hdr_->wake, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+shm_subscriber::shm_subscriber(const std::string &name, start from)
+	: name_(name), hdr_(nullptr), slots_(nullptr), map_len_(0), mask_(0), ino_(0),
+	  cursor_(0)
+{
+	open(from);
+}
+
+shm_subscriber::~shm_subscriber()
+{
+	unmap();
+}
+
+void shm_subscriber::open(start from)
+{
+	struct stat st;
+	uint64_t head;
+	void *map;
+	int fd;
+
+	fd = shm_open(name_.c_str(), O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), "shm_open " + name_);
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(shm_header)) {
+		::close(fd);
+		throw std::system_error(EPROTO, std::generic_category(), name_ + " is not a ring");
+	}
+	map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+		throw std::system_error(errno, std::generic_category(), "mmap " + name_);
+	hdr_ = (const shm_header *) map;
+	map_len_ = st.st_size;
+	if (hdr_->magic != SHM_MAGIC || hdr_->version != SHM_VERSION ||
+		hdr_->record_size != sizeof(record) ||
+		map_len_ < shm_len(hdr_->capacity)) {
+		unmap();
+		throw std::system_error(EPROTO, std::generic_category(),
+				name_ + ": unknown ring version");
+	}
+	slots_ = slots_of(hdr_);
+	mask_ = hdr_->capacity - 1;
+	ino_ = st.st_ino;
+
+	head = hdr_->head.load(std::memory_order_acquire);
+	if (from == start::newest)
+		cursor_ = head;
+	else
+		cursor_ = head > hdr_->capacity ? head - hdr_->capacity : 0;
+}
+
+void shm_subscriber::unmap()
+{
+	if (hdr_)
+		munmap((void *) hdr_, map_len_);
+	hdr_ = nullptr;
+}
+
+/* A daemon killed before it could close the ring was restarted */
+bool shm_subscriber::replaced() const
+{
+	struct stat st;
+	int fd;
+	bool ret;
+
+	fd = shm_open(name_.c_str(), O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	ret = fstat(fd, &st) == 0 && st.st_ino != ino_;
+	::close(fd);
+	return ret;
+}
+
+uint64_t shm_subscriber::lag() const
+{
+	uint64_t head;
+
+	if (!hdr_)
+		return 0;
+	head = hdr_->head.load(std::memory_order_acquire);
+	return head > cursor_ ? head - cursor_ : 0;
+}
+
+size_t shm_subscriber::read(record *out, size_t max, int timeout_ms)
+{
+	uint64_t deadline = timeout_ms >= 0 ? monotonic_ns() + timeout_ms * 1000000ULL : 0;
+	size_t n = 0;
+
+	for (;;) {
+		struct timespec ts;
+		uint64_t head, now, wait;
+		uint32_t wake;
+
+		if (!hdr_) {
+			/* between two daemons: a new ring is read from its start */
+			try {
+				open(start::oldest);
+				stats_.reopens++;
+			} catch (const std::system_error &) {
+				if (timeout_ms >= 0 && monotonic_ns() >= deadline)
+					return 0;
+				ts = { 0, 100 * 1000000L };
+				nanosleep(&ts, nullptr);
+				continue;
+			}
+		}
+
+		wake = hdr_->wake.load(std::memory_order_acquire);
+		head = hdr_->head.load(std::memory_order_acquire);
+		if (head > cursor_ && head - cursor_ > hdr_->capacity) {
+			/* lapped: the oldest records are gone */
+			stats_.lost += head - hdr_->capacity - cursor_;
+			cursor_ = head - hdr_->capacity;
+		}
+		/* the cursor may be ahead of head after skipping overwritten slots */
+		while (cursor_ < head && n < max) {
+			const shm_slot &slot = slots_[cursor_ & mask_];
+			uint64_t seq = slot.seq.load(std::memory_order_acquire);
+			uint64_t oldest;
+
+			if (seq == cursor_) {
+				memcpy(&out[n], &slot.rec, sizeof(record));
+				std::atomic_thread_fence(std::memory_order_acquire);
+				seq = slot.seq.load(std::memory_order_relaxed);
+			}
+			if (seq != cursor_) {
+				/*
+				 * Overwritten under us. head is only stored after a whole
+				 * batch, the slot tells how far the daemon got: record seq
+				 * is there, and the ones up to seq - capacity are gone.
+				 * While the slot is written, only this record is known lost.
+				 */
+				oldest = cursor_ + 1;
+				if (seq != SLOT_BUSY && seq > cursor_ &&
+					seq - hdr_->capacity + 1 > oldest)
+					oldest = seq - hdr_->capacity + 1;
+				stats_.lost += oldest - cursor_;
+				cursor_ = oldest;
+				continue;
+			}
+			cursor_++;
+			n++;
+		}
+		if (n)
+			break;
+
+		if (hdr_->state.load(std::memory_order_acquire) == SHM_CLOSED) {
+			unmap();
+			continue;
+		}
+		/* sleep at most a second at a time to notice a replaced ring */
+		wait = 1000000000ULL;
+		if (timeout_ms >= 0) {
+			now = monotonic_ns();
+			if (now >= deadline)
+				return 0;
+			if (deadline - now < wait)
+				wait = deadline - now;
+		}
+		ts.tv_sec = wait / 1000000000ULL;
+		ts.tv_nsec = wait % 1000000000ULL;
+		/* sleeps unless a batch was published since wake was read */
+		if (syscall(SYS_futex, &hdr_->wake, FUTEX_WAIT, wake, &ts, nullptr, 0) < 0 &&
+			errno == ETIMEDOUT && replaced())
+			unmap();
+	}
+	stats_.records += n;
+	return n;
+}
+
+} /* namespace tcpprobe */
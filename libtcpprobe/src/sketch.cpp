@@ -0,0 +1,335 @@
+/*
+ * libtcpprobe: mergeable quantile sketches, see tcpprobe/sketch.hpp.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <system_error>
+
+#include "tcpprobe/sketch.hpp"
+
+namespace tcpprobe {
+
+static const char SKETCH_MAGIC[8] = { 't', 't', 'p', 's', 'k', '0', '0', '2' };
+
+const char *const metric_names[METRICS] = { "srtt", "cwnd", "goodput", "rto" };
+
+static const unsigned SUB = 1U << quantile_sketch::SUB_BITS;
+
+static uint32_t bucket_of(uint64_t v)
+{
+	unsigned e, shift;
+
+	if (v < 2 * SUB)
+		return v;
+	e = 63 - __builtin_clzll(v);
+	shift = e - quantile_sketch::SUB_BITS;
+	return shift * SUB + (v >> shift);
+}
+
+/* Middle of the values of bucket b */
+static uint64_t bucket_value(uint32_t b)
+{
+	unsigned shift;
+	uint64_t sub, low;
+
+	if (b < 2 * SUB)
+		return b;
+	shift = b / SUB - 1;
+	sub = b % SUB + SUB;
+	low = sub << shift;
+	return low + ((1ULL << shift) - 1) / 2;
+}
+
+void quantile_sketch::add(uint64_t v, uint64_t n)
+{
+	uint32_t b = bucket_of(v);
+	auto it = std::lower_bound(buckets_.begin(), buckets_.end(), b,
+			[](const std::pair<uint32_t, uint64_t> &e, uint32_t k) {
+				return e.first < k;
+			});
+
+	if (!n)
+		return;
+	if (it != buckets_.end() && it->first == b)
+		it->second += n;
+	else
+		buckets_.insert(it, std::make_pair(b, n));
+	count_ += n;
+	sum_ += v * n;
+	if (v < min_)
+		min_ = v;
+	if (v > max_)
+		max_ = v;
+}
+
+void quantile_sketch::merge(const quantile_sketch &o)
+{
+	std::vector<std::pair<uint32_t, uint64_t>> out;
+	size_t i = 0, j = 0;
+
+	if (!o.count_)
+		return;
+	out.reserve(buckets_.size() + o.buckets_.size());
+	while (i < buckets_.size() || j < o.buckets_.size()) {
+		if (j == o.buckets_.size() ||
+			(i < buckets_.size() && buckets_[i].first < o.buckets_[j].first)) {
+			out.push_back(buckets_[i++]);
+		} else if (i == buckets_.size() || o.buckets_[j].first < buckets_[i].first) {
+			out.push_back(o.buckets_[j++]);
+		} else {
+			out.push_back(std::make_pair(buckets_[i].first,
+					buckets_[i].second + o.buckets_[j].second));
+			i++, j++;
+		}
+	}
+	buckets_.swap(out);
+	count_ += o.count_;
+	sum_ += o.sum_;
+	min_ = std::min(min_, o.min_);
+	max_ = std::max(max_, o.max_);
+}
+
+uint64_t quantile_sketch::quantile(double q) const
+{
+	uint64_t rank, seen = 0;
+
+	if (!count_)
+		return 0;
+	/* nearest rank */
+	rank = (uint64_t) std::ceil(q * count_);
+	if (rank < 1)
+		rank = 1;
+	for (const auto &b : buckets_) {
+		seen += b.second;
+		if (seen >= rank)
+			return std::min(std::max(bucket_value(b.first), min_), max_);
+	}
+	return max_;
+}
+
+static void put_varint(std::string &out, uint64_t v)
+{
+	while (v >= 0x80) {
+		out.push_back((char) (v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((char) v);
+}
+
+static bool get_varint(const unsigned char *&p, const unsigned char *end, uint64_t &v)
+{
+	v = 0;
+	for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+		uint8_t c = *p++;
+
+		v |= (uint64_t) (c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+/* count min max sum, then the buckets: index delta and count */
+void quantile_sketch::serialize(std::string &out) const
+{
+	uint32_t prev = 0;
+
+	put_varint(out, count_);
+	if (!count_)
+		return;
+	put_varint(out, min_);
+	put_varint(out, max_);
+	put_varint(out, sum_);
+	put_varint(out, buckets_.size());
+	for (const auto &b : buckets_) {
+		put_varint(out, b.first - prev);
+		put_varint(out, b.second);
+		prev = b.first;
+	}
+}
+
+bool quantile_sketch::deserialize(const unsigned char *&p, const unsigned char *end)
+{
+	uint64_t n, idx = 0, count = 0;
+
+	*this = quantile_sketch();
+	if (!get_varint(p, end, count_))
+		return false;
+	if (!count_)
+		return true;
+	if (!get_varint(p, end, min_) || !get_varint(p, end, max_) ||
+		!get_varint(p, end, sum_) || !get_varint(p, end, n) ||
+		n > (uint64_t) (end - p) / 2)
+		return false;
+	buckets_.reserve(n);
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t delta, c;
+
+		if (!get_varint(p, end, delta) || !get_varint(p, end, c))
+			return false;
+		/* indexes are increasing and below the bucket of UINT64_MAX */
+		if ((i && !delta) || (idx += delta) > bucket_of(UINT64_MAX))
+			return false;
+		buckets_.push_back(std::make_pair((uint32_t) idx, c));
+		count += c;
+	}
+	return count == count_;
+}
+
+void sketch_table::merge(const sketch_table &o)
+{
+	for (const auto &kv : o.sketches_) {
+		metric_sketches &ms = sketches_[kv.first];
+
+		for (unsigned m = 0; m < METRICS; m++)
+			ms.m[m].merge(kv.second.m[m]);
+	}
+}
+
+/*
+ * The magic, then per key: dimension, saddr, daddr, sport, dport,
+ * socket_idf and a sketch per metric, all varints.
+ */
+void sketch_table::save(const std::string &path) const
+{
+	std::string out(SKETCH_MAGIC, sizeof(SKETCH_MAGIC));
+	std::string tmp = path + ".tmp";
+	FILE *f;
+
+	for (const auto &kv : sketches_) {
+		const sketch_key &k = kv.first;
+
+		put_varint(out, k.dim);
+		put_varint(out, k.flow.saddr);
+		put_varint(out, k.flow.daddr);
+		put_varint(out, k.flow.sport);
+		put_varint(out, k.flow.dport);
+		put_varint(out, k.flow.socket_idf);
+		for (unsigned m = 0; m < METRICS; m++)
+			kv.second.m[m].serialize(out);
+	}
+
+	/* readers of path never see a partial table */
+	f = fopen(tmp.c_str(), "wb");
+	if (!f)
+		throw std::system_error(errno, std::generic_category(), "open " + tmp);
+	if (fwrite(out.data(), 1, out.size(), f) != out.size() || fclose(f)) {
+		int err = errno;
+
+		remove(tmp.c_str());
+		throw std::system_error(err, std::generic_category(), "write " + tmp);
+	}
+	if (rename(tmp.c_str(), path.c_str()) < 0)
+		throw std::system_error(errno, std::generic_category(), "rename " + path);
+}
+
+void sketch_table::load(const std::string &path)
+{
+	std::vector<unsigned char> buf;
+	const unsigned char *p, *end;
+	FILE *f = fopen(path.c_str(), "rb");
+	sketch_table t;
+	size_t n;
+	auto corrupt = [&path, &n] {
+		return std::system_error(EPROTO, std::generic_category(),
+				path + ": corrupt sketch " + std::to_string(n));
+	};
+
+	if (!f)
+		throw std::system_error(errno, std::generic_category(), "open " + path);
+	buf.resize(1 << 16);
+	for (size_t len = 0;; buf.resize(buf.size() * 2)) {
+		len += fread(buf.data() + len, 1, buf.size() - len, f);
+		if (len < buf.size()) {
+			buf.resize(len);
+			break;
+		}
+	}
+	fclose(f);
+	if (buf.size() < sizeof(SKETCH_MAGIC) ||
+		!std::equal(SKETCH_MAGIC, SKETCH_MAGIC + sizeof(SKETCH_MAGIC), buf.begin()))
+		throw std::system_error(EPROTO, std::generic_category(), path + " is not a sketch table");
+
+	p = buf.data() + sizeof(SKETCH_MAGIC);
+	end = buf.data() + buf.size();
+	for (n = 0; p < end; n++) {
+		uint64_t v[6];
+		sketch_key k;
+		metric_sketches ms;
+
+		for (unsigned i = 0; i < 6; i++)
+			if (!get_varint(p, end, v[i]))
+				throw corrupt();
+		k.dim = (dimension) v[0];
+		k.flow.saddr = v[1];
+		k.flow.daddr = v[2];
+		k.flow.sport = v[3];
+		k.flow.dport = v[4];
+		k.flow.socket_idf = v[5];
+		for (unsigned m = 0; m < METRICS; m++)
+			if (!ms.m[m].deserialize(p, end))
+				throw corrupt();
+		metric_sketches &dst = t.sketches_[k];
+		for (unsigned m = 0; m < METRICS; m++)
+			dst.m[m].merge(ms.m[m]);
+	}
+	merge(t);
+}
+
+sketch_builder::sketch_builder(unsigned dims, size_t flows)
+	: dims_(dims),
+	  goodput_([this](const rollup &r) {
+		if (r.period_s != 1)
+			return;
+		each_key(r.key, [&r](metric_sketches &ms) {
+			ms.m[M_GOODPUT].add(r.goodput_bps);
+		});
+	  }, flows)
+{
+}
+
+template <typename F>
+void sketch_builder::each_key(const flow_key &k, F f)
+{
+	sketch_key sk = sketch_key();
+
+	if (dims_ & DIM_FLOW) {
+		sk.dim = DIM_FLOW;
+		sk.flow = k;
+		f(table_[sk]);
+	}
+	if (dims_ & DIM_PORT) {
+		sk = sketch_key();
+		sk.dim = DIM_PORT;
+		sk.flow.sport = k.sport;
+		f(table_[sk]);
+	}
+	if (dims_ & DIM_PEER) {
+		sk = sketch_key();
+		sk.dim = DIM_PEER;
+		sk.flow.daddr = k.daddr;
+		f(table_[sk]);
+	}
+}
+
+void sketch_builder::add(const record &r)
+{
+	if (!r.is_sample() || r.type == FLOWDEF)
+		return;
+	each_key(key_of(r), [&r](metric_sketches &ms) {
+		ms.m[M_SRTT].add(r.srtt >> 3);
+		ms.m[M_CWND].add(r.snd_cwnd);
+		if (r.is_end())
+			ms.m[M_RTO].add(r.rto_num);
+	});
+	goodput_.add(r);
+}
+
+void sketch_builder::finish()
+{
+	goodput_.flush();
+}
+
+} /* namespace tcpprobe */
@@ -0,0 +1,76 @@
+/*
+ * libtcpprobe internals: the transports a reader gets its batches from.
+ */
+#ifndef TCPPROBE_SOURCE_HPP
+#define TCPPROBE_SOURCE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tcpprobe/reader.hpp"
+
+namespace tcpprobe {
+
+/* Results of source::read() */
+enum {
+	SOURCE_GONE = -1,    /* the module went away, the source must be reopened */
+	SOURCE_TIMEOUT = 0,
+	SOURCE_BATCH = 1,
+};
+
+class source {
+public:
+	virtual ~source() {}
+	/*
+	 * Fill b with the next records. b.seq_ and b.next_seq_ are set, the
+	 * reader computes the rest.
+	 */
+	virtual int read(batch &b, int timeout_ms) = 0;
+};
+
+/* /proc/net/tcpprobe_data, one text line per record */
+class procfs_source : public source {
+public:
+	/* Opens path and moves to start_seq (-1: oldest record) */
+	procfs_source(const options &opt, int64_t start_seq, reader_stats &stats);
+	~procfs_source();
+	int read(batch &b, int timeout_ms);
+
+	/* Sequence number the module actually moved the reader to */
+	uint64_t position() const { return pos_; }
+
+	/* Parse one line (without the newline) into r, false if malformed */
+	static bool parse_line(const char *line, const char *end, bool compact, record &r);
+
+private:
+	int fd_;
+	uint64_t pos_;
+	bool compact_; /* flowid set: records name their flow by id */
+	std::vector<char> buf_;
+	size_t carry_; /* bytes of an incomplete line kept from the last read */
+	reader_stats &stats_;
+};
+
+/* Generic netlink multicast group of the module */
+class netlink_source : public source {
+public:
+	netlink_source(const options &opt, reader_stats &stats);
+	~netlink_source();
+	int read(batch &b, int timeout_ms);
+
+private:
+	bool resolve(const char *name, const char *group, uint16_t &family,
+			uint32_t &group_id);
+	void parse_batch(const void *attrs, size_t len, batch &b);
+
+	int fd_;
+	uint16_t family_;   /* id of the tcpprobe_plus family */
+	uint32_t seq_;      /* of the requests to the controller */
+	std::vector<char> buf_;
+	reader_stats &stats_;
+};
+
+} /* namespace tcpprobe */
+
+#endif /* TCPPROBE_SOURCE_HPP */
@@ -0,0 +1,319 @@
+#include <linux/kernel.h>
+#include <linux/kprobes.h>
+#include <linux/socket.h>
+#include <linux/tcp.h>
+#include <linux/slab.h>
+#include <linux/module.h>
+#include <linux/ktime.h>
+#include <linux/time.h>
+#include <linux/jiffies.h>
+#include <linux/list.h>
+#include <linux/version.h>
+#include <linux/rcupdate.h>
+
+#include <net/tcp.h>
+#include <net/inet_connection_sock.h>
+
+#include "tcp_probe_plus.h"
+
+/*
+ * Listener tracking: the accept queue of the listening sockets matching
+ * port is looked at when a connection is established (tcp_v4_syn_recv_sock)
+ * and when the application accepts it (inet_csk_accept). Listeners are
+ * keyed by local port, so the listeners of a port (SO_REUSEPORT, several
+ * addresses) are reported together every listen_interval_ms (LOG_LISTEN).
+ */
+#define TCP_LISTEN_HASH_SIZE 64
+/* Most listeners tracked at once */
+#define TCP_LISTEN_MAX 1024
+
+struct tcp_listener {
+	struct hlist_node hlist;
+	struct rcu_head rcu;
+	__be16 port;
+	spinlock_t lock; /* protects what follows */
+	s64 active_ns; /* last connection or accept */
+	/* since the last LOG_LISTEN */
+	u32 conns;
+	u32 overflows;
+	u32 accepts;
+	u32 backlog_max;
+	u64 backlog_sum;
+	u32 max_backlog;
+	u32 accepts_timed; /* accepts of tracked flows, in accept_sum_us */
+	u64 accept_sum_us;
+	u32 accept_max_us;
+};
+
+static struct hlist_head tcp_listen_hash[TCP_LISTEN_HASH_SIZE];
+static DEFINE_SPINLOCK(tcp_listen_lock); /* insertion and removal of listeners */
+static int tcp_listen_count;
+struct timer_list listen_timer;
+
+static inline struct hlist_head *tcp_listen_bucket(__be16 port)
+{
+	return &tcp_listen_hash[ntohs(port) & (TCP_LISTEN_HASH_SIZE - 1)];
+}
+
+/* Lockless lookup, call with rcu_read_lock held */
+static struct tcp_listener *tcp_listener_find(__be16 port)
+{
+	struct tcp_listener *l;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	struct hlist_node *pos;
+	hlist_for_each_entry_rcu(l, pos, tcp_listen_bucket(port), hlist) {
+#else
+	hlist_for_each_entry_rcu(l, tcp_listen_bucket(port), hlist) {
+#endif
+		if (l->port == port)
+			return l;
+	}
+	return NULL;
+}
+
+/* Find the listener of port, create it when it is not tracked yet */
+static struct tcp_listener *tcp_listener_get(__be16 port)
+{
+	struct tcp_listener *l = tcp_listener_find(port);
+
+	if (l)
+		return l;
+
+	spin_lock_bh(&tcp_listen_lock);
+	/* another CPU may have just created it */
+	l = tcp_listener_find(port);
+	if (!l && tcp_listen_count < TCP_LISTEN_MAX) {
+		l = kzalloc(sizeof(*l), GFP_ATOMIC);
+		if (l) {
+			l->port = port;
+			spin_lock_init(&l->lock);
+			hlist_add_head_rcu(&l->hlist, tcp_listen_bucket(port));
+			tcp_listen_count++;
+		}
+	}
+	spin_unlock_bh(&tcp_listen_lock);
+	return l;
+}
+
+/*
+ * A connection is established on the listener sk: account the depth of
+ * its accept queue, and an overflow when the queue is full (the connection
+ * is then dropped by tcp_v4_syn_recv_sock()).
+ */
+void tcp_listen_syn_recv(const struct tcpprobe_config *cfg, struct sock *sk, ktime_t tstamp)
+{
+	struct tcp_listener *l;
+	u32 backlog = sk->sk_ack_backlog;
+
+	if (cfg->listen_interval_ms <= 0)
+		return;
+
+	rcu_read_lock();
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,32)
+	l = tcp_listener_get(inet_sk(sk)->inet_sport);
+#else
+	l = tcp_listener_get(inet_sk(sk)->sport);
+#endif
+	if (l) {
+		spin_lock_bh(&l->lock);
+		l->conns++;
+		if (sk_acceptq_is_full(sk))
+			l->overflows++;
+		l->backlog_sum += backlog;
+		l->backlog_max = max(l->backlog_max, backlog);
+		l->max_backlog = sk->sk_max_ack_backlog;
+		l->active_ns = ktime_to_ns(tstamp);
+		spin_unlock_bh(&l->lock);
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * Return probe of inet_csk_accept(): the time from the establishment of
+ * the accepted connection, when its flow is tracked, to its accept().
+ * The accepting process is also the owner of the flow.
+ */
+int kret_inet_csk_accept(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct sock *child = (struct sock *) regs_return_value(regs);
+	const struct inet_sock *inet;
+	struct tcp_tuple tuple;
+	struct tcp_hash_flow *tcp_flow;
+	struct tcp_listener *l;
+	const struct tcpprobe_config *cfg;
+	s64 setup_ns = 0;
+	ktime_t tstamp;
+
+	if (IS_ERR_OR_NULL(child) || child->sk_family != AF_INET || child->sk_protocol != IPPROTO_TCP)
+		return 0;
+
+	inet = inet_sk(child);
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,32)
+	tuple.saddr = inet->inet_saddr;
+	tuple.daddr = inet->inet_daddr;
+	tuple.sport = inet->inet_sport;
+	tuple.dport = inet->inet_dport;
+#else
+	tuple.saddr = inet->saddr;
+	tuple.daddr = inet->daddr;
+	tuple.sport = inet->sport;
+	tuple.dport = inet->dport;
+#endif
+	/* one configuration for the whole call, see config.c */
+	rcu_read_lock();
+	cfg = rcu_dereference(tcpprobe_cfg);
+	if (cfg->port != 0 && ntohs(tuple.sport) != cfg->port) {
+		rcu_read_unlock();
+		return 0;
+	}
+	tstamp = ktime_get();
+
+	tcp_flow = tcp_flow_find(&tuple, hash_tcp_flow(&tuple));
+	if (tcp_flow) {
+		tcp_flow_set_owner(tcp_flow);
+		setup_ns = ACCESS_ONCE(tcp_flow->setup_ns);
+	}
+	l = cfg->listen_interval_ms > 0 ? tcp_listener_get(tuple.sport) : NULL;
+	if (l) {
+		spin_lock_bh(&l->lock);
+		l->accepts++;
+		if (setup_ns) {
+			u32 wait_us = div_s64(ktime_to_ns(tstamp) - setup_ns, NSEC_PER_USEC);
+
+			l->accepts_timed++;
+			l->accept_sum_us += wait_us;
+			l->accept_max_us = max(l->accept_max_us, wait_us);
+		}
+		l->active_ns = ktime_to_ns(tstamp);
+		spin_unlock_bh(&l->lock);
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+/*
+ * Write the aggregates of the listener (LOG_LISTEN) and start a new
+ * interval. Returns 1 if a record was written.
+ * Assumes that the listener lock has been taken.
+ */
+static int write_listener(const struct tcpprobe_config *cfg, struct tcp_listener *l,
+		ktime_t tstamp)
+{
+	int written = 0;
+
+	spin_lock(&tcp_probe.lock);
+	/* If log fills, just silently drop */
+	if (tcp_probe_avail() > 0) {
+		struct tcp_log *p = tcp_probe_slot(tcp_probe.head);
+
+		memset(p, 0, offsetof(struct tcp_log, user_agent));
+		p->type = LOG_LISTEN;
+		p->tstamp = tstamp;
+		p->sport = l->port;
+		p->listen.port = ntohs(l->port);
+		p->listen.conns = l->conns;
+		p->listen.overflows = l->overflows;
+		p->listen.accepts = l->accepts;
+		p->listen.backlog_max = l->backlog_max;
+		p->listen.backlog_avg = l->conns ? div_u64(l->backlog_sum, l->conns) : 0;
+		p->listen.max_backlog = l->max_backlog;
+		/* only the accepts of tracked flows are timed */
+		p->listen.accept_avg_us = l->accepts_timed ?
+			div_u64(l->accept_sum_us, l->accepts_timed) : 0;
+		p->listen.accept_max_us = l->accept_max_us;
+		tcp_probe.head++;
+		tcpprobe_commit(cfg);
+		written = 1;
+	} else {
+		TCPPROBE_STAT_INC(ack_drop_ring_full);
+	}
+	spin_unlock(&tcp_probe.lock);
+
+	l->conns = 0;
+	l->overflows = 0;
+	l->accepts = 0;
+	l->backlog_max = 0;
+	l->backlog_sum = 0;
+	l->accepts_timed = 0;
+	l->accept_sum_us = 0;
+	l->accept_max_us = 0;
+	return written;
+}
+
+static void tcp_listener_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct tcp_listener, rcu));
+}
+
+/*
+ * Report the listeners with activity in the interval and forget the ones
+ * idle for purgetime.
+ */
+void listen_timer_run(unsigned long dummy)
+{
+	const struct tcpprobe_config *cfg;
+	ktime_t tstamp = ktime_get();
+	s64 now = ktime_to_ns(tstamp);
+	struct tcp_listener *l;
+	struct hlist_node *tmp;
+	int i, written = 0;
+
+	/* one configuration for the whole run, see config.c */
+	rcu_read_lock();
+	cfg = rcu_dereference(tcpprobe_cfg);
+	spin_lock(&tcp_listen_lock);
+	for (i = 0; i < TCP_LISTEN_HASH_SIZE; i++) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+		struct hlist_node *pos;
+		hlist_for_each_entry_safe(l, pos, tmp, &tcp_listen_hash[i], hlist) {
+#else
+		hlist_for_each_entry_safe(l, tmp, &tcp_listen_hash[i], hlist) {
+#endif
+			spin_lock(&l->lock);
+			if (l->conns || l->accepts)
+				written += write_listener(cfg, l, tstamp);
+			spin_unlock(&l->lock);
+			if (now - l->active_ns >= (s64) cfg->purgetime * NSEC_PER_SEC) {
+				hlist_del_rcu(&l->hlist);
+				tcp_listen_count--;
+				call_rcu(&l->rcu, tcp_listener_free_rcu);
+			}
+		}
+	}
+	spin_unlock(&tcp_listen_lock);
+	if (written)
+		wake_up(&tcp_probe.wait);
+	mod_timer(&listen_timer, jiffies + listen_timer_interval(cfg));
+	rcu_read_unlock();
+}
+
+/* Report every listen_interval_ms, check every second when it is off */
+unsigned long listen_timer_interval(const struct tcpprobe_config *cfg)
+{
+	int ms = cfg->listen_interval_ms;
+
+	return ms > 0 ? msecs_to_jiffies(ms) : HZ;
+}
+
+/* Forget every listener, at unload once the probes and the timer are gone */
+void tcp_listen_free_all(void)
+{
+	struct tcp_listener *l;
+	struct hlist_node *tmp;
+	int i;
+
+	spin_lock_bh(&tcp_listen_lock);
+	for (i = 0; i < TCP_LISTEN_HASH_SIZE; i++) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+		struct hlist_node *pos;
+		hlist_for_each_entry_safe(l, pos, tmp, &tcp_listen_hash[i], hlist) {
+#else
+		hlist_for_each_entry_safe(l, tmp, &tcp_listen_hash[i], hlist) {
+#endif
+			hlist_del_rcu(&l->hlist);
+			call_rcu(&l->rcu, tcp_listener_free_rcu);
+		}
+	}
+	tcp_listen_count = 0;
+	spin_unlock_bh(&tcp_listen_lock);
+}
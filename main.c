@@ -51,12 +51,38 @@ static struct jprobe tcp_jprobe_rto_timeout = {
 	},
 	.entry = (kprobe_opcode_t *) jtcp_retransmit_timer,
 };
+/* every retransmission goes through __tcp_retransmit_skb(), tail loss probes included */
+static struct jprobe tcp_jprobe_retransmit = {
+	.kp = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
+		.symbol_name = "__tcp_retransmit_skb",
+#else
+		.symbol_name = "tcp_retransmit_skb",
+#endif
+	},
+	.entry = (kprobe_opcode_t *) jtcp_retransmit_skb,
+};
+static struct jprobe tcp_jprobe_set_state = {
+	.kp = {
+		.symbol_name = "tcp_set_state",
+	},
+	.entry = (kprobe_opcode_t *) jtcp_set_state,
+};
 static struct jprobe tcp_jprobe_syn_recv = {
 	.kp = {
 		.symbol_name = "tcp_v4_syn_recv_sock",
 	},
 	.entry = (kprobe_opcode_t *) jtcp_v4_syn_recv_sock,
 };
+/* return probe: the accepted socket is the return value */
+static struct kretprobe tcp_kretprobe_accept = {
+	.kp = {
+		.symbol_name = "inet_csk_accept",
+	},
+	.handler = kret_inet_csk_accept,
+	/* blocking accept() calls hold an instance while they sleep */
+	.maxactive = 256,
+};
 static struct jprobe tcp_jprobe_test= {
 	.kp = {
 		.symbol_name	= "tcp_rcv_established",
@@ -65,23 +91,134 @@ static struct jprobe tcp_jprobe_test= {
 };
 
 
-static struct hlist_head * alloc_hashtable(int size)
+/* Largest chunk of a table, what the page allocator gives at once */
+#define TCPPROBE_CHUNK_MAX (PAGE_SIZE << (MAX_ORDER - 1))
+
+static size_t tcpprobe_chunk_size(const struct tcpprobe_table *t, unsigned int i)
+{
+	unsigned long first = (unsigned long) i << t->shift;
+
+	return min(t->entries - first, 1UL << t->shift) * t->entry_size;
+}
+
+/*
+ * alloc_pages_exact_nid() is not exported to modules: take the order
+ * around size on the node and give back the pages past size, like it does.
+ * The chunk is freed with free_pages_exact().
+ */
+static void *tcpprobe_alloc_chunk(int node, size_t size)
+{
+	unsigned int order = get_order(size);
+	struct page *page;
+	unsigned long i;
+
+	page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY,
+			order);
+	if (!page) {
+		return NULL;
+	}
+	split_page(page, order);
+	for (i = PAGE_ALIGN(size) >> PAGE_SHIFT; i < (1UL << order); i++) {
+		__free_page(page + i);
+	}
+	return page_address(page);
+}
+
+static void tcpprobe_free_chunks(struct tcpprobe_table *t)
 {
-	struct hlist_head *hash;
-	hash = vmalloc(sizeof(struct hlist_head) * size);
-	if (hash) {
-		int i;
-		for (i = 0; i < size; i++) {
-			INIT_HLIST_HEAD(&hash[i]);
+	unsigned int i;
+
+	for (i = 0; i < t->nr_chunks; i++) {
+		if (!t->chunks[i]) {
+			continue;
 		}
-	} else {
-		pr_err("Unable to vmalloc hash table size = %d\n", size);
+		if (is_vmalloc_addr(t->chunks[i])) {
+			vfree(t->chunks[i]);
+		} else {
+			free_pages_exact(t->chunks[i], tcpprobe_chunk_size(t, i));
+		}
+		t->chunks[i] = NULL;
 	}
-	return hash;
+}
+
+/*
+ * Allocate a large zeroed table of entries on the given node.
+ * The table is split in chunks of up to TCPPROBE_CHUNK_MAX bytes from the
+ * page allocator: they are in the kernel linear mapping, which is mapped with
+ * huge pages, so walking the table does not thrash the TLB like 4K vmalloc
+ * pages do, however big the table is. A full chunk holds a power of 2 of
+ * entries, so an entry is found with a shift and a mask, and the pages past
+ * the end of a chunk are given back. vmalloc is only the fallback when the
+ * node is out of contiguous memory.
+ */
+static int tcpprobe_alloc_table(struct tcpprobe_table *t, unsigned long entries,
+		size_t entry_size, int node, const char *what)
+{
+	unsigned long per_chunk = rounddown_pow_of_two(TCPPROBE_CHUNK_MAX / entry_size);
+	unsigned int i;
+
+	t->entry_size = entry_size;
+	t->entries = entries;
+	t->shift = ilog2(per_chunk);
+	t->nr_chunks = DIV_ROUND_UP(entries, per_chunk);
+	t->chunks = kzalloc_node(t->nr_chunks * sizeof(*t->chunks), GFP_KERNEL, node);
+	if (!t->chunks) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < t->nr_chunks; i++) {
+		t->chunks[i] = tcpprobe_alloc_chunk(node, tcpprobe_chunk_size(t, i));
+		if (!t->chunks[i]) {
+			break;
+		}
+	}
+	if (i == t->nr_chunks) {
+		pr_info("%s: %lu bytes in linear mapping (node %d, chunks %u)\n",
+			what, entries * entry_size, node, t->nr_chunks);
+		return 0;
+	}
+
+	/* a single chunk of vmalloc space, as large as the table */
+	tcpprobe_free_chunks(t);
+	t->nr_chunks = 1;
+	t->shift = ilog2(roundup_pow_of_two(entries));
+	t->chunks[0] = vzalloc_node(entries * entry_size, node);
+	if (!t->chunks[0]) {
+		kfree(t->chunks);
+		t->chunks = NULL;
+		return -ENOMEM;
+	}
+	pr_info("%s: %lu bytes in vmalloc space (node %d)\n", what, entries * entry_size, node);
+	return 0;
+}
+
+static void tcpprobe_free_table(struct tcpprobe_table *t)
+{
+	if (!t->chunks) {
+		return;
+	}
+	tcpprobe_free_chunks(t);
+	kfree(t->chunks);
+	t->chunks = NULL;
+}
+
+static int alloc_hashtable(int size)
+{
+	int i;
+
+	if (tcpprobe_alloc_table(&tcp_hash, size, sizeof(struct hlist_head), numa_node,
+			"Hashtable")) {
+		pr_err("Unable to allocate hash table size = %d\n", size);
+		return -ENOMEM;
+	}
+	for (i = 0; i < size; i++) {
+		INIT_HLIST_HEAD(tcp_hash_bucket(i));
+	}
+	return 0;
 }
 
 static __init int tcpprobe_init(void)
 {
+	const struct tcpprobe_config *cfg;
 	int ret = -ENOMEM;
 	struct proc_dir_entry *proc_stat;
 	struct timespec ct_ts;
@@ -89,12 +226,69 @@ static __init int tcpprobe_init(void)
 
 	init_waitqueue_head(&tcp_probe.wait);
 	spin_lock_init(&tcp_probe.lock);
+	atomic_set(&tcp_probe.readers, 0);
+	tcp_probe.closing = 0;
+	init_waitqueue_head(&tcp_capture.wait);
+	spin_lock_init(&tcp_capture.lock);
+	tcpprobe_reset_start();
 
 	if (bufsize == 0) {
 		pr_err("Bufsize is 0\n");
 		return -EINVAL;
 	}
 
+	if (numa_node != NUMA_NO_NODE &&
+		(numa_node < 0 || numa_node >= MAX_NUMNODES || !node_online(numa_node))) {
+		pr_err("NUMA node %d is not online\n", numa_node);
+		return -EINVAL;
+	}
+
+	/* before the budget, which counts the flows at their slab size */
+	tcp_flow_cachep = kmem_cache_create("tcp_flow",
+	sizeof(struct tcp_hash_flow), 0, 0, NULL
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 23)
+		, NULL
+#endif
+	);
+	if (!tcp_flow_cachep) {
+		pr_err("Unable to create tcp_flow slab cache\n");
+		goto err;
+	}
+
+	/* Size the ring and the hash table from the memory budget */
+	if (mem_limit_mb > 0) {
+		unsigned long limit = (unsigned long) mem_limit_mb << 20;
+		unsigned long capture = capture_bufsize ?
+			roundup_pow_of_two(capture_bufsize) * sizeof(struct tcp_log) : 0;
+		unsigned long ring_max;
+
+		/* the capture ring is preallocated whole, the rest is shared */
+		if (capture >= limit) {
+			pr_err("capture_bufsize %u does not fit in mem_limit_mb %d\n",
+				capture_bufsize, mem_limit_mb);
+			ret = -EINVAL;
+			goto err_free_cache;
+		}
+		limit -= capture;
+		/* the ring gets at most a quarter of the budget */
+		ring_max = limit / 4 / sizeof(struct tcp_log);
+		if (ring_max < 64) {
+			pr_err("mem_limit_mb %d is too small\n", mem_limit_mb);
+			ret = -EINVAL;
+			goto err_free_cache;
+		}
+		if (roundup_pow_of_two(bufsize) > ring_max) {
+			bufsize = rounddown_pow_of_two(ring_max);
+		}
+		/* one bucket per flow fitting in the rest of the budget */
+		if (!hashsize) {
+			hashsize = (limit - roundup_pow_of_two(bufsize) * sizeof(struct tcp_log))
+				/ (tcp_flow_size() + sizeof(struct hlist_head));
+		}
+		pr_info("Memory budget %d MB: bufsize %u hashsize %d\n",
+			mem_limit_mb, roundup_pow_of_two(bufsize), hashsize);
+	}
+
 	/* Hashtable initialization */
 	get_random_bytes(&tcp_hash_rnd, 4);
 
@@ -112,24 +306,36 @@ static __init int tcpprobe_init(void)
 	pr_info("Hashtable initialized with %u buckets\n", hashsize);
 	
 	tcp_hash_size = hashsize;
-	tcp_hash = alloc_hashtable(tcp_hash_size);
-	if (!tcp_hash) {
+	if (alloc_hashtable(tcp_hash_size)) {
 		pr_err("Unable to create tcp hashtable\n");
-		goto err;
+		goto err_free_cache;
 	}
-	tcp_flow_cachep = kmem_cache_create("tcp_flow",
-	sizeof(struct tcp_hash_flow), 0, 0, NULL
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 23)
-		, NULL
-#endif
-	);
-	if (!tcp_flow_cachep) {
-		pr_err("Unable to create tcp_flow slab cache\n");
+
+	/* before the shrinker, the timers and the hooks, they read the published configuration */
+	if (tcpprobe_config_init()) {
+		pr_err("Unable to publish the configuration.\n");
 		goto err_free_hash;
 	}
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,12,0)
+	register_shrinker(&tcp_flow_shrinker);
+	ret = 0;
+#else
+	ret = register_shrinker(&tcp_flow_shrinker);
+#endif
+	if (ret) {
+		pr_err("Unable to register tcp_flow shrinker\n");
+		goto err_config;
+	}
+	ret = -ENOMEM;
+	rcu_read_lock();
+	cfg = rcu_dereference(tcpprobe_cfg);
 	setup_timer(&purge_timer, purge_timer_run, 0);
-	mod_timer(&purge_timer, jiffies + (HZ * purgetime));
-
+	mod_timer(&purge_timer, jiffies + (HZ * cfg->purgetime));
+	setup_timer(&stall_timer, stall_timer_run, 0);
+	mod_timer(&stall_timer, jiffies + stall_timer_interval(cfg));
+	setup_timer(&listen_timer, listen_timer_run, 0);
+	mod_timer(&listen_timer, jiffies + listen_timer_interval(cfg));
+	rcu_read_unlock();
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
 	tcpprobe_sysctl_header = register_sysctl_table(tcpprobe_net_table
@@ -162,11 +368,23 @@ static __init int tcpprobe_init(void)
 
 
 	bufsize = roundup_pow_of_two(bufsize);
-	tcp_probe.log = kcalloc(bufsize, sizeof(struct tcp_log), GFP_KERNEL);
-	if (!tcp_probe.log) {
+	if (tcpprobe_alloc_table(&tcp_probe.log, bufsize, sizeof(struct tcp_log), numa_node,
+			"Ring")) {
 		pr_err("Unable to allocate tcp_log memory.\n");
 		goto err_free_proc_stat;
 	}
+	tcp_probe.size = bufsize;
+
+	/* preallocated, a capture never allocates */
+	if (capture_bufsize) {
+		capture_bufsize = roundup_pow_of_two(capture_bufsize);
+		if (tcpprobe_alloc_table(&tcp_capture.log, capture_bufsize,
+				sizeof(struct tcp_log), numa_node, "Capture ring")) {
+			pr_err("Unable to allocate the capture ring.\n");
+			goto err_free_proc_stat;
+		}
+		tcp_capture.size = capture_bufsize;
+	}
 
 	//proc_net_fops_create has been deprecated by proc_create since 3.10
 	if (!proc_create(PROC_TCPPROBE, S_IRUSR, INIT_NET(proc_net), &tcpprobe_fops)) {
@@ -174,16 +392,36 @@ static __init int tcpprobe_init(void)
 		goto err_free_proc_stat;
 	}
 
+	if (!proc_create(PROC_TCPPROBE_FLOWS, S_IRUSR, INIT_NET(proc_net), &tcpprobe_flows_fops)) {
+		pr_err("Unable to create /proc/net/%s\n", PROC_TCPPROBE_FLOWS);
+		goto err_free_proc_data;
+	}
+
+	if (!proc_create(PROC_TCPPROBE_CAPTURE, S_IRUSR, INIT_NET(proc_net), &tcpprobe_capture_fops)) {
+		pr_err("Unable to create /proc/net/%s\n", PROC_TCPPROBE_CAPTURE);
+		goto err_free_proc_flows;
+	}
+
+	if (!proc_create(PROC_TCPPROBE_CTL, S_IRUSR | S_IWUSR, INIT_NET(proc_net), &tcpprobe_ctl_fops)) {
+		pr_err("Unable to create /proc/net/%s\n", PROC_TCPPROBE_CTL);
+		goto err_free_proc_capture;
+	}
+
+	ret = tcpprobe_nl_init();
+	if (ret) {
+		goto err_free_proc_ctl;
+	}
+
 	ret = register_jprobe(&tcp_jprobe_recv);
 	if (ret) {
 		pr_err("Unable to register jprobe on tcp_v4_do_rcv.\n");
-		goto err1;
+		goto err_nl;
 	}
 
 	ret = register_jprobe(&tcp_jprobe_send);
 	if (ret) {
 		pr_err("Unable to register jprobe on tcp_transmit_skb.\n");
-		goto err1;
+		goto err_nl;
 	}
 
 	ret = register_jprobe(&tcp_jprobe_rto_timeout);
@@ -198,6 +436,24 @@ static __init int tcpprobe_init(void)
 		goto err_tcpdone;
 	}
 
+	ret = register_jprobe(&tcp_jprobe_retransmit);
+	if (ret) {
+		pr_err("Unable to register jprobe on %s.\n", tcp_jprobe_retransmit.kp.symbol_name);
+		goto err_tcpdone;
+	}
+
+	ret = register_jprobe(&tcp_jprobe_set_state);
+	if (ret) {
+		pr_err("Unable to register jprobe on tcp_set_state.\n");
+		goto err_tcpdone;
+	}
+
+	ret = register_kretprobe(&tcp_kretprobe_accept);
+	if (ret) {
+		pr_err("Unable to register kretprobe on inet_csk_accept.\n");
+		goto err_tcpdone;
+	}
+
 	/*ret = register_jprobe(&tcp_jprobe_test);
 	if (ret) {
 		pr_err("Unable to register jprobe on tcp_v4_syn_recv_sock.\n");
@@ -239,8 +495,19 @@ err_tcpdone:
 	unregister_jprobe(&tcp_jprobe_send);
 	unregister_jprobe(&tcp_jprobe_rto_timeout);
 	unregister_jprobe(&tcp_jprobe_syn_recv);
+	unregister_jprobe(&tcp_jprobe_retransmit);
+	unregister_jprobe(&tcp_jprobe_set_state);
+	unregister_kretprobe(&tcp_kretprobe_accept);
 	/*unregister_jprobe(&tcp_jprobe_test);*/
-err1:
+err_nl:
+	tcpprobe_nl_exit();
+err_free_proc_ctl:
+	remove_proc_entry(PROC_TCPPROBE_CTL, INIT_NET(proc_net));
+err_free_proc_capture:
+	remove_proc_entry(PROC_TCPPROBE_CAPTURE, INIT_NET(proc_net));
+err_free_proc_flows:
+	remove_proc_entry(PROC_TCPPROBE_FLOWS, INIT_NET(proc_net));
+err_free_proc_data:
 	remove_proc_entry(PROC_TCPPROBE, INIT_NET(proc_net));
 err_free_proc_stat:
 	remove_proc_entry(PROC_STAT_TCPPROBE, INIT_NET(proc_net_stat));
@@ -248,10 +515,19 @@ err_free_sysctl:
 	unregister_sysctl_table(tcpprobe_sysctl_header);
 err0:
 	del_timer_sync(&purge_timer);
-	kfree(tcp_probe.log);
-	kmem_cache_destroy(tcp_flow_cachep);
+	del_timer_sync(&stall_timer);
+	del_timer_sync(&listen_timer);
+	tcp_listen_free_all();
+	tcpprobe_free_table(&tcp_probe.log);
+	tcpprobe_free_table(&tcp_capture.log);
+	unregister_shrinker(&tcp_flow_shrinker);
+err_config:
+	tcpprobe_config_exit();
+	rcu_barrier();
 err_free_hash:
-	vfree(tcp_hash);
+	tcpprobe_free_table(&tcp_hash);
+err_free_cache:
+	kmem_cache_destroy(tcp_flow_cachep);
 err:
 	return ret;
 }
@@ -266,25 +542,41 @@ static __exit void tcpprobe_exit(void)
 	ct_ts.tv_sec += 28800;
 	rtc_time_to_tm((unsigned long) ct_ts.tv_sec, &ct_tm);
 
-	remove_proc_entry(PROC_TCPPROBE, INIT_NET(proc_net));
-	remove_proc_entry(PROC_STAT_TCPPROBE, INIT_NET(proc_net_stat));
 	unregister_sysctl_table(tcpprobe_sysctl_header);
 	unregister_jprobe(&tcp_jprobe_recv);
 	unregister_jprobe(&tcp_jprobe_send);
 	unregister_jprobe(&tcp_jprobe_rto_timeout);
 	unregister_jprobe(&tcp_jprobe_syn_recv);
+	unregister_jprobe(&tcp_jprobe_retransmit);
+	unregister_jprobe(&tcp_jprobe_set_state);
+	unregister_kretprobe(&tcp_kretprobe_accept);
 	/*unregister_jprobe(&tcp_jprobe_test);*/
 
 #if LINUX_VERSION_CODE >=  KERNEL_VERSION(2,6,22)	
 	unregister_jprobe(&tcp_jprobe_done);
 #endif	
 
-	kfree(tcp_probe.log);
 	del_timer_sync(&purge_timer);
-	/* tcp flow table memory */
+	del_timer_sync(&stall_timer);
+	del_timer_sync(&listen_timer);
+	unregister_shrinker(&tcp_flow_shrinker);
+	/* tcp flow table memory, the reader drains the purge records */
 	purge_all_flows();
+	tcp_listen_free_all();
+	tcpprobe_config_exit();
+	/* flows, listeners and configurations are freed after a grace period */
+	rcu_barrier();
+	remove_proc_entry(PROC_TCPPROBE, INIT_NET(proc_net));
+	remove_proc_entry(PROC_TCPPROBE_FLOWS, INIT_NET(proc_net));
+	remove_proc_entry(PROC_TCPPROBE_CAPTURE, INIT_NET(proc_net));
+	remove_proc_entry(PROC_TCPPROBE_CTL, INIT_NET(proc_net));
+	remove_proc_entry(PROC_STAT_TCPPROBE, INIT_NET(proc_net_stat));
+	/* no more records after this point, stop the exporter before the ring goes */
+	tcpprobe_nl_exit();
+	tcpprobe_free_table(&tcp_probe.log);
+	tcpprobe_free_table(&tcp_capture.log);
 	kmem_cache_destroy(tcp_flow_cachep);
-	vfree(tcp_hash);
+	tcpprobe_free_table(&tcp_hash);
 	pr_info("(%04d-%02d-%02d %02d:%02d:%02d) TCP probe plus unregistered.\n",
 		ct_tm.tm_year + 1900, ct_tm.tm_mon + 1, ct_tm.tm_mday,
 		ct_tm.tm_hour, ct_tm.tm_min, ct_tm.tm_sec);
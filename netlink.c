@@ -0,0 +1,518 @@
+/*
+ * Generic netlink export channel.
+ *
+ * When the "export" sysctl is set to TCPPROBE_EXPORT_NETLINK, the ring is
+ * drained by a delayed work item instead of /proc/net/tcpprobe_data and the
+ * records are multicast in batches to every socket subscribed to the
+ * TCPPROBE_GENL_MCGRP group. Each subscriber socket has its own receive
+ * buffer; a subscriber that does not keep up gets ENOBUFS on its socket and
+ * the overrun is accounted in TCPPROBE_A_DROP_NETLINK of the next batches.
+ *
+ * The same family accepts TCPPROBE_CMD_GET_CONFIG and TCPPROBE_CMD_SET_CONFIG.
+ */
+#include <linux/kernel.h>
+#include <linux/kprobes.h>
+#include <linux/socket.h>
+#include <linux/tcp.h>
+#include <linux/slab.h>
+#include <linux/proc_fs.h>
+#include <linux/module.h>
+#include <linux/ktime.h>
+#include <linux/time.h>
+#include <linux/jiffies.h>
+#include <linux/list.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+#include <net/tcp.h>
+#include <net/genetlink.h>
+
+#include "tcp_probe_plus.h"
+
+/* Maximum delay between a record being written and being multicast */
+#define TCPPROBE_NL_FLUSH_DELAY (HZ / 10)
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,7,0)
+#define tcpprobe_nla_put_u64(skb, attr, val, pad) nla_put_u64(skb, attr, val)
+#define nla_reserve_64bit(skb, attr, len, pad) nla_reserve(skb, attr, len)
+#else
+#define tcpprobe_nla_put_u64(skb, attr, val, pad) nla_put_u64_64bit(skb, attr, val, pad)
+#endif
+
+static void tcpprobe_nl_flush(struct work_struct *work);
+static DECLARE_DELAYED_WORK(tcpprobe_nl_work, tcpprobe_nl_flush);
+
+static const struct nla_policy tcpprobe_genl_policy[TCPPROBE_A_MAX + 1] = {
+	[TCPPROBE_A_PORT]      = { .type = NLA_U32 },
+	[TCPPROBE_A_FULL]      = { .type = NLA_U32 },
+	[TCPPROBE_A_PROBETIME] = { .type = NLA_U32 },
+	[TCPPROBE_A_MAXFLOWS]  = { .type = NLA_U32 },
+	[TCPPROBE_A_PURGETIME] = { .type = NLA_U32 },
+	[TCPPROBE_A_READNUM]   = { .type = NLA_U32 },
+	[TCPPROBE_A_DEBUG]     = { .type = NLA_U32 },
+	[TCPPROBE_A_EXPORT]    = { .type = NLA_U32 },
+	[TCPPROBE_A_RESET_ON_OPEN] = { .type = NLA_U32 },
+	[TCPPROBE_A_FLOWID]    = { .type = NLA_U32 },
+	[TCPPROBE_A_CAPTURE]   = { .type = NLA_U32 },
+	[TCPPROBE_A_MEM_LIMIT_MB] = { .type = NLA_U32 },
+	[TCPPROBE_A_UNLOAD_WAIT_MS] = { .type = NLA_U32 },
+	[TCPPROBE_A_FLOW_RATE] = { .type = NLA_U32 },
+	[TCPPROBE_A_FLOW_BURST] = { .type = NLA_U32 },
+	[TCPPROBE_A_FAIR_SHARE] = { .type = NLA_U32 },
+	[TCPPROBE_A_STALL_MS]  = { .type = NLA_U32 },
+	[TCPPROBE_A_ECN_INTERVAL_MS] = { .type = NLA_U32 },
+	[TCPPROBE_A_HOSTQ_INTERVAL_MS] = { .type = NLA_U32 },
+	[TCPPROBE_A_LISTEN_INTERVAL_MS] = { .type = NLA_U32 },
+};
+
+#define TCPPROBE_NL_ATTR(_attr, _field) \
+	{ _attr, offsetof(struct tcpprobe_config, _field) }
+
+/* The settings of TCPPROBE_CMD_GET_CONFIG and TCPPROBE_CMD_SET_CONFIG */
+static const struct {
+	int attr;
+	size_t offset; /* in struct tcpprobe_config */
+} tcpprobe_nl_attrs[] = {
+	TCPPROBE_NL_ATTR(TCPPROBE_A_PORT, port),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_FULL, full),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_PROBETIME, probetime),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_MAXFLOWS, maxflows),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_PURGETIME, purgetime),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_READNUM, readnum),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_DEBUG, debug),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_EXPORT, export_mode),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_RESET_ON_OPEN, reset_on_open),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_FLOWID, flowid),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_MEM_LIMIT_MB, mem_limit_mb),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_UNLOAD_WAIT_MS, unload_wait_ms),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_FLOW_RATE, flow_rate),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_FLOW_BURST, flow_burst),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_FAIR_SHARE, fair_share),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_STALL_MS, stall_ms),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_ECN_INTERVAL_MS, ecn_interval_ms),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_HOSTQ_INTERVAL_MS, hostq_interval_ms),
+	TCPPROBE_NL_ATTR(TCPPROBE_A_LISTEN_INTERVAL_MS, listen_interval_ms),
+};
+
+static inline int *tcpprobe_nl_field(struct tcpprobe_config *c, int i)
+{
+	return (int *) ((char *) c + tcpprobe_nl_attrs[i].offset);
+}
+
+static int tcpprobe_nl_get_config(struct sk_buff *skb, struct genl_info *info);
+static int tcpprobe_nl_set_config(struct sk_buff *skb, struct genl_info *info);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
+/* genl_register_family_with_ops() links the ops into the family */
+static struct genl_ops tcpprobe_genl_ops[] = {
+#else
+static const struct genl_ops tcpprobe_genl_ops[] = {
+#endif
+	{
+		.cmd = TCPPROBE_CMD_GET_CONFIG,
+		.doit = tcpprobe_nl_get_config,
+		.policy = tcpprobe_genl_policy,
+	},
+	{
+		.cmd = TCPPROBE_CMD_SET_CONFIG,
+		.doit = tcpprobe_nl_set_config,
+		.policy = tcpprobe_genl_policy,
+		.flags = GENL_ADMIN_PERM,
+	},
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
+/* registered after the family, it gets a global id */
+static struct genl_multicast_group tcpprobe_genl_mcgrp = {
+	.name = TCPPROBE_GENL_MCGRP,
+};
+#else
+static const struct genl_multicast_group tcpprobe_genl_mcgrps[] = {
+	{ .name = TCPPROBE_GENL_MCGRP },
+};
+#endif
+
+static struct genl_family tcpprobe_genl_family = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+	.id = GENL_ID_GENERATE,
+#endif
+	.name = TCPPROBE_GENL_NAME,
+	.version = TCPPROBE_GENL_VERSION,
+	.maxattr = TCPPROBE_A_MAX,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	.module = THIS_MODULE,
+	.ops = tcpprobe_genl_ops,
+	.n_ops = ARRAY_SIZE(tcpprobe_genl_ops),
+	.mcgrps = tcpprobe_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(tcpprobe_genl_mcgrps),
+#endif
+};
+
+/*
+ * Encode one ring record as a nested TCPPROBE_A_RECORD attribute.
+ * Returns -EMSGSIZE if the message is full; the partial nest is cancelled.
+ */
+static int tcpprobe_nl_put_record(struct sk_buff *skb, const struct tcp_log *p,
+		const struct tcpprobe_config *cfg)
+{
+	struct nlattr *nest;
+	u64 tstamp = ktime_to_ns(ktime_sub(p->tstamp, tcp_probe.start));
+
+	nest = nla_nest_start(skb, TCPPROBE_A_RECORD);
+	if (!nest)
+		return -EMSGSIZE;
+
+	if (nla_put_u8(skb, TCPPROBE_R_TYPE, p->type) ||
+		tcpprobe_nla_put_u64(skb, TCPPROBE_R_TSTAMP, tstamp, TCPPROBE_R_PAD) ||
+		nla_put_u32(skb, TCPPROBE_R_FLOW_ID, p->flow_id))
+		goto nla_put_failure;
+
+	/* with flowid set, the tuple is given once by the flow definition */
+	if ((!cfg->flowid || p->type == LOG_FLOWDEF) &&
+		(nla_put_be32(skb, TCPPROBE_R_SADDR, p->saddr) ||
+		nla_put_be32(skb, TCPPROBE_R_DADDR, p->daddr) ||
+		nla_put_be16(skb, TCPPROBE_R_SPORT, p->sport) ||
+		nla_put_be16(skb, TCPPROBE_R_DPORT, p->dport) ||
+		tcpprobe_nla_put_u64(skb, TCPPROBE_R_SOCKET_IDF, p->socket_idf, TCPPROBE_R_PAD)))
+		goto nla_put_failure;
+
+	if (p->type == LOG_RETRANS) {
+		if (nla_put_u32(skb, TCPPROBE_R_RETX_FAST, p->retx.fast) ||
+			nla_put_u32(skb, TCPPROBE_R_RETX_RTO, p->retx.rto) ||
+			nla_put_u32(skb, TCPPROBE_R_RETX_TLP, p->retx.tlp) ||
+			nla_put_u32(skb, TCPPROBE_R_RETX_SPURIOUS, p->retx.spurious) ||
+			nla_put_u32(skb, TCPPROBE_R_RETX_BYTES, p->retx.bytes) ||
+			nla_put_u32(skb, TCPPROBE_R_RETX_SEQ_LO, p->retx.seq_lo) ||
+			nla_put_u32(skb, TCPPROBE_R_RETX_SEQ_HI, p->retx.seq_hi))
+			goto nla_put_failure;
+		goto out;
+	}
+
+	if (p->type == LOG_STALL) {
+		if (nla_put_u32(skb, TCPPROBE_R_STALL_CAUSE, p->stall.cause) ||
+			nla_put_u32(skb, TCPPROBE_R_STALL_MS, p->stall.stalled_ms) ||
+			nla_put_u32(skb, TCPPROBE_R_SND_UNA, p->stall.snd_una) ||
+			nla_put_u32(skb, TCPPROBE_R_SND_WND, p->stall.snd_wnd) ||
+			nla_put_u32(skb, TCPPROBE_R_WQUEUE, p->stall.wqueue) ||
+			nla_put_u32(skb, TCPPROBE_R_RQUEUE, p->stall.rqueue) ||
+			nla_put_u32(skb, TCPPROBE_R_PACKETS_OUT, p->stall.packets_out) ||
+			nla_put_u32(skb, TCPPROBE_R_STALL_RTO, p->stall.rto_num))
+			goto nla_put_failure;
+		goto out;
+	}
+
+	if (p->type == LOG_ECN) {
+		if (nla_put_u32(skb, TCPPROBE_R_ECN_ACKS, p->ecn.acks) ||
+			nla_put_u32(skb, TCPPROBE_R_ECN_ECE_ACKS, p->ecn.ece_acks) ||
+			nla_put_u32(skb, TCPPROBE_R_ECN_ACKED_BYTES, p->ecn.acked_bytes) ||
+			nla_put_u32(skb, TCPPROBE_R_ECN_ECE_BYTES, p->ecn.ece_bytes) ||
+			nla_put_u32(skb, TCPPROBE_R_ECN_ECE_PERMILLE, p->ecn.ece_permille) ||
+			nla_put_u32(skb, TCPPROBE_R_ECN_CWR, p->ecn.cwr) ||
+			nla_put_u32(skb, TCPPROBE_R_ECN_DATA_PKTS, p->ecn.data_pkts) ||
+			nla_put_u32(skb, TCPPROBE_R_ECN_DATA_BYTES, p->ecn.data_bytes) ||
+			nla_put_u32(skb, TCPPROBE_R_ECN_CE_PKTS, p->ecn.ce_pkts) ||
+			nla_put_u32(skb, TCPPROBE_R_ECN_CE_BYTES, p->ecn.ce_bytes) ||
+			nla_put_u32(skb, TCPPROBE_R_ECN_CE_PERMILLE, p->ecn.ce_permille))
+			goto nla_put_failure;
+		goto out;
+	}
+
+	if (p->type == LOG_HOSTQ) {
+		if (tcpprobe_nla_put_u64(skb, TCPPROBE_R_HOSTQ_PACING_RATE, p->hostq.pacing_rate, TCPPROBE_R_PAD) ||
+			nla_put_u32(skb, TCPPROBE_R_HOSTQ_WMEM_QUEUED, p->hostq.wmem_queued) ||
+			nla_put_u32(skb, TCPPROBE_R_HOSTQ_WMEM_QUEUED_MAX, p->hostq.wmem_queued_max) ||
+			nla_put_u32(skb, TCPPROBE_R_HOSTQ_WMEM_ALLOC, p->hostq.wmem_alloc) ||
+			nla_put_u32(skb, TCPPROBE_R_HOSTQ_WMEM_ALLOC_MAX, p->hostq.wmem_alloc_max) ||
+			nla_put_u32(skb, TCPPROBE_R_HOSTQ_TSQ_MS, p->hostq.tsq_ms) ||
+			nla_put_u32(skb, TCPPROBE_R_HOSTQ_PACING_MS, p->hostq.pacing_ms) ||
+			nla_put_u32(skb, TCPPROBE_R_HOSTQ_SNDBUF_MS, p->hostq.sndbuf_ms) ||
+			nla_put_u32(skb, TCPPROBE_R_HOSTQ_EVENTS, p->hostq.events))
+			goto nla_put_failure;
+		goto out;
+	}
+	if (p->type == LOG_OWNER) {
+		if (nla_put_u32(skb, TCPPROBE_R_OWNER_PID, p->owner.pid) ||
+			nla_put_u32(skb, TCPPROBE_R_OWNER_TGID, p->owner.tgid) ||
+			nla_put_u32(skb, TCPPROBE_R_OWNER_UID, p->owner.uid) ||
+			nla_put_string(skb, TCPPROBE_R_OWNER_COMM, p->owner.comm))
+			goto nla_put_failure;
+		goto out;
+	}
+
+	if (p->type == LOG_STATES) {
+		if (nla_put_u32(skb, TCPPROBE_R_STATE, p->states.state) ||
+			nla_put_u32(skb, TCPPROBE_R_STATE_TRANSITIONS, p->states.transitions) ||
+			nla_put(skb, TCPPROBE_R_STATE_MS, sizeof(p->states.ms), p->states.ms))
+			goto nla_put_failure;
+		goto out;
+	}
+
+	if (p->type == LOG_LISTEN) {
+		/* a listener has no flow definition, it always gives its port */
+		if ((cfg->flowid && nla_put_be16(skb, TCPPROBE_R_SPORT, p->sport)) ||
+			nla_put_u32(skb, TCPPROBE_R_LISTEN_CONNS, p->listen.conns) ||
+			nla_put_u32(skb, TCPPROBE_R_LISTEN_OVERFLOWS, p->listen.overflows) ||
+			nla_put_u32(skb, TCPPROBE_R_LISTEN_ACCEPTS, p->listen.accepts) ||
+			nla_put_u32(skb, TCPPROBE_R_LISTEN_BACKLOG_MAX, p->listen.backlog_max) ||
+			nla_put_u32(skb, TCPPROBE_R_LISTEN_BACKLOG_AVG, p->listen.backlog_avg) ||
+			nla_put_u32(skb, TCPPROBE_R_LISTEN_MAX_BACKLOG, p->listen.max_backlog) ||
+			nla_put_u32(skb, TCPPROBE_R_LISTEN_ACCEPT_AVG_US, p->listen.accept_avg_us) ||
+			nla_put_u32(skb, TCPPROBE_R_LISTEN_ACCEPT_MAX_US, p->listen.accept_max_us))
+			goto nla_put_failure;
+		goto out;
+	}
+
+	if (nla_put_u16(skb, TCPPROBE_R_LENGTH, p->length) ||
+		nla_put_u8(skb, TCPPROBE_R_TCP_FLAGS, p->tcp_flags) ||
+		nla_put_u32(skb, TCPPROBE_R_SEQ_NUM, p->seq_num) ||
+		nla_put_u32(skb, TCPPROBE_R_ACK_NUM, p->ack_num) ||
+		nla_put_u8(skb, TCPPROBE_R_CA_STATE, p->ca_state) ||
+		tcpprobe_nla_put_u64(skb, TCPPROBE_R_SND_NXT, p->snd_nxt, TCPPROBE_R_PAD) ||
+		nla_put_u32(skb, TCPPROBE_R_SND_UNA, p->snd_una) ||
+		nla_put_u32(skb, TCPPROBE_R_WRITE_SEQ, p->write_seq) ||
+		nla_put_u32(skb, TCPPROBE_R_WQUEUE, p->wqueue) ||
+		nla_put_u32(skb, TCPPROBE_R_RQUEUE, p->rqueue) ||
+		nla_put_u32(skb, TCPPROBE_R_SND_CWND, p->snd_cwnd) ||
+		nla_put_u32(skb, TCPPROBE_R_SSTHRESH, p->ssthresh) ||
+		nla_put_u32(skb, TCPPROBE_R_SND_WND, p->snd_wnd) ||
+		nla_put_u32(skb, TCPPROBE_R_RCV_WND, p->rcv_wnd) ||
+		nla_put_u32(skb, TCPPROBE_R_SRTT, p->srtt) ||
+		nla_put_u32(skb, TCPPROBE_R_MDEV, p->mdev) ||
+		nla_put_u32(skb, TCPPROBE_R_RTTVAR, p->rttvar) ||
+		nla_put_u32(skb, TCPPROBE_R_RTO, p->rto) ||
+		nla_put_u32(skb, TCPPROBE_R_PACKETS_OUT, p->packets_out) ||
+		nla_put_u32(skb, TCPPROBE_R_LOST_OUT, p->lost_out) ||
+		nla_put_u32(skb, TCPPROBE_R_SACKED_OUT, p->sacked_out) ||
+		nla_put_u32(skb, TCPPROBE_R_RETRANS_OUT, p->retrans_out) ||
+		nla_put_u32(skb, TCPPROBE_R_RETRANS, p->retrans) ||
+		nla_put_u8(skb, TCPPROBE_R_FRTO_COUNTER, p->frto_counter) ||
+		nla_put_u16(skb, TCPPROBE_R_RTO_NUM, p->rto_num))
+		goto nla_put_failure;
+
+	if (p->user_agent[0] != '\0' &&
+		nla_put_string(skb, TCPPROBE_R_USER_AGENT, p->user_agent))
+		goto nla_put_failure;
+
+out:
+	nla_nest_end(skb, nest);
+	return 0;
+
+nla_put_failure:
+	nla_nest_cancel(skb, nest);
+	return -EMSGSIZE;
+}
+
+/*
+ * Move as many records as fit from the ring into skb.
+ * Called with tcp_probe.lock held. Returns the number of records moved.
+ */
+static int tcpprobe_nl_fill_batch(struct sk_buff *skb, const struct tcpprobe_config *cfg)
+{
+	int count = 0;
+
+	while (tcp_probe_used() > 0) {
+		const struct tcp_log *p = tcp_probe_slot(tcp_probe.tail);
+
+		if (tcpprobe_nl_put_record(skb, p, cfg))
+			break;
+		tcp_probe.tail++;
+		count++;
+	}
+	return count;
+}
+
+static void tcpprobe_nl_flush(struct work_struct *work)
+{
+	struct tcpprobe_config cfg;
+	struct tcpprobe_stat stat;
+	struct sk_buff *skb;
+	struct nlattr *count_attr;
+	struct nlattr *seq_attr;
+	void *hdr;
+	int count;
+	int ret;
+
+	/* one configuration for the whole flush */
+	tcpprobe_config_get(&cfg);
+	if (cfg.export_mode != TCPPROBE_EXPORT_NETLINK)
+		return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,0,0)
+	/* Keep the records in the ring until somebody listens */
+	if (!genl_has_listeners(&tcpprobe_genl_family, &init_net, 0))
+		return;
+#endif
+
+	do {
+		skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+		if (!skb) {
+			/* retry later, records stay in the ring */
+			tcpprobe_nl_kick(&cfg);
+			return;
+		}
+		hdr = genlmsg_put(skb, 0, 0, &tcpprobe_genl_family, 0, TCPPROBE_CMD_RECORDS);
+		if (!hdr) {
+			nlmsg_free(skb);
+			return;
+		}
+
+		tcpprobe_stat_sum(&stat);
+		count_attr = nla_reserve(skb, TCPPROBE_A_COUNT, sizeof(u32));
+		seq_attr = nla_reserve_64bit(skb, TCPPROBE_A_SEQ, sizeof(u64), TCPPROBE_A_PAD);
+		if (!count_attr || !seq_attr ||
+			tcpprobe_nla_put_u64(skb, TCPPROBE_A_DROP_RING,
+				stat.ack_drop_ring_full, TCPPROBE_A_PAD) ||
+			tcpprobe_nla_put_u64(skb, TCPPROBE_A_DROP_NETLINK,
+				stat.netlink_overrun, TCPPROBE_A_PAD)) {
+			nlmsg_free(skb);
+			return;
+		}
+
+		spin_lock_bh(&tcp_probe.lock);
+		*(u64 *) nla_data(seq_attr) = tcp_probe.tail;
+		count = tcpprobe_nl_fill_batch(skb, &cfg);
+		spin_unlock_bh(&tcp_probe.lock);
+
+		if (count == 0) {
+			nlmsg_free(skb);
+			return;
+		}
+		*(u32 *) nla_data(count_attr) = count;
+		genlmsg_end(skb, hdr);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
+		ret = genlmsg_multicast(skb, 0, tcpprobe_genl_mcgrp.id, GFP_KERNEL);
+#else
+		ret = genlmsg_multicast(&tcpprobe_genl_family, skb, 0, 0, GFP_KERNEL);
+#endif
+		if (ret == -ENOBUFS) {
+			local_bh_disable();
+			TCPPROBE_STAT_INC(netlink_overrun);
+			local_bh_enable();
+		}
+		PRINT_TRACE("Multicast %d records (ret %d).\n", count, ret);
+	} while (tcp_probe_used() > 0);
+}
+
+/*
+ * Schedule a flush of the ring to the multicast group.
+ * Safe to call from the hooks; does nothing if a flush is already pending.
+ */
+void tcpprobe_nl_kick(const struct tcpprobe_config *cfg)
+{
+	if (cfg->export_mode == TCPPROBE_EXPORT_NETLINK)
+		schedule_delayed_work(&tcpprobe_nl_work, TCPPROBE_NL_FLUSH_DELAY);
+}
+
+/* Is anybody subscribed to the multicast group? */
+int tcpprobe_nl_listening(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,0,0)
+	return genl_has_listeners(&tcpprobe_genl_family, &init_net, 0);
+#else
+	return 1;
+#endif
+}
+
+static int tcpprobe_nl_get_config(struct sk_buff *skb, struct genl_info *info)
+{
+	struct tcpprobe_config c;
+	struct sk_buff *msg;
+	void *hdr;
+	int i;
+
+	msg = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	hdr = genlmsg_put_reply(msg, info, &tcpprobe_genl_family, 0,
+			TCPPROBE_CMD_GET_CONFIG);
+	if (!hdr)
+		goto nla_put_failure;
+
+	tcpprobe_config_get(&c);
+	for (i = 0; i < ARRAY_SIZE(tcpprobe_nl_attrs); i++)
+		if (nla_put_u32(msg, tcpprobe_nl_attrs[i].attr, *tcpprobe_nl_field(&c, i)))
+			goto nla_put_failure;
+	if (nla_put_u32(msg, TCPPROBE_A_CAPTURE, tcpprobe_capture_remaining()))
+		goto nla_put_failure;
+
+	genlmsg_end(msg, hdr);
+	return genlmsg_reply(msg, info);
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return -EMSGSIZE;
+}
+
+#define TCPPROBE_NL_GET(attr, dflt) \
+	(info->attrs[attr] ? nla_get_u32(info->attrs[attr]) : (u32) (dflt))
+
+static int tcpprobe_nl_set_config(struct sk_buff *skb, struct genl_info *info)
+{
+	struct tcpprobe_config c;
+	u32 new_capture = TCPPROBE_NL_GET(TCPPROBE_A_CAPTURE, 0);
+	u32 mask = 0, v;
+	int i, ret;
+
+	/* the settings not given keep their value */
+	memset(&c, 0, sizeof(c));
+	for (i = 0; i < ARRAY_SIZE(tcpprobe_nl_attrs); i++) {
+		if (!info->attrs[tcpprobe_nl_attrs[i].attr])
+			continue;
+		v = nla_get_u32(info->attrs[tcpprobe_nl_attrs[i].attr]);
+		if (v > INT_MAX)
+			return -EINVAL;
+		*tcpprobe_nl_field(&c, i) = v;
+		mask |= TCPPROBE_CFG_BIT(tcpprobe_nl_attrs[i].offset);
+	}
+	/* Validate everything before changing anything */
+	if (new_capture > TCPPROBE_CAPTURE_MAX ||
+		(new_capture && !tcp_capture.log.chunks))
+		return -EINVAL;
+	ret = tcpprobe_config_set(&c, mask);
+	if (ret)
+		return ret;
+	/* a running capture is only changed on request */
+	if (info->attrs[TCPPROBE_A_CAPTURE])
+		tcpprobe_capture_arm(new_capture);
+
+	PRINT_DEBUG("Configuration changed through netlink.\n");
+	/* Start draining what accumulated in the ring */
+	tcpprobe_config_get(&c);
+	tcpprobe_nl_kick(&c);
+	wake_up(&tcp_probe.wait);
+	return 0;
+}
+
+int tcpprobe_nl_init(void)
+{
+	int ret;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
+	ret = genl_register_family_with_ops(&tcpprobe_genl_family,
+			tcpprobe_genl_ops, ARRAY_SIZE(tcpprobe_genl_ops));
+	if (!ret) {
+		ret = genl_register_mc_group(&tcpprobe_genl_family, &tcpprobe_genl_mcgrp);
+		if (ret)
+			genl_unregister_family(&tcpprobe_genl_family);
+	}
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+	ret = genl_register_family_with_ops_groups(&tcpprobe_genl_family,
+			tcpprobe_genl_ops, tcpprobe_genl_mcgrps);
+#else
+	ret = genl_register_family(&tcpprobe_genl_family);
+#endif
+	if (ret) {
+		pr_err("Unable to register generic netlink family %s\n", TCPPROBE_GENL_NAME);
+		return ret;
+	}
+	pr_info("tcpprobe_plus: registered: genetlink %s\n", TCPPROBE_GENL_NAME);
+	return 0;
+}
+
+void tcpprobe_nl_exit(void)
+{
+	cancel_delayed_work_sync(&tcpprobe_nl_work);
+	genl_unregister_family(&tcpprobe_genl_family);
+}
@@ -6,6 +6,23 @@ import datetime
 import logging
 import shutil
 
+# Record types, see the flowid sysctl
+LOG_DONE = 4
+LOG_PURGE = 5
+LOG_FLOWDEF = 6
+LOG_RETRANS = 7
+LOG_STALL = 8
+LOG_ECN = 9
+LOG_HOSTQ = 10
+LOG_LISTEN = 11
+LOG_STATES = 12
+LOG_OWNER = 13
+
+# TCP states of the LOG_STATES records, in order from TCP_ESTABLISHED (1)
+TCP_STATES = ("established", "syn_sent", "syn_recv", "fin_wait1",
+        "fin_wait2", "time_wait", "close", "close_wait", "last_ack",
+        "listen", "closing")
+
 def ipaddr_ntos(ipaddr):
     return "%d.%d.%d.%d" % (
             (ipaddr >> 24) & 0xff,
@@ -30,6 +47,8 @@ class tcp_log_reader(object):
         self.archive_dir = "archive"
         self.oname = oname
         self.stat_file = "/proc/net/stat/tcpprobe_plus"
+        # flow id -> [srcaddr, srcport, dstaddr, dstport] when flowid=1
+        self.flows = {}
 
     def check_trace_dir(self):
         """ Check whether trace directory exists. If so, move it the archive directory
@@ -79,6 +98,47 @@ class tcp_log_reader(object):
         result["srcport"] = int(line[4], base=num_base)
         result["dstaddr"] = int(line[5], base=num_base)
         result["dstport"] = int(line[6], base=num_base)
+        if result["type"] == LOG_RETRANS:
+            for i, key in enumerate(("retx_fast", "retx_rto", "retx_tlp",
+                    "retx_spurious", "retx_bytes", "retx_seq_lo", "retx_seq_hi")):
+                result[key] = int(line[7 + i], base=num_base)
+            return result
+        if result["type"] == LOG_STALL:
+            for i, key in enumerate(("stall_cause", "stalled_ms", "snd_una",
+                    "snd_wnd", "wqueue", "rqueue", "packets_out", "stall_rto")):
+                result[key] = int(line[7 + i], base=num_base)
+            return result
+        if result["type"] == LOG_ECN:
+            for i, key in enumerate(("acks", "ece_acks", "acked_bytes",
+                    "ece_bytes", "ece_permille", "cwr", "data_pkts",
+                    "data_bytes", "ce_pkts", "ce_bytes", "ce_permille")):
+                result[key] = int(line[7 + i], base=num_base)
+            return result
+        if result["type"] == LOG_HOSTQ:
+            result["pacing_rate"] = long(line[7], base=num_base)
+            for i, key in enumerate(("wmem_queued", "wmem_queued_max",
+                    "wmem_alloc", "wmem_alloc_max", "tsq_ms", "pacing_ms",
+                    "sndbuf_ms", "events")):
+                result[key] = int(line[8 + i], base=num_base)
+            return result
+        if result["type"] == LOG_OWNER:
+            result["pid"] = int(line[7], base=num_base)
+            result["tgid"] = int(line[8], base=num_base)
+            result["uid"] = int(line[9], base=num_base)
+            result["comm"] = " ".join(line[10:])
+            return result
+        if result["type"] == LOG_STATES:
+            result["state"] = int(line[7], base=num_base)
+            result["transitions"] = int(line[8], base=num_base)
+            for i, name in enumerate(TCP_STATES):
+                result[name + "_ms"] = int(line[9 + i], base=num_base)
+            return result
+        if result["type"] == LOG_LISTEN:
+            for i, key in enumerate(("port", "conns", "overflows", "accepts",
+                    "backlog_max", "backlog_avg", "max_backlog",
+                    "accept_avg_us", "accept_max_us")):
+                result[key] = int(line[7 + i], base=num_base)
+            return result
         result["length"] = int(line[7], base=num_base)
         result["tcp_flags"] = int(line[8], base=num_base)
         result["seq_num"] = int(line[9], base=num_base)
@@ -107,6 +167,32 @@ class tcp_log_reader(object):
             result["user-agent"] =  " ".join(line[30:])
         return result
 
+    def parse_line_flowid(self, line, num_base=16):
+        """ Parse a line written with flowid=1 into dictionary.
+
+        The tuple of a flow is only given by its flow definition, which
+        is remembered until the flow is done or purged.
+
+        line: A string containing line to be parsed
+        num_base: Base of all numbers
+
+        Returns:
+            A dictionary containing the data, None for a flow definition
+        """
+        fields = line.split()
+        record_type = int(fields[0], base=num_base)
+        flow_id = int(fields[3], base=num_base)
+        if record_type == LOG_FLOWDEF:
+            self.flows[flow_id] = fields[4:8]
+            return None
+        flow_tuple = self.flows.get(flow_id, ["0", "0", "0", "0"])
+        if record_type in (LOG_DONE, LOG_PURGE):
+            self.flows.pop(flow_id, None)
+        result = self.parse_line(" ".join(fields[:3] + flow_tuple + fields[4:]),
+                num_base)
+        result["flow_id"] = flow_id
+        return result
+
     def read_parse_and_store(self):
         """ Read data, parse information, and store it into output file
         """
@@ -222,6 +308,90 @@ class tcp_log_reader(object):
                     ),
                 )
 
+    def load_position(self, position_file):
+        """ Return the sequence number saved in position_file, or None
+        """
+        try:
+            with open(position_file) as pfp:
+                return int(pfp.read().strip())
+        except (IOError, ValueError):
+            return None
+
+    def save_position(self, position_file, position):
+        """ Atomically save the sequence number of the next record to read
+        """
+        tmp_file = position_file + ".tmp"
+        with open(tmp_file, "w") as pfp:
+            pfp.write("%d\n" % position)
+            pfp.flush()
+            os.fsync(pfp.fileno())
+        os.rename(tmp_file, position_file)
+
+    def read_and_store_resumable(self, position_file, file_size_max = (1 << 30),
+            flush_max = 30):
+        """ Read data and store it into file, resuming where the previous
+        run stopped.
+
+        The file position of the tcpprobe data file is the sequence number
+        of the next record. It is saved into position_file every flush_max
+        reads and on exit, and restored with lseek() on the next start, so a
+        restart neither loses records nor needs any resync. Records read after
+        the last save are read again after a crash.
+
+        Args:
+            position_file: A string containing the file holding the position
+            file_size_max: A number contaning the maximum bytes of a file.
+            flush_max: A number representing the maximum number of reads
+                between two flushes of the output and of the position.
+        """
+        self.check_trace_dir()
+        file_num = 1
+        fd = os.open(self.ifname, os.O_RDONLY)
+        position = self.load_position(position_file)
+        if position is not None:
+            resumed = os.lseek(fd, position, os.SEEK_SET)
+            if resumed != position:
+                logging.warning(
+                    "Resumed at record %d instead of %d, %d records lost.",
+                    resumed, position, max(resumed - position, 0),
+                )
+        position = os.lseek(fd, 0, os.SEEK_CUR)
+        timestamp = datetime.datetime.now().strftime("%Y-%m-%d %H:%M:%S")
+        ofp = None
+        try:
+            print "Press <Ctrl-C> to stop reading!"
+            while True:
+                ofname = self.oname + (".%d" % file_num)
+                ofname = os.path.join(self.odir, ofname)
+                ofp = open(ofname, "w")
+                ofp.write("# %s\n" % timestamp)
+                flush_num, file_size = 0, 0
+                while file_size <= file_size_max:
+                    # every read returns whole records
+                    data = os.read(fd, 65536)
+                    if not data:
+                        break
+                    ofp.write(data)
+                    file_size += len(data)
+                    position = os.lseek(fd, 0, os.SEEK_CUR)
+                    flush_num += 1
+                    if flush_num > flush_max:
+                        ofp.flush()
+                        self.save_position(position_file, position)
+                        flush_num = 0
+                ofp.close()
+                self.save_position(position_file, position)
+                if not data:
+                    break
+                file_num += 1
+        except KeyboardInterrupt:
+            logging.warning("Receive Interrupt Signal.\n")
+        finally:
+            if ofp is not None and not ofp.closed:
+                ofp.close()
+                self.save_position(position_file, position)
+            os.close(fd)
+
 
 def main():
     ifname = "/proc/net/tcpprobe_data"
@@ -18,14 +18,11 @@
 
 #include "tcp_probe_plus.h"
 
-static int tcpprobe_open(struct inode * inode, struct file * file)
+/* Set the start of the relative timestamps to now */
+void tcpprobe_reset_start(void)
 {
 	struct timespec ts; 
 
-	/* Reset (empty) log */
-	spin_lock_bh(&tcp_probe.lock);
-	tcp_probe.head = tcp_probe.tail = 0;
-
 	getnstimeofday(&ts);
 	tcp_probe.start_datetime = timespec_to_ktime(ts);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,21)
@@ -33,25 +30,174 @@ static int tcpprobe_open(struct inode * inode, struct file * file)
 #else
 	tcp_probe.start = ktime_get();
 #endif
+}
+
+static int tcpprobe_open(struct inode * inode, struct file * file)
+{
+	struct tcpprobe_config cfg;
+
+	tcpprobe_config_get(&cfg);
+	/* The ring is drained by the netlink or the trace exporter */
+	if (cfg.export_mode != TCPPROBE_EXPORT_PROCFS)
+		return -EBUSY;
+
+	spin_lock_bh(&tcp_probe.lock);
+	if (tcp_probe.closing) {
+		spin_unlock_bh(&tcp_probe.lock);
+		return -ENODEV;
+	}
+	atomic_inc(&tcp_probe.readers);
+	if (cfg.reset_on_open) {
+		/* Discard (empty) log, sequence numbers keep increasing */
+		tcp_probe.tail = tcp_probe.head;
+		tcpprobe_reset_start();
+	}
+	/* The file position is the sequence number of the next record */
+	file->f_pos = tcp_probe.tail;
 	spin_unlock_bh(&tcp_probe.lock);
 
 	return 0;
 }
 
-static int tcpprobe_sprint(char *tbuf, int n)
+static int tcpprobe_release(struct inode *inode, struct file *file)
+{
+	atomic_dec(&tcp_probe.readers);
+	return 0;
+}
+
+/*
+ * Move the reader to record number offset (SEEK_SET), relative to the next
+ * record to read (SEEK_CUR) or relative to the next record to be written
+ * (SEEK_END). A position older than the oldest record still in the ring is
+ * moved forward to it and a position in the future is moved back to the next
+ * record to be written. The returned position tells the reader how many
+ * records were lost.
+ */
+static loff_t tcpprobe_llseek(struct file *file, loff_t offset, int whence)
+{
+	s64 seq;
+
+	spin_lock_bh(&tcp_probe.lock);
+	switch (whence) {
+	case SEEK_SET:
+		seq = offset;
+		break;
+	case SEEK_CUR:
+		seq = tcp_probe.tail + offset;
+		break;
+	case SEEK_END:
+		seq = tcp_probe.head + offset;
+		break;
+	default:
+		spin_unlock_bh(&tcp_probe.lock);
+		return -EINVAL;
+	}
+	if (seq < (s64) tcp_probe_oldest()) {
+		seq = tcp_probe_oldest();
+	} else if (seq > (s64) tcp_probe.head) {
+		seq = tcp_probe.head;
+	}
+	tcp_probe.tail = seq;
+	file->f_pos = seq;
+	spin_unlock_bh(&tcp_probe.lock);
+
+	PRINT_DEBUG("Reader moved to record %lld.\n", seq);
+	return seq;
+}
+
+/*
+ * Format a record. When compact (flowid set), a record names its flow
+ * by flow id and the tuple is only printed by the flow definition;
+ * otherwise every record carries the tuple and the flow definitions are
+ * skipped (0 is returned).
+ */
+int tcpprobe_sprint(const struct tcp_log *p, int compact, char *tbuf, int n)
 {
-	const struct tcp_log *p = tcp_probe.log + tcp_probe.tail;
 	struct timespec tv = ktime_to_timespec(ktime_sub(p->tstamp, tcp_probe.start));
 	
 	int copied = 0;
+	if (p->type == LOG_FLOWDEF) {
+		if (!compact)
+			return 0;
+		return scnprintf(tbuf, n, "%x %lx %lx %x %x %x %x %x %llx %x\n",
+			p->type, (unsigned long) tv.tv_sec, (unsigned long) tv.tv_nsec,
+			p->flow_id, ntohl(p->saddr), ntohs(p->sport),
+			ntohl(p->daddr), ntohs(p->dport), p->socket_idf, p->ack_num
+		);
+	}
 	/*copied += scnprintf(tbuf+copied, n-copied, "%x %lu.%09lu %pI4:%u %pI4:%u ", 
 		p->type, (unsigned long) tv.tv_sec, (unsigned long) tv.tv_nsec,
 		&p->saddr, ntohs(p->sport), &p->daddr, ntohs(p->dport)
 	);*/
-	copied += scnprintf(tbuf+copied, n-copied, "%x %lx %lx %x %x %x %x ", 
-		p->type, (unsigned long) tv.tv_sec, (unsigned long) tv.tv_nsec,
-		ntohl(p->saddr), ntohs(p->sport), ntohl(p->daddr), ntohs(p->dport)
-	);
+	if (compact) {
+		copied += scnprintf(tbuf+copied, n-copied, "%x %lx %lx %x ",
+			p->type, (unsigned long) tv.tv_sec, (unsigned long) tv.tv_nsec,
+			p->flow_id
+		);
+	} else {
+		copied += scnprintf(tbuf+copied, n-copied, "%x %lx %lx %x %x %x %x ", 
+			p->type, (unsigned long) tv.tv_sec, (unsigned long) tv.tv_nsec,
+			ntohl(p->saddr), ntohs(p->sport), ntohl(p->daddr), ntohs(p->dport)
+		);
+	}
+	if (p->type == LOG_RETRANS) {
+		copied += scnprintf(tbuf+copied, n-copied, "%x %x %x %x %x %x %x\n",
+			p->retx.fast, p->retx.rto, p->retx.tlp, p->retx.spurious,
+			p->retx.bytes, p->retx.seq_lo, p->retx.seq_hi
+		);
+		return copied;
+	}
+	if (p->type == LOG_STALL) {
+		copied += scnprintf(tbuf+copied, n-copied, "%x %x %x %x %x %x %x %x\n",
+			p->stall.cause, p->stall.stalled_ms, p->stall.snd_una, p->stall.snd_wnd,
+			p->stall.wqueue, p->stall.rqueue, p->stall.packets_out, p->stall.rto_num
+		);
+		return copied;
+	}
+	if (p->type == LOG_ECN) {
+		copied += scnprintf(tbuf+copied, n-copied, "%x %x %x %x %x %x %x %x %x %x %x\n",
+			p->ecn.acks, p->ecn.ece_acks, p->ecn.acked_bytes, p->ecn.ece_bytes,
+			p->ecn.ece_permille, p->ecn.cwr, p->ecn.data_pkts, p->ecn.data_bytes,
+			p->ecn.ce_pkts, p->ecn.ce_bytes, p->ecn.ce_permille
+		);
+		return copied;
+	}
+	if (p->type == LOG_HOSTQ) {
+		copied += scnprintf(tbuf+copied, n-copied, "%llx %x %x %x %x %x %x %x %x\n",
+			p->hostq.pacing_rate, p->hostq.wmem_queued, p->hostq.wmem_queued_max,
+			p->hostq.wmem_alloc, p->hostq.wmem_alloc_max, p->hostq.tsq_ms,
+			p->hostq.pacing_ms, p->hostq.sndbuf_ms, p->hostq.events
+		);
+		return copied;
+	}
+	if (p->type == LOG_OWNER) {
+		/* comm last, it may contain spaces */
+		copied += scnprintf(tbuf+copied, n-copied, "%x %x %x %.*s\n",
+			p->owner.pid, p->owner.tgid, p->owner.uid,
+			(int) sizeof(p->owner.comm), p->owner.comm
+		);
+		return copied;
+	}
+	if (p->type == LOG_STATES) {
+		int i;
+
+		copied += scnprintf(tbuf+copied, n-copied, "%x %x",
+			p->states.state, p->states.transitions);
+		/* ms spent in TCP_ESTABLISHED to TCP_CLOSING */
+		for (i = 1; i < TCPPROBE_TCP_STATES; i++) {
+			copied += scnprintf(tbuf+copied, n-copied, " %x", p->states.ms[i]);
+		}
+		copied += scnprintf(tbuf+copied, n-copied, "\n");
+		return copied;
+	}
+	if (p->type == LOG_LISTEN) {
+		copied += scnprintf(tbuf+copied, n-copied, "%x %x %x %x %x %x %x %x %x\n",
+			p->listen.port, p->listen.conns, p->listen.overflows,
+			p->listen.accepts, p->listen.backlog_max, p->listen.backlog_avg,
+			p->listen.max_backlog, p->listen.accept_avg_us, p->listen.accept_max_us
+		);
+		return copied;
+	}
 	copied += scnprintf(tbuf+copied, n-copied, "%x %x %x %x ", 
 		p->length, p->tcp_flags, p->seq_num, p->ack_num
 	);
@@ -75,12 +221,16 @@ static int tcpprobe_sprint(char *tbuf, int n)
 static ssize_t tcpprobe_read(struct file *file, char __user *buf,
 						size_t len, loff_t *ppos)
 {
+	struct tcpprobe_config cfg;
 	int error = 0;
 	size_t cnt = 0;
-	int toread = readnum;
+	int toread;
 	
 	if (!buf)
 		return -EINVAL;
+	/* one configuration for the whole read */
+	tcpprobe_config_get(&cfg);
+	toread = cfg.readnum;
 	PRINT_TRACE("Page size is %lu. Buffer len is %zu.\n", PAGE_SIZE, len);
 	
 	while (toread && cnt < len) {
@@ -88,26 +238,37 @@ static ssize_t tcpprobe_read(struct file *file, char __user *buf,
 		int width;
 		
 		/* Wait for data in buffer */
-		error = wait_event_interruptible(tcp_probe.wait, tcp_probe_used() > 0);
+		error = wait_event_interruptible(tcp_probe.wait,
+				tcp_probe_used() > 0 || tcp_probe.closing);
 		if (error)
 			break;
 		
 		spin_lock_bh(&tcp_probe.lock);
 		if (tcp_probe.head == tcp_probe.tail) {
+			if (tcp_probe.closing) {
+				/* module unloading and everything read */
+				spin_unlock_bh(&tcp_probe.lock);
+				break;
+			}
 			/* multiple readers race? */
 			TCPPROBE_STAT_INC(multiple_readers);
 			spin_unlock_bh(&tcp_probe.lock);
 			continue;
 		}
 	
-		width = tcpprobe_sprint(tbuf, sizeof(tbuf));
+		width = tcpprobe_sprint(tcp_probe_slot(tcp_probe.tail), cfg.flowid,
+				tbuf, sizeof(tbuf));
 		
 		if (cnt + width < len) {
-			tcp_probe.tail = (tcp_probe.tail + 1) & (bufsize - 1);
+			tcp_probe.tail++;
+			*ppos = tcp_probe.tail;
 		}
 		
 		spin_unlock_bh(&tcp_probe.lock);
 		
+		/* skipped record */
+		if (width == 0)
+			continue;
 		/* if record greater than space available
 		return partial buffer (so far) */
 		if (cnt + width >= len) {
@@ -124,6 +285,35 @@ static ssize_t tcpprobe_read(struct file *file, char __user *buf,
 	return cnt == 0 ? error : cnt;
 }
 
+/* Sum the per-cpu statistics into stat */
+void tcpprobe_stat_sum(struct tcpprobe_stat *stat)
+{
+	int cpu;
+
+	memset(stat, 0, sizeof(struct tcpprobe_stat));
+
+	for_each_present_cpu(cpu) {
+		struct tcpprobe_stat *cpu_stat = &per_cpu(tcpprobe_stat, cpu);
+		
+		stat->ack_drop_purge += cpu_stat->ack_drop_purge;
+		stat->ack_drop_ring_full += cpu_stat->ack_drop_ring_full;
+		stat->ack_drop_rate += cpu_stat->ack_drop_rate;
+		stat->ack_drop_fair += cpu_stat->ack_drop_fair;
+		stat->conn_maxflow_limit += cpu_stat->conn_maxflow_limit;
+		stat->conn_memory_limit += cpu_stat->conn_memory_limit;
+		stat->searched += cpu_stat->searched;
+		stat->found += cpu_stat->found;
+		stat->notfound += cpu_stat->notfound;
+		stat->multiple_readers += cpu_stat->multiple_readers;
+		stat->copy_error += cpu_stat->copy_error;
+		stat->reset_flows += cpu_stat->reset_flows;
+		stat->netlink_overrun += cpu_stat->netlink_overrun;
+		stat->conn_evicted += cpu_stat->conn_evicted;
+		stat->agent_skipped += cpu_stat->agent_skipped;
+		stat->capture_drop += cpu_stat->capture_drop;
+	}
+}
+
 /* procfs statistics /proc/net/stat/tcpprobe */
 static int tcpprobe_seq_show(struct seq_file *seq, void *v)
 {
@@ -131,41 +321,41 @@ static int tcpprobe_seq_show(struct seq_file *seq, void *v)
 	struct tcpprobe_stat stat;
 	int cpu;
 	
-	memset(&stat, 0, sizeof(struct tcpprobe_stat));
-	
-	for_each_present_cpu(cpu) {
-		struct tcpprobe_stat *cpu_stat = &per_cpu(tcpprobe_stat, cpu);
-		
-		stat.ack_drop_purge += cpu_stat->ack_drop_purge;
-		stat.ack_drop_ring_full += cpu_stat->ack_drop_ring_full;
-		stat.conn_maxflow_limit += cpu_stat->conn_maxflow_limit;
-		stat.conn_memory_limit += cpu_stat->conn_memory_limit;
-		stat.searched += cpu_stat->searched;
-		stat.found += cpu_stat->found;
-		stat.notfound += cpu_stat->notfound;
-		stat.multiple_readers += cpu_stat->multiple_readers;
-		stat.copy_error += cpu_stat->copy_error;
-		stat.reset_flows += cpu_stat->reset_flows;
-	}
-	seq_printf(seq, "Flows: active %u mem %uK\n", nr_flows,
-	(unsigned int)((nr_flows * sizeof(struct tcp_hash_flow)) >> 10));
+	tcpprobe_stat_sum(&stat);
+	seq_printf(seq, "Flows: active %u mem %uK agents %luK\n", nr_flows,
+	(unsigned int)((nr_flows * tcp_flow_size()) >> 10),
+	atomic_long_read(&agent_mem) >> 10);
 	seq_printf(seq, "Hash: size %u mem %uK\n",
-	hashsize, (unsigned int)((hashsize * sizeof(struct hlist_head)) >> 10));
-	seq_printf(seq, "cpu# hash_stat: <search_flows found new reset>, ack_drop: <purge_in_progress ring_full>, conn_drop: <maxflow_reached memory_alloc_failed>, err: <multiple_reader copy_failed>\n");
-	seq_printf(seq, "Total: hash_stat: %6llu %6llu %6llu %6llu, ack_drop: %6llu %6llu, conn_drop: %6llu %6llu, err: %6llu %6llu\n",
+	tcp_hash_size, (unsigned int)((tcp_hash_size * sizeof(struct hlist_head)) >> 10));
+	seq_printf(seq, "Ring: size %u mem %uK\n",
+	bufsize, (unsigned int)((bufsize * sizeof(struct tcp_log)) >> 10));
+	seq_printf(seq, "Capture: size %u mem %uK pending %d remaining %ds\n",
+	tcp_capture.size, (unsigned int)((tcp_capture.size * sizeof(struct tcp_log)) >> 10),
+	tcp_ring_used(&tcp_capture), tcpprobe_capture_remaining());
+	seq_printf(seq, "Memory: used %luK limit %uK\n",
+	tcpprobe_mem_used() >> 10, mem_limit_mb << 10);
+	seq_printf(seq, "cpu# hash_stat: <search_flows found new reset>, ack_drop: <purge_in_progress ring_full rate_limit fair_share>, conn_drop: <maxflow_reached memory_alloc_failed>, err: <multiple_reader copy_failed>, export: <netlink_overrun>, mem: <evicted agent_skipped>, capture: <dropped>\n");
+	seq_printf(seq, "Total: hash_stat: %6llu %6llu %6llu %6llu, ack_drop: %6llu %6llu %6llu %6llu, conn_drop: %6llu %6llu, err: %6llu %6llu, export: %6llu, mem: %6llu %6llu, capture: %6llu\n",
 	stat.searched, stat.found, stat.notfound, stat.reset_flows,
 	stat.ack_drop_purge, stat.ack_drop_ring_full,
+	stat.ack_drop_rate, stat.ack_drop_fair,
 	stat.conn_maxflow_limit, stat.conn_memory_limit,
-	stat.multiple_readers, stat.copy_error);
+	stat.multiple_readers, stat.copy_error,
+	stat.netlink_overrun,
+	stat.conn_evicted, stat.agent_skipped, stat.capture_drop);
 	if (num_present_cpus() > 1) {
 		for_each_present_cpu(cpu) {
 			struct tcpprobe_stat *cpu_stat = &per_cpu(tcpprobe_stat, cpu);
-			seq_printf(seq, "cpu%u: hash_stat: %6llu %6llu %6llu %6llu, ack_drop: %6llu %6llu, conn_drop: %6llu %6llu, err: %6llu %6llu\n",
+			seq_printf(seq, "cpu%u: hash_stat: %6llu %6llu %6llu %6llu, ack_drop: %6llu %6llu %6llu %6llu, conn_drop: %6llu %6llu, err: %6llu %6llu, export: %6llu, mem: %6llu %6llu, capture: %6llu\n",
 			cpu,
 			cpu_stat->searched, cpu_stat->found, stat.notfound, stat.reset_flows,
 			cpu_stat->ack_drop_purge, cpu_stat->ack_drop_ring_full,
+			cpu_stat->ack_drop_rate, cpu_stat->ack_drop_fair,
 			cpu_stat->conn_maxflow_limit, cpu_stat->conn_memory_limit,
-			cpu_stat->multiple_readers, cpu_stat->copy_error);
+			cpu_stat->multiple_readers, cpu_stat->copy_error,
+			cpu_stat->netlink_overrun,
+			cpu_stat->conn_evicted, cpu_stat->agent_skipped,
+			cpu_stat->capture_drop);
 		}
 	}
 	return 0;
@@ -176,11 +366,97 @@ static int tcpprobe_seq_open(struct inode *inode, struct file *file)
 	return single_open(file, tcpprobe_seq_show, NULL);
 }
 
+/*
+ * procfs flow table dump /proc/net/tcpprobe_flows
+ * Position 0 is the header, position n is bucket n-1 of the hash table.
+ * The buckets are walked without lock (RCU), so the dump never blocks
+ * the hooks, even with millions of flows.
+ */
+static void *tcpprobe_flows_seq_start(struct seq_file *seq, loff_t *pos)
+{
+	if (*pos == 0)
+		return SEQ_START_TOKEN;
+	return *pos <= tcp_hash_size ? pos : NULL;
+}
+
+static void *tcpprobe_flows_seq_next(struct seq_file *seq, void *v, loff_t *pos)
+{
+	(*pos)++;
+	return *pos <= tcp_hash_size ? pos : NULL;
+}
+
+static void tcpprobe_flows_seq_stop(struct seq_file *seq, void *v)
+{
+}
+
+static int tcpprobe_flows_seq_show(struct seq_file *seq, void *v)
+{
+	struct tcp_hash_flow *flow;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	struct hlist_node *node;
+#endif
+	unsigned int bucket;
+	ktime_t tstamp;
+	struct tcp_flow_sample last;
+	const char *agent;
+
+	if (v == SEQ_START_TOKEN) {
+		seq_printf(seq, "flow_id src dst socket_idf first_ack idle_ms rto_num snd_cwnd srtt state state_ms user_agent\n");
+		return 0;
+	}
+	bucket = *(loff_t *) v - 1;
+	tstamp = ktime_get();
+
+	rcu_read_lock();
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	hlist_for_each_entry_rcu(flow, node, tcp_hash_bucket(bucket), hlist) {
+#else
+	hlist_for_each_entry_rcu(flow, tcp_hash_bucket(bucket), hlist) {
+#endif
+		tcp_flow_read_sample(flow, &last);
+		agent = ACCESS_ONCE(flow->user_agent);
+		/* state and state_since change together under tcp_probe.lock,
+		 * a dump racing with a change may show the old state */
+		seq_printf(seq, "%x %pI4:%u %pI4:%u %llx %x %lld %u %u %u %u %lld %s\n",
+			flow->flow_id, &flow->tuple.saddr, ntohs(flow->tuple.sport),
+			&flow->tuple.daddr, ntohs(flow->tuple.dport),
+			flow->first_seq_num, flow->first_ack_num,
+			ktime_to_ms(ktime_sub(tstamp, tcp_flow_tstamp(flow))),
+			atomic_read(&flow->rto_num), last.snd_cwnd, last.srtt,
+			ACCESS_ONCE(flow->states.state),
+			div_s64(ktime_to_ns(tstamp) - ACCESS_ONCE(flow->state_since), NSEC_PER_MSEC),
+			agent ? agent : "-");
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+static const struct seq_operations tcpprobe_flows_seq_ops = {
+	.start = tcpprobe_flows_seq_start,
+	.next  = tcpprobe_flows_seq_next,
+	.stop  = tcpprobe_flows_seq_stop,
+	.show  = tcpprobe_flows_seq_show,
+};
+
+static int tcpprobe_flows_seq_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &tcpprobe_flows_seq_ops);
+}
+
 const struct file_operations tcpprobe_fops = {
 	.owner	 = THIS_MODULE,
 	.open	 = tcpprobe_open,
 	.read    = tcpprobe_read,
-	.llseek  = noop_llseek,
+	.llseek  = tcpprobe_llseek,
+	.release = tcpprobe_release,
+};
+
+const struct file_operations tcpprobe_flows_fops = {
+	.owner = THIS_MODULE,
+	.open  = tcpprobe_flows_seq_open,
+	.read  = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release,
 };
 
 const struct file_operations tcpprobe_stat_fops = {
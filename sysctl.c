@@ -60,6 +60,131 @@ module_param(debug, int , 0);
 int purgetime __read_mostly = 300;
 MODULE_PARM_DESC(purgetime, "Max inactivity in seconds before purging a flow (Default 300 seconds)");
 
+int export_mode __read_mostly = TCPPROBE_EXPORT_PROCFS;
+MODULE_PARM_DESC(export_mode, "Record export: 0=/proc/net/tcpprobe_data, 1=generic netlink multicast, 2=trace events (Default 0)");
+module_param(export_mode, int, 0);
+
+int numa_node __read_mostly = NUMA_NO_NODE;
+MODULE_PARM_DESC(numa_node, "NUMA node of the ring and of the hash table, e.g. the node of the reader (Default -1: node loading the module)");
+module_param(numa_node, int, 0);
+
+int mem_limit_mb __read_mostly = 0;
+MODULE_PARM_DESC(mem_limit_mb, "Memory budget in MB for the ring, the hash table and the flows (Default 0: no limit)");
+module_param(mem_limit_mb, int, 0);
+
+int reset_on_open __read_mostly = 0;
+MODULE_PARM_DESC(reset_on_open, "Discard buffered records when /proc/net/tcpprobe_data is opened (Default 0)");
+module_param(reset_on_open, int, 0);
+
+int unload_wait_ms __read_mostly = 1000;
+MODULE_PARM_DESC(unload_wait_ms, "Max time in milliseconds to wait for the reader to drain the purge records at unload (Default 1000)");
+module_param(unload_wait_ms, int, 0);
+
+int flowid __read_mostly = 0;
+MODULE_PARM_DESC(flowid, "Identify the flow of a record by its flow id instead of its tuple (Default 0)");
+module_param(flowid, int, 0);
+
+unsigned int capture_bufsize __read_mostly = 0;
+MODULE_PARM_DESC(capture_bufsize, "Burst capture buffer size in packets (Default 0: no burst capture)");
+module_param(capture_bufsize, uint, 0);
+
+int flow_rate __read_mostly = 0;
+MODULE_PARM_DESC(flow_rate, "Max records per second and per flow (Default 0: no limit)");
+module_param(flow_rate, int, 0);
+
+int flow_burst __read_mostly = 10;
+MODULE_PARM_DESC(flow_burst, "Records a flow may write in a row above flow_rate (Default 10)");
+module_param(flow_burst, int, 0);
+
+int fair_share __read_mostly = 50;
+MODULE_PARM_DESC(fair_share, "Ring occupancy in percent above which each flow is limited to its share of the ring (Default 50, 0: never)");
+module_param(fair_share, int, 0);
+
+int stall_ms __read_mostly = 0;
+MODULE_PARM_DESC(stall_ms, "Time in milliseconds without progress after which a flow is reported stalled (Default 0: no detection)");
+module_param(stall_ms, int, 0);
+
+int ecn_interval_ms __read_mostly = 0;
+MODULE_PARM_DESC(ecn_interval_ms, "Count the ECN marks of every packet and report them per flow at most every ecn_interval_ms (Default 0: no ECN accounting)");
+module_param(ecn_interval_ms, int, 0);
+
+int hostq_interval_ms __read_mostly = 0;
+MODULE_PARM_DESC(hostq_interval_ms, "Report the host side queueing (pacing, TSQ, send buffer) of every flow every hostq_interval_ms (Default 0: no report)");
+module_param(hostq_interval_ms, int, 0);
+
+int listen_interval_ms __read_mostly = 0;
+MODULE_PARM_DESC(listen_interval_ms, "Report the accept queue of the listeners every listen_interval_ms (Default 0: listeners are not tracked)");
+module_param(listen_interval_ms, int, 0);
+
+/* Seconds of the burst capture, see proc_capture() */
+static int capture;
+
+static int zero = 0;
+static int one = 1;
+static int hundred = 100;
+static int port_max = UINT16_MAX;
+static int debug_max = TRACE_ENABLE;
+static int export_max = TCPPROBE_EXPORT_MAX;
+static int capture_max = TCPPROBE_CAPTURE_MAX;
+
+/*
+ * Writing n to the capture sysctl starts a burst capture of n seconds,
+ * 0 stops it. Reading it gives the seconds left.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
+static int proc_capture(struct ctl_table *table, int write, struct file *filp,
+		void __user *buffer, size_t *lenp, loff_t *ppos)
+#else
+static int proc_capture(struct ctl_table *table, int write,
+		void __user *buffer, size_t *lenp, loff_t *ppos)
+#endif
+{
+	int ret;
+
+	if (!write)
+		capture = tcpprobe_capture_remaining();
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
+	ret = proc_dointvec_minmax(table, write, filp, buffer, lenp, ppos);
+#else
+	ret = proc_dointvec_minmax(table, write, buffer, lenp, ppos);
+#endif
+	if (ret || !write)
+		return ret;
+	return tcpprobe_capture_arm(capture);
+}
+
+/*
+ * Settings that the hooks read: writing one publishes the whole
+ * configuration again (see config.c). The global is written under the
+ * lock of the configuration, and is restored if it cannot be published.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
+static int proc_config(struct ctl_table *table, int write, struct file *filp,
+		void __user *buffer, size_t *lenp, loff_t *ppos)
+#else
+static int proc_config(struct ctl_table *table, int write,
+		void __user *buffer, size_t *lenp, loff_t *ppos)
+#endif
+{
+	int *value = table->data;
+	int old, ret;
+
+	tcpprobe_config_lock();
+	old = *value;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
+	ret = proc_dointvec_minmax(table, write, filp, buffer, lenp, ppos);
+#else
+	ret = proc_dointvec_minmax(table, write, buffer, lenp, ppos);
+#endif
+	if (!ret && write) {
+		ret = tcpprobe_config_publish();
+		if (ret)
+			*value = old;
+	}
+	tcpprobe_config_unlock();
+	return ret;
+}
+
 struct ctl_table tcpprobe_sysctl_table[] = {
 	{
 		_CTL_NAME(1)
@@ -67,7 +192,9 @@ struct ctl_table tcpprobe_sysctl_table[] = {
 		.mode = 0644,
 		.data = &debug,
 		.maxlen = sizeof(int),
-		.proc_handler = &proc_dointvec,
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
+		.extra2 = &debug_max,
 	},
 	{
 		_CTL_NAME(2)
@@ -75,7 +202,8 @@ struct ctl_table tcpprobe_sysctl_table[] = {
 		.mode = 0644,
 		.data = &probetime,
 		.maxlen = sizeof(int),
-		.proc_handler = &proc_dointvec,
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
 	},
 	{
 		_CTL_NAME(3)
@@ -83,7 +211,8 @@ struct ctl_table tcpprobe_sysctl_table[] = {
 		.mode = 0644,
 		.data = &maxflows,
 		.maxlen = sizeof(int),
-		.proc_handler = &proc_dointvec,
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
 	},
 	{
 		_CTL_NAME(4)
@@ -91,7 +220,9 @@ struct ctl_table tcpprobe_sysctl_table[] = {
 		.mode = 0644,
 		.data = &full,
 		.maxlen = sizeof(int),
-		.proc_handler = &proc_dointvec,
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
+		.extra2 = &one,
 	},
 	{
 		_CTL_NAME(5)
@@ -99,7 +230,9 @@ struct ctl_table tcpprobe_sysctl_table[] = {
 		.mode = 0644,
 		.data = &port,
 		.maxlen = sizeof(int),
-		.proc_handler = &proc_dointvec,
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
+		.extra2 = &port_max,
 	},
 	{
 		_CTL_NAME(6)
@@ -120,10 +253,11 @@ struct ctl_table tcpprobe_sysctl_table[] = {
 	{ 
 		_CTL_NAME(8)
 		.procname = "purge_time",
-		.mode = 0644, 
+		.mode = 0644,
 		.data = &purgetime,
 		.maxlen = sizeof(int),
-		.proc_handler = &proc_dointvec, 
+		.proc_handler = &proc_config,
+		.extra1 = &one,
 	},
 	{
 		_CTL_NAME(9)
@@ -131,7 +265,130 @@ struct ctl_table tcpprobe_sysctl_table[] = {
 		.mode = 0644,
 		.data = &readnum,
 		.maxlen = sizeof(int),
-		.proc_handler = &proc_dointvec,
+		.proc_handler = &proc_config,
+		.extra1 = &one,
+	},
+	{
+		_CTL_NAME(10)
+		.procname = "export",
+		.mode = 0644,
+		.data = &export_mode,
+		.maxlen = sizeof(int),
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
+		.extra2 = &export_max,
+	},
+	{
+		_CTL_NAME(11)
+		.procname = "reset_on_open",
+		.mode = 0644,
+		.data = &reset_on_open,
+		.maxlen = sizeof(int),
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
+		.extra2 = &one,
+	},
+	{
+		_CTL_NAME(12)
+		.procname = "mem_limit_mb",
+		.mode = 0644,
+		.data = &mem_limit_mb,
+		.maxlen = sizeof(int),
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
+	},
+	{
+		_CTL_NAME(13)
+		.procname = "unload_wait_ms",
+		.mode = 0644,
+		.data = &unload_wait_ms,
+		.maxlen = sizeof(int),
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
+	},
+	{
+		_CTL_NAME(14)
+		.procname = "flowid",
+		.mode = 0644,
+		.data = &flowid,
+		.maxlen = sizeof(int),
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
+		.extra2 = &one,
+	},
+	{
+		_CTL_NAME(15)
+		.procname = "capture",
+		.mode = 0644,
+		.data = &capture,
+		.maxlen = sizeof(int),
+		.proc_handler = &proc_capture,
+		.extra1 = &zero,
+		.extra2 = &capture_max,
+	},
+	{
+		_CTL_NAME(16)
+		.procname = "flow_rate",
+		.mode = 0644,
+		.data = &flow_rate,
+		.maxlen = sizeof(int),
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
+	},
+	{
+		_CTL_NAME(17)
+		.procname = "flow_burst",
+		.mode = 0644,
+		.data = &flow_burst,
+		.maxlen = sizeof(int),
+		.proc_handler = &proc_config,
+		.extra1 = &one,
+	},
+	{
+		_CTL_NAME(18)
+		.procname = "fair_share",
+		.mode = 0644,
+		.data = &fair_share,
+		.maxlen = sizeof(int),
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
+		.extra2 = &hundred,
+	},
+	{
+		_CTL_NAME(19)
+		.procname = "stall_ms",
+		.mode = 0644,
+		.data = &stall_ms,
+		.maxlen = sizeof(int),
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
+	},
+	{
+		_CTL_NAME(20)
+		.procname = "ecn_interval_ms",
+		.mode = 0644,
+		.data = &ecn_interval_ms,
+		.maxlen = sizeof(int),
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
+	},
+	{
+		_CTL_NAME(21)
+		.procname = "hostq_interval_ms",
+		.mode = 0644,
+		.data = &hostq_interval_ms,
+		.maxlen = sizeof(int),
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
+	},
+	{
+		_CTL_NAME(22)
+		.procname = "listen_interval_ms",
+		.mode = 0644,
+		.data = &listen_interval_ms,
+		.maxlen = sizeof(int),
+		.proc_handler = &proc_config,
+		.extra1 = &zero,
 	},
 	{}
 };
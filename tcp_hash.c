@@ -14,6 +14,11 @@
 #include <linux/swap.h>
 #include <linux/random.h>
 #include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+#include <linux/cred.h>
+#endif
 
 
 #include <net/tcp.h>
@@ -21,26 +26,112 @@
 #include "tcp_probe_plus.h"
 
 unsigned int tcp_hash_rnd;
-struct hlist_head *tcp_hash __read_mostly; /* hash table memory */
+struct tcpprobe_table tcp_hash __read_mostly; /* of struct hlist_head */
 unsigned int tcp_hash_size __read_mostly = 0; /* buckets */
 struct kmem_cache *tcp_flow_cachep __read_mostly; /* tcp flow memory */
+atomic_long_t agent_mem = ATOMIC_LONG_INIT(0); /* user agent memory */
 
 void tcp_hash_flow_free(struct tcp_hash_flow *flow)
 {
-	atomic_dec(&flow_count);
+	if (flow->user_agent) {
+		atomic_long_sub(strlen(flow->user_agent) + 1, &agent_mem);
+		kfree(flow->user_agent);
+	}
 	kmem_cache_free(tcp_flow_cachep, flow);
 }
 
+static void tcp_hash_flow_free_rcu(struct rcu_head *head)
+{
+	tcp_hash_flow_free(container_of(head, struct tcp_hash_flow, rcu));
+}
+
+/*
+ * Remove the flow from the hash table and from the flow list. The memory
+ * is released once the hooks that may have found the flow are done with it.
+ * Assumes that tcp_hash_lock has been taken.
+ */
+void tcp_flow_unlink(struct tcp_hash_flow *flow)
+{
+	// Remove from Hashtable
+	hlist_del_rcu(&flow->hlist);
+	// Remove from Global List
+	list_del(&flow->list);
+	atomic_dec(&flow_count);
+	// Free memory
+	call_rcu(&flow->rcu, tcp_hash_flow_free_rcu);
+}
+
+/*
+ * Store a copy of the user agent in the flow. The agent is not stored
+ * when it would exceed mem_limit_mb.
+ */
+void tcp_flow_set_agent(const struct tcpprobe_config *cfg, struct tcp_hash_flow *flow,
+		const char *agent)
+{
+	size_t len = strlen(agent) + 1;
+	char *copy;
+
+	if (tcpprobe_mem_exceeded(cfg, len)) {
+		TCPPROBE_STAT_INC(agent_skipped);
+		return;
+	}
+	copy = kmalloc(len, GFP_ATOMIC);
+	if (!copy) {
+		return;
+	}
+	memcpy(copy, agent, len);
+	/* the hooks of the flow may race to store it, the first one wins */
+	if (cmpxchg(&flow->user_agent, NULL, copy) != NULL) {
+		kfree(copy);
+		return;
+	}
+	atomic_long_add(len, &agent_mem);
+}
+
+/*
+ * Record the process that owns the socket of the flow, once. Only from
+ * process context (sendmsg, recvmsg, accept): in softirq, current is
+ * whatever task was interrupted.
+ */
+void tcp_flow_set_owner(struct tcp_hash_flow *flow)
+{
+	struct tcp_owner_stat *o = &flow->owner;
+
+	if (ACCESS_ONCE(flow->owned) || in_interrupt() ||
+		(current->flags & PF_KTHREAD))
+		return;
+	/* the hooks of the flow may race to store it, the first one wins */
+	if (cmpxchg(&flow->owned, 0, TCP_OWNER_FILLING) != 0)
+		return;
+	o->pid = task_pid_nr(current);
+	o->tgid = task_tgid_nr(current);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0)
+	o->uid = from_kuid_munged(&init_user_ns, current_uid());
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+	o->uid = current_uid();
+#else
+	o->uid = current->uid;
+#endif
+	get_task_comm(o->comm, current);
+	/* the records read owner once they see TCP_OWNER_SET */
+	smp_wmb();
+	flow->owned = TCP_OWNER_SET;
+}
+
+/*
+ * Look up a flow. Called either under rcu_read_lock() or with
+ * tcp_hash_lock taken.
+ */
 struct tcp_hash_flow* 
 tcp_flow_find(const struct tcp_tuple *tuple, unsigned int hash)
 {
 	struct tcp_hash_flow *flow;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
 	struct hlist_node *pos;
-	hlist_for_each_entry(flow, pos, &tcp_hash[hash], hlist) {
+	hlist_for_each_entry_rcu(flow, pos, tcp_hash_bucket(hash), hlist) {
 #else
 	//Second argument was removed 
-	hlist_for_each_entry(flow, &tcp_hash[hash], hlist) {
+	hlist_for_each_entry_rcu(flow, tcp_hash_bucket(hash), hlist) {
 #endif
 		if (tcp_tuple_equal(tuple, &flow->tuple)) {
 			TCPPROBE_STAT_INC(found);
@@ -52,32 +143,51 @@ tcp_flow_find(const struct tcp_tuple *tuple, unsigned int hash)
 	return NULL;
 }
 
+/* Id of the last flow created, protected by tcp_hash_lock */
+static u32 tcp_flow_last_id;
+
 static struct tcp_hash_flow*
 tcp_hash_flow_alloc(struct tcp_tuple *tuple)
 {
 	struct tcp_hash_flow *flow;
-	flow = kmem_cache_alloc(tcp_flow_cachep, GFP_ATOMIC);
+	/* on the node of the CPU that sees the flow first */
+	flow = kmem_cache_alloc_node(tcp_flow_cachep, GFP_ATOMIC, numa_node_id());
 	if (!flow) {
 		pr_err("Cannot allocate tcp_hash_flow.\n");
 		TCPPROBE_STAT_INC(conn_memory_limit);
 		return NULL;
 	}
 	memset(flow, 0, sizeof(struct tcp_hash_flow));
+	seqcount_init(&flow->seq);
 	flow->tuple = *tuple;
 	atomic_inc(&flow_count);
 	return flow;
 }
 
+/*
+ * Create a flow and publish it to the lockless lookups. The flow is fully
+ * initialized before it can be found.
+ * Assumes that tcp_hash_lock has been taken.
+ */
 struct tcp_hash_flow* init_tcp_hash_flow(struct tcp_tuple *tuple,
-		ktime_t tstamp, unsigned int hash)
+		ktime_t tstamp, unsigned int hash, u64 first_seq_num, u32 first_ack_num)
 {
 	struct tcp_hash_flow *flow;
 	flow = tcp_hash_flow_alloc(tuple);
 	if (!flow) {
 		return NULL;
 	}
-	flow->tstamp = tstamp;
-	hlist_add_head(&flow->hlist, &tcp_hash[hash]);
+	atomic64_set(&flow->tstamp, ktime_to_ns(tstamp));
+	atomic_set(&flow->rto_num, 0);
+	/* the time until the first change is given to the state it leaves */
+	flow->state_since = ktime_to_ns(tstamp);
+	flow->first_seq_num = first_seq_num;
+	flow->first_ack_num = first_ack_num;
+	/* 0 means no flow */
+	if (++tcp_flow_last_id == 0)
+		tcp_flow_last_id = 1;
+	flow->flow_id = tcp_flow_last_id;
+	hlist_add_head_rcu(&flow->hlist, tcp_hash_bucket(hash));
 	INIT_LIST_HEAD(&flow->list);
 	list_add(&flow->list, &tcp_flow_list);
 	
@@ -1,4 +1,12 @@
+#ifndef _TCP_PROBE_PLUS_H
+#define _TCP_PROBE_PLUS_H
+
+#include "tcp_probe_plus_uapi.h"
+
 #define PROC_TCPPROBE "tcpprobe_data"
+#define PROC_TCPPROBE_FLOWS "tcpprobe_flows"
+#define PROC_TCPPROBE_CAPTURE "tcpprobe_capture"
+#define PROC_TCPPROBE_CTL "tcpprobe_ctl"
 
 #define PROC_SYSCTL_TCPPROBE  "tcpprobe_plus"
 #define PROC_STAT_TCPPROBE "tcpprobe_plus"
@@ -42,27 +50,237 @@ struct tcp_tuple {
 /* tuple size is rounded to u32s */
 #define TCP_TUPLE_SIZE (sizeof(struct tcp_tuple) / 4)
 
+/* Compact copy of the socket state of the last record written for a flow */
+struct tcp_flow_sample {
+	u8 ca_state;
+	u8 frto_counter;
+	u64 snd_nxt;
+	u32 snd_una;
+	u32 snd_wnd;
+	u32 snd_cwnd;
+	u32 rcv_wnd;
+	u32 ssthresh;
+	u32 srtt;
+	u32 mdev;
+	u32 rttvar;
+	u32 rto;
+	u32 packets_out;
+	u32 lost_out;
+	u32 sacked_out;
+	u32 retrans_out;
+	u32 retrans;
+	u32 write_seq;
+	u32 rqueue;
+	u32 wqueue;
+};
+
+/* Retransmissions of a flow since its previous record (LOG_RETRANS) */
+struct tcp_retx_stat {
+	u32 fast;     /* retransmits in recovery (fast retransmit, RACK, ...) */
+	u32 rto;      /* retransmits after a retransmit timeout */
+	u32 tlp;      /* tail loss probes */
+	u32 spurious; /* retransmits reported unneeded by a DSACK */
+	u32 bytes;    /* bytes retransmitted */
+	u32 seq_lo;   /* lowest sequence number retransmitted (relative) */
+	u32 seq_hi;   /* highest end sequence number retransmitted (relative) */
+};
+
+/* A flow that made no progress for stall_ms (LOG_STALL) */
+struct tcp_stall_stat {
+	u32 cause;       /* TCPPROBE_STALL_* */
+	u32 stalled_ms;  /* time without progress */
+	u32 snd_una;     /* relative */
+	u32 snd_wnd;
+	u32 wqueue;
+	u32 rqueue;
+	u32 packets_out;
+	u32 rto_num;     /* retransmit timeouts during the stall */
+};
+
+/* ECN marks of a flow over ecn_interval_ms (LOG_ECN) */
+struct tcp_ecn_stat {
+	u32 acks;         /* ACKs received */
+	u32 ece_acks;     /* ... with ECE set */
+	u32 acked_bytes;  /* bytes newly acknowledged */
+	u32 ece_bytes;    /* ... by ACKs with ECE set (DCTCP) */
+	u32 ece_permille; /* ece_bytes / acked_bytes, per mille */
+	u32 cwr;          /* segments received with CWR set */
+	u32 data_pkts;    /* data segments received */
+	u32 data_bytes;
+	u32 ce_pkts;      /* ... marked CE by the network */
+	u32 ce_bytes;
+	u32 ce_permille;  /* ce_bytes / data_bytes, per mille */
+};
+
+/* Counters of struct tcp_ecn_stat, updated by the RX hooks without lock */
+struct tcp_ecn_count {
+	atomic_t acks;
+	atomic_t ece_acks;
+	atomic_t acked_bytes;
+	atomic_t ece_bytes;
+	atomic_t cwr;
+	atomic_t data_pkts;
+	atomic_t data_bytes;
+	atomic_t ce_pkts;
+	atomic_t ce_bytes;
+};
+
+/* Host side queueing of a flow over hostq_interval_ms (LOG_HOSTQ) */
+struct tcp_hostq_stat {
+	u64 pacing_rate;     /* bytes per second, ~0 when not paced */
+	u32 wmem_queued;     /* bytes in the write queue */
+	u32 wmem_queued_max;
+	u32 wmem_alloc;      /* bytes sent but still in the qdisc or the device */
+	u32 wmem_alloc_max;
+	u32 tsq_ms;          /* time throttled by TCP small queues */
+	u32 pacing_ms;       /* time waiting for the pacing timer */
+	u32 sndbuf_ms;       /* time limited by the send buffer */
+	u32 events;          /* packets sent and received in the interval */
+};
+
+/*
+ * Host side queueing of a flow since its last LOG_HOSTQ, only updated by
+ * the hooks of the flow, which the socket lock serializes.
+ */
+struct tcp_hostq_count {
+	s64 last_ns;  /* last LOG_HOSTQ, start of the interval */
+	s64 prev_ns;  /* previous packet */
+	int prev_state; /* TCP_HOSTQ_* at the previous packet */
+	u32 wmem_queued_max;
+	u32 wmem_alloc_max;
+	u64 tsq_ns;
+	u64 pacing_ns;
+	u32 sndbuf_prev; /* send buffer limited time at last_ns, ms */
+	u32 events;
+};
+
+/* Aggregates of the listeners of a port over listen_interval_ms (LOG_LISTEN) */
+struct tcp_listen_stat {
+	u32 port;
+	u32 conns;           /* connections established */
+	u32 overflows;       /* ... dropped because the accept queue was full */
+	u32 accepts;         /* connections accepted by the application */
+	u32 backlog_max;     /* deepest accept queue seen by a new connection */
+	u32 backlog_avg;
+	u32 max_backlog;     /* listen() backlog */
+	u32 accept_avg_us;   /* time from establishment to accept() */
+	u32 accept_max_us;
+};
+
+/* Process owning the socket of a flow (LOG_OWNER) */
+struct tcp_owner_stat {
+	u32 pid;
+	u32 tgid;
+	u32 uid;
+	char comm[TCPPROBE_COMM_LEN];
+};
+
+/* tcp_hash_flow.owned */
+#define TCP_OWNER_FILLING 1
+#define TCP_OWNER_SET 2
+
+/*
+ * Time spent by a flow in each TCP state (LOG_STATES), indexed by state.
+ * The time in the last state runs until the done or purge record.
+ */
+struct tcp_states_stat {
+	u32 state;           /* TCP state at the end, 0 if no change was seen */
+	u32 transitions;
+	u32 ms[TCPPROBE_TCP_STATES];
+};
+
+static inline int tcp_retx_pending(const struct tcp_retx_stat *r) {
+	return r->fast || r->rto || r->tlp || r->spurious;
+}
+
+/*
+ * A flow is looked up without lock (RCU) by the hooks; tcp_hash_lock is only
+ * taken to insert or remove flows. The mutable state is updated without
+ * any shared lock:
+ *  - tstamp, rto_num, rate_tat and ecn are atomics,
+ *  - user_agent is set once (cmpxchg) and freed with the flow,
+ *  - owner is set once, owned (cmpxchg) tells when it can be read,
+ *  - last, defined, dead, retx, ecn_last, states, owner_written and the
+ *    fair share counters are
+ *    written with tcp_probe.lock held (as the records are), last is read
+ *    consistently through seq by the readers that do not hold
+ *    tcp_probe.lock.
+ */
 struct tcp_hash_flow {
 	struct hlist_node hlist; // hashtable search chain
-	struct list_head list; // all flows chain
+	struct list_head list; // all flows chain, protected by tcp_hash_lock
+	struct rcu_head rcu;
 	
 	/* unique per flow data (hashed, TCP_TUPLE_SIZE) */
 	struct tcp_tuple tuple;
 	
-	/* Last ACK Timestamp */
-	ktime_t tstamp;
+	/* Last ACK Timestamp, in ns (see tcp_flow_tstamp()) */
+	atomic64_t tstamp;
 	u32 first_ack_num;
 	/* remember last sequence number */
 	u32 last_seq_num;
 	u64 first_seq_num;
-	unsigned rto_num; /* # of retransmit timeout */
-	char user_agent[MAX_AGENT_LEN];
+	atomic_t rto_num; /* # of retransmit timeout */
+	atomic64_t rate_tat; /* token bucket: earliest time of the next record, in ns */
+	u64 fair_epoch; /* ring epoch of fair_records (see tcp_flow_fair_ok()) */
+	u32 fair_records; /* records written in fair_epoch */
+	u32 flow_id; /* never 0, unique until it wraps */
+	int defined; /* LOG_FLOWDEF written */
+	int dead; /* done or purge record written, no more records */
+	char *user_agent; /* allocated to size when found, NULL otherwise */
+	seqcount_t seq; /* protects last */
+	struct tcp_flow_sample last; /* state of the last record */
+	struct tcp_retx_stat retx; /* retransmissions since the last record */
+	struct tcp_ecn_count ecn; /* ECN marks since the last LOG_ECN */
+	s64 ecn_last; /* ns, last LOG_ECN */
+	struct tcp_hostq_count hostq;
+	s64 setup_ns; /* ns, established by tcp_v4_syn_recv_sock(), 0 if not seen */
+	struct tcp_states_stat states; /* time in each TCP state so far */
+	s64 state_since; /* ns, last change of TCP state, or creation of the flow */
+	/* stall detector state, only used by the stall timer */
+	s64 stall_since; /* ns, last progress seen */
+	u32 stall_una;
+	u32 stall_rqueue;
+	int stall_rto;
+	int stalled; /* stall reported, until the flow progresses */
+	/* cold data: the owner, captured once in process context */
+	int owned; /* 0, TCP_OWNER_FILLING or TCP_OWNER_SET */
+	int owner_written; /* LOG_OWNER written */
+	struct tcp_owner_stat owner;
 };
 
+/* Timestamp of the last sample of the flow */
+static inline ktime_t tcp_flow_tstamp(const struct tcp_hash_flow *flow) {
+	return ns_to_ktime(atomic64_read(&flow->tstamp));
+}
+
+/* Consistent copy of the state of the last record of the flow */
+static inline void tcp_flow_read_sample(const struct tcp_hash_flow *flow,
+		struct tcp_flow_sample *s) {
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&flow->seq);
+		*s = flow->last;
+	} while (read_seqcount_retry(&flow->seq, seq));
+}
+
+/* Number of the oldest flows looked at to find the coldest one */
+#define TCP_FLOW_EVICT_SCAN 16
+/* Minimum idle time of a flow purged by the shrinker */
+#define TCP_FLOW_SHRINK_IDLE_MS 1000
+/* Shortest interval between two runs of the stall detector */
+#define TCP_STALL_SCAN_MIN_MS 100
+
+/* Polling interval while draining the ring at unload */
+#define TCP_UNLOAD_POLL_MS 10
+
 /* statistics */
 struct tcpprobe_stat {
 	u64 ack_drop_purge;      /* ACK dropped due to purge in progress */
 	u64 ack_drop_ring_full;  /* ACK dropped due to slow reader */
+	u64 ack_drop_rate;       /* ACK dropped by the per-flow rate limit */
+	u64 ack_drop_fair;       /* ACK dropped because the flow used its fair share of the ring */
 	u64 conn_maxflow_limit;  /* Connection skipped due maxflow limit */ 
 	u64 conn_memory_limit;   /* Connection skipped because memory was unavailable */
 	u64 searched;            /* hash stat - searched */
@@ -71,6 +289,10 @@ struct tcpprobe_stat {
 	u64 multiple_readers;    /* Multiple readers for /proc/net/tcpprobe */
 	u64 copy_error;          /* Userspace copy error */
 	u64 reset_flows; /* Number of FIN/RST received that caused to purge the flow */
+	u64 netlink_overrun;     /* Netlink batch not delivered to every subscriber */
+	u64 conn_evicted;        /* Cold flow purged to stay within mem_limit_mb or by the shrinker */
+	u64 agent_skipped;       /* User agent not stored to stay within mem_limit_mb */
+	u64 capture_drop;        /* Capture record dropped because the capture ring was full */
 };
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24)
@@ -86,10 +308,20 @@ enum {
 	LOG_SETUP,
 	LOG_DONE,
 	LOG_PURGE,
+	LOG_FLOWDEF,	/* flow definition, written before the first record of a flow */
+	LOG_RETRANS,	/* retransmissions of a flow, written before its next record */
+	LOG_STALL,	/* flow without progress for stall_ms */
+	LOG_ECN,	/* ECN marks of a flow, written before its next record */
+	LOG_HOSTQ,	/* host side queueing of a flow over hostq_interval_ms */
+	LOG_LISTEN,	/* accept queue of the listeners of a port over listen_interval_ms */
+	LOG_STATES,	/* time of a flow in each TCP state, written before its last record */
+	LOG_OWNER,	/* process owning a flow, written before its next record once known */
 };
 
 struct tcp_log {
-	/* log type: recv(0), send(1), timeout(2), connection setup(3), tcp_done(4), RTO timeout(5)*/
+	/* log type: recv(0), send(1), timeout(2), connection setup(3), tcp_done(4), purge(5), flow definition(6),
+	 * retransmissions(7), stall(8), ecn(9), host queueing(10),
+	 * listener(11), tcp states(12), owner(13) */
 	u8 type;
 	u8 ca_state;
 	u8 frto_counter;
@@ -99,6 +331,7 @@ struct tcp_log {
 	__be16	sport, dport;
 	u16 rto_num;
 	u16 length;
+	u32 flow_id;
 	u32 seq_num;
 	u32 ack_num;
 	u64 snd_nxt;
@@ -127,9 +360,38 @@ struct tcp_log {
 	/*long seq_rtt_us_tsecr;
 	long seq_rtt_us_skb_mstamp;*/
 	long seq_rtt;
-	char user_agent[MAX_AGENT_LEN];
+	/* records of events carry their payload instead of a user agent */
+	union {
+		char user_agent[MAX_AGENT_LEN];
+		struct tcp_retx_stat retx; /* LOG_RETRANS */
+		struct tcp_stall_stat stall; /* LOG_STALL */
+		struct tcp_ecn_stat ecn; /* LOG_ECN */
+		struct tcp_hostq_stat hostq; /* LOG_HOSTQ */
+		struct tcp_listen_stat listen; /* LOG_LISTEN */
+		struct tcp_states_stat states; /* LOG_STATES */
+		struct tcp_owner_stat owner; /* LOG_OWNER */
+	};
 };
 
+
+/*
+ * Table of fixed size entries, in chunks of the kernel linear mapping so
+ * that tables bigger than the page allocator can give at once are still
+ * mapped with huge pages (see tcpprobe_alloc_table()). A table that falls
+ * back to vmalloc is a single chunk.
+ */
+struct tcpprobe_table {
+	char **chunks;
+	unsigned int nr_chunks;
+	unsigned int shift; /* log2 of the entries of a full chunk */
+	unsigned int entry_size;
+	unsigned long entries;
+};
+
+static inline void *tcpprobe_table_entry(const struct tcpprobe_table *t, unsigned long i) {
+	return t->chunks[i >> t->shift] + (i & ((1UL << t->shift) - 1)) * t->entry_size;
+}
+
 struct tcp_probe_list {
 	spinlock_t lock;
 	wait_queue_head_t wait;
@@ -137,8 +399,14 @@ struct tcp_probe_list {
 	ktime_t start_datetime;
 	u32 lastcwnd;
 	
-	unsigned long head, tail;
-	struct tcp_log *log;
+	/* Sequence numbers of the next record to write and to read. They are
+	 * never reset, so a reader can resume from the sequence number of the
+	 * last record it processed (see tcpprobe_llseek()). */
+	u64 head, tail;
+	unsigned int size; /* records, power of 2 */
+	struct tcpprobe_table log; /* of struct tcp_log */
+	atomic_t readers; /* open /proc/net/tcpprobe_data */
+	int closing; /* set at unload once the ring has been drained */
 };
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24)
@@ -160,21 +428,77 @@ extern int hashsize;
 extern int maxflows;
 extern int debug;
 extern int purgetime;
+extern int export_mode;
+extern int reset_on_open;
+extern int numa_node;
+extern int mem_limit_mb;
+extern int unload_wait_ms;
+extern int flowid;
+extern unsigned int capture_bufsize;
+extern int flow_rate;
+extern int flow_burst;
+extern int fair_share;
+extern int stall_ms;
+extern int ecn_interval_ms;
+extern int hostq_interval_ms;
+extern int listen_interval_ms;
+
+/*
+ * Immutable copy of the settings, published through tcpprobe_cfg (see
+ * config.c). What the packet hooks read comes first.
+ */
+struct tcpprobe_config {
+	int port;
+	int full;
+	int probetime;
+	int flow_rate;
+	int flow_burst;
+	int fair_share;
+	int ecn_interval_ms;
+	int hostq_interval_ms;
+	int listen_interval_ms;
+	int stall_ms;
+	int maxflows;
+	int purgetime;
+	int readnum;
+	int debug;
+	int export_mode;
+	int reset_on_open;
+	int mem_limit_mb;
+	int unload_wait_ms;
+	int flowid;
+	struct rcu_head rcu;
+};
+
+extern struct tcpprobe_config __rcu *tcpprobe_cfg;
+
+/* Bit in the mask of tcpprobe_config_set() of the setting at offset */
+#define TCPPROBE_CFG_BIT(offset) (1U << ((offset) / sizeof(int)))
 
 extern struct tcp_probe_list tcp_probe;
+extern struct tcp_probe_list tcp_capture; /* burst capture ring */
+extern unsigned long capture_until; /* jiffies, 0 when no capture is running */
 
 extern unsigned int tcp_hash_rnd;
 extern unsigned int tcp_hash_size; /* buckets */
-extern struct hlist_head *tcp_hash; /* hash table memory */
+extern struct tcpprobe_table tcp_hash; /* of struct hlist_head */
 extern struct kmem_cache *tcp_flow_cachep; /* tcp flow memory */
 
+extern spinlock_t tcp_hash_lock;
 extern struct timer_list purge_timer;
+extern struct timer_list stall_timer;
+extern struct timer_list listen_timer;
 extern atomic_t flow_count;
+extern atomic_long_t agent_mem;
+extern struct shrinker tcp_flow_shrinker;
 extern struct list_head tcp_flow_list;
 
 
 extern const struct file_operations tcpprobe_fops;
+extern const struct file_operations tcpprobe_capture_fops;
 extern const struct file_operations tcpprobe_stat_fops;
+extern const struct file_operations tcpprobe_flows_fops;
+extern const struct file_operations tcpprobe_ctl_fops;
 
 extern struct ctl_table tcpprobe_sysctl_table[];
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
@@ -183,12 +507,69 @@ extern struct ctl_table tcpprobe_net_table[];
 extern struct ctl_path tcpprobe_sysctl_path[];
 #endif
 
+static inline int tcp_ring_used(const struct tcp_probe_list *ring) {
+	return ring->head - ring->tail;
+}
+
+static inline struct tcp_log *tcp_ring_slot(const struct tcp_probe_list *ring, u64 seq) {
+	return tcpprobe_table_entry(&ring->log, seq & (ring->size - 1));
+}
+
+static inline int tcp_ring_avail(const struct tcp_probe_list *ring) {
+	return ring->size - tcp_ring_used(ring) - 1;
+}
+
 static inline int tcp_probe_used(void) {
-	return (tcp_probe.head - tcp_probe.tail) & (bufsize - 1);
+	return tcp_ring_used(&tcp_probe);
+}
+
+static inline struct tcp_log *tcp_probe_slot(u64 seq) {
+	return tcp_ring_slot(&tcp_probe, seq);
+}
+
+static inline struct hlist_head *tcp_hash_bucket(unsigned int hash) {
+	return tcpprobe_table_entry(&tcp_hash, hash);
+}
+
+/* Oldest record that has not been overwritten yet */
+static inline u64 tcp_probe_oldest(void) {
+	return tcp_probe.head > tcp_probe.size - 1 ? tcp_probe.head - (tcp_probe.size - 1) : 0;
 }
 
 static inline int tcp_probe_avail(void) {
-	return bufsize - tcp_probe_used() - 1;
+	return tcp_ring_avail(&tcp_probe);
+}
+
+/* Is a burst capture running? */
+static inline int tcpprobe_capturing(void) {
+	unsigned long until = ACCESS_ONCE(capture_until);
+	return until && time_before(jiffies, until);
+}
+
+/* Memory footprint of one flow entry, without its user agent */
+static inline size_t tcp_flow_size(void) {
+	return kmem_cache_size(tcp_flow_cachep);
+}
+
+/* Memory of a table: its entries and the array of its chunks */
+static inline unsigned long tcpprobe_table_mem(const struct tcpprobe_table *t) {
+	if (!t->chunks)
+		return 0;
+	return t->entries * t->entry_size + t->nr_chunks * sizeof(*t->chunks);
+}
+
+/* Memory used by the rings, the hash table, the flows and their user agents */
+static inline unsigned long tcpprobe_mem_used(void) {
+	return tcpprobe_table_mem(&tcp_probe.log) + tcpprobe_table_mem(&tcp_capture.log) +
+		tcpprobe_table_mem(&tcp_hash) +
+		atomic_read(&flow_count) * tcp_flow_size() +
+		atomic_long_read(&agent_mem);
+}
+
+/* Would allocating extra bytes more exceed mem_limit_mb? */
+static inline int tcpprobe_mem_exceeded(const struct tcpprobe_config *cfg, size_t extra) {
+	return cfg->mem_limit_mb > 0 &&
+		tcpprobe_mem_used() + extra > ((unsigned long) cfg->mem_limit_mb << 20);
 }
 
 static inline int tcp_tuple_equal(
@@ -207,12 +588,67 @@ void jtcp_transmit_skb(struct sock *sk, struct sk_buff *skb, int clone_it,
 void jtcp_retransmit_timer(struct sock *sk);
 void jtcp_v4_syn_recv_sock(struct sock *sk, struct sk_buff *skb, struct request_sock *req, struct dst_entry *dst);
 void jtcp_v4_do_rcv(struct sock *sk, struct sk_buff *skb);
+void jtcp_set_state(struct sock *sk, int state);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,9,0)
+void jtcp_retransmit_skb(struct sock *sk, struct sk_buff *skb, int segs);
+#else
+void jtcp_retransmit_skb(struct sock *sk, struct sk_buff *skb);
+#endif
+
+int kret_inet_csk_accept(struct kretprobe_instance *ri, struct pt_regs *regs);
+void tcp_listen_syn_recv(const struct tcpprobe_config *cfg, struct sock *sk, ktime_t tstamp);
+void listen_timer_run(unsigned long dummy);
+unsigned long listen_timer_interval(const struct tcpprobe_config *cfg);
+void tcp_listen_free_all(void);
 
 void purge_timer_run(unsigned long dummy);
+void stall_timer_run(unsigned long dummy);
+unsigned long stall_timer_interval(const struct tcpprobe_config *cfg);
 void purge_all_flows(void);
+int purge_cold_flows(const struct tcpprobe_config *cfg, int nr, s64 min_idle_ms);
+
+void tcpprobe_stat_sum(struct tcpprobe_stat *stat);
+int tcpprobe_sprint(const struct tcp_log *p, int compact, char *tbuf, int n);
+
+int tcpprobe_capture_arm(int secs);
+int tcpprobe_capture_remaining(void);
+void tcpprobe_reset_start(void);
+
+int tcpprobe_nl_init(void);
+void tcpprobe_nl_exit(void);
+void tcpprobe_nl_kick(const struct tcpprobe_config *cfg);
+int tcpprobe_nl_listening(void);
+
+void tcpprobe_trace_flush(void);
+
+void tcpprobe_config_lock(void);
+void tcpprobe_config_unlock(void);
+void tcpprobe_config_get(struct tcpprobe_config *c);
+int tcpprobe_config_set(const struct tcpprobe_config *c, u32 mask);
+int tcpprobe_config_publish(void);
+int tcpprobe_config_init(void);
+void tcpprobe_config_exit(void);
+
+/*
+ * Hand the records just written to the ring to the exporter: the trace
+ * exporter consumes them at once, the netlink one is scheduled.
+ * Assumes that the spin_lock on the tcp_probe has been taken.
+ */
+static inline void tcpprobe_commit(const struct tcpprobe_config *cfg) {
+	if (cfg->export_mode == TCPPROBE_EXPORT_TRACE)
+		tcpprobe_trace_flush();
+	else
+		tcpprobe_nl_kick(cfg);
+}
 
 void tcp_hash_flow_free(struct tcp_hash_flow *flow);
+void tcp_flow_unlink(struct tcp_hash_flow *flow);
 struct tcp_hash_flow* tcp_flow_find(const struct tcp_tuple *tuple,
 		unsigned int hash);
+void tcp_flow_set_agent(const struct tcpprobe_config *cfg, struct tcp_hash_flow *flow,
+		const char *agent);
+void tcp_flow_set_owner(struct tcp_hash_flow *flow);
 struct tcp_hash_flow* init_tcp_hash_flow(struct tcp_tuple *tuple,
-		ktime_t tstamp, unsigned int hash);
+		ktime_t tstamp, unsigned int hash, u64 first_seq_num, u32 first_ack_num);
+
+#endif /* _TCP_PROBE_PLUS_H */
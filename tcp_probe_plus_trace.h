@@ -0,0 +1,194 @@
+/*
+ * Trace events of tcp_probe_plus, the records of the ring when the
+ * "export" sysctl is TCPPROBE_EXPORT_TRACE. They appear under
+ * /sys/kernel/debug/tracing/events/tcp_probe_plus/ and can be consumed
+ * with perf, trace-cmd or the tracefs files.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tcp_probe_plus
+
+#if !defined(_TCP_PROBE_PLUS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TCP_PROBE_PLUS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "tcp_probe_plus.h"
+
+/* Records with the socket state: recv, send, setup, done, timeout, purge */
+DECLARE_EVENT_CLASS(tcp_probe_plus_record,
+
+	TP_PROTO(const struct tcp_log *p, u64 tstamp),
+
+	TP_ARGS(p, tstamp),
+
+	TP_STRUCT__entry(
+		__field(u8, type)
+		__field(u64, tstamp)
+		__field(u32, flow_id)
+		__field(__be32, saddr)
+		__field(__be32, daddr)
+		__field(u16, sport)
+		__field(u16, dport)
+		__field(u16, length)
+		__field(u8, tcp_flags)
+		__field(u32, seq_num)
+		__field(u32, ack_num)
+		__field(u8, ca_state)
+		__field(u64, snd_nxt)
+		__field(u32, snd_una)
+		__field(u32, write_seq)
+		__field(u32, wqueue)
+		__field(u32, rqueue)
+		__field(u32, snd_cwnd)
+		__field(u32, ssthresh)
+		__field(u32, snd_wnd)
+		__field(u32, rcv_wnd)
+		__field(u32, srtt)
+		__field(u32, mdev)
+		__field(u32, rttvar)
+		__field(u32, rto)
+		__field(u32, packets_out)
+		__field(u32, lost_out)
+		__field(u32, sacked_out)
+		__field(u32, retrans_out)
+		__field(u32, retrans)
+		__field(u8, frto_counter)
+		__field(u16, rto_num)
+		__field(u64, socket_idf)
+		__string(user_agent, p->user_agent)
+	),
+
+	TP_fast_assign(
+		__entry->type = p->type;
+		__entry->tstamp = tstamp;
+		__entry->flow_id = p->flow_id;
+		__entry->saddr = p->saddr;
+		__entry->daddr = p->daddr;
+		__entry->sport = ntohs(p->sport);
+		__entry->dport = ntohs(p->dport);
+		__entry->length = p->length;
+		__entry->tcp_flags = p->tcp_flags;
+		__entry->seq_num = p->seq_num;
+		__entry->ack_num = p->ack_num;
+		__entry->ca_state = p->ca_state;
+		__entry->snd_nxt = p->snd_nxt;
+		__entry->snd_una = p->snd_una;
+		__entry->write_seq = p->write_seq;
+		__entry->wqueue = p->wqueue;
+		__entry->rqueue = p->rqueue;
+		__entry->snd_cwnd = p->snd_cwnd;
+		__entry->ssthresh = p->ssthresh;
+		__entry->snd_wnd = p->snd_wnd;
+		__entry->rcv_wnd = p->rcv_wnd;
+		__entry->srtt = p->srtt;
+		__entry->mdev = p->mdev;
+		__entry->rttvar = p->rttvar;
+		__entry->rto = p->rto;
+		__entry->packets_out = p->packets_out;
+		__entry->lost_out = p->lost_out;
+		__entry->sacked_out = p->sacked_out;
+		__entry->retrans_out = p->retrans_out;
+		__entry->retrans = p->retrans;
+		__entry->frto_counter = p->frto_counter;
+		__entry->rto_num = p->rto_num;
+		__entry->socket_idf = p->socket_idf;
+		__assign_str(user_agent, p->user_agent);
+	),
+
+	TP_printk("type=%u tstamp=%llu flow_id=%x src=%pI4:%u dst=%pI4:%u length=%u "
+		"tcp_flags=%x seq_num=%x ack_num=%x ca_state=%u snd_nxt=%llx snd_una=%x "
+		"write_seq=%x wqueue=%u rqueue=%u snd_cwnd=%u ssthresh=%u snd_wnd=%u "
+		"rcv_wnd=%u srtt=%u mdev=%u rttvar=%u rto=%u packets_out=%u lost_out=%u "
+		"sacked_out=%u retrans_out=%u retrans=%u frto_counter=%u rto_num=%u "
+		"socket_idf=%llx user_agent=%s",
+		__entry->type, __entry->tstamp, __entry->flow_id,
+		&__entry->saddr, __entry->sport, &__entry->daddr, __entry->dport,
+		__entry->length, __entry->tcp_flags, __entry->seq_num, __entry->ack_num,
+		__entry->ca_state, __entry->snd_nxt, __entry->snd_una,
+		__entry->write_seq, __entry->wqueue, __entry->rqueue,
+		__entry->snd_cwnd, __entry->ssthresh, __entry->snd_wnd,
+		__entry->rcv_wnd, __entry->srtt, __entry->mdev, __entry->rttvar,
+		__entry->rto, __entry->packets_out, __entry->lost_out,
+		__entry->sacked_out, __entry->retrans_out, __entry->retrans,
+		__entry->frto_counter, __entry->rto_num, __entry->socket_idf,
+		__get_str(user_agent))
+);
+
+/* LOG_RECV and LOG_SEND, the sampled packets */
+DEFINE_EVENT(tcp_probe_plus_record, sample,
+	TP_PROTO(const struct tcp_log *p, u64 tstamp),
+	TP_ARGS(p, tstamp)
+);
+
+DEFINE_EVENT(tcp_probe_plus_record, setup,
+	TP_PROTO(const struct tcp_log *p, u64 tstamp),
+	TP_ARGS(p, tstamp)
+);
+
+DEFINE_EVENT(tcp_probe_plus_record, done,
+	TP_PROTO(const struct tcp_log *p, u64 tstamp),
+	TP_ARGS(p, tstamp)
+);
+
+DEFINE_EVENT(tcp_probe_plus_record, timeout,
+	TP_PROTO(const struct tcp_log *p, u64 tstamp),
+	TP_ARGS(p, tstamp)
+);
+
+DEFINE_EVENT(tcp_probe_plus_record, purge,
+	TP_PROTO(const struct tcp_log *p, u64 tstamp),
+	TP_ARGS(p, tstamp)
+);
+
+/*
+ * Event records (retransmissions, stall, ECN, ...): the payload is the
+ * struct of the type, see the union at the end of struct tcp_log.
+ */
+TRACE_EVENT(flow_event,
+
+	TP_PROTO(const struct tcp_log *p, u64 tstamp, const void *payload, u16 len),
+
+	TP_ARGS(p, tstamp, payload, len),
+
+	TP_STRUCT__entry(
+		__field(u8, type)
+		__field(u64, tstamp)
+		__field(u32, flow_id)
+		__field(__be32, saddr)
+		__field(__be32, daddr)
+		__field(u16, sport)
+		__field(u16, dport)
+		__field(u64, socket_idf)
+		__field(u16, len)
+		__dynamic_array(u8, payload, len)
+	),
+
+	TP_fast_assign(
+		__entry->type = p->type;
+		__entry->tstamp = tstamp;
+		__entry->flow_id = p->flow_id;
+		__entry->saddr = p->saddr;
+		__entry->daddr = p->daddr;
+		__entry->sport = ntohs(p->sport);
+		__entry->dport = ntohs(p->dport);
+		__entry->socket_idf = p->socket_idf;
+		__entry->len = len;
+		memcpy(__get_dynamic_array(payload), payload, len);
+	),
+
+	TP_printk("type=%u tstamp=%llu flow_id=%x src=%pI4:%u dst=%pI4:%u "
+		"socket_idf=%llx payload=%s",
+		__entry->type, __entry->tstamp, __entry->flow_id,
+		&__entry->saddr, __entry->sport, &__entry->daddr, __entry->dport,
+		__entry->socket_idf,
+		__print_hex(__get_dynamic_array(payload), __entry->len))
+);
+
+#endif /* _TCP_PROBE_PLUS_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tcp_probe_plus_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,188 @@
+/*
+ * tcp_probe_plus userspace ABI.
+ *
+ * This header is shared between the kernel module and userspace
+ * consumers and therefore only depends on <linux/types.h>.
+ */
+#ifndef _TCP_PROBE_PLUS_UAPI_H
+#define _TCP_PROBE_PLUS_UAPI_H
+
+#include <linux/types.h>
+
+/* Generic netlink family */
+#define TCPPROBE_GENL_NAME    "tcpprobe_plus"
+#define TCPPROBE_GENL_VERSION 1
+#define TCPPROBE_GENL_MCGRP   "records"
+
+/* Values of the "export" sysctl */
+enum {
+	TCPPROBE_EXPORT_PROCFS = 0, /* /proc/net/tcpprobe_data (default) */
+	TCPPROBE_EXPORT_NETLINK,    /* multicast to TCPPROBE_GENL_MCGRP */
+	TCPPROBE_EXPORT_TRACE,      /* trace events of the tcp_probe_plus system */
+	__TCPPROBE_EXPORT_MAX,
+};
+#define TCPPROBE_EXPORT_MAX (__TCPPROBE_EXPORT_MAX - 1)
+
+/* Causes of a stall, records of type 8 */
+enum {
+	TCPPROBE_STALL_NETWORK = 1,  /* data in flight not acknowledged: loss, RTO */
+	TCPPROBE_STALL_RWND,         /* data queued, the receiver window does not let it out */
+	TCPPROBE_STALL_ZERO_WINDOW,  /* data queued, the receiver advertises a zero window */
+	TCPPROBE_STALL_APP,          /* nothing to send, the application does not read */
+};
+
+/* TCP states, TCP_ESTABLISHED (1) to TCP_CLOSING (11), of the type 12 records */
+#define TCPPROBE_TCP_STATES 12
+
+/* Length of the command name of the owner of a flow (TASK_COMM_LEN) */
+#define TCPPROBE_COMM_LEN 16
+
+/* Longest burst capture, in seconds */
+#define TCPPROBE_CAPTURE_MAX 3600
+
+enum {
+	TCPPROBE_CMD_UNSPEC,
+	TCPPROBE_CMD_RECORDS,    /* multicast: a batch of records */
+	TCPPROBE_CMD_GET_CONFIG, /* request/reply: current configuration */
+	TCPPROBE_CMD_SET_CONFIG, /* request: change configuration (CAP_NET_ADMIN) */
+	__TCPPROBE_CMD_MAX,
+};
+#define TCPPROBE_CMD_MAX (__TCPPROBE_CMD_MAX - 1)
+
+/* Top level attributes */
+enum {
+	TCPPROBE_A_UNSPEC,
+	TCPPROBE_A_PAD,
+	/* TCPPROBE_CMD_RECORDS */
+	TCPPROBE_A_COUNT,        /* u32: number of TCPPROBE_A_RECORD in the batch */
+	TCPPROBE_A_DROP_RING,    /* u64: records dropped because the ring was full */
+	TCPPROBE_A_DROP_NETLINK, /* u64: batches not delivered to every subscriber */
+	TCPPROBE_A_RECORD,       /* nested: TCPPROBE_R_* */
+	/* TCPPROBE_CMD_GET_CONFIG / TCPPROBE_CMD_SET_CONFIG */
+	TCPPROBE_A_PORT,         /* u32 */
+	TCPPROBE_A_FULL,         /* u32 */
+	TCPPROBE_A_PROBETIME,    /* u32: milliseconds */
+	TCPPROBE_A_MAXFLOWS,     /* u32 */
+	TCPPROBE_A_PURGETIME,    /* u32: seconds */
+	TCPPROBE_A_READNUM,      /* u32 */
+	TCPPROBE_A_DEBUG,        /* u32 */
+	TCPPROBE_A_EXPORT,       /* u32: TCPPROBE_EXPORT_* */
+	TCPPROBE_A_SEQ,          /* u64: sequence number of the first record of a batch */
+	TCPPROBE_A_RESET_ON_OPEN, /* u32 */
+	TCPPROBE_A_FLOWID,       /* u32 */
+	TCPPROBE_A_CAPTURE,      /* u32: seconds of burst capture (left), 0 stops it */
+	TCPPROBE_A_MEM_LIMIT_MB, /* u32: MB */
+	TCPPROBE_A_UNLOAD_WAIT_MS, /* u32: milliseconds */
+	TCPPROBE_A_FLOW_RATE,    /* u32: records per second */
+	TCPPROBE_A_FLOW_BURST,   /* u32: records */
+	TCPPROBE_A_FAIR_SHARE,   /* u32: percent */
+	TCPPROBE_A_STALL_MS,     /* u32: milliseconds */
+	TCPPROBE_A_ECN_INTERVAL_MS, /* u32: milliseconds */
+	TCPPROBE_A_HOSTQ_INTERVAL_MS, /* u32: milliseconds */
+	TCPPROBE_A_LISTEN_INTERVAL_MS, /* u32: milliseconds */
+	__TCPPROBE_A_MAX,
+};
+#define TCPPROBE_A_MAX (__TCPPROBE_A_MAX - 1)
+
+/* Record attributes, nested in TCPPROBE_A_RECORD. Same fields as struct tcp_log */
+enum {
+	TCPPROBE_R_UNSPEC,
+	TCPPROBE_R_PAD,
+	TCPPROBE_R_TYPE,         /* u8: LOG_*, 6 is a flow definition, 7 retransmissions,
+	                          * 8 a stall, 9 ECN marks, 10 host queueing,
+	                          * 11 a listener, 12 TCP states, 13 the owner */
+	TCPPROBE_R_TSTAMP,       /* u64: nanoseconds since the module was loaded */
+	TCPPROBE_R_SADDR,        /* be32 */
+	TCPPROBE_R_DADDR,        /* be32 */
+	TCPPROBE_R_SPORT,        /* be16 */
+	TCPPROBE_R_DPORT,        /* be16 */
+	TCPPROBE_R_LENGTH,       /* u16 */
+	TCPPROBE_R_TCP_FLAGS,    /* u8 */
+	TCPPROBE_R_SEQ_NUM,      /* u32 */
+	TCPPROBE_R_ACK_NUM,      /* u32 */
+	TCPPROBE_R_CA_STATE,     /* u8 */
+	TCPPROBE_R_SND_NXT,      /* u64 */
+	TCPPROBE_R_SND_UNA,      /* u32 */
+	TCPPROBE_R_WRITE_SEQ,    /* u32 */
+	TCPPROBE_R_WQUEUE,       /* u32 */
+	TCPPROBE_R_RQUEUE,       /* u32 */
+	TCPPROBE_R_SND_CWND,     /* u32 */
+	TCPPROBE_R_SSTHRESH,     /* u32 */
+	TCPPROBE_R_SND_WND,      /* u32 */
+	TCPPROBE_R_RCV_WND,      /* u32 */
+	TCPPROBE_R_SRTT,         /* u32 */
+	TCPPROBE_R_MDEV,         /* u32 */
+	TCPPROBE_R_RTTVAR,       /* u32 */
+	TCPPROBE_R_RTO,          /* u32 */
+	TCPPROBE_R_PACKETS_OUT,  /* u32 */
+	TCPPROBE_R_LOST_OUT,     /* u32 */
+	TCPPROBE_R_SACKED_OUT,   /* u32 */
+	TCPPROBE_R_RETRANS_OUT,  /* u32 */
+	TCPPROBE_R_RETRANS,      /* u32 */
+	TCPPROBE_R_FRTO_COUNTER, /* u8 */
+	TCPPROBE_R_RTO_NUM,      /* u16 */
+	TCPPROBE_R_SOCKET_IDF,   /* u64 */
+	TCPPROBE_R_USER_AGENT,   /* string, only present when known */
+	TCPPROBE_R_FLOW_ID,      /* u32: tuple and socket_idf are only present in the
+	                          * flow definition when the flowid sysctl is set */
+	/* Retransmissions since the previous record of the flow (type 7), which
+	 * carries these instead of the socket state (TCPPROBE_R_LENGTH to
+	 * TCPPROBE_R_RTO_NUM) */
+	TCPPROBE_R_RETX_FAST,    /* u32: in recovery (fast retransmit, RACK, ...) */
+	TCPPROBE_R_RETX_RTO,     /* u32: after a retransmit timeout */
+	TCPPROBE_R_RETX_TLP,     /* u32: tail loss probes */
+	TCPPROBE_R_RETX_SPURIOUS, /* u32: reported unneeded by a DSACK */
+	TCPPROBE_R_RETX_BYTES,   /* u32 */
+	TCPPROBE_R_RETX_SEQ_LO,  /* u32: lowest sequence number retransmitted */
+	TCPPROBE_R_RETX_SEQ_HI,  /* u32: highest end sequence number retransmitted */
+	/* Stall (type 8), with TCPPROBE_R_SND_UNA, TCPPROBE_R_SND_WND,
+	 * TCPPROBE_R_WQUEUE, TCPPROBE_R_RQUEUE and TCPPROBE_R_PACKETS_OUT */
+	TCPPROBE_R_STALL_CAUSE,  /* u32: TCPPROBE_STALL_* */
+	TCPPROBE_R_STALL_MS,     /* u32: time without progress */
+	TCPPROBE_R_STALL_RTO,    /* u32: retransmit timeouts during the stall */
+	/* ECN marks since the previous ECN record of the flow (type 9) */
+	TCPPROBE_R_ECN_ACKS,     /* u32: ACKs received */
+	TCPPROBE_R_ECN_ECE_ACKS, /* u32: ... with ECE set */
+	TCPPROBE_R_ECN_ACKED_BYTES, /* u32: bytes newly acknowledged */
+	TCPPROBE_R_ECN_ECE_BYTES, /* u32: ... by ACKs with ECE set */
+	TCPPROBE_R_ECN_ECE_PERMILLE, /* u32: ECE_BYTES / ACKED_BYTES, per mille */
+	TCPPROBE_R_ECN_CWR,      /* u32: segments received with CWR set */
+	TCPPROBE_R_ECN_DATA_PKTS, /* u32: data segments received */
+	TCPPROBE_R_ECN_DATA_BYTES, /* u32 */
+	TCPPROBE_R_ECN_CE_PKTS,  /* u32: ... marked CE */
+	TCPPROBE_R_ECN_CE_BYTES, /* u32 */
+	TCPPROBE_R_ECN_CE_PERMILLE, /* u32: CE_BYTES / DATA_BYTES, per mille */
+	/* Host side queueing over hostq_interval_ms (type 10) */
+	TCPPROBE_R_HOSTQ_PACING_RATE, /* u64: bytes per second, ~0 when not paced */
+	TCPPROBE_R_HOSTQ_WMEM_QUEUED, /* u32: bytes in the write queue */
+	TCPPROBE_R_HOSTQ_WMEM_QUEUED_MAX, /* u32 */
+	TCPPROBE_R_HOSTQ_WMEM_ALLOC, /* u32: bytes in the qdisc or the device */
+	TCPPROBE_R_HOSTQ_WMEM_ALLOC_MAX, /* u32 */
+	TCPPROBE_R_HOSTQ_TSQ_MS, /* u32: time throttled by TCP small queues */
+	TCPPROBE_R_HOSTQ_PACING_MS, /* u32: time waiting for the pacing timer */
+	TCPPROBE_R_HOSTQ_SNDBUF_MS, /* u32: time limited by the send buffer */
+	TCPPROBE_R_HOSTQ_EVENTS, /* u32: packets seen in the interval */
+	/* Listeners of TCPPROBE_R_SPORT over listen_interval_ms (type 11) */
+	TCPPROBE_R_LISTEN_CONNS, /* u32: connections established */
+	TCPPROBE_R_LISTEN_OVERFLOWS, /* u32: ... dropped, the accept queue was full */
+	TCPPROBE_R_LISTEN_ACCEPTS, /* u32: connections accepted */
+	TCPPROBE_R_LISTEN_BACKLOG_MAX, /* u32: deepest accept queue seen */
+	TCPPROBE_R_LISTEN_BACKLOG_AVG, /* u32 */
+	TCPPROBE_R_LISTEN_MAX_BACKLOG, /* u32: listen() backlog */
+	TCPPROBE_R_LISTEN_ACCEPT_AVG_US, /* u32: establishment to accept() */
+	TCPPROBE_R_LISTEN_ACCEPT_MAX_US, /* u32 */
+	/* TCP states of the flow (type 12), written before its done or purge record */
+	TCPPROBE_R_STATE,        /* u32: TCP state at the end */
+	TCPPROBE_R_STATE_TRANSITIONS, /* u32 */
+	TCPPROBE_R_STATE_MS,     /* u32[TCPPROBE_TCP_STATES]: milliseconds spent in
+	                          * each TCP state, indexed by state */
+	/* Owner of the flow (type 13), once known and before the done or purge record */
+	TCPPROBE_R_OWNER_PID,    /* u32: thread that sent, received or accepted */
+	TCPPROBE_R_OWNER_TGID,   /* u32: its process */
+	TCPPROBE_R_OWNER_UID,    /* u32: in the initial user namespace */
+	TCPPROBE_R_OWNER_COMM,   /* string */
+	__TCPPROBE_R_MAX,
+};
+#define TCPPROBE_R_MAX (__TCPPROBE_R_MAX - 1)
+
+#endif /* _TCP_PROBE_PLUS_UAPI_H */
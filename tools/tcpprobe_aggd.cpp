@@ -0,0 +1,150 @@
+/*
+ * tcpprobe_aggd: per-flow rollups of the records, one line per flow and
+ * interval, per second and per minute (see tcpprobe/aggregate.hpp).
+ *
+ *	tcpprobe_aggd [-r ring] [-t any|procfs|netlink] [-p 1|60] [-f flows] [-j workers]
+ *
+ * The flows are sharded by hash between the worker threads (see
+ * tcpprobe/collector.hpp); the rollups of a flow stay in order.
+ *
+ * Each line is:
+ *	period start_s saddr:sport daddr:dport socket_idf samples acked_bytes
+ *	goodput_bps srtt_max_us retrans cwnd_p50 cwnd_p90 cwnd_p99 cwnd_max final
+ */
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <system_error>
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "tcpprobe/collector.hpp"
+#include "tcpprobe/reader.hpp"
+#include "tcpprobe/shm.hpp"
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int)
+{
+	stop = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-r ring] [-t any|procfs|netlink] [-p 1|60] [-f flows] [-j workers]\n"
+			"  -r  read the ring of tcpprobe_fanout instead of the module\n"
+			"  -t  transport to read the module from (default any)\n"
+			"  -p  only print the rollups of this period, in seconds\n"
+			"  -f  flows expected, to size the tables (default 16384)\n"
+			"  -j  worker threads aggregating the flows (default 1)\n",
+			prog);
+	exit(2);
+}
+
+static void encode_rollup(std::string &out, const tcpprobe::rollup &r)
+{
+	struct in_addr s = { htonl(r.key.saddr) }, d = { htonl(r.key.daddr) };
+	char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+	char line[256];
+	int n;
+
+	inet_ntop(AF_INET, &s, src, sizeof(src));
+	inet_ntop(AF_INET, &d, dst, sizeof(dst));
+	n = snprintf(line, sizeof(line), "%u %llu %s:%u %s:%u %llx %u %llu %llu %u %u %u %u %u %u %d\n",
+			r.period_s, (unsigned long long) (r.start_ns / 1000000000ULL),
+			src, r.key.sport, dst, r.key.dport,
+			(unsigned long long) r.key.socket_idf, r.samples,
+			(unsigned long long) r.acked_bytes,
+			(unsigned long long) r.goodput_bps, r.srtt_max >> 3, r.retrans,
+			r.cwnd_p50, r.cwnd_p90, r.cwnd_p99, r.cwnd_max, r.final);
+	out.append(line, n);
+}
+
+int main(int argc, char **argv)
+{
+	static tcpprobe::record recs[1024];
+	std::unique_ptr<tcpprobe::shm_subscriber> sub;
+	std::unique_ptr<tcpprobe::reader> rd;
+	tcpprobe::options opt;
+	std::string ring;
+	struct sigaction sa;
+	unsigned period = 0, workers = 1;
+	size_t flows = 1 << 14;
+	int c;
+
+	while ((c = getopt(argc, argv, "r:t:p:f:j:h")) != -1) {
+		switch (c) {
+		case 'r':
+			ring = optarg[0] == '/' ? optarg : std::string("/") + optarg;
+			break;
+		case 't':
+			if (!strcmp(optarg, "procfs"))
+				opt.mode = tcpprobe::transport::procfs;
+			else if (!strcmp(optarg, "netlink"))
+				opt.mode = tcpprobe::transport::netlink;
+			else if (strcmp(optarg, "any"))
+				usage(argv[0]);
+			break;
+		case 'p':
+			period = atoi(optarg);
+			if (period != 1 && period != 60)
+				usage(argv[0]);
+			break;
+		case 'f':
+			flows = strtoul(optarg, nullptr, 0);
+			break;
+		case 'j':
+			workers = atoi(optarg);
+			if (!workers)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+	setvbuf(stdout, nullptr, _IOFBF, 1 << 20);
+
+	try {
+		tcpprobe::collector col(workers,
+				[period](std::string &out, const tcpprobe::rollup &r) {
+					if (!period || r.period_s == period)
+						encode_rollup(out, r);
+				},
+				[](const std::string &chunk) {
+					fwrite(chunk.data(), 1, chunk.size(), stdout);
+					fflush(stdout);
+				}, flows);
+		tcpprobe::batch b;
+
+		if (!ring.empty()) {
+			sub.reset(new tcpprobe::shm_subscriber(ring));
+		} else {
+			rd.reset(new tcpprobe::reader(opt));
+			rd->open();
+		}
+		while (!stop) {
+			if (sub) {
+				size_t n = sub->read(recs, sizeof(recs) / sizeof(recs[0]), 1000);
+
+				col.add(recs, n);
+			} else if (rd->next(b, 1000)) {
+				col.add(b.begin(), b.size());
+			}
+		}
+		col.finish();
+	} catch (const std::system_error &e) {
+		if (!stop) {
+			fprintf(stderr, "%s: %s\n", argv[0], e.what());
+			return 1;
+		}
+	}
+	return 0;
+}
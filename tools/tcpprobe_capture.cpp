@@ -0,0 +1,143 @@
+/*
+ * tcpprobe_capture: writes the records into capture files, a new one every
+ * rotate seconds, for tcpprobe_query (see tcpprobe/capture.hpp).
+ *
+ *	tcpprobe_capture [-d dir] [-r ring] [-t any|procfs|netlink] [-R seconds] [-b rows]
+ *
+ * Files are named tcpprobe-YYYYmmdd-HHMMSS.tpc after the UTC time they
+ * were created at.
+ */
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <system_error>
+
+#include <unistd.h>
+
+#include "tcpprobe/capture.hpp"
+#include "tcpprobe/reader.hpp"
+#include "tcpprobe/shm.hpp"
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int)
+{
+	stop = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d dir] [-r ring] [-t any|procfs|netlink] [-R seconds] [-b rows]\n"
+			"  -d  directory of the capture files (default .)\n"
+			"  -r  read the ring of tcpprobe_fanout instead of the module\n"
+			"  -t  transport to read the module from (default any)\n"
+			"  -R  seconds of records per file (default 3600)\n"
+			"  -b  records per block (default 4096)\n",
+			prog);
+	exit(2);
+}
+
+static std::string file_name(const std::string &dir, time_t now)
+{
+	char name[64];
+	struct tm tm;
+
+	gmtime_r(&now, &tm);
+	strftime(name, sizeof(name), "tcpprobe-%Y%m%d-%H%M%S.tpc", &tm);
+	return dir + "/" + name;
+}
+
+int main(int argc, char **argv)
+{
+	static tcpprobe::record recs[1024];
+	std::unique_ptr<tcpprobe::shm_subscriber> sub;
+	std::unique_ptr<tcpprobe::capture_writer> out;
+	std::unique_ptr<tcpprobe::reader> rd;
+	std::string dir = ".", ring;
+	tcpprobe::options opt;
+	struct sigaction sa;
+	unsigned rotate = 3600, rows = 4096;
+	time_t opened = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:r:t:R:b:h")) != -1) {
+		switch (c) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'r':
+			ring = optarg[0] == '/' ? optarg : std::string("/") + optarg;
+			break;
+		case 't':
+			if (!strcmp(optarg, "procfs"))
+				opt.mode = tcpprobe::transport::procfs;
+			else if (!strcmp(optarg, "netlink"))
+				opt.mode = tcpprobe::transport::netlink;
+			else if (strcmp(optarg, "any"))
+				usage(argv[0]);
+			break;
+		case 'R':
+			rotate = atoi(optarg);
+			if (!rotate)
+				usage(argv[0]);
+			break;
+		case 'b':
+			rows = atoi(optarg);
+			if (!rows)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+
+	try {
+		tcpprobe::batch b;
+
+		if (!ring.empty()) {
+			sub.reset(new tcpprobe::shm_subscriber(ring));
+		} else {
+			rd.reset(new tcpprobe::reader(opt));
+			rd->open();
+		}
+		while (!stop) {
+			const tcpprobe::record *p = recs;
+			time_t now = time(nullptr);
+			size_t n = 0;
+
+			if (!out || now - opened >= rotate) {
+				if (out)
+					out->close();
+				out.reset(new tcpprobe::capture_writer(file_name(dir, now), rows));
+				opened = now;
+			}
+			if (sub) {
+				n = sub->read(recs, sizeof(recs) / sizeof(recs[0]), 1000);
+			} else if (rd->next(b, 1000)) {
+				p = b.begin();
+				n = b.size();
+			}
+			if (n)
+				out->add(p, n);
+			else
+				/* idle: what was read becomes visible to the queries */
+				out->flush();
+		}
+		if (out)
+			out->close();
+	} catch (const std::system_error &e) {
+		if (!stop) {
+			fprintf(stderr, "%s: %s\n", argv[0], e.what());
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * tcpprobe_fanout: sole reader of the records of tcp_probe_plus, which it
+ * republishes into a shared memory ring for any number of local
+ * subscribers (see libtcpprobe/include/tcpprobe/shm.hpp).
+ *
+ *	tcpprobe_fanout [-n name] [-s slots] [-t any|procfs|netlink]
+ */
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+
+#include <unistd.h>
+
+#include "tcpprobe/reader.hpp"
+#include "tcpprobe/shm.hpp"
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int)
+{
+	stop = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n name] [-s slots] [-t any|procfs|netlink]\n"
+			"  -n  name of the shared memory ring (default %s)\n"
+			"  -s  records in the ring, a power of 2 (default 65536)\n"
+			"  -t  transport to read the module from (default any)\n",
+			prog, tcpprobe::SHM_DEFAULT_NAME);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	std::string name = tcpprobe::SHM_DEFAULT_NAME;
+	uint64_t slots = 65536;
+	tcpprobe::options opt;
+	struct sigaction sa;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:t:h")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg[0] == '/' ? optarg : std::string("/") + optarg;
+			break;
+		case 's':
+			slots = strtoull(optarg, nullptr, 0);
+			break;
+		case 't':
+			if (!strcmp(optarg, "procfs"))
+				opt.mode = tcpprobe::transport::procfs;
+			else if (!strcmp(optarg, "netlink"))
+				opt.mode = tcpprobe::transport::netlink;
+			else if (strcmp(optarg, "any"))
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* no SA_RESTART: a signal interrupts the wait of the reader */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+
+	try {
+		tcpprobe::shm_publisher ring(name, slots);
+		tcpprobe::reader r(opt);
+		tcpprobe::batch b;
+
+		r.open();
+		fprintf(stderr, "%s: reading %s, %llu slots in /dev/shm%s\n", argv[0],
+				tcpprobe::transport_name(r.active()),
+				(unsigned long long) slots, name.c_str());
+		while (!stop) {
+			/* an idle module still gets a heartbeat every second */
+			if (!r.next(b, 1000)) {
+				ring.heartbeat();
+				continue;
+			}
+			ring.set_upstream(b.next_seq(), b.lost(), b.restarted());
+			ring.publish(b.begin(), b.size());
+		}
+		ring.close();
+	} catch (const std::system_error &e) {
+		if (!stop) {
+			fprintf(stderr, "%s: %s\n", argv[0], e.what());
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,367 @@
+/*
+ * tcpprobe_query: aggregates over the capture files of tcpprobe_capture
+ * (see tcpprobe/scan.hpp).
+ *
+ *	tcpprobe_query [-j threads] [-w predicate]... [-g key]... [-a aggregate]...
+ *		[-s since] [-u until] [-n rows] [-v] file|dir...
+ *
+ * For instance the flows with a srtt above 200ms in the last hour, by
+ * remote /24:
+ *
+ *	tcpprobe_query -s 1h -w 'srtt>200ms' -g daddr/24 -a count -a max:srtt /var/lib/tcpprobe
+ *
+ * srtt is microseconds << 3 and mdev and rttvar microseconds << 2, like in
+ * the kernel: their predicates take a duration (200ms, 500us, 1s) besides
+ * a raw value, and their sums, minimums, maximums and averages are printed
+ * in microseconds.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tcpprobe/scan.hpp"
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-j threads] [-w predicate]... [-g key]... [-a aggregate]...\n"
+			"          [-s since] [-u until] [-n rows] [-v] file|dir...\n"
+			"  -w  column op value, op one of < <= > >= = != (saddr and daddr\n"
+			"      also take an address, and a prefix with =: daddr=10.1.2.0/24;\n"
+			"      srtt, mdev and rttvar a duration: srtt>200ms)\n"
+			"  -g  group by column, column/N for addresses by prefix\n"
+			"  -a  count, or sum, min, max or avg:column (default count), srtt,\n"
+			"      mdev and rttvar in us\n"
+			"  -s  records of the last duration only: 90s, 30m, 1h, 2d\n"
+			"  -u  records up to duration ago\n"
+			"  -n  rows printed, the largest first aggregate first (default 20, 0 all)\n"
+			"  -j  threads (default: the processors)\n"
+			"  -v  print the statistics of the scan\n",
+			prog);
+	exit(2);
+}
+
+static bool is_addr(tcpprobe::column c)
+{
+	return c == tcpprobe::COL_SADDR || c == tcpprobe::COL_DADDR;
+}
+
+static tcpprobe::column column_arg(const std::string &name)
+{
+	tcpprobe::column c = tcpprobe::column_by_name(name);
+
+	if (c >= tcpprobe::COL_SCALARS)
+		throw std::invalid_argument("unknown column " + name);
+	return c;
+}
+
+/*
+ * The rtt columns are microseconds shifted left, like in the kernel:
+ * 8 units to the us for srtt, 4 for mdev and rttvar, 0 for the others
+ */
+static unsigned usec_shift(tcpprobe::column c)
+{
+	if (c == tcpprobe::COL_SRTT)
+		return 3;
+	if (c == tcpprobe::COL_MDEV || c == tcpprobe::COL_RTTVAR)
+		return 2;
+	return 0;
+}
+
+/* Raw value, or a duration (us, ms, s) for the rtt columns */
+static uint64_t value_arg(tcpprobe::column c, const std::string &s)
+{
+	char *end;
+	uint64_t v = strtoull(s.c_str(), &end, 0);
+	uint64_t unit;
+
+	if (!*end)
+		return v;
+	if (!strcmp(end, "us"))
+		unit = 1;
+	else if (!strcmp(end, "ms"))
+		unit = 1000;
+	else if (!strcmp(end, "s"))
+		unit = 1000000;
+	else
+		throw std::invalid_argument("bad value " + s);
+	if (!usec_shift(c))
+		throw std::invalid_argument("a duration only compares to srtt, mdev or rttvar: " + s);
+	return (v * unit) << usec_shift(c);
+}
+
+/* Address in host byte order, with the mask of its prefix */
+static uint32_t addr_arg(const std::string &s, uint32_t *mask)
+{
+	size_t slash = s.find('/');
+	struct in_addr a;
+	int prefix = 32;
+
+	if (slash != std::string::npos)
+		prefix = atoi(s.c_str() + slash + 1);
+	if (prefix < 0 || prefix > 32 || inet_pton(AF_INET, s.substr(0, slash).c_str(), &a) != 1)
+		throw std::invalid_argument("bad address " + s);
+	*mask = prefix ? ~0U << (32 - prefix) : 0;
+	return ntohl(a.s_addr) & *mask;
+}
+
+static void where_arg(const std::string &s, std::vector<tcpprobe::predicate> &where)
+{
+	static const struct {
+		const char *str;
+		tcpprobe::cmp op;
+	} ops[] = {
+		{ "<=", tcpprobe::cmp::le }, { ">=", tcpprobe::cmp::ge },
+		{ "!=", tcpprobe::cmp::ne }, { "==", tcpprobe::cmp::eq },
+		{ "<", tcpprobe::cmp::lt }, { ">", tcpprobe::cmp::gt },
+		{ "=", tcpprobe::cmp::eq },
+	};
+	size_t pos = s.find_first_of("<>=!");
+
+	if (pos == std::string::npos)
+		throw std::invalid_argument("bad predicate " + s);
+	for (const auto &o : ops) {
+		std::string value;
+		tcpprobe::column c;
+		uint32_t mask;
+
+		if (s.compare(pos, strlen(o.str), o.str))
+			continue;
+		c = column_arg(s.substr(0, pos));
+		value = s.substr(pos + strlen(o.str));
+		if (is_addr(c) && value.find('.') != std::string::npos) {
+			uint32_t net = addr_arg(value, &mask);
+
+			if (mask != ~0U) {
+				/* a prefix is the range of its addresses */
+				if (o.op != tcpprobe::cmp::eq)
+					throw std::invalid_argument("a prefix only takes =: " + s);
+				where.push_back({ c, tcpprobe::cmp::ge, net });
+				where.push_back({ c, tcpprobe::cmp::le, net | ~mask });
+				return;
+			}
+			where.push_back({ c, o.op, net });
+			return;
+		}
+		where.push_back({ c, o.op, value_arg(c, value) });
+		return;
+	}
+	throw std::invalid_argument("bad predicate " + s);
+}
+
+static tcpprobe::group_key group_arg(const std::string &s)
+{
+	size_t slash = s.find('/');
+	tcpprobe::column c = column_arg(s.substr(0, slash));
+	int prefix;
+
+	if (slash == std::string::npos)
+		return { c, ~0ULL };
+	prefix = atoi(s.c_str() + slash + 1);
+	if (!is_addr(c) || prefix < 0 || prefix > 32)
+		throw std::invalid_argument("bad group key " + s);
+	return { c, prefix ? (uint64_t) (~0U << (32 - prefix)) : 0 };
+}
+
+static tcpprobe::aggregate aggregate_arg(const std::string &s)
+{
+	static const struct {
+		const char *name;
+		tcpprobe::agg_fn fn;
+	} fns[] = {
+		{ "sum", tcpprobe::agg_fn::sum }, { "min", tcpprobe::agg_fn::min },
+		{ "max", tcpprobe::agg_fn::max }, { "avg", tcpprobe::agg_fn::avg },
+	};
+	size_t colon = s.find(':');
+
+	if (s == "count")
+		return { tcpprobe::agg_fn::count, tcpprobe::COL_TYPE };
+	for (const auto &f : fns)
+		if (colon != std::string::npos && s.compare(0, colon, f.name) == 0)
+			return { f.fn, column_arg(s.substr(colon + 1)) };
+	throw std::invalid_argument("bad aggregate " + s);
+}
+
+static int64_t ago_arg(const std::string &s)
+{
+	char *end;
+	double v = strtod(s.c_str(), &end);
+	int64_t unit;
+
+	switch (*end) {
+	case 's': case '\0':
+		unit = 1;
+		break;
+	case 'm':
+		unit = 60;
+		break;
+	case 'h':
+		unit = 3600;
+		break;
+	case 'd':
+		unit = 86400;
+		break;
+	default:
+		throw std::invalid_argument("bad duration " + s);
+	}
+	return (int64_t) time(nullptr) * 1000000000LL - (int64_t) (v * unit * 1e9);
+}
+
+/* The .tpc files of a directory, or the file itself */
+static void add_path(const std::string &path, std::vector<std::string> &files)
+{
+	struct stat st;
+	struct dirent *de;
+	DIR *d;
+
+	if (stat(path.c_str(), &st) < 0)
+		throw std::system_error(errno, std::generic_category(), path);
+	if (!S_ISDIR(st.st_mode)) {
+		files.push_back(path);
+		return;
+	}
+	d = opendir(path.c_str());
+	if (!d)
+		throw std::system_error(errno, std::generic_category(), path);
+	while ((de = readdir(d))) {
+		size_t len = strlen(de->d_name);
+
+		if (len > 4 && !strcmp(de->d_name + len - 4, ".tpc"))
+			files.push_back(path + "/" + de->d_name);
+	}
+	closedir(d);
+	std::sort(files.begin(), files.end());
+}
+
+static void print_key(const tcpprobe::group_key &g, uint64_t v)
+{
+	if (is_addr(g.col)) {
+		struct in_addr a = { htonl((uint32_t) v) };
+		char buf[INET_ADDRSTRLEN];
+
+		inet_ntop(AF_INET, &a, buf, sizeof(buf));
+		if ((uint32_t) g.mask != ~0U)
+			printf("%s/%d\t", buf, __builtin_popcount((uint32_t) g.mask));
+		else
+			printf("%s\t", buf);
+	} else if (g.col == tcpprobe::COL_SOCKET_IDF) {
+		printf("%llx\t", (unsigned long long) v);
+	} else {
+		printf("%llu\t", (unsigned long long) v);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned threads = std::thread::hardware_concurrency();
+	std::vector<std::string> files;
+	std::vector<std::string> select;
+	tcpprobe::scan_result res;
+	tcpprobe::query q;
+	size_t top = 20;
+	bool verbose = false;
+	int c;
+
+	try {
+		while ((c = getopt(argc, argv, "j:w:g:a:s:u:n:vh")) != -1) {
+			switch (c) {
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'w':
+				where_arg(optarg, q.where);
+				break;
+			case 'g':
+				if (q.group.size() == tcpprobe::MAX_GROUP)
+					throw std::invalid_argument("too many group keys");
+				q.group.push_back(group_arg(optarg));
+				break;
+			case 'a':
+				q.select.push_back(aggregate_arg(optarg));
+				select.push_back(optarg);
+				break;
+			case 's':
+				q.since_ns = ago_arg(optarg);
+				break;
+			case 'u':
+				q.until_ns = ago_arg(optarg);
+				break;
+			case 'n':
+				top = strtoul(optarg, nullptr, 0);
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				usage(argv[0]);
+			}
+		}
+		if (optind == argc)
+			usage(argv[0]);
+		if (q.select.empty()) {
+			q.select.push_back({ tcpprobe::agg_fn::count, tcpprobe::COL_TYPE });
+			select.push_back("count");
+		}
+		for (int i = optind; i < argc; i++)
+			add_path(argv[i], files);
+
+		auto start = std::chrono::steady_clock::now();
+		res = tcpprobe::scan(files, q, threads);
+		std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+
+		std::sort(res.rows.begin(), res.rows.end(),
+				[](const tcpprobe::group_row &a, const tcpprobe::group_row &b) {
+					return a.values[0] > b.values[0];
+				});
+		if (top && res.rows.size() > top)
+			res.rows.resize(top);
+
+		for (const tcpprobe::group_key &g : q.group)
+			printf("%s\t", tcpprobe::columns[g.col].name);
+		for (size_t i = 0; i < select.size(); i++)
+			printf("%s%s%c", select[i].c_str(),
+					q.select[i].fn != tcpprobe::agg_fn::count &&
+					usec_shift(q.select[i].col) ? "_us" : "",
+					i + 1 < select.size() ? '\t' : '\n');
+		for (const tcpprobe::group_row &row : res.rows) {
+			for (size_t k = 0; k < q.group.size(); k++)
+				print_key(q.group[k], row.key[k]);
+			for (size_t i = 0; i < row.values.size(); i++) {
+				const tcpprobe::aggregate &a = q.select[i];
+				double v = row.values[i];
+
+				if (a.fn != tcpprobe::agg_fn::count)
+					v /= 1U << usec_shift(a.col);
+				printf("%.*f%c", a.fn == tcpprobe::agg_fn::avg ? 1 : 0,
+						v, i + 1 < row.values.size() ? '\t' : '\n');
+			}
+		}
+		if (verbose)
+			fprintf(stderr, "%llu files, %llu blocks, %llu skipped, %llu rows scanned, "
+					"%llu matched, %llu steals, %.3f s\n",
+					(unsigned long long) res.stats.files,
+					(unsigned long long) res.stats.blocks,
+					(unsigned long long) res.stats.blocks_skipped,
+					(unsigned long long) res.stats.rows_scanned,
+					(unsigned long long) res.stats.rows_matched,
+					(unsigned long long) res.stats.steals, took.count());
+	} catch (const std::invalid_argument &e) {
+		fprintf(stderr, "%s: %s\n", argv[0], e.what());
+		return 2;
+	} catch (const std::system_error &e) {
+		fprintf(stderr, "%s: %s\n", argv[0], e.what());
+		return 1;
+	}
+	return 0;
+}
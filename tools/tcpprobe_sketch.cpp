@@ -0,0 +1,276 @@
+/*
+ * tcpprobe_sketch: quantile sketches of srtt, cwnd, goodput and RTO
+ * counts per flow, local port and peer (see tcpprobe/sketch.hpp).
+ *
+ *	tcpprobe_sketch [-r ring] [-t any|procfs|netlink] [-k flow,port,peer]
+ *		[-o file] [-q 50,90,99] [-n rows] [-P] [file...]
+ *
+ * Without files, the records are read from the module (or the ring) until
+ * SIGINT. Files are capture files of tcpprobe_capture (.tpc), whose records
+ * are sketched, or tables saved by -o (.tps), which are merged: the tables
+ * of several hosts merge into the percentiles of the fleet.
+ */
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "tcpprobe/capture.hpp"
+#include "tcpprobe/reader.hpp"
+#include "tcpprobe/shm.hpp"
+#include "tcpprobe/sketch.hpp"
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int)
+{
+	stop = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-r ring] [-t any|procfs|netlink] [-k flow,port,peer]\n"
+			"          [-o file] [-q 50,90,99] [-n rows] [-P] [file...]\n"
+			"  -r  read the ring of tcpprobe_fanout instead of the module\n"
+			"  -t  transport to read the module from (default any)\n"
+			"  -k  what the sketches are kept per (default flow,port,peer)\n"
+			"  -o  save the sketches, to merge them later\n"
+			"  -q  percentiles printed (default 50,90,99)\n"
+			"  -n  keys printed per dimension, the most sampled first (default 20, 0 all)\n"
+			"  -P  do not print the percentiles\n",
+			prog);
+	exit(2);
+}
+
+static unsigned dims_arg(const char *s)
+{
+	unsigned dims = 0;
+	std::string a(s);
+	size_t pos = 0;
+
+	while (pos <= a.size()) {
+		size_t comma = a.find(',', pos);
+		std::string d = a.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+
+		if (d == "flow")
+			dims |= tcpprobe::DIM_FLOW;
+		else if (d == "port")
+			dims |= tcpprobe::DIM_PORT;
+		else if (d == "peer")
+			dims |= tcpprobe::DIM_PEER;
+		else
+			throw std::invalid_argument("unknown dimension " + d);
+		if (comma == std::string::npos)
+			break;
+		pos = comma + 1;
+	}
+	return dims;
+}
+
+static std::vector<double> quantiles_arg(const char *s)
+{
+	std::vector<double> q;
+	char *end;
+
+	for (;;) {
+		double v = strtod(s, &end);
+
+		if (end == s || v < 0 || v > 100)
+			throw std::invalid_argument("bad percentiles");
+		q.push_back(v);
+		if (*end != ',')
+			break;
+		s = end + 1;
+	}
+	return q;
+}
+
+static bool ends_with(const std::string &s, const char *suffix)
+{
+	size_t n = strlen(suffix);
+
+	return s.size() >= n && !s.compare(s.size() - n, n, suffix);
+}
+
+static void sketch_capture(const std::string &path, tcpprobe::sketch_builder &sb)
+{
+	tcpprobe::capture_file f(path);
+	uint64_t offset = sizeof(tcpprobe::capture_header);
+	tcpprobe::block_view b;
+	tcpprobe::record r;
+
+	while (f.block(offset, b))
+		for (uint32_t i = 0; i < b.hdr->rows; i++) {
+			b.row(i, r);
+			sb.add(r);
+		}
+}
+
+static void print_key(const tcpprobe::sketch_key &k)
+{
+	struct in_addr s = { htonl(k.flow.saddr) }, d = { htonl(k.flow.daddr) };
+	char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+
+	inet_ntop(AF_INET, &s, src, sizeof(src));
+	inet_ntop(AF_INET, &d, dst, sizeof(dst));
+	switch (k.dim) {
+	case tcpprobe::DIM_FLOW:
+		printf("flow %s:%u-%s:%u/%llx", src, k.flow.sport, dst, k.flow.dport,
+				(unsigned long long) k.flow.socket_idf);
+		break;
+	case tcpprobe::DIM_PORT:
+		printf("port %u", k.flow.sport);
+		break;
+	default:
+		printf("peer %s", dst);
+		break;
+	}
+}
+
+static void print_table(const tcpprobe::sketch_table &t, unsigned dims,
+		const std::vector<double> &q, size_t top)
+{
+	typedef std::pair<const tcpprobe::sketch_key, tcpprobe::metric_sketches> entry;
+	static const tcpprobe::dimension order[] = {
+		tcpprobe::DIM_FLOW, tcpprobe::DIM_PORT, tcpprobe::DIM_PEER,
+	};
+
+	printf("key\tmetric\tcount");
+	for (double v : q)
+		printf("\tp%g", v);
+	printf("\tmax\n");
+	for (tcpprobe::dimension dim : order) {
+		std::vector<const entry *> rows;
+
+		if (!(dims & dim))
+			continue;
+		for (const entry &e : t.sketches())
+			if (e.first.dim == dim)
+				rows.push_back(&e);
+		std::sort(rows.begin(), rows.end(), [](const entry *a, const entry *b) {
+			return a->second.m[tcpprobe::M_SRTT].count() >
+				b->second.m[tcpprobe::M_SRTT].count();
+		});
+		if (top && rows.size() > top)
+			rows.resize(top);
+		for (const entry *e : rows)
+			for (unsigned m = 0; m < tcpprobe::METRICS; m++) {
+				const tcpprobe::quantile_sketch &s = e->second.m[m];
+
+				if (!s.count())
+					continue;
+				print_key(e->first);
+				printf("\t%s\t%llu", tcpprobe::metric_names[m],
+						(unsigned long long) s.count());
+				for (double v : q)
+					printf("\t%llu", (unsigned long long) s.quantile(v / 100));
+				printf("\t%llu\n", (unsigned long long) s.max());
+			}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static tcpprobe::record recs[1024];
+	std::vector<double> q = { 50, 90, 99 };
+	unsigned dims = tcpprobe::DIM_ALL;
+	tcpprobe::options opt;
+	std::string ring, out;
+	struct sigaction sa;
+	bool print = true;
+	size_t top = 20;
+	int c;
+
+	try {
+		while ((c = getopt(argc, argv, "r:t:k:o:q:n:Ph")) != -1) {
+			switch (c) {
+			case 'r':
+				ring = optarg[0] == '/' ? optarg : std::string("/") + optarg;
+				break;
+			case 't':
+				if (!strcmp(optarg, "procfs"))
+					opt.mode = tcpprobe::transport::procfs;
+				else if (!strcmp(optarg, "netlink"))
+					opt.mode = tcpprobe::transport::netlink;
+				else if (strcmp(optarg, "any"))
+					usage(argv[0]);
+				break;
+			case 'k':
+				dims = dims_arg(optarg);
+				break;
+			case 'o':
+				out = optarg;
+				break;
+			case 'q':
+				q = quantiles_arg(optarg);
+				break;
+			case 'n':
+				top = strtoul(optarg, nullptr, 0);
+				break;
+			case 'P':
+				print = false;
+				break;
+			default:
+				usage(argv[0]);
+			}
+		}
+
+		tcpprobe::sketch_builder sb(dims);
+
+		if (optind < argc) {
+			for (int i = optind; i < argc; i++) {
+				if (ends_with(argv[i], ".tps"))
+					sb.table().load(argv[i]);
+				else
+					sketch_capture(argv[i], sb);
+			}
+		} else {
+			std::unique_ptr<tcpprobe::shm_subscriber> sub;
+			std::unique_ptr<tcpprobe::reader> rd;
+			tcpprobe::batch b;
+
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_handler = on_signal;
+			sigaction(SIGINT, &sa, nullptr);
+			sigaction(SIGTERM, &sa, nullptr);
+			if (!ring.empty()) {
+				sub.reset(new tcpprobe::shm_subscriber(ring));
+			} else {
+				rd.reset(new tcpprobe::reader(opt));
+				rd->open();
+			}
+			try {
+				while (!stop) {
+					if (sub)
+						sb.add(recs, sub->read(recs, sizeof(recs) / sizeof(recs[0]), 1000));
+					else if (rd->next(b, 1000))
+						sb.add(b.begin(), b.size());
+				}
+			} catch (const std::system_error &) {
+				/* interrupted: the sketches so far are still wanted */
+				if (!stop)
+					throw;
+			}
+		}
+		sb.finish();
+
+		if (!out.empty())
+			sb.table().save(out);
+		if (print)
+			print_table(sb.table(), dims, q, top);
+	} catch (const std::invalid_argument &e) {
+		fprintf(stderr, "%s: %s\n", argv[0], e.what());
+		return 2;
+	} catch (const std::system_error &e) {
+		fprintf(stderr, "%s: %s\n", argv[0], e.what());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * tcpprobe_tail: subscriber of the ring of tcpprobe_fanout, prints the
+ * records it reads and, every second, its lag and the records it lost.
+ *
+ *	tcpprobe_tail [-n name] [-o] [-q]
+ *
+ * Each record is printed as:
+ *	type tstamp saddr:sport daddr:dport snd_cwnd srtt_us length
+ */
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <system_error>
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "tcpprobe/shm.hpp"
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int)
+{
+	stop = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n name] [-o] [-q]\n"
+			"  -n  name of the shared memory ring (default %s)\n"
+			"  -o  start at the oldest record of the ring, not the newest\n"
+			"  -q  only print the statistics\n",
+			prog, tcpprobe::SHM_DEFAULT_NAME);
+	exit(2);
+}
+
+static void print_record(const tcpprobe::record &r)
+{
+	struct in_addr s = { htonl(r.saddr) }, d = { htonl(r.daddr) };
+	char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+
+	inet_ntop(AF_INET, &s, src, sizeof(src));
+	inet_ntop(AF_INET, &d, dst, sizeof(dst));
+	printf("%u %llu.%09llu %s:%u %s:%u %u %u %u\n", r.type,
+			(unsigned long long) (r.tstamp_ns / 1000000000ULL),
+			(unsigned long long) (r.tstamp_ns % 1000000000ULL),
+			src, r.sport, dst, r.dport, r.snd_cwnd, r.srtt >> 3, r.length);
+}
+
+int main(int argc, char **argv)
+{
+	auto from = tcpprobe::shm_subscriber::start::newest;
+	std::string name = tcpprobe::SHM_DEFAULT_NAME;
+	static tcpprobe::record recs[256];
+	bool quiet = false;
+	time_t last = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:oqh")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg[0] == '/' ? optarg : std::string("/") + optarg;
+			break;
+		case 'o':
+			from = tcpprobe::shm_subscriber::start::oldest;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	try {
+		tcpprobe::shm_subscriber sub(name, from);
+
+		while (!stop) {
+			size_t n = sub.read(recs, sizeof(recs) / sizeof(recs[0]), 1000);
+			time_t now = time(nullptr);
+
+			if (!quiet)
+				for (size_t i = 0; i < n; i++)
+					print_record(recs[i]);
+			if (now != last) {
+				const tcpprobe::subscriber_stats &st = sub.stats();
+
+				fprintf(stderr, "records %llu lag %llu lost %llu reopens %llu\n",
+						(unsigned long long) st.records,
+						(unsigned long long) sub.lag(),
+						(unsigned long long) st.lost,
+						(unsigned long long) st.reopens);
+				last = now;
+			}
+		}
+	} catch (const std::system_error &e) {
+		fprintf(stderr, "%s: %s\n", argv[0], e.what());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,83 @@
+#include <linux/kernel.h>
+#include <linux/kprobes.h>
+#include <linux/socket.h>
+#include <linux/tcp.h>
+#include <linux/module.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+
+#include <net/tcp.h>
+
+#include "tcp_probe_plus.h"
+
+#define CREATE_TRACE_POINTS
+#include "tcp_probe_plus_trace.h"
+
+/*
+ * Trace export: when the "export" sysctl is TCPPROBE_EXPORT_TRACE, every
+ * record leaves the ring as soon as it is written and becomes a trace
+ * event in the per-CPU ring buffer of ftrace. Records written while the
+ * events are disabled are lost, like the records of a full ring.
+ */
+
+/* Size of the payload of an event record */
+static u16 tcpprobe_trace_payload_len(u8 type)
+{
+	switch (type) {
+	case LOG_RETRANS:
+		return sizeof(struct tcp_retx_stat);
+	case LOG_STALL:
+		return sizeof(struct tcp_stall_stat);
+	case LOG_ECN:
+		return sizeof(struct tcp_ecn_stat);
+	case LOG_HOSTQ:
+		return sizeof(struct tcp_hostq_stat);
+	case LOG_LISTEN:
+		return sizeof(struct tcp_listen_stat);
+	case LOG_STATES:
+		return sizeof(struct tcp_states_stat);
+	case LOG_OWNER:
+		return sizeof(struct tcp_owner_stat);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Emit the records written since the last call as trace events, they are
+ * then consumed from the ring.
+ * Assumes that the spin_lock on the tcp_probe has been taken.
+ */
+void tcpprobe_trace_flush(void)
+{
+	while (tcp_probe.tail != tcp_probe.head) {
+		const struct tcp_log *p = tcp_probe_slot(tcp_probe.tail);
+		u64 tstamp = ktime_to_ns(ktime_sub(p->tstamp, tcp_probe.start));
+
+		switch (p->type) {
+		case LOG_RECV:
+		case LOG_SEND:
+			trace_sample(p, tstamp);
+			break;
+		case LOG_SETUP:
+			trace_setup(p, tstamp);
+			break;
+		case LOG_DONE:
+			trace_done(p, tstamp);
+			break;
+		case LOG_TIMEOUT:
+			trace_timeout(p, tstamp);
+			break;
+		case LOG_PURGE:
+			trace_purge(p, tstamp);
+			break;
+		case LOG_FLOWDEF:
+			/* every event carries the tuple and the flow id */
+			break;
+		default:
+			trace_flow_event(p, tstamp, &p->user_agent,
+					tcpprobe_trace_payload_len(p->type));
+		}
+		tcp_probe.tail++;
+	}
+}